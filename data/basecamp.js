@@ -93,7 +93,7 @@ function buildSite (data) {
 
 function collectConfiguration() {
 	document.getElementById("WifiConfigured").value="True";
-	var configurationData = new FormData();
+	var configurationData = {};
 	configurationElements = document.body.querySelectorAll('*[data-config]');
 	for (var i = configurationElements.length - 1; i >= 0; i--) {
 		var configurationKey = configurationElements[i].getAttribute("data-config");
@@ -103,15 +103,16 @@ function collectConfiguration() {
 			return;
 		}
 		if (configurationValue.length > 0 && configurationKey.length > 0) {
-			configurationData.append(configurationKey, configurationValue);
+			configurationData[configurationKey] = configurationValue;
 		}
 	}
 	var request = new XMLHttpRequest();
 	request.addEventListener("load", transferComplete);
 	request.addEventListener("error", transferFailed);
 	request.open("POST", "/submitconfig");
+	request.setRequestHeader("Content-Type", "application/json");
 	console.log("Sending configuration");
-	request.send(configurationData);
+	request.send(JSON.stringify(configurationData));
 	function transferFailed(){
 		alert("Configuration could not be saved");
 	}
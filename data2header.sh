@@ -31,6 +31,9 @@ cat > $OUTFILE <<DELIMITER
    Licensed under GPLv3. See LICENSE for details.
    */
 
+#ifndef data_h
+#define data_h
+
 #include <pgmspace.h>
 //
 // converted data/* to gzipped flash variables
@@ -41,6 +44,8 @@ DELIMITER
 
 #convert contents into array of bytes
 INDEX=0
+ASSETFILE="$CURRDIR/assets.tmp"
+: > $ASSETFILE
 for i in $(ls -1); do
 
 	CONTENT=$(cat $i | xxd -i)
@@ -50,7 +55,55 @@ for i in $(ls -1); do
 	printf "const uint8_t "$FILENAME"[] PROGMEM {\n$CONTENT\n};" >> $OUTFILE
 	echo >> $OUTFILE
 	unset CONTENT
+
+	# Route, MIME type and cache lifetime of the asset. The HTML page is the entry point
+	# and has to be revalidated, everything else may be cached by the browser for a week.
+	SOURCE=${i%.gz}
+	ROUTE="/$SOURCE"
+	MAXAGE=604800
+	case "$SOURCE" in
+		*.htm) MIME="text/html"; ROUTE="/"; MAXAGE=0 ;;
+		*.css) MIME="text/css" ;;
+		*.js) MIME="application/javascript" ;;
+		*.svg) MIME="image/svg+xml" ;;
+		*) MIME="application/octet-stream" ;;
+	esac
+	ETAG=$(md5sum $i | cut -c1-16)
+	printf '\t{"%s", "%s", %s, %s_len, "\\"%s\\"", %s},\n' "$ROUTE" "$MIME" "$FILENAME" "$FILENAME" "$ETAG" "$MAXAGE" >> $ASSETFILE
 done
+
+cat >> $OUTFILE <<DELIMITER
+
+struct BasecampAsset {
+	const char* path;
+	const char* mimeType;
+	// gzip compressed content
+	const uint8_t* data;
+	size_t length;
+	const char* etag;
+	uint32_t maxAgeSeconds;
+};
+
+constexpr BasecampAsset kBasecampAssets[] = {
+DELIMITER
+cat $ASSETFILE >> $OUTFILE
+rm $ASSETFILE
+cat >> $OUTFILE <<DELIMITER
+};
+
+// Returns the asset served at path or nullptr
+inline const BasecampAsset* findBasecampAsset(const char* path)
+{
+	for (const auto &asset : kBasecampAssets) {
+		if (strcmp(asset.path, path) == 0) {
+			return &asset;
+		}
+	}
+	return nullptr;
+}
+
+#endif
+DELIMITER
 rm $TMPDIR/*
 rmdir $TMPDIR
 cd $CURRDIR
@@ -0,0 +1,167 @@
+#!/usr/bin/env python3
+"""Creates a delta between two firmware images for Basecamp's OtaPipeline.
+
+Usage: otadelta.py [--gzip] old.bin new.bin delta.bin
+
+old.bin has to be exactly the image running on the device (the .bin written by
+the build). The device refuses deltas that were created against anything else.
+Prints the SHA-256 of new.bin, pass it along with the update.
+"""
+
+import argparse
+import gzip
+import hashlib
+import struct
+import sys
+
+MAGIC = b"BCDF"
+VERSION = 1
+OP_END = 0x00
+OP_COPY = 0x01
+OP_INSERT = 0x02
+
+# esp_image_header_t: segment count at byte 1, hash_appended at byte 23
+IMAGE_MAGIC = 0xE9
+HASH_APPENDED_OFFSET = 23
+
+# Source positions are indexed every STEP bytes by a KEY bytes long key.
+# Matches shorter than MIN_MATCH are cheaper as inserts.
+KEY = 12
+STEP = 4
+MIN_MATCH = 32
+
+
+def index_source(source):
+    index = {}
+    for offset in range(0, len(source) - KEY + 1, STEP):
+        index.setdefault(source[offset:offset + KEY], offset)
+    return index
+
+
+def find_match(source, index, target, position):
+    """Longest match of target[position:] in source, as (offset, length)."""
+    best_offset, best_length = 0, 0
+    # A match may start up to STEP - 1 bytes before an indexed position
+    for back in range(min(STEP, position + 1)):
+        offset = index.get(target[position + back:position + back + KEY])
+        if offset is None or offset < back:
+            continue
+        offset -= back
+        length = 0
+        while (position + length < len(target) and offset + length < len(source)
+               and source[offset + length] == target[position + length]):
+            length += 1
+        if length > best_length:
+            best_offset, best_length = offset, length
+    return best_offset, best_length
+
+
+def running_image_sha256(image):
+    """What esp_partition_get_sha256() returns for the image once it runs.
+
+    With an appended digest, IDF returns that digest, which covers the image
+    without its last 32 bytes. Otherwise it hashes the whole image.
+    """
+    if len(image) > HASH_APPENDED_OFFSET and image[0] == IMAGE_MAGIC and image[HASH_APPENDED_OFFSET] == 1:
+        if hashlib.sha256(image[:-32]).digest() != image[-32:]:
+            raise ValueError("appended digest does not match the image")
+        return image[-32:]
+    return hashlib.sha256(image).digest()
+
+
+def create_delta(source, target):
+    index = index_source(source)
+    out = bytearray(MAGIC)
+    out += struct.pack("<B3xI", VERSION, len(target))
+    out += running_image_sha256(source)
+
+    pending = bytearray()
+
+    def flush_insert():
+        if pending:
+            out.extend(struct.pack("<BI", OP_INSERT, len(pending)))
+            out.extend(pending)
+            pending.clear()
+
+    position = 0
+    while position < len(target):
+        offset, length = find_match(source, index, target, position)
+        if length >= MIN_MATCH:
+            flush_insert()
+            out += struct.pack("<BII", OP_COPY, offset, length)
+            position += length
+        else:
+            pending.append(target[position])
+            position += 1
+    flush_insert()
+    out.append(OP_END)
+    return bytes(out)
+
+
+def apply_delta(source, delta):
+    """Applies delta like the device does, returns (source hash, image)."""
+    if delta[:4] != MAGIC or delta[4] != VERSION:
+        raise ValueError("unsupported delta format")
+    size, = struct.unpack_from("<I", delta, 8)
+    source_sha256 = delta[12:44]
+    out = bytearray()
+    position = 44
+    while True:
+        op = delta[position]
+        if op == OP_END:
+            break
+        if op == OP_COPY:
+            offset, length = struct.unpack_from("<II", delta, position + 1)
+            out += source[offset:offset + length]
+            position += 9
+        elif op == OP_INSERT:
+            length, = struct.unpack_from("<I", delta, position + 1)
+            out += delta[position + 5:position + 5 + length]
+            position += 5 + length
+        else:
+            raise ValueError("unknown operation %d" % op)
+    if len(out) != size:
+        raise ValueError("delta produces %d bytes instead of %d" % (len(out), size))
+    return source_sha256, bytes(out)
+
+
+def check_delta(source, target, delta):
+    """Round trip: the device has to accept the delta for source and rebuild target."""
+    source_sha256, image = apply_delta(source, delta)
+    if source_sha256 != running_image_sha256(source):
+        raise ValueError("source hash differs from the one the device computes")
+    if image != target:
+        raise ValueError("delta does not reproduce the new image")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--gzip", action="store_true", help="compress the delta as well")
+    parser.add_argument("old")
+    parser.add_argument("new")
+    parser.add_argument("delta")
+    arguments = parser.parse_args()
+
+    with open(arguments.old, "rb") as f:
+        source = f.read()
+    with open(arguments.new, "rb") as f:
+        target = f.read()
+
+    try:
+        delta = create_delta(source, target)
+        check_delta(source, target, delta)
+    except ValueError as error:
+        print("%s: %s" % (arguments.old, error), file=sys.stderr)
+        return 1
+    if arguments.gzip:
+        delta = gzip.compress(delta, 9)
+    with open(arguments.delta, "wb") as f:
+        f.write(delta)
+
+    print("%s: %d bytes for an image of %d bytes" % (arguments.delta, len(delta), len(target)), file=sys.stderr)
+    print(hashlib.sha256(target).hexdigest())
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -6,14 +6,62 @@
 
 #include <iomanip>
 #include "Basecamp.hpp"
-#include "lwip/apps/sntp.h"
+#include "Hash.hpp"
+#include "Metrics.hpp"
+#include "Scheduler.hpp"
+#include "TimeSync.hpp"
+#include "Trace.hpp"
+#include <esp_attr.h>
+#include <esp_sleep.h>
+#include <time.h>
 
 namespace {
 	const constexpr char* kLoggingTag = "Basecamp";
-	const constexpr uint16_t defaultThreadStackSize = 3072;
-	const constexpr UBaseType_t defaultThreadPriority = 0;
 	// Default length for access point mode password
 	const constexpr unsigned defaultApSecretLength = 8;
+	// Services hosted on basecampScheduler
+	const constexpr uint32_t kDnsPollIntervalMs = 10;
+	const constexpr uint32_t kOtaPollIntervalMs = 50;
+	// Time deepSleep() gives queued log lines to reach syslog
+	const constexpr uint32_t kLogFlushTimeoutMs = 200;
+
+	// After a wake from deep sleep SNTP is skipped while the last sync is younger than this
+	const constexpr time_t kTimeResyncIntervalS = 24 * 3600;
+
+	// What beginFast() needs, kept by deepSleep(). Power-on clears RTC memory, but esp_restart(),
+	// watchdog and panic resets keep it: the state is only trusted with a deep sleep wake cause.
+	struct FastBootState {
+		static constexpr uint32_t kMagic = 0x42434642;
+
+		uint32_t magic;
+		uint32_t checksum;
+		uint16_t snapshotLength;
+		uint8_t snapshot[1536];
+		// When SNTP last reached its server
+		time_t lastTimeSync;
+	};
+	RTC_DATA_ATTR FastBootState fastBootState;
+
+	bool isFastBootStateValid()
+	{
+		return fastBootState.magic == FastBootState::kMagic &&
+			fastBootState.snapshotLength <= sizeof(fastBootState.snapshot) &&
+			fastBootState.checksum == basecampHash::fnv1a(fastBootState.snapshot, fastBootState.snapshotLength);
+	}
+
+	// String keys have no typed getter applying the schema default
+	const char* getOrDefault(const Configuration &configuration, ConfigurationKey key)
+	{
+		const String &value = configuration.get(key);
+		return value.length() > 0 ? value.c_str() : kConfigurationKeys[static_cast<size_t>(key)].defaultValue;
+	}
+
+	bool isTimeFresh()
+	{
+		const time_t now = time(nullptr);
+		return now >= TimeSync::kMinimumValidTime && fastBootState.lastTimeSync >= TimeSync::kMinimumValidTime &&
+			now - fastBootState.lastTimeSync < kTimeResyncIntervalS;
+	}
 }
 
 Basecamp::Basecamp(SetupModeWifiEncryption setupModeWifiEncryption, ConfigurationUI configurationUi) : 
@@ -21,6 +69,11 @@ Basecamp::Basecamp(SetupModeWifiEncryption setupModeWifiEncryption, Configuratio
 	setupModeWifiEncryption_(setupModeWifiEncryption), 
 	configurationUi_(configurationUi)
 {
+#ifdef BASECAMP_CONFIG_NVS
+	// Store the configuration in NVS, migrating an existing /basecamp.json once. Not in the
+	// "basecamp" namespace of the boot counter, a factory reset erases the whole namespace.
+	configuration.setStorage(std::unique_ptr<ConfigurationStorage>(new NvsConfigurationStorage("basecampCfg", "/basecamp.json")));
+#endif
 }
 
 /**
@@ -74,8 +127,12 @@ String Basecamp::getSetupModeWifiSecret(){
 /**
  * This is the initialisation function for the Basecamp class.
  */
-bool Basecamp::begin(String fixedWiFiApEncryptionPassword)
+bool Basecamp::begin(String fixedWiFiApEncryptionPassword, const BasecampTaskConfig &tasks)
 {
+	BASECAMP_TRACE_SCOPE("begin");
+	applyTaskConfig(tasks);
+	basecampHeap.begin();
+
 	// Make sure we only accept valid passwords for ap
 	if (fixedWiFiApEncryptionPassword.length() != 0) {
 		if (fixedWiFiApEncryptionPassword.length() >= network.getMinimumSecretLength()) {
@@ -90,6 +147,113 @@ bool Basecamp::begin(String fixedWiFiApEncryptionPassword)
 	ESP_LOGW(kLoggingTag, "Basecamp Startup");
 	ESP_LOGW(kLoggingTag, "********************");
 
+	// In serial mode every stage depends on the previous one, which is the order Basecamp always used.
+	// In staged mode only real dependencies are kept: WiFi connects in the background while the
+	// interface is built, and MQTT is started from handle() once the link is up.
+	const bool staged = (startupMode_ == StartupMode::staged);
+	const auto configurationStage = startup_.add("configuration", [this]() { beginConfiguration(); });
+	const auto resetReasonStage = startup_.add("resetReason", [this]() { checkResetReason(); },
+		StartupSequence::after(configurationStage));
+	const auto networkStage = startup_.add("network", [this, fixedWiFiApEncryptionPassword]() {
+		beginNetwork(fixedWiFiApEncryptionPassword);
+	}, StartupSequence::after(resetReasonStage));
+	auto linkStage = networkStage;
+#ifndef BASECAMP_NO_NETWORK
+	if (staged) {
+		linkStage = startup_.addCondition("link", [this]() {
+			// There is no link to wait for while acting as access point
+			return network.getOperationMode() != NetworkControl::Mode::client || network.isLinkUp();
+		}, StartupSequence::after(networkStage));
+	}
+#endif
+	const auto mqttStage = startup_.add("mqtt", [this]() { beginMqtt(); }, StartupSequence::after(linkStage));
+	const auto otaStage = startup_.add("ota", [this]() { beginOta(); },
+		StartupSequence::after(staged ? networkStage : mqttStage));
+	const auto webInterfaceStage = startup_.add("webinterface", [this]() { beginWebInterface(); },
+		StartupSequence::after(staged ? networkStage : otaStage));
+	const auto sntpStage = startup_.add("sntp", [this]() { beginSntp(); },
+		StartupSequence::after(staged ? networkStage : webInterfaceStage));
+	startup_.add("syslog", [this]() { beginSyslog(); }, StartupSequence::after(staged ? networkStage : sntpStage));
+
+	startupDone_ = startup_.run();
+
+	ESP_LOGW(kLoggingTag, "%s", showSystemInfo().c_str());
+
+	// TODO: only return true if everything setup up correctly
+	return true;
+}
+
+bool Basecamp::beginFast(String fixedWiFiApEncryptionPassword, const BasecampTaskConfig &tasks)
+{
+	BASECAMP_TRACE_SCOPE("beginFast");
+
+	// Setting up the access point needs the full startup. The wake cause is what rules out stale
+	// state after a restart, the magic and checksum only catch a cleared or corrupted one.
+	const bool woken = (esp_sleep_get_wakeup_cause() != ESP_SLEEP_WAKEUP_UNDEFINED);
+	if (!woken || !isFastBootStateValid() ||
+		!configuration.importSnapshot(fastBootState.snapshot, fastBootState.snapshotLength) ||
+		!configuration.getBool(ConfigurationKey::wifiConfigured)) {
+		ESP_LOGI(kLoggingTag, "No retained state, starting normally");
+		fastBootState.magic = 0;
+		return begin(std::move(fixedWiFiApEncryptionPassword), tasks);
+	}
+
+	ESP_LOGI(kLoggingTag, "Fast boot from retained state");
+	fastBoot_ = true;
+	applyTaskConfig(tasks);
+	basecampHeap.begin();
+	hostname = _cleanHostname();
+
+	// The boot counter is only incremented on power-on, nothing to clear after a wake
+	network.setClearBootCounter(false);
+	startupMode_ = StartupMode::staged;
+	const auto networkStage = startup_.add("network", [this]() { beginNetwork({}); });
+	auto linkStage = networkStage;
+#ifndef BASECAMP_NO_NETWORK
+	linkStage = startup_.addCondition("link", [this]() { return network.isLinkUp(); },
+		StartupSequence::after(networkStage));
+#endif
+	startup_.add("mqtt", [this]() { beginMqtt(); }, StartupSequence::after(linkStage));
+	startup_.add("sntp", [this]() { beginSntp(); }, StartupSequence::after(networkStage));
+	startup_.add("syslog", [this]() { beginSyslog(); }, StartupSequence::after(networkStage));
+
+	startupDone_ = startup_.run();
+	return true;
+}
+
+void Basecamp::deepSleep(uint64_t sleepUs)
+{
+	const size_t length = configuration.exportSnapshot(fastBootState.snapshot, sizeof(fastBootState.snapshot));
+	fastBootState.snapshotLength = length;
+	fastBootState.checksum = basecampHash::fnv1a(fastBootState.snapshot, length);
+	// Without a snapshot the next wake runs the full startup
+	fastBootState.magic = (length > 0) ? FastBootState::kMagic : 0;
+#ifndef BASECAMP_NO_SNTP
+	// Keeps the previous one if SNTP was skipped on this wake
+	const time_t lastSync = basecampTime.getStats().lastSync;
+	if (lastSync != 0) {
+		fastBootState.lastTimeSync = lastSync;
+	}
+#endif
+
+	ESP_LOGI(kLoggingTag, "Sleeping for %u ms", static_cast<uint32_t>(sleepUs / 1000));
+	basecampLogs.flush(kLogFlushTimeoutMs);
+	esp_sleep_enable_timer_wakeup(sleepUs);
+	esp_deep_sleep_start();
+}
+
+void Basecamp::applyTaskConfig(const BasecampTaskConfig &tasks)
+{
+	tasks_ = tasks;
+	basecampScheduler.setTaskPlacement(tasks_.scheduler);
+	basecampLogs.setTaskPlacement(tasks_.logs);
+#ifndef BASECAMP_NOMQTT
+	mqtt.SetTaskConfig(tasks_.mqtt);
+#endif
+}
+
+void Basecamp::beginConfiguration()
+{
 	// Load configuration from internal flash storage.
 	// If configuration.load() fails, reset the configuration
 	if (!configuration.load()) {
@@ -101,11 +265,10 @@ bool Basecamp::begin(String fixedWiFiApEncryptionPassword)
 	// It is used as a hostname for DHCP and ArduinoOTA.
 	hostname = _cleanHostname();
 	ESP_LOGD(kLoggingTag, "hostname: %s", hostname.c_str());
+}
 
-	// Have checkResetReason() control if the device configuration
-	// should be reset or not.
-	checkResetReason();
-
+void Basecamp::beginNetwork(const String &fixedWiFiApEncryptionPassword)
+{
 #ifndef BASECAMP_NO_NETWORK
 #ifndef BASECAMP_NETWORK_ETHERNET
 	// If there is no access point secret set yet, generate one and save it.
@@ -122,13 +285,32 @@ bool Basecamp::begin(String fixedWiFiApEncryptionPassword)
 			ESP_LOGW(kLoggingTag, "Using fixed access point secret.");
 		}
 		configuration.set(ConfigurationKey::accessPointSecret, apSecret);
-		configuration.save();
+		configuration.saveDeferred();
 	}
 
 	ESP_LOGD(kLoggingTag, "accessPointSecret: %s", configuration.get(ConfigurationKey::accessPointSecret).c_str());
+
+	if (configuration.isKeySet(ConfigurationKey::wifiStaticIp)) {
+		network.setStaticIp(configuration.getIpAddress(ConfigurationKey::wifiStaticIp),
+			configuration.getIpAddress(ConfigurationKey::wifiGateway),
+			configuration.getIpAddress(ConfigurationKey::wifiNetmask),
+			configuration.getIpAddress(ConfigurationKey::wifiDns));
+	}
+#endif
+
+	// Push link changes instead of having every subsystem poll the link state
+	network.onLinkChange([this](bool up) {
+#ifndef BASECAMP_NOMQTT
+		mqtt.SetLinkUp(up);
+#endif
+#ifndef BASECAMP_NOWEB
+		web.sendEvent("link", up ? "up" : "down");
 #endif
+	});
 
 	// Initialize Wifi with the stored configuration data.
+	// In staged mode the link is awaited by the startup sequence instead of blocking here.
+	network.setWaitForConnection(startupMode_ == StartupMode::serial);
 	network.begin(
 			configuration.get(ConfigurationKey::wifiEssid), // The (E)SSID or WiFi-Name
 			configuration.get(ConfigurationKey::wifiPassword), // The WiFi password
@@ -140,19 +322,50 @@ bool Basecamp::begin(String fixedWiFiApEncryptionPassword)
 	// Get WiFi MAC
 	mac = network.getSoftwareMacAddress(":");
 #endif
+}
+
+void Basecamp::beginMqtt()
+{
 #ifndef BASECAMP_NOMQTT
 	// Check if MQTT has been disabled by the user
-	if (!configuration.get(ConfigurationKey::mqttActive).equalsIgnoreCase("false")) {
+	if (configuration.getBool(ConfigurationKey::mqttActive)) {
 		const auto &mqttUri = configuration.get(ConfigurationKey::mqttHost);
-		const auto &mqttHaDiscoveryPrefix = configuration.get(ConfigurationKey::haDiscoveryPrefix);
+		// The discovery configs are retained by the broker, publishing them on every wake is wasted time
+		const String &mqttHaDiscoveryPrefix = fastBoot_ ? String() : configuration.get(ConfigurationKey::haDiscoveryPrefix);
 		mqtt.Begin(mqttUri, hostname, mqttHaDiscoveryPrefix);
+
+		if (metricsPublishInterval_ > 0) {
+			startTask(&MetricsTask, "MetricsTask", tasks_.metrics, this, &metricsTask_);
+		}
+
+		basecampHeap.onLowHeap([this](const HeapStats &stats) {
+			if (!mqtt.IsConnected()) {
+				return;
+			}
+			// Formatted on the stack, the heap is short already
+			char payload[128];
+			const int length = snprintf(payload, sizeof(payload),
+				"{\"free\":%u,\"largestBlock\":%u,\"minFree\":%u,\"fragmentation\":%u}",
+				stats.freeBytes, stats.largestFreeBlock, stats.minimumFreeBytes, stats.fragmentationPercent);
+			mqtt.Publish(mqtt.MakeTopic("heap/alert"), payload, length, false, 1);
+		});
+
+#ifndef BASECAMP_NOOTA
+		if (otaPullEnabled_ && !fastBoot_ && configuration.getBool(ConfigurationKey::otaActive)) {
+			mqtt.Subscribe(mqtt.MakeTopic("ota").c_str(), [this](const char*, const char* payload, size_t length) {
+				onOtaRequest(payload, length);
+			});
+		}
+#endif
 	};
 #endif
+}
 
+void Basecamp::beginOta()
+{
 #ifndef BASECAMP_NOOTA
 	// Set up Over-the-Air-Updates (OTA) if it hasn't been disabled.
-	if (!configuration.get(ConfigurationKey::otaActive).equalsIgnoreCase("false")) {
-
+	if (configuration.getBool(ConfigurationKey::otaActive)) {
 		// Set OTA password
 		String otaPass = configuration.get(ConfigurationKey::otaPass);
 		if (otaPass.length() != 0) {
@@ -181,10 +394,19 @@ bool Basecamp::begin(String fixedWiFiApEncryptionPassword)
 				})
 		// Show the progress of the update
 		.onProgress([](unsigned int progress, unsigned int total) {
-				ESP_LOGI(kLoggingTag, "Progress: %u%%\r", (progress / (total / 100)));
+				// Called for every received chunk, only report about once a second
+				static OtaProgressLimiter limiter;
+				if (!limiter.shouldReport(progress, total)) {
+					return;
+				}
+				static MetricGauge *otaProgress = basecampMetrics.gauge("basecamp_ota_progress_percent", "Progress of the running OTA update");
+				otaProgress->set(OtaProgressLimiter::percent(progress, total));
+				ESP_LOGI(kLoggingTag, "Progress: %u%%", OtaProgressLimiter::percent(progress, total));
 				})
 		// Error handling for the update
 		.onError([](ota_error_t error) {
+				static MetricCounter *otaErrors = basecampMetrics.counter("basecamp_ota_errors_total", "Failed OTA updates");
+				otaErrors->increment();
 				ESP_LOGE(kLoggingTag, "Error[%u]: ", error);
 				if (error == OTA_AUTH_ERROR) ESP_LOGW(kLoggingTag, "Auth Failed");
 				else if (error == OTA_BEGIN_ERROR) ESP_LOGW(kLoggingTag, "Begin Failed");
@@ -193,12 +415,15 @@ bool Basecamp::begin(String fixedWiFiApEncryptionPassword)
 				else if (error == OTA_END_ERROR) ESP_LOGW(kLoggingTag, "End Failed");
 				});
 
-		// Start the OTA service
+		// Start the OTA service. A running update blocks the other services on the scheduler task.
 		ArduinoOTA.begin();
-
+		basecampScheduler.every(kOtaPollIntervalMs, []() { ArduinoOTA.handle(); });
 	}
 #endif
+}
 
+void Basecamp::beginWebInterface()
+{
 #ifndef BASECAMP_NOWEB
 	if (shouldEnableConfigWebserver())
 	{
@@ -230,6 +455,10 @@ bool Basecamp::begin(String fixedWiFiApEncryptionPassword)
 		web.addInterfaceElement("WifiEssid", "input", "WIFI SSID:","#configform" , "WifiEssid");
 		web.addInterfaceElement("WifiPassword", "input", "WIFI Password:", "#configform", "WifiPassword");
 		web.setInterfaceElementAttribute("WifiPassword", "type", "password");
+		web.addInterfaceElement("WifiStaticIp", "input", "Static IP address (space/empty for DHCP):", "#configform", "WifiStaticIp");
+		web.addInterfaceElement("WifiGateway", "input", "Gateway:", "#configform", "WifiGateway");
+		web.addInterfaceElement("WifiNetmask", "input", "Netmask:", "#configform", "WifiNetmask");
+		web.addInterfaceElement("WifiDns", "input", "DNS server (empty to use the gateway):", "#configform", "WifiDns");
 #endif
 		// Need to keep these even without WIFI as otherwise basecamp.js will crash
 		web.addInterfaceElement("WifiConfigured", "input", "", "#configform", "WifiConfigured");
@@ -237,13 +466,15 @@ bool Basecamp::begin(String fixedWiFiApEncryptionPassword)
 		web.setInterfaceElementAttribute("WifiConfigured", "value", "true");
 
 		// Add input fields for MQTT configurations if it hasn't been disabled
-		if (!configuration.get(ConfigurationKey::mqttActive).equalsIgnoreCase("false")) {
-			web.addInterfaceElement("MQTTHost", "input", "MQTT URI:","#configform" , "MQTTHost");
+		if (configuration.getBool(ConfigurationKey::mqttActive)) {
+			web.addInterfaceElement("MQTTHost", "input", "MQTT URIs (comma-separated, primary first):","#configform" , "MQTTHost");
 			web.addInterfaceElement("MQTTTopicPrefix", "input", "MQTT Topic Prefix (suggested 'esp-basecamp'):","#configform" , "MQTTTopicPrefix");
 			web.addInterfaceElement("HaDiscoveryPrefix", "input", "Home Assistant MQTT Discovery Topic Prefix (suggested 'homeassistant', space/empty to disable):","#configform" , "HaDiscoveryPrefix");
 		}
 
 		web.addInterfaceElement("SyslogServer", "input", "Syslog Server (space/empty to disable):","#configform" , "SyslogServer");
+		web.addInterfaceElement("NtpServer", "input", "NTP Server:","#configform" , "NtpServer");
+		web.addInterfaceElement("Timezone", "input", "Timezone (POSIX TZ string):","#configform" , "Timezone");
 
 		// Add a save button that calls the JavaScript function collectConfiguration() on click
 		web.addInterfaceElement("saveform", "button", "Save","#configform");
@@ -259,33 +490,48 @@ bool Basecamp::begin(String fixedWiFiApEncryptionPassword)
 		web.setInterfaceElementAttribute("footerlink", "target", "_blank");
 		#ifdef BASECAMP_USEDNS
 		#ifdef DNSServer_h
-		if (!configuration.get(ConfigurationKey::wifiConfigured).equalsIgnoreCase("true")) {
+		if (!configuration.getBool(ConfigurationKey::wifiConfigured)) {
 			dnsServer.start(53, "*", network.getSoftAPIP());
-			xTaskCreatePinnedToCore(&DnsHandling, "DNSTask", 4096, (void*) &dnsServer, 5, NULL,0);
+			// DNSServer does not expose its socket, polling it often keeps answers within milliseconds
+			basecampScheduler.every(kDnsPollIntervalMs, [this]() { dnsServer.processNextRequest(); });
 		}
 		#endif
 		#endif
 		// Start webserver and pass the configuration object to it
 		// Also pass a Lambda-function that restarts the device after the configuration has been saved.
+		web.setSubmitTaskPlacement(tasks_.webSubmit);
 		web.begin(configuration, [](){
 			delay(2000);
 			ESP.restart();
 		});
+
+		// One event per period carries everything sampled, so the rate limits the events sent to all clients
+		telemetryTimer_ = basecampScheduler.every(telemetryIntervalMs(telemetryRate_), [this]() { sendTelemetry(); });
 	}
 #endif
+}
 
+void Basecamp::beginSntp()
+{
 #ifndef BASECAMP_NO_SNTP
-	sntp_setoperatingmode(SNTP_OPMODE_POLL);
-    sntp_setservername(0, "pool.ntp.org");
-    sntp_init();
-    setenv("TZ", "CET-1CEST,M3.5.0/2:00,M10.5.0/3:00", 1);
-    tzset();
+	// The RTC keeps the time during deep sleep
+	const bool timeFresh = fastBoot_ && isTimeFresh();
+	if (timeFresh) {
+		ESP_LOGD(kLoggingTag, "Time synced %u s ago, skipping SNTP", static_cast<uint32_t>(time(nullptr) - fastBootState.lastTimeSync));
+	}
+	basecampTime.begin(getOrDefault(configuration, ConfigurationKey::ntpServer),
+		getOrDefault(configuration, ConfigurationKey::timezone), !timeFresh);
 #endif
+}
 
-	ESP_LOGW(kLoggingTag, "%s", showSystemInfo().c_str());
-
-	// TODO: only return true if everything setup up correctly
-	return true;
+void Basecamp::beginSyslog()
+{
+	String server = configuration.get(ConfigurationKey::syslogServer);
+	// The web interface uses a space to disable it
+	server.trim();
+	if (server.length() > 0) {
+		basecampLogs.setSyslogServer(server, hostname);
+	}
 }
 
 /**
@@ -293,34 +539,193 @@ bool Basecamp::begin(String fixedWiFiApEncryptionPassword)
  */
 void Basecamp::handle (void)
 {
-	#ifndef BASECAMP_NOOTA
-		// This call takes care of the ArduinoOTA function provided by Basecamp
-		ArduinoOTA.handle();
-	#endif
+	if (!startupDone_) {
+		// Stages waiting for the network link in staged startup mode
+		startupDone_ = startup_.run();
+	}
+#ifndef BASECAMP_NOWEB
+	const int64_t now = esp_timer_get_time();
+	if (lastHandleUs_ != 0) {
+		const uint32_t gap = now - lastHandleUs_;
+		uint32_t maxGap = loopMaxGapUs_.load();
+		while (gap > maxGap && !loopMaxGapUs_.compare_exchange_weak(maxGap, gap)) {
+		}
+	}
+	lastHandleUs_ = now;
+#endif
+}
+
+#ifndef BASECAMP_NOWEB
+void Basecamp::sampleTelemetry(char *buffer, size_t size)
+{
+	int rssi = 0;
+	bool mqttConnected = false;
+	size_t outboxDepth = 0;
+#if !defined(BASECAMP_NO_NETWORK) && !defined(BASECAMP_NETWORK_ETHERNET)
+	if (network.isLinkUp()) {
+		rssi = WiFi.RSSI();
+	}
+#endif
+#ifndef BASECAMP_NOMQTT
+	mqttConnected = mqtt.IsConnected();
+	outboxDepth = mqtt.GetOutboxStats().depth;
+#endif
+
+	snprintf(buffer, size,
+		"{\"uptime\":%u,\"heapFree\":%u,\"heapMin\":%u,\"rssi\":%d,\"mqttConnected\":%s,\"outboxDepth\":%u,\"loopMaxUs\":%u}",
+		static_cast<uint32_t>(esp_timer_get_time() / 1000000), ESP.getFreeHeap(), ESP.getMinFreeHeap(), rssi,
+		mqttConnected ? "true" : "false", outboxDepth, loopMaxGapUs_.exchange(0));
+}
+
+void Basecamp::setTelemetryRate(uint8_t eventsPerSecond)
+{
+	telemetryRate_ = eventsPerSecond;
+	basecampScheduler.reschedule(telemetryTimer_, telemetryIntervalMs(eventsPerSecond));
 }
 
-bool Basecamp::shouldEnableConfigWebserver() const
+uint32_t Basecamp::telemetryIntervalMs(uint8_t eventsPerSecond)
 {
-	return (configurationUi_ == ConfigurationUI::always ||
-	   (configurationUi_ == ConfigurationUI::accessPoint && network.getOperationMode() == NetworkControl::Mode::accessPoint));
+	// While disabled the timer keeps running slowly and does nothing
+	return eventsPerSecond > 0 ? 1000 / eventsPerSecond : 1000;
 }
 
+void Basecamp::sendTelemetry()
+{
+	if (telemetryRate_ == 0 || web.eventClientCount() == 0) {
+		return;
+	}
+	char message[192];
+	sampleTelemetry(message, sizeof(message));
+	web.sendEvent("telemetry", message);
+}
+#endif
 
-#ifdef BASECAMP_USEDNS
-#ifdef DNSServer_h
-// This is a task that handles DNS requests from clients
-void Basecamp::DnsHandling(void * dnsServerPointer)
+#ifndef BASECAMP_NOMQTT
+void Basecamp::MetricsTask(void *basecampPointer)
 {
-		DNSServer * dnsServer = (DNSServer *) dnsServerPointer;
-		while(1) {
-			// handle each request
-			dnsServer->processNextRequest();
-			vTaskDelay(1000);
+	// Basecamp's own metrics take about 3.6 KB, the buffer grows when more get registered.
+	// On the heap as the task stack is small.
+	static const constexpr size_t kInitialPayloadSize = 4096;
+	// Room for metrics registered later, saves reallocating on every new one
+	static const constexpr size_t kPayloadReserve = 512;
+	Basecamp *basecamp = static_cast<Basecamp*>(basecampPointer);
+	size_t payloadSize = kInitialPayloadSize;
+	char *payload = static_cast<char*>(heapAllocate(HeapSubsystem::mqtt, payloadSize));
+	if (!payload) {
+		ESP_LOGE(kLoggingTag, "Not enough memory to publish metrics");
+		basecampTaskStacks.finished(xTaskGetCurrentTaskHandle());
+		vTaskDelete(nullptr);
+		return;
+	}
+
+	MqttTopic topic;
+	TickType_t lastWake = xTaskGetTickCount();
+	while (true) {
+		const uint16_t interval = basecamp->metricsPublishInterval_;
+		vTaskDelayUntil(&lastWake, pdMS_TO_TICKS(interval > 0 ? interval * 1000u : 1000u));
+		if (interval == 0 || !basecamp->mqtt.IsConnected()) {
+			continue;
 		}
-};
+		if (!topic.IsValid()) {
+			topic = basecamp->mqtt.MakeTopic("metrics");
+		}
+
+		MetricsBufferPrint out(payload, payloadSize);
+		basecampMetrics.render(out);
+		size_t length = out.length();
+		if (out.isTruncated()) {
+			// A cut off line would be misread, so render again into a buffer of the required size
+			const size_t requiredSize = out.requiredSize() + kPayloadReserve;
+			char *grown = static_cast<char*>(heapReallocate(payload, requiredSize));
+			if (!grown) {
+				ESP_LOGE(kLoggingTag, "Not enough memory for %u bytes of metrics", requiredSize);
+				continue;
+			}
+			payload = grown;
+			payloadSize = requiredSize;
+			MetricsBufferPrint retry(payload, payloadSize);
+			basecampMetrics.render(retry);
+			if (retry.isTruncated()) {
+				// Grew by more than the reserve in between, grown again on the next interval
+				continue;
+			}
+			length = retry.length();
+		}
+		// Usually larger than an outbox slot, such messages are published directly
+		basecamp->mqtt.Publish(topic, payload, length);
+	}
+}
+
+#ifndef BASECAMP_NOOTA
+namespace {
+	struct OtaPullRequest {
+		Basecamp *basecamp;
+		String url;
+		uint8_t sha256[32];
+	};
+}
+
+void Basecamp::onOtaRequest(const char* payload, size_t length)
+{
+	StaticJsonDocument<384> request;
+	if (deserializeJson(request, payload, length) != DeserializationError::Ok) {
+		ESP_LOGW(kLoggingTag, "Ignoring malformed OTA request");
+		return;
+	}
+
+	auto *pullRequest = new OtaPullRequest{this, request["url"] | "", {}};
+	if (pullRequest->url.length() == 0 || !OtaPipeline::parseSha256(request["sha256"] | "", pullRequest->sha256)) {
+		ESP_LOGW(kLoggingTag, "OTA requests need an url and a sha256");
+		mqtt.Publish(String("{\"result\":\"invalid request\"}"), false, "ota/status");
+		delete pullRequest;
+		return;
+	}
+	if (otaPullRunning_.exchange(true)) {
+		ESP_LOGW(kLoggingTag, "OTA update already running");
+		delete pullRequest;
+		return;
+	}
+
+	// Runs in its own task as the download blocks and TLS needs a large stack
+	if (!startTask(&OtaPullTask, "OtaPullTask", tasks_.otaPull, pullRequest)) {
+		otaPullRunning_ = false;
+		delete pullRequest;
+	}
+}
+
+void Basecamp::OtaPullTask(void *requestPointer)
+{
+	OtaPullRequest *request = static_cast<OtaPullRequest*>(requestPointer);
+	Basecamp *basecamp = request->basecamp;
+	ESP_LOGW(kLoggingTag, "Pulling update from %s", request->url.c_str());
+
+	OtaPipeline pipeline;
+	const bool success = pipeline.pull(request->url.c_str(), request->sha256);
+	delete request;
+
+	StaticJsonDocument<128> status;
+	status["result"] = success ? "ok" : pipeline.getError();
+	basecamp->mqtt.Publish(status, false, "ota/status");
+	if (success) {
+		// Give the status message a moment to leave
+		vTaskDelay(pdMS_TO_TICKS(1000));
+		ESP.restart();
+	}
+	basecamp->otaPullRunning_ = false;
+	basecampTaskStacks.finished(xTaskGetCurrentTaskHandle());
+	vTaskDelete(nullptr);
+}
 #endif
 #endif
 
+bool Basecamp::shouldEnableConfigWebserver() const
+{
+	return (configurationUi_ == ConfigurationUI::always ||
+	   (configurationUi_ == ConfigurationUI::accessPoint && network.getOperationMode() == NetworkControl::Mode::accessPoint));
+}
+
+
+
 // This function checks the reset reason returned by the ESP and resets the configuration if neccessary.
 // It counts all system reboots that occured by power cycles or button resets.
 // If the ESP32 receives an IP the boot counts as successful and the counter will be reset by Basecamps
@@ -358,8 +763,10 @@ void Basecamp::checkResetReason()
 			ESP.restart();
 
 			// If the WiFi is unconfigured and the device is rebooted twice format the internal flash storage
-		} else if (bootCounter > 2 && configuration.get(ConfigurationKey::wifiConfigured).equalsIgnoreCase("false")) {
+		} else if (bootCounter > 2 && configuration.isKeySet(ConfigurationKey::wifiConfigured) && !configuration.getBool(ConfigurationKey::wifiConfigured)) {
 			ESP_LOGW(kLoggingTag, "Factory reset was forced.");
+			// Remove the configuration, it may not be stored on SPIFFS
+			configuration.erase();
 			// Format the flash storage
 			SPIFFS.format();
 			// Reset the boot counter
@@ -389,6 +796,7 @@ String Basecamp::showSystemInfo() {
 	std::ostringstream info;
 	info << "MAC-Address: " << mac.c_str();
 	info << ", Hardware MAC: " << network.getHardwareMacAddress(":").c_str() << std::endl;
+	info << basecampHeap.describe().c_str() << std::endl;
 
 	if (configuration.isKeySet(ConfigurationKey::accessPointSecret)) {
 			info << "*******************************************" << std::endl;
@@ -8,8 +8,15 @@
 #define Basecamp_h
 #include <Esp32Logging.hpp>
 #include "Configuration.hpp"
+#include "StartupSequence.hpp"
+#include "Scheduler.hpp"
+#include "HeapMonitor.hpp"
+#include "LogPipeline.hpp"
+#include "TaskPlacement.hpp"
+#include "TimeSync.hpp"
 #include <Preferences.h>
 #include <rom/rtc.h>
+#include <atomic>
 
 #ifndef BASECAMP_NO_NETWORK
 #include "NetworkControl.hpp"
@@ -29,8 +36,31 @@
 
 #ifndef BASECAMP_NOOTA
 #include <ArduinoOTA.h>
+#include "OtaPipeline.hpp"
 #endif
 
+// Placement of Basecamp's background tasks, passed to Basecamp::begin().
+// basecampTaskStacks reports how much of each stack was used, e.g. via basecampTaskStacks.log().
+struct BasecampTaskConfig {
+	// Hosts captive DNS, ArduinoOTA, telemetry and deferred configuration saves
+	TaskPlacement scheduler = {6144, 2, tskNO_AFFINITY};
+	// Only started if a syslog server is configured or basecampLogs.addSink() is used
+	TaskPlacement logs = {4096, 1, tskNO_AFFINITY};
+#ifndef BASECAMP_NOWEB
+	// Short-lived, saves a configuration submitted via the web interface
+	TaskPlacement webSubmit = {4096, 1, tskNO_AFFINITY};
+#endif
+#ifndef BASECAMP_NOMQTT
+	EspIdfMqttClient::TaskConfig mqtt;
+	// Only started if setMetricsPublishInterval() is used
+	TaskPlacement metrics = {3072, 0, tskNO_AFFINITY};
+#ifndef BASECAMP_NOOTA
+	// Only started for updates requested via setOtaPullEnabled(), TLS needs the large stack
+	TaskPlacement otaPull = {8192, 0, tskNO_AFFINITY};
+#endif
+#endif
+};
+
 class Basecamp
 {
 	public:
@@ -48,6 +78,13 @@ class Basecamp
 			accessPoint,	///< Only start the server if acting as an access  (first setup mode)
 		};
 
+		// How begin() runs the startup stages
+		enum class StartupMode
+		{
+			serial,	///< One after the other, begin() returns when everything is started
+			staged,	///< Independent stages run while the network link comes up, MQTT is started by handle() once it is up
+		};
+
 		explicit Basecamp(Basecamp::SetupModeWifiEncryption setupModeWifiEncryption =
 			Basecamp::SetupModeWifiEncryption::none,
 			Basecamp::ConfigurationUI configurationUi = Basecamp::ConfigurationUI::always);
@@ -62,9 +99,27 @@ class Basecamp
 		 * password generation. If a password is given, the ctor given
 		 * SetupModeWifiEncryption will be overriden to SetupModeWifiEncryption::secure.
 		*/
-		bool begin(String fixedWiFiApEncryptionPassword = {});
+		bool begin(String fixedWiFiApEncryptionPassword = {}, const BasecampTaskConfig &tasks = {});
 		void handle();
 
+		// Startup for nodes that wake, publish and go back to deep sleep. After a wake from
+		// deepSleep() the configuration comes from RTC memory instead of flash, and only the
+		// network and MQTT are started: no web interface, OTA, boot counter or Home Assistant
+		// discovery, and SNTP only once the last sync is a day old. MQTT is started from handle()
+		// as soon as the link is up. Without retained state (e.g. after power-on) it runs begin()
+		// with the same arguments.
+		bool beginFast(String fixedWiFiApEncryptionPassword = {}, const BasecampTaskConfig &tasks = {});
+		// Keeps the configuration and time sync state for beginFast() and sleeps. Does not return,
+		// make sure messages that have to arrive were delivered before.
+		void deepSleep(uint64_t sleepUs);
+		// True if beginFast() used the retained state
+		bool isFastBoot() const { return fastBoot_; }
+
+		// Has to be called before begin()
+		void setStartupMode(StartupMode mode) { startupMode_ = mode; }
+		// Per-stage timings are logged once all stages are done
+		const StartupSequence& getStartupSequence() const { return startup_; }
+
 		void checkResetReason();
 		String showSystemInfo();
 		bool isSetupModeWifiEncrypted();
@@ -79,6 +134,17 @@ class Basecamp
 
 #ifndef BASECAMP_NOMQTT
     	EspIdfMqttClient mqtt;
+
+		// Publishes the metrics served at /metrics to the "metrics" topic every intervalSeconds.
+		// Has to be enabled before begin(), afterwards it changes the interval, 0 pauses it.
+		void setMetricsPublishInterval(uint16_t intervalSeconds) { metricsPublishInterval_ = intervalSeconds; }
+
+#ifndef BASECAMP_NOOTA
+		// Listens on the "ota" topic for {"url": "...", "sha256": "..."} and pulls the update via
+		// OtaPipeline (gzip and delta images are accepted). The result is published to "ota/status",
+		// on success the device restarts. Needs OTA to be active, has to be enabled before begin().
+		void setOtaPullEnabled(bool enabled) { otaPullEnabled_ = enabled; }
+#endif
 #endif
 
 #ifndef BASECAMP_NOWEB
@@ -86,16 +152,60 @@ class Basecamp
 #ifdef BASECAMP_USEDNS
 #ifdef DNSServer_h
 		DNSServer dnsServer;
-		static void DnsHandling(void *);
 #endif
 #endif
 		WebServer web;
+
+		// Pushes a "telemetry" event with heap, RSSI, MQTT outbox depth, loop latency and uptime
+		// to the clients of /events, at most eventsPerSecond times per second. 0 disables it.
+		void setTelemetryRate(uint8_t eventsPerSecond);
 #endif
 
 	private:
 		String _cleanHostname();
 		bool shouldEnableConfigWebserver() const;
 
+		// Startup stages run by begin()
+		void beginConfiguration();
+		void beginNetwork(const String &fixedWiFiApEncryptionPassword);
+		void beginMqtt();
+		void beginOta();
+		void beginWebInterface();
+		void beginSntp();
+		void beginSyslog();
+		void applyTaskConfig(const BasecampTaskConfig &tasks);
+
+		BasecampTaskConfig tasks_;
+		StartupMode startupMode_ = StartupMode::serial;
+		StartupSequence startup_;
+		bool startupDone_ = false;
+		bool fastBoot_ = false;
+
+#ifndef BASECAMP_NOWEB
+		static uint32_t telemetryIntervalMs(uint8_t eventsPerSecond);
+		void sendTelemetry();
+		// Renders the current status as JSON into buffer
+		void sampleTelemetry(char *buffer, size_t size);
+		std::atomic<uint8_t> telemetryRate_{1};
+		Scheduler::TimerId telemetryTimer_ = Scheduler::kNoTimer;
+		// Longest time between two calls of handle() since the last telemetry sample
+		std::atomic<uint32_t> loopMaxGapUs_{0};
+		int64_t lastHandleUs_ = 0;
+#endif
+
+#ifndef BASECAMP_NOMQTT
+		static void MetricsTask(void *);
+		std::atomic<uint16_t> metricsPublishInterval_{0};
+		TaskHandle_t metricsTask_ = nullptr;
+
+#ifndef BASECAMP_NOOTA
+		void onOtaRequest(const char* payload, size_t length);
+		static void OtaPullTask(void *);
+		bool otaPullEnabled_ = false;
+		std::atomic<bool> otaPullRunning_{false};
+#endif
+#endif
+
 		SetupModeWifiEncryption setupModeWifiEncryption_;
 		ConfigurationUI configurationUi_;
 };
@@ -0,0 +1,201 @@
+/*
+   Basecamp - ESP32 library to simplify the basics of IoT projects
+   Written by Merlin Schumacher (mls@ct.de) for c't magazin für computer technik (https://www.ct.de)
+   Licensed under GPLv3. See LICENSE for details.
+   */
+#ifdef BASECAMP_BENCHMARK
+
+#include "Benchmark.hpp"
+
+#include <Esp32Logging.hpp>
+#include <SPIFFS.h>
+#include <esp_heap_caps.h>
+
+namespace {
+	const constexpr char* kLoggingTag = "BasecampBenchmark";
+	// Always a file, also with BASECAMP_CONFIG_NVS
+	const constexpr char* kScratchConfiguration = "/benchmark.json";
+	// Flash writes are slow and wear the flash
+	const constexpr uint32_t kMaxSaves = 20;
+	const constexpr uint32_t kMaxLoads = 200;
+
+	// Set while a benchmark runs, allocations of other tasks are not counted
+	TaskHandle_t volatile countedTask = nullptr;
+	uint32_t allocations = 0;
+	uint32_t allocatedBytes = 0;
+	size_t freeHeapBefore = 0;
+
+	inline void countAllocation(size_t size)
+	{
+		if (countedTask != nullptr && xTaskGetCurrentTaskHandle() == countedTask) {
+			allocations++;
+			allocatedBytes += size;
+		}
+	}
+}
+
+#ifdef BASECAMP_BENCHMARK_WRAP_MALLOC
+extern "C" {
+	void* __real_malloc(size_t size);
+	void* __real_calloc(size_t count, size_t size);
+	void* __real_realloc(void *pointer, size_t size);
+
+	void* __wrap_malloc(size_t size)
+	{
+		countAllocation(size);
+		return __real_malloc(size);
+	}
+
+	void* __wrap_calloc(size_t count, size_t size)
+	{
+		countAllocation(count * size);
+		return __real_calloc(count, size);
+	}
+
+	// Counted as a new allocation of the full size, even if the block could be grown in place
+	void* __wrap_realloc(void *pointer, size_t size)
+	{
+		countAllocation(size);
+		return __real_realloc(pointer, size);
+	}
+}
+#else
+// The default operator delete frees with free()
+void* operator new(size_t size)
+{
+	countAllocation(size);
+	void *pointer = malloc(size);
+	if (!pointer) {
+		abort();
+	}
+	return pointer;
+}
+
+void* operator new[](size_t size)
+{
+	return operator new(size);
+}
+#endif
+
+void BasecampBenchmark::begin()
+{
+	allocations = 0;
+	allocatedBytes = 0;
+	freeHeapBefore = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+	countedTask = xTaskGetCurrentTaskHandle();
+}
+
+BenchmarkResult BasecampBenchmark::end(const char* name, uint32_t iterations, int64_t elapsedUs)
+{
+	countedTask = nullptr;
+	const size_t freeHeapAfter = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+
+	BenchmarkResult result;
+	result.name = name;
+	result.iterations = iterations;
+	result.opsPerSecond = elapsedUs > 0 ? iterations * 1e6f / elapsedUs : 0;
+	result.bytesPerOp = iterations > 0 ? static_cast<float>(allocatedBytes) / iterations : 0;
+	result.allocationsPerOp = iterations > 0 ? static_cast<float>(allocations) / iterations : 0;
+	result.heapDelta = static_cast<int32_t>(freeHeapAfter) - static_cast<int32_t>(freeHeapBefore);
+	return result;
+}
+
+void BasecampBenchmark::log(const BenchmarkResult &result)
+{
+	ESP_LOGI(kLoggingTag, "%-18s %7u ops %10.1f ops/s %8.1f B/op %6.2f allocs/op, heap %+d B", result.name,
+		result.iterations, result.opsPerSecond, result.bytesPerOp, result.allocationsPerOp, result.heapDelta);
+}
+
+void BasecampBenchmark::runAll(uint32_t durationMs)
+{
+#ifdef BASECAMP_BENCHMARK_WRAP_MALLOC
+	ESP_LOGI(kLoggingTag, "Running benchmarks for %u ms each, counting all allocations", durationMs);
+#else
+	ESP_LOGI(kLoggingTag, "Running benchmarks for %u ms each, counting operator new only", durationMs);
+#endif
+	runConfiguration(durationMs);
+#ifndef BASECAMP_NOWEB
+	runWeb(durationMs);
+#endif
+#ifndef BASECAMP_NOMQTT
+	runMqtt(durationMs);
+#endif
+}
+
+void BasecampBenchmark::runConfiguration(uint32_t durationMs)
+{
+	// A copy of the device's values, so sizes are realistic but its configuration is not touched
+	Configuration scratch(String{kScratchConfiguration});
+	for (size_t i = 0; i < kConfigurationKeyCount; i++) {
+		const ConfigurationKey key = static_cast<ConfigurationKey>(i);
+		scratch.set(key, basecamp_.configuration.get(key));
+	}
+
+	log(run("config.get", [&]() { sink_ += scratch.get(ConfigurationKey::mqttHost).length(); }, durationMs));
+	log(run("config.getByName", [&]() { sink_ += scratch.get("MQTTHost").length(); }, durationMs));
+	log(run("config.getInt", [&]() { sink_ += scratch.getInt(ConfigurationKey::mqttPort); }, durationMs));
+
+	// Setting the current value again is a no-op, so alternate between two
+	const String names[2] = {scratch.get(ConfigurationKey::deviceName) + "-a", scratch.get(ConfigurationKey::deviceName) + "-b"};
+	uint32_t toggle = 0;
+	log(run("config.set", [&]() { scratch.set(ConfigurationKey::deviceName, names[toggle++ & 1]); }, durationMs));
+
+	// save() skips an untainted configuration, so every iteration changes a value first
+	log(run("config.save", [&]() {
+		scratch.set(ConfigurationKey::deviceName, names[toggle++ & 1]);
+		sink_ += scratch.save();
+	}, durationMs, kMaxSaves));
+	log(run("config.load", [&]() { sink_ += scratch.load(); }, durationMs, kMaxLoads));
+	SPIFFS.remove(kScratchConfiguration);
+}
+
+#ifndef BASECAMP_NOWEB
+void BasecampBenchmark::runWeb(uint32_t durationMs)
+{
+	WebServer &web = basecamp_.web;
+	if (!web.configuration_) {
+		ESP_LOGW(kLoggingTag, "Web interface not started, skipping");
+		return;
+	}
+
+	// Renders every time, as if the configuration had changed before each request
+	log(run("web.dataJson", [&]() {
+		xSemaphoreTake(web.interfaceMutex_, portMAX_DELAY);
+		web.renderInterfaceData();
+		sink_ += web.interfaceData_->length();
+		xSemaphoreGive(web.interfaceMutex_);
+	}, durationMs));
+}
+#endif
+
+#ifndef BASECAMP_NOMQTT
+void BasecampBenchmark::runMqtt(uint32_t durationMs)
+{
+	EspIdfMqttClient &mqtt = basecamp_.mqtt;
+	if (!mqtt.jsonBufferMutex) {
+		ESP_LOGW(kLoggingTag, "MQTT not started, skipping");
+		return;
+	}
+
+	// The topic part of every Publish()
+	log(run("mqtt.makeTopic", [&]() { sink_ += mqtt.MakeTopic("status").length(); }, durationMs));
+
+	HaDiscoveryEntity entity;
+	entity.unitOfMeasurement = "°C";
+	entity.deviceClass = "temperature";
+	entity.expireAfter = 300;
+	entity.valueTemplate = "{{ value_json.temperature }}";
+	entity.stateTopicSuffix = "state";
+	entity.entitySuffix = "temperature";
+	char topic[MqttTopic::kMaxLength + 1];
+	char uniqueEntityId[96];
+	log(run("mqtt.haDiscovery", [&]() {
+		if (mqtt.AcquireJsonBuffer()) {
+			sink_ += mqtt.SerializeHaDiscovery(entity, topic, sizeof(topic), uniqueEntityId, sizeof(uniqueEntityId));
+			xSemaphoreGive(mqtt.jsonBufferMutex);
+		}
+	}, durationMs));
+}
+#endif
+
+#endif
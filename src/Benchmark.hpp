@@ -0,0 +1,94 @@
+/*
+   Basecamp - ESP32 library to simplify the basics of IoT projects
+   Written by Merlin Schumacher (mls@ct.de) for c't magazin für computer technik (https://www.ct.de)
+   Licensed under GPLv3. See LICENSE for details.
+   */
+
+#ifndef Benchmark_h
+#define Benchmark_h
+
+#ifdef BASECAMP_BENCHMARK
+
+#include <Arduino.h>
+#include <esp_timer.h>
+#include "Basecamp.hpp"
+
+struct BenchmarkResult {
+	const char* name;
+	uint32_t iterations;
+	float opsPerSecond;
+	// Heap allocations made by the benchmarking task, see BasecampBenchmark
+	float bytesPerOp;
+	float allocationsPerOp;
+	// Change of the free heap over all iterations, negative if memory was kept
+	int32_t heapDelta;
+};
+
+// Measures Basecamp's hot paths on the device, compiled only with BASECAMP_BENCHMARK.
+// Run it from setup() after begin(), with the log level at info or above, e.g.
+//   BasecampBenchmark(iot).runAll();
+//
+// Allocations are counted on the benchmarking task only. By default operator new is
+// counted, which misses Arduino's String as it uses malloc() directly. To count every
+// allocation, also define BASECAMP_BENCHMARK_WRAP_MALLOC and link with
+//   -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc
+class BasecampBenchmark {
+	public:
+		explicit BasecampBenchmark(Basecamp &basecamp) : basecamp_(basecamp) {}
+
+		// Runs and logs every benchmark, each for about durationMs
+		void runAll(uint32_t durationMs = 1000);
+
+		// Calls operation once to warm up, then repeatedly for about durationMs or maxIterations
+		template<typename OPERATION>
+		static BenchmarkResult run(const char* name, OPERATION operation, uint32_t durationMs = 1000,
+			uint32_t maxIterations = UINT32_MAX)
+		{
+			operation();
+
+			begin();
+			const int64_t startUs = esp_timer_get_time();
+			const int64_t durationUs = static_cast<int64_t>(durationMs) * 1000;
+			int64_t elapsedUs = 0;
+			uint32_t iterations = 0;
+			// Batches grow until they take about a millisecond, so reading the timer does not dominate
+			uint32_t batch = 1;
+			while (elapsedUs < durationUs && iterations < maxIterations) {
+				const uint32_t count = (maxIterations - iterations < batch) ? maxIterations - iterations : batch;
+				const int64_t batchStartUs = esp_timer_get_time();
+				for (uint32_t i = 0; i < count; i++) {
+					operation();
+				}
+				iterations += count;
+				const int64_t nowUs = esp_timer_get_time();
+				if (nowUs - batchStartUs < 1000 && batch < 4096) {
+					batch *= 2;
+				}
+				elapsedUs = nowUs - startUs;
+			}
+			return end(name, iterations, elapsedUs);
+		}
+
+		static void log(const BenchmarkResult &result);
+
+	private:
+		// Start and stop counting allocations of the calling task
+		static void begin();
+		static BenchmarkResult end(const char* name, uint32_t iterations, int64_t elapsedUs);
+
+		void runConfiguration(uint32_t durationMs);
+#ifndef BASECAMP_NOWEB
+		void runWeb(uint32_t durationMs);
+#endif
+#ifndef BASECAMP_NOMQTT
+		void runMqtt(uint32_t durationMs);
+#endif
+
+		Basecamp &basecamp_;
+		// Results are added here, so the compiler cannot drop the operations
+		volatile uint32_t sink_ = 0;
+};
+
+#endif
+
+#endif
@@ -9,20 +9,16 @@ class CaptiveRequestHandler : public AsyncWebHandler {
 
 		bool canHandle(AsyncWebServerRequest *request) {
 			//skip all basecamp related sources - handle all other requests and return the default html
-			if (request->url() != "/basecamp.css" && 
-					request->url() != "/basecamp.js" && 
-					request->url() != "/data.json" && 
-					request->url() != "/logo.svg" && 
-					request->url() != "/submitconfig") {
-				return true;
-			} else {
-				return false;
-			}
+			const char* url = request->url().c_str();
+			return !findBasecampAsset(url) &&
+					strcmp(url, "/data.json") != 0 &&
+					strcmp(url, "/submitconfig") != 0;
 		}
 
 		void handleRequest(AsyncWebServerRequest *request) {
+			const BasecampAsset *index = findBasecampAsset("/");
 			AsyncWebServerResponse *response = request->beginResponse_P(
-					200, "text/html", index_htm_gz, index_htm_gz_len);
+					200, index->mimeType, index->data, index->length);
 			response->addHeader("Content-Encoding", "gzip");
 			request->send(response);
 		}
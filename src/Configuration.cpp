@@ -4,127 +4,356 @@
    Licensed under GPLv3. See LICENSE for details.
    */
 #include "Configuration.hpp"
+#include "Metrics.hpp"
+#include "Scheduler.hpp"
 
 namespace {
 	const constexpr char* kLoggingTag = "BasecampConfig";
 }
 
 Configuration::Configuration()
-	: _memOnlyConfig( true ),
-	_jsonFile()
+	: mutex_(xSemaphoreCreateRecursiveMutex())
 {
+	for (size_t i = 0; i < kConfigurationKeyCount; i++) {
+		loaded_[i] = true;
+		parse(i);
+	}
 }
 
 Configuration::Configuration(String filename)
-	: _memOnlyConfig( false ),
-	_jsonFile(std::move(filename))
+	: Configuration()
+{
+	storage_.reset(new SpiffsJsonConfigurationStorage(std::move(filename)));
+}
+
+Configuration::~Configuration()
 {
+	basecampScheduler.cancel(saveTimer_);
+	vSemaphoreDelete(mutex_);
 }
 
 void Configuration::setMemOnly() {
-	_memOnlyConfig = true;
-	_jsonFile = "";
+	storage_.reset();
 }
 
 void Configuration::setFileName(const String& filename) {
-	_memOnlyConfig = false;
-	_jsonFile = filename;
+	storage_.reset(new SpiffsJsonConfigurationStorage(filename));
+}
+
+void Configuration::setStorage(std::unique_ptr<ConfigurationStorage> storage) {
+	storage_ = std::move(storage);
 }
 
 bool Configuration::load() {
 	ESP_LOGD(kLoggingTag, "Loading config file");
 	
-	if (_memOnlyConfig) {
+	if (!storage_) {
 		ESP_LOGD(kLoggingTag, "Memory-only configuration: Nothing loaded!");
 		return false;
 	}
-	
-	ESP_LOGD(kLoggingTag, "JSON File: %s", _jsonFile.c_str());
-	if (!SPIFFS.begin(true)) {
-		ESP_LOGE(kLoggingTag, "Could not access SPIFFS.");
-		return false;
-	}
-
-	File configFile = SPIFFS.open(_jsonFile, "r");
 
-	if (!configFile || configFile.isDirectory()) {
-		ESP_LOGE(kLoggingTag, "Failed to open config file");
+	if (!storage_->begin()) {
 		return false;
 	}
 
-	DynamicJsonDocument _jsonDoc(2048);
-	auto error = deserializeJson(_jsonDoc, configFile);
-	JsonObject _jsonData = _jsonDoc.as<JsonObject>();
-
-	if (error) {
-		ESP_LOGE(kLoggingTag, "Failed to parse config file.");
-		return false;
+	lock();
+	bool result = true;
+	if (storage_->supportsLazyRead()) {
+		// Values are read on first access, see fetch()
+		for (size_t i = 0; i < kConfigurationKeyCount; i++) {
+			loaded_[i] = false;
+		}
+		allLoaded_ = false;
+	} else {
+		result = storage_->readAll([this](const char* key, const char* value) {
+			set(String(key), String(value));
+		});
 	}
+	// Memory and flash are in sync now
+	_configurationTainted = false;
+	unlock();
+	return result;
+}
 
-	for (const auto& configItem: _jsonData) {
-		set(String(configItem.key().c_str()), String(configItem.value().as<char*>()));
+void Configuration::fetch(size_t index) const
+{
+	lock();
+	if (!loaded_[index]) {
+		loaded_[index] = true;
+		String value;
+		if (storage_ && storage_->read(kConfigurationKeys[index].name, value) && value.length() > 0) {
+			values_[index] = std::move(value);
+			present_[index] = true;
+			parse(index);
+		}
 	}
+	unlock();
+}
 
-	configFile.close();
-	return true;
+void Configuration::fetchAll() const
+{
+	lock();
+	if (!allLoaded_) {
+		allLoaded_ = true;
+		if (storage_) {
+			storage_->readAll([this](const char* key, const char* value) {
+				ConfigurationKey configKey;
+				if (!findKey(key, configKey)) {
+					if (*value) {
+						configuration[String(key)] = value;
+					}
+				} else if (!loaded_[static_cast<size_t>(configKey)] && *value) {
+					const size_t index = static_cast<size_t>(configKey);
+					values_[index] = value;
+					present_[index] = true;
+					parse(index);
+				}
+			});
+		}
+		for (size_t i = 0; i < kConfigurationKeyCount; i++) {
+			loaded_[i] = true;
+		}
+	}
+	unlock();
 }
 
 bool Configuration::save() {
 	ESP_LOGD(kLoggingTag, "Saving config file");
 	
-	if (_memOnlyConfig) {
+	if (!storage_) {
 		ESP_LOGD(kLoggingTag, "Memory-only configuration: Nothing saved!");
 		return false;
 	}
 
-	File configFile = SPIFFS.open(_jsonFile, "w");
-	if (!configFile) {
-		ESP_LOGE(kLoggingTag, "Failed to open config file for writing");
+	lock();
+	// A deferred save is superseded by this one
+	basecampScheduler.cancel(saveTimer_);
+	saveTimer_ = Scheduler::kNoTimer;
+	if (!_configurationTainted) {
+		ESP_LOGD(kLoggingTag, "Configuration unchanged, nothing to save");
+		unlock();
+		return true;
+	}
+
+	// Keys not accessed yet have to be written as well
+	fetchAll();
+	bool success = storage_->beginWrite();
+	for (size_t i = 0; success && i < kConfigurationKeyCount; i++) {
+		if (present_[i]) {
+			success = storage_->write(kConfigurationKeys[i].name, values_[i]);
+		}
+	}
+	for (auto x = configuration.begin(); success && x != configuration.end(); ++x) {
+		success = storage_->write(x->first.c_str(), x->second);
+	}
+	static MetricCounter *saved = basecampMetrics.counter("basecamp_config_saves_total", "Configuration saves", "result=\"ok\"");
+	static MetricCounter *failed = basecampMetrics.counter("basecamp_config_saves_total", "Configuration saves", "result=\"failed\"");
+	if (!storage_->endWrite(success)) {
+		failed->increment();
+		unlock();
 		return false;
 	}
 
-	if (configuration.empty())
-	{
-		ESP_LOGI(kLoggingTag, "Configuration empty");
+	saved->increment();
+	_configurationTainted = false;
+	unlock();
+	return true;
+}
+
+bool Configuration::erase()
+{
+	if (!storage_) {
+		return false;
 	}
 
-	DynamicJsonDocument _jsonDoc(2048);
-	
-	for (const auto& x : configuration)
-	{
-		_jsonDoc[String(x.first)] = (String(x.second));
+	lock();
+	bool result = storage_->begin() && storage_->erase();
+	unlock();
+	return result;
+}
+
+void Configuration::saveDeferred(uint32_t delayMs)
+{
+	if (!storage_) {
+		return;
 	}
 
-	serializeJson(_jsonDoc, configFile);
-#ifdef DEBUG
-	serializeJsonPretty(_jsonDoc, Serial);
-#endif
-	configFile.close();
+	lock();
+	// Restarting the timer coalesces all changes made within delayMs into one write.
+	// It runs on the scheduler task, flash writes would stall all esp_timer callbacks.
+	if (!basecampScheduler.reschedule(saveTimer_, delayMs)) {
+		saveTimer_ = basecampScheduler.after(delayMs, [this]() { save(); });
+	}
+	if (saveTimer_ == Scheduler::kNoTimer) {
+		ESP_LOGW(kLoggingTag, "Could not schedule the save, saving immediately");
+		unlock();
+		save();
+		return;
+	}
+	unlock();
+}
+
+void Configuration::lock() const
+{
+	xSemaphoreTakeRecursive(mutex_, portMAX_DELAY);
+}
+
+void Configuration::unlock() const
+{
+	xSemaphoreGiveRecursive(mutex_);
+}
+
+size_t Configuration::exportSnapshot(uint8_t *buffer, size_t size) const
+{
+	// Known keys as their index followed by the value, unknown ones as kSnapshotUnknownKey,
+	// name and value. Values and names are zero terminated.
+	size_t length = 0;
+	auto append = [&](const char* text) {
+		const size_t textLength = strlen(text) + 1;
+		if (length + textLength > size) {
+			return false;
+		}
+		memcpy(buffer + length, text, textLength);
+		length += textLength;
+		return true;
+	};
+
+	fetchAll();
+	lock();
+	bool fits = true;
+	for (size_t i = 0; fits && i < kConfigurationKeyCount; i++) {
+		if (!present_[i]) {
+			continue;
+		}
+		fits = (length < size);
+		if (fits) {
+			buffer[length++] = i;
+			fits = append(values_[i].c_str());
+		}
+	}
+	for (auto x = configuration.begin(); fits && x != configuration.end(); ++x) {
+		fits = (length < size);
+		if (fits) {
+			buffer[length++] = kSnapshotUnknownKey;
+			fits = append(x->first.c_str()) && append(x->second.c_str());
+		}
+	}
+	unlock();
+
+	if (!fits) {
+		ESP_LOGW(kLoggingTag, "Configuration does not fit into %u bytes", size);
+		return 0;
+	}
+	return length;
+}
+
+bool Configuration::importSnapshot(const uint8_t *buffer, size_t length)
+{
+	// Returns the zero terminated string at offset and moves behind it, nullptr if it is cut off
+	auto next = [&](size_t &offset) -> const char* {
+		const char* text = reinterpret_cast<const char*>(buffer + offset);
+		const void *end = memchr(text, '\0', length - offset);
+		if (!end) {
+			return nullptr;
+		}
+		offset = static_cast<const uint8_t*>(end) - buffer + 1;
+		return text;
+	};
+
+	lock();
+	clear();
+	size_t offset = 0;
+	bool valid = true;
+	while (valid && offset < length) {
+		const uint8_t key = buffer[offset++];
+		if (key == kSnapshotUnknownKey) {
+			const char* name = next(offset);
+			const char* value = name ? next(offset) : nullptr;
+			valid = (value != nullptr);
+			if (valid) {
+				configuration[name] = value;
+			}
+		} else {
+			const char* value = (key < kConfigurationKeyCount) ? next(offset) : nullptr;
+			valid = (value != nullptr);
+			if (valid) {
+				values_[key] = value;
+				present_[key] = true;
+				parse(key);
+			}
+		}
+	}
+	if (!valid) {
+		ESP_LOGW(kLoggingTag, "Invalid configuration snapshot");
+		clear();
+	}
+	// In sync with the storage, as far as it is known
 	_configurationTainted = false;
-	return true;
+	unlock();
+	return valid;
+}
+
+bool Configuration::findKey(const char* name, ConfigurationKey &key)
+{
+	for (size_t i = 0; i < kConfigurationKeyCount; i++) {
+		if (strcmp(name, kConfigurationKeys[i].name) == 0) {
+			key = static_cast<ConfigurationKey>(i);
+			return true;
+		}
+	}
+	return false;
 }
 
 void Configuration::set(String key, String value) {
+	ConfigurationKey configKey;
+	if (findKey(key.c_str(), configKey)) {
+		set(configKey, std::move(value));
+		return;
+	}
+	fetchAll();
+
 	ESP_LOGD(kLoggingTag, "Setting %s to %s (was %s)", key.c_str(), value.c_str(), get(key).c_str());
 
+	lock();
 	if (get(key) != value) {
 		_configurationTainted = true;
-		configuration[key] = value;
+		revision_++;
+		configuration[key] = std::move(value);
 	} else {
 		ESP_LOGD(kLoggingTag, "Cowardly refusing to overwrite existing key with the same value");
 	}
+	unlock();
 }
 
 void Configuration::set(ConfigurationKey key, String value)
 {
-	set(getKeyName(key), std::move(value));
+	const size_t index = static_cast<size_t>(key);
+	ensureLoaded(index);
+	ESP_LOGD(kLoggingTag, "Setting %s to %s (was %s)", kConfigurationKeys[index].name, value.c_str(), values_[index].c_str());
+
+	lock();
+	if (values_[index] != value) {
+		_configurationTainted = true;
+		revision_++;
+		values_[index] = std::move(value);
+		present_[index] = true;
+		parse(index);
+	} else {
+		ESP_LOGD(kLoggingTag, "Cowardly refusing to overwrite existing key with the same value");
+	}
+	unlock();
 }
 
 const String &Configuration::get(String key) const
 {
+	ConfigurationKey configKey;
+	if (findKey(key.c_str(), configKey)) {
+		return get(configKey);
+	}
+
+	fetchAll();
 	auto found = configuration.find(key);
 	if (found != configuration.end()) {
-		ESP_LOGD(kLoggingTag, "Config value for %s: %s", key.c_str(), found->second.c_str());
 		return found->second;
 	}
 
@@ -134,7 +363,82 @@ const String &Configuration::get(String key) const
 
 const String &Configuration::get(ConfigurationKey key) const
 {
-	return get(getKeyName(key));
+	const size_t index = static_cast<size_t>(key);
+	ensureLoaded(index);
+	// Unset keys hold an empty String
+	return values_[index];
+}
+
+bool Configuration::parseValue(const ConfigurationKeySchema &schema, const char* value, int32_t &result)
+{
+	switch (schema.type) {
+		case ConfigurationType::boolean:
+			// The web interface and older configurations use "true", "True" and "False"
+			if (strcasecmp(value, "true") == 0 || strcmp(value, "1") == 0) {
+				result = 1;
+				return true;
+			}
+			if (strcasecmp(value, "false") == 0 || strcmp(value, "0") == 0) {
+				result = 0;
+				return true;
+			}
+			return false;
+		case ConfigurationType::integer: {
+			char *end = nullptr;
+			long parsed = strtol(value, &end, 10);
+			if (end == value || *end != '\0' || parsed < schema.minimum || parsed > schema.maximum) {
+				return false;
+			}
+			result = parsed;
+			return true;
+		}
+		case ConfigurationType::ipAddress: {
+			IPAddress address;
+			if (!address.fromString(value)) {
+				return false;
+			}
+			result = static_cast<uint32_t>(address);
+			return true;
+		}
+		case ConfigurationType::string:
+		default:
+			return true;
+	}
+}
+
+void Configuration::parse(size_t index) const
+{
+	const ConfigurationKeySchema &schema = kConfigurationKeys[index];
+	if (schema.type == ConfigurationType::string) {
+		return;
+	}
+
+	if (values_[index].length() > 0 && parseValue(schema, values_[index].c_str(), parsed_[index])) {
+		return;
+	}
+	if (values_[index].length() > 0) {
+		ESP_LOGW(kLoggingTag, "Invalid value '%s' for %s, using default '%s'", values_[index].c_str(), schema.name, schema.defaultValue);
+	}
+	parsed_[index] = 0;
+	parseValue(schema, schema.defaultValue, parsed_[index]);
+}
+
+bool Configuration::getBool(ConfigurationKey key) const
+{
+	ensureLoaded(static_cast<size_t>(key));
+	return parsed_[static_cast<size_t>(key)] != 0;
+}
+
+int32_t Configuration::getInt(ConfigurationKey key) const
+{
+	ensureLoaded(static_cast<size_t>(key));
+	return parsed_[static_cast<size_t>(key)];
+}
+
+IPAddress Configuration::getIpAddress(ConfigurationKey key) const
+{
+	ensureLoaded(static_cast<size_t>(key));
+	return IPAddress(static_cast<uint32_t>(parsed_[static_cast<size_t>(key)]));
 }
 
 // return a char* instead of a Arduino String to maintain backwards compatibility
@@ -142,35 +446,53 @@ const String &Configuration::get(ConfigurationKey key) const
 [[deprecated("getCString() is deprecated. Use get() instead")]]
 char* Configuration::getCString(String key)
 {
-	char *newCString = (char*) malloc(configuration[key].length()+1);
-	strcpy(newCString,get(key).c_str());
+	const String &value = get(key);
+	char *newCString = (char*) malloc(value.length()+1);
+	strcpy(newCString,value.c_str());
 	return newCString;
 }
 
 bool Configuration::keyExists(const String& key) const
 {
+	ConfigurationKey configKey;
+	if (findKey(key.c_str(), configKey)) {
+		return keyExists(configKey);
+	}
+	fetchAll();
 	return (configuration.find(key) != configuration.end());
 }
 
 bool Configuration::keyExists(ConfigurationKey key) const
 {
-	return (configuration.find(getKeyName(key)) != configuration.end());
+	const size_t index = static_cast<size_t>(key);
+	ensureLoaded(index);
+	return present_[index];
 }
 
 bool Configuration::isKeySet(ConfigurationKey key) const
 {
-	auto found = configuration.find(getKeyName(key));
-	if (found == configuration.end())
-	{
-		return false;
-	}
+	return (get(key).length() > 0);
+}
 
-	return (found->second.length() > 0);
+void Configuration::clear()
+{
+	lock();
+	for (size_t i = 0; i < kConfigurationKeyCount; i++) {
+		values_[i] = String();
+		present_[i] = false;
+		loaded_[i] = true;
+		parse(i);
+	}
+	configuration.clear();
+	allLoaded_ = true;
+	_configurationTainted = true;
+	revision_++;
+	unlock();
 }
 
 void Configuration::reset()
 {
-	configuration.clear();
+	clear();
 	this->save();
 	this->load();
 }
@@ -185,7 +507,7 @@ void Configuration::resetExcept(const std::list<ConfigurationKey> &keysToPreserv
 		}
 	}
 
-	configuration.clear();
+	clear();
 
 	for (const auto &key : preservedKeys) {
 		set(key.first, key.second);
@@ -197,6 +519,12 @@ void Configuration::resetExcept(const std::list<ConfigurationKey> &keysToPreserv
 
 void Configuration::dump() {
 #ifndef DEBUG
+	fetchAll();
+	for (size_t i = 0; i < kConfigurationKeyCount; i++) {
+		if (present_[i]) {
+			ESP_LOGD(kLoggingTag, "configuration[%s] = %s", kConfigurationKeys[i].name, values_[i].c_str());
+		}
+	}
 	for (const auto &p : configuration) {
 		ESP_LOGD(kLoggingTag, "configuration[%s] = %s", p.first.c_str(), p.second.c_str());
 	}
@@ -9,11 +9,19 @@
 
 #include <Esp32Logging.hpp>
 
+#include <atomic>
 #include <sstream>
 #include <list>
 #include <map>
 #include <ArduinoJson.h>
+#include <memory>
 #include <SPIFFS.h>
+#include <IPAddress.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include "ConfigurationStorage.hpp"
+#include "Scheduler.hpp"
 
 // TODO: Extend with all known keys
 enum class ConfigurationKey {
@@ -32,86 +40,112 @@ enum class ConfigurationKey {
 	syslogServer,
 	mqttTopicPrefix,
 	haDiscoveryPrefix,
+	wifiStaticIp,
+	wifiGateway,
+	wifiNetmask,
+	wifiDns,
+	ntpServer,
+	timezone,
 };
 
-// TODO: Extend with all known keys
-static const String __attribute__((unused)) getKeyName (ConfigurationKey key)
-{
-	// This automatically will break the compiler if a known key has been forgotten
-	// (if the warnings are turned on exactly...)
-	switch (key)
-	{
-		case ConfigurationKey::deviceName:
-			return "DeviceName";
-
-		case ConfigurationKey::accessPointSecret:
-			return "APSecret";
-
-		case ConfigurationKey::wifiConfigured:
-			return "WifiConfigured";
-
-		case ConfigurationKey::wifiEssid:
-			return "WifiEssid";
-
-		case ConfigurationKey::wifiPassword:
-			return "WifiPassword";
+// Number of known keys, ConfigurationKey values are used as index into the tables below
+static constexpr size_t kConfigurationKeyCount = static_cast<size_t>(ConfigurationKey::timezone) + 1;
 
-		case ConfigurationKey::mqttActive:
-			return "MQTTActive";
-
-		case ConfigurationKey::mqttHost:
-			return "MQTTHost";
-
-		case ConfigurationKey::mqttPort:
-			return "MQTTPort";
-
-		case ConfigurationKey::mqttUser:
-			return "MQTTUser";
-
-		case ConfigurationKey::mqttPass:
-			return "MQTTPass";
-
-		case ConfigurationKey::otaActive:
-			return "OTAActive";
-
-		case ConfigurationKey::otaPass:
-			return "OTAPass";
+enum class ConfigurationType {
+	string,
+	boolean,
+	integer,
+	ipAddress,
+};
 
-		case ConfigurationKey::syslogServer:
-			return "SyslogServer";
+// Schema of a known key. The default is used by the typed getters if the key is unset or invalid,
+// minimum/maximum are only checked for integers.
+struct ConfigurationKeySchema {
+	const char* name;
+	ConfigurationType type;
+	const char* defaultValue;
+	int32_t minimum;
+	int32_t maximum;
+};
 
-		case ConfigurationKey::mqttTopicPrefix:
-			return "MQTTTopicPrefix";
+// Known keys as used in the configuration file and the web interface, in the same order as ConfigurationKey
+static constexpr ConfigurationKeySchema kConfigurationKeys[] = {
+	{"DeviceName", ConfigurationType::string, "", 0, 0},
+	{"APSecret", ConfigurationType::string, "", 0, 0},
+	{"WifiConfigured", ConfigurationType::boolean, "false", 0, 0},
+	{"WifiEssid", ConfigurationType::string, "", 0, 0},
+	{"WifiPassword", ConfigurationType::string, "", 0, 0},
+	{"MQTTActive", ConfigurationType::boolean, "true", 0, 0},
+	{"MQTTHost", ConfigurationType::string, "", 0, 0},
+	{"MQTTPort", ConfigurationType::integer, "1883", 1, 65535},
+	{"MQTTUser", ConfigurationType::string, "", 0, 0},
+	{"MQTTPass", ConfigurationType::string, "", 0, 0},
+	{"OTAActive", ConfigurationType::boolean, "true", 0, 0},
+	{"OTAPass", ConfigurationType::string, "", 0, 0},
+	{"SyslogServer", ConfigurationType::string, "", 0, 0},
+	{"MQTTTopicPrefix", ConfigurationType::string, "", 0, 0},
+	{"HaDiscoveryPrefix", ConfigurationType::string, "", 0, 0},
+	// Empty for DHCP
+	{"WifiStaticIp", ConfigurationType::ipAddress, "", 0, 0},
+	{"WifiGateway", ConfigurationType::ipAddress, "", 0, 0},
+	{"WifiNetmask", ConfigurationType::ipAddress, "255.255.255.0", 0, 0},
+	{"WifiDns", ConfigurationType::ipAddress, "", 0, 0},
+	{"NtpServer", ConfigurationType::string, "pool.ntp.org", 0, 0},
+	// POSIX TZ string
+	{"Timezone", ConfigurationType::string, "CET-1CEST,M3.5.0/2:00,M10.5.0/3:00", 0, 0},
+};
+// This will break the compiler if a known key has been forgotten
+static_assert(sizeof(kConfigurationKeys) / sizeof(kConfigurationKeys[0]) == kConfigurationKeyCount,
+	"kConfigurationKeys does not match ConfigurationKey");
 
-		case ConfigurationKey::haDiscoveryPrefix:
-			return "HaDiscoveryPrefix";
-	}
-	return "";
+static inline const char* getKeyName(ConfigurationKey key)
+{
+	return kConfigurationKeys[static_cast<size_t>(key)].name;
 }
 
 class Configuration {
 	public:
 		// Default constructor: Memory-only configuration (NO EEPROM read/writes
 		Configuration();
-		// Constructor with filename: Can be read from and written to EEPROM
+		// Constructor with filename: Can be read from and written to a JSON file on SPIFFS
 		explicit Configuration(String filename);
-		~Configuration() = default;
+		~Configuration();
+		Configuration(const Configuration&) = delete;
+		Configuration& operator=(const Configuration&) = delete;
 		
 		// Switched configuration to memory-only and empties filename
 		void setMemOnly();
 		// Sets new filename and removes memory-only tag
 		void setFileName(const String& filename);
+		// Uses a different storage backend, e.g. NvsConfigurationStorage. Call load() afterwards.
+		void setStorage(std::unique_ptr<ConfigurationStorage> storage);
 		// Returns memory-only state of configuration
-		bool isMemOnly() {return _memOnlyConfig;}
+		bool isMemOnly() {return !storage_;}
 
 		const String& getKey(ConfigurationKey configKey) const;
 
 		// Both functions return true on successful load or save. Return false on any failure. Also return false for memory-only configurations.
+		// save() only writes if something changed and replaces the file atomically.
+		// Storages supporting it read values lazily on first access after load().
 		bool load();
 		bool save();
+		// Removes everything from the storage (factory reset), values in memory are kept
+		bool erase();
+		// Coalesces changes into a single save() after delayMs without further calls.
+		// Use save() if the device is going to restart.
+		void saveDeferred(uint32_t delayMs = 1000);
+
+		// Compact copy of all values, e.g. to keep them in RTC memory during deep sleep.
+		// Returns the number of bytes written, 0 if they do not fit.
+		size_t exportSnapshot(uint8_t *buffer, size_t size) const;
+		// Replaces all values with the snapshot without touching the storage. save() still writes to it.
+		bool importSnapshot(const uint8_t *buffer, size_t length);
 		
 		void dump();
 
+		// Incremented by every change of a value, e.g. to invalidate data derived from the configuration
+		uint32_t getRevision() const { return revision_; }
+
 		// Returns true if the key 'key' exists
 		bool keyExists(const String& key) const;
 
@@ -129,6 +163,8 @@ class Configuration {
 
 		// FIXME: Get rid of every direct access ("name") set() and get()
 		// to minimize the risk of unknown-key usage. Move to private.
+		// Slower compatibility path: known names are mapped to their ConfigurationKey,
+		// all others are kept in `configuration`.
 		void set(String key, String value);
 		// FIXME: use this instead
 		void set(ConfigurationKey key, String value);
@@ -136,9 +172,15 @@ class Configuration {
 		// FIXME: Get rid of every direct access ("name") set() and get()
 		// to minimize the risk of unknown-key usage. Move to private.
 		const String& get(String key) const;
-		// FIXME: use this instead
+		// FIXME: use this instead. O(1) and allocation-free.
 		const String& get(ConfigurationKey key) const;
 		char* getCString(String key);
+
+		// Typed access, parsed once when the value is set or loaded.
+		// Return the schema default if the key is unset or its value is invalid.
+		bool getBool(ConfigurationKey key) const;
+		int32_t getInt(ConfigurationKey key) const;
+		IPAddress getIpAddress(ConfigurationKey key) const;
 		struct cmp_str
 		{
 			bool operator()(const String &a, const String &b) const
@@ -147,15 +189,56 @@ class Configuration {
 			}
 		};
 
-		std::map<String, String, cmp_str> configuration;
+		// Returns true and sets `key` if `name` is a known key
+		static bool findKey(const char* name, ConfigurationKey &key);
+
+		// Values of keys that are not part of ConfigurationKey
+		mutable std::map<String, String, cmp_str> configuration;
 
 	private:
+		// Marks unknown keys in snapshots, known ones are stored by index
+		static constexpr uint8_t kSnapshotUnknownKey = 0xff;
+
+		// Values of the known keys, indexed by ConfigurationKey.
+		// Mutable as they may be read lazily from the storage.
+		mutable String values_[kConfigurationKeyCount];
+		mutable bool present_[kConfigurationKeyCount] = {};
+		// Parsed values of non-string keys (bool as 0/1, IP addresses in network order)
+		mutable int32_t parsed_[kConfigurationKeyCount] = {};
+		// False if the key still has to be read from the storage
+		mutable bool loaded_[kConfigurationKeyCount];
+		// False if unknown keys still have to be read from the storage
+		mutable bool allLoaded_ = true;
+
+		inline void ensureLoaded(size_t index) const
+		{
+			if (!loaded_[index]) {
+				fetch(index);
+			}
+		}
+		void fetch(size_t index) const;
+		void fetchAll() const;
+
+		// Updates parsed_ from values_, falling back to the default
+		void parse(size_t index) const;
+		static bool parseValue(const ConfigurationKeySchema &schema, const char* value, int32_t &result);
+
+		// Removes all values, known and unknown keys
+		void clear();
+
+		// Guards values against concurrent deferred saves
+		void lock() const;
+		void unlock() const;
+
 		static void CheckConfigStatus(void *);
+		// Set by every change, cleared by load() and save()
 		bool _configurationTainted = false;
+		std::atomic<uint32_t> revision_{0};
 		String noResult_ = {};
-		// Set to true if configuration is memory-only
-		bool _memOnlyConfig;
-		String _jsonFile;
+		// Memory-only configuration if not set
+		std::unique_ptr<ConfigurationStorage> storage_;
+		SemaphoreHandle_t mutex_;
+		Scheduler::TimerId saveTimer_ = Scheduler::kNoTimer;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,347 @@
+/*
+   Basecamp - ESP32 library to simplify the basics of IoT projects
+   Written by Merlin Schumacher (mls@ct.de) for c't magazin für computer technik (https://www.ct.de)
+   Licensed under GPLv3. See LICENSE for details.
+   */
+#include "ConfigurationStorage.hpp"
+#include "Hash.hpp"
+#include "HeapMonitor.hpp"
+
+#include <ArduinoJson.h>
+
+namespace {
+	const constexpr char* kLoggingTag = "BasecampConfig";
+	const constexpr char* kTempSuffix = ".tmp";
+	// Index of all stored keys, cannot collide with key names as those never start with '_'
+	const constexpr char* kKeyIndexEntry = "_keys";
+
+	// Calls line for every line of a newline separated list
+	void forEachLine(const String &lines, const std::function<void(const char*)> &line)
+	{
+		const char* start = lines.c_str();
+		while (*start) {
+			const char* end = strchr(start, '\n');
+			size_t length = end ? (size_t)(end - start) : strlen(start);
+			char key[128];
+			if (length > 0 && length < sizeof(key)) {
+				memcpy(key, start, length);
+				key[length] = '\0';
+				line(key);
+			}
+			if (!end) {
+				break;
+			}
+			start = end + 1;
+		}
+	}
+}
+
+SpiffsJsonConfigurationStorage::SpiffsJsonConfigurationStorage(String filename)
+	: filename_(std::move(filename)),
+	tempFilename_(filename_ + kTempSuffix)
+{
+}
+
+bool SpiffsJsonConfigurationStorage::begin()
+{
+	ESP_LOGD(kLoggingTag, "JSON File: %s", filename_.c_str());
+	if (!SPIFFS.begin(true)) {
+		ESP_LOGE(kLoggingTag, "Could not access SPIFFS.");
+		return false;
+	}
+
+	// A power loss during endWrite() may have left only the temporary file behind
+	if (!SPIFFS.exists(filename_) && SPIFFS.exists(tempFilename_)) {
+		ESP_LOGW(kLoggingTag, "Recovering config file from %s", tempFilename_.c_str());
+		SPIFFS.rename(tempFilename_, filename_);
+	}
+	return true;
+}
+
+bool SpiffsJsonConfigurationStorage::readAll(const ItemCallback &item)
+{
+	File configFile = SPIFFS.open(filename_, "r");
+
+	if (!configFile || configFile.isDirectory()) {
+		ESP_LOGE(kLoggingTag, "Failed to open config file");
+		return false;
+	}
+
+	HeapJsonDocument<HeapSubsystem::config> _jsonDoc(2048);
+	auto error = deserializeJson(_jsonDoc, configFile);
+	configFile.close();
+
+	if (error) {
+		ESP_LOGE(kLoggingTag, "Failed to parse config file.");
+		return false;
+	}
+
+	for (const auto& configItem: _jsonDoc.as<JsonObject>()) {
+		const char* value = configItem.value().as<const char*>();
+		item(configItem.key().c_str(), value ? value : "");
+	}
+	return true;
+}
+
+void SpiffsJsonConfigurationStorage::writeJsonString(Print &out, const char* text)
+{
+	out.write('"');
+	for (const char* c = text; *c; c++) {
+		if (*c == '"' || *c == '\\') {
+			out.write('\\');
+			out.write(*c);
+		} else if (static_cast<uint8_t>(*c) < 0x20) {
+			char escaped[7];
+			snprintf(escaped, sizeof(escaped), "\\u%04x", *c);
+			out.print(escaped);
+		} else {
+			out.write(*c);
+		}
+	}
+	out.write('"');
+}
+
+bool SpiffsJsonConfigurationStorage::beginWrite()
+{
+	// Write to a temporary file first and replace the old file only after that succeeded,
+	// so a power loss never leaves a truncated configuration.
+	writeFile_ = SPIFFS.open(tempFilename_, "w");
+	if (!writeFile_) {
+		ESP_LOGE(kLoggingTag, "Failed to open config file for writing");
+		return false;
+	}
+	firstItem_ = true;
+	return true;
+}
+
+bool SpiffsJsonConfigurationStorage::write(const char* key, const String &value)
+{
+	// Stream the JSON object directly into the file instead of building a document first
+	writeFile_.write(firstItem_ ? '{' : ',');
+	firstItem_ = false;
+	writeJsonString(writeFile_, key);
+	writeFile_.write(':');
+	writeJsonString(writeFile_, value.c_str());
+	return writeFile_.getWriteError() == 0;
+}
+
+bool SpiffsJsonConfigurationStorage::endWrite(bool success)
+{
+	if (firstItem_) {
+		ESP_LOGI(kLoggingTag, "Configuration empty");
+		writeFile_.write('{');
+	}
+	writeFile_.write('}');
+
+	const bool complete = success && writeFile_.getWriteError() == 0;
+	writeFile_.close();
+	if (!complete) {
+		ESP_LOGE(kLoggingTag, "Failed to write config file");
+		SPIFFS.remove(tempFilename_);
+		return false;
+	}
+
+	// SPIFFS can not rename onto an existing file. If power is lost in between,
+	// begin() picks up the temporary file.
+	SPIFFS.remove(filename_);
+	if (!SPIFFS.rename(tempFilename_, filename_)) {
+		ESP_LOGE(kLoggingTag, "Failed to replace config file");
+		return false;
+	}
+	return true;
+}
+
+bool SpiffsJsonConfigurationStorage::erase()
+{
+	SPIFFS.remove(tempFilename_);
+	return !SPIFFS.exists(filename_) || SPIFFS.remove(filename_);
+}
+
+NvsConfigurationStorage::NvsConfigurationStorage(const char* nvsNamespace, const char* migrateFrom)
+	: namespace_(nvsNamespace),
+	migrateFrom_(migrateFrom)
+{
+}
+
+NvsConfigurationStorage::~NvsConfigurationStorage()
+{
+	if (open_) {
+		nvs_close(handle_);
+	}
+}
+
+void NvsConfigurationStorage::entryName(const char* key, char (&name)[NVS_KEY_NAME_MAX_SIZE])
+{
+	if (strlen(key) < sizeof(name)) {
+		strcpy(name, key);
+	} else {
+		snprintf(name, sizeof(name), "~%08x", basecampHash::fnv1a(key, strlen(key)));
+	}
+}
+
+bool NvsConfigurationStorage::begin()
+{
+	if (open_) {
+		return true;
+	}
+
+	esp_err_t error = nvs_open(namespace_, NVS_READWRITE, &handle_);
+	if (error != ESP_OK) {
+		ESP_LOGE(kLoggingTag, "Could not open NVS namespace %s: %s", namespace_, esp_err_to_name(error));
+		return false;
+	}
+	open_ = true;
+
+	size_t length = 0;
+	if (migrateFrom_ && nvs_get_str(handle_, kKeyIndexEntry, nullptr, &length) == ESP_ERR_NVS_NOT_FOUND) {
+		migrate();
+	}
+	return true;
+}
+
+bool NvsConfigurationStorage::migrate()
+{
+	if (!SPIFFS.begin(false) || !SPIFFS.exists(migrateFrom_)) {
+		return false;
+	}
+
+	ESP_LOGW(kLoggingTag, "Migrating configuration from %s to NVS", migrateFrom_);
+	SpiffsJsonConfigurationStorage file(migrateFrom_);
+	bool itemsWritten = true;
+	bool success = beginWrite() && file.readAll([&](const char* key, const char* value) {
+		itemsWritten = write(key, String(value)) && itemsWritten;
+	});
+	if (!endWrite(success && itemsWritten)) {
+		ESP_LOGE(kLoggingTag, "Migration failed, keeping %s", migrateFrom_);
+		return false;
+	}
+	file.erase();
+	return true;
+}
+
+bool NvsConfigurationStorage::readEntry(const char* name, String &value)
+{
+	size_t length = 0;
+	if (nvs_get_str(handle_, name, nullptr, &length) != ESP_OK) {
+		return false;
+	}
+
+	char* buffer = static_cast<char*>(heapAllocate(HeapSubsystem::config, length));
+	if (!buffer) {
+		return false;
+	}
+	bool result = (nvs_get_str(handle_, name, buffer, &length) == ESP_OK);
+	if (result) {
+		value = buffer;
+	}
+	heapFree(buffer);
+	return result;
+}
+
+bool NvsConfigurationStorage::read(const char* key, String &value)
+{
+	if (!open_) {
+		return false;
+	}
+
+	char name[NVS_KEY_NAME_MAX_SIZE];
+	entryName(key, name);
+	return readEntry(name, value);
+}
+
+bool NvsConfigurationStorage::readAll(const ItemCallback &item)
+{
+	if (!open_) {
+		return false;
+	}
+
+	String keys;
+	if (!readEntry(kKeyIndexEntry, keys)) {
+		// Nothing stored yet
+		return true;
+	}
+
+	forEachLine(keys, [&](const char* key) {
+		String value;
+		if (read(key, value)) {
+			item(key, value.c_str());
+		}
+	});
+	return true;
+}
+
+bool NvsConfigurationStorage::beginWrite()
+{
+	if (!open_) {
+		return false;
+	}
+	writtenKeys_ = "";
+	changed_ = false;
+	return true;
+}
+
+bool NvsConfigurationStorage::write(const char* key, const String &value)
+{
+	writtenKeys_ += key;
+	writtenKeys_ += '\n';
+
+	char name[NVS_KEY_NAME_MAX_SIZE];
+	entryName(key, name);
+
+	// Unchanged values are not written again to save flash wear
+	String stored;
+	if (readEntry(name, stored) && stored == value) {
+		return true;
+	}
+	esp_err_t error = nvs_set_str(handle_, name, value.c_str());
+	if (error != ESP_OK) {
+		ESP_LOGE(kLoggingTag, "Could not store %s: %s", key, esp_err_to_name(error));
+		return false;
+	}
+	changed_ = true;
+	return true;
+}
+
+bool NvsConfigurationStorage::endWrite(bool success)
+{
+	if (!success) {
+		// Entries already set will be committed with the next successful write
+		writtenKeys_ = "";
+		return false;
+	}
+
+	String storedKeys;
+	const bool hasIndex = readEntry(kKeyIndexEntry, storedKeys);
+	if (storedKeys != writtenKeys_) {
+		// Remove entries of keys that are gone, e.g. after a reset
+		const String written = String('\n') + writtenKeys_;
+		forEachLine(storedKeys, [&](const char* key) {
+			if (written.indexOf(String('\n') + key + '\n') < 0) {
+				char name[NVS_KEY_NAME_MAX_SIZE];
+				entryName(key, name);
+				nvs_erase_key(handle_, name);
+				changed_ = true;
+			}
+		});
+	}
+	// An empty index is written as well, it marks the storage as initialized
+	if (!hasIndex || storedKeys != writtenKeys_) {
+		nvs_set_str(handle_, kKeyIndexEntry, writtenKeys_.c_str());
+		changed_ = true;
+	}
+	writtenKeys_ = "";
+
+	if (changed_ && nvs_commit(handle_) != ESP_OK) {
+		ESP_LOGE(kLoggingTag, "Could not commit configuration to NVS");
+		return false;
+	}
+	return true;
+}
+
+bool NvsConfigurationStorage::erase()
+{
+	if (!open_) {
+		return false;
+	}
+	return nvs_erase_all(handle_) == ESP_OK && nvs_commit(handle_) == ESP_OK;
+}
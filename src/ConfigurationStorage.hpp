@@ -0,0 +1,105 @@
+/*
+   Basecamp - ESP32 library to simplify the basics of IoT projects
+   Written by Merlin Schumacher (mls@ct.de) for c't magazin für computer technik (https://www.ct.de)
+   Licensed under GPLv3. See LICENSE for details.
+   */
+
+#ifndef ConfigurationStorage_h
+#define ConfigurationStorage_h
+
+#include <Esp32Logging.hpp>
+
+#include <functional>
+#include <Arduino.h>
+#include <SPIFFS.h>
+#include <nvs.h>
+
+#ifndef NVS_KEY_NAME_MAX_SIZE
+// Not defined by older IDF versions, includes the terminating NUL
+#define NVS_KEY_NAME_MAX_SIZE 16
+#endif
+
+// Where Configuration keeps its values. All values are strings.
+class ConfigurationStorage {
+	public:
+		typedef std::function<void(const char* key, const char* value)> ItemCallback;
+
+		virtual ~ConfigurationStorage() = default;
+
+		// Mounts or opens the storage. Returns false if it is not available.
+		virtual bool begin() = 0;
+		// Calls item for every stored key
+		virtual bool readAll(const ItemCallback &item) = 0;
+		// Storages returning true here can read single keys on first access
+		virtual bool supportsLazyRead() const { return false; }
+		// Reads a single key, returns false if it does not exist
+		virtual bool read(const char* key, String &value) { return false; }
+
+		// Writing always covers the whole configuration: beginWrite(), write() for every key, endWrite()
+		virtual bool beginWrite() = 0;
+		virtual bool write(const char* key, const String &value) = 0;
+		// Keys that have not been written are removed. Nothing is changed if success is false.
+		virtual bool endWrite(bool success) = 0;
+
+		// Removes all stored keys (factory reset)
+		virtual bool erase() = 0;
+};
+
+// JSON file on SPIFFS, written atomically via a temporary file
+class SpiffsJsonConfigurationStorage : public ConfigurationStorage {
+	public:
+		explicit SpiffsJsonConfigurationStorage(String filename);
+
+		const String& getFileName() const { return filename_; }
+
+		bool begin() override;
+		bool readAll(const ItemCallback &item) override;
+		bool beginWrite() override;
+		bool write(const char* key, const String &value) override;
+		bool endWrite(bool success) override;
+		bool erase() override;
+
+	private:
+		static void writeJsonString(Print &out, const char* text);
+
+		String filename_;
+		String tempFilename_;
+		File writeFile_;
+		bool firstItem_ = true;
+};
+
+// Every key is stored natively in its own NVS entry, so nothing has to be mounted or parsed
+// and single keys can be read on first access. Keys longer than NVS allows are stored under a hash.
+class NvsConfigurationStorage : public ConfigurationStorage {
+	public:
+		// If the namespace is empty and migrateFrom names an existing JSON file on SPIFFS,
+		// its content is copied once and the file is removed afterwards. erase() clears the whole
+		// namespace, so it must not be shared with other Preferences.
+		explicit NvsConfigurationStorage(const char* nvsNamespace = "basecampCfg", const char* migrateFrom = "/basecamp.json");
+		~NvsConfigurationStorage() override;
+
+		bool begin() override;
+		bool readAll(const ItemCallback &item) override;
+		bool supportsLazyRead() const override { return true; }
+		bool read(const char* key, String &value) override;
+		bool beginWrite() override;
+		bool write(const char* key, const String &value) override;
+		bool endWrite(bool success) override;
+		bool erase() override;
+
+	private:
+		// NVS_KEY_NAME_MAX_SIZE includes the terminating NUL
+		static void entryName(const char* key, char (&name)[NVS_KEY_NAME_MAX_SIZE]);
+		bool readEntry(const char* name, String &value);
+		bool migrate();
+
+		const char* namespace_;
+		const char* migrateFrom_;
+		nvs_handle handle_ = 0;
+		bool open_ = false;
+		// Newline separated list of stored keys, NVS can not be enumerated on all IDF versions
+		String writtenKeys_;
+		bool changed_ = false;
+};
+
+#endif
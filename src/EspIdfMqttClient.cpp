@@ -1,12 +1,34 @@
 #include "EspIdfMqttClient.hpp"
+#include "Hash.hpp"
+#include "HeapMonitor.hpp"
+#include "Metrics.hpp"
+#include "Trace.hpp"
+#include <Preferences.h>
+#include <esp_timer.h>
+#include <SPIFFS.h>
 
+namespace {
+    const constexpr char* kHaDiscoveryPreferences = "basecampHa";
+    // Number of stored messages replayed before fresh messages get a chance again
+    const constexpr size_t kOfflineReplayBatchSize = 16;
+    const constexpr uint32_t kBrokerProbeTimeoutMs = 2000;
+    const constexpr uint32_t kDeliveryExpiryIntervalMs = 1000;
+}
 
 EspIdfMqttClient& EspIdfMqttClient::Begin(const String& mqttUri, const String& deviceName, const String& haDiscoveryTopicPrefix, const String& baseTopic)
 {
     ESP_LOGD("MQTT", "mqttUri: %s, deviceName: %s, haDiscoveryTopicPrefix: %s, baseTopic: %s", 
              mqttUri.c_str(), deviceName.c_str(), haDiscoveryTopicPrefix.c_str(), baseTopic.c_str());
 
-    if (!mqttUri.isEmpty()) {
+    if (!jsonBufferMutex)
+        jsonBufferMutex = xSemaphoreCreateMutex();
+    if (!subscriptionMutex)
+        subscriptionMutex = xSemaphoreCreateRecursiveMutex();
+    // Timeouts also have to fire once no more messages are published or acknowledged
+    if (deliveryExpiryTimer == Scheduler::kNoTimer)
+        deliveryExpiryTimer = basecampScheduler.every(kDeliveryExpiryIntervalMs, [this]() { deliveryTracker.Expire(); });
+
+    if (brokers.Parse(mqttUri) > 0) {
         uint8_t rawMac[6];
         char macString[sizeof(rawMac) * 2 + 1];
         esp_read_mac(rawMac, ESP_MAC_WIFI_STA);
@@ -21,18 +43,104 @@ EspIdfMqttClient& EspIdfMqttClient::Begin(const String& mqttUri, const String& d
                  this->macAddress.c_str(), this->deviceName.c_str(), this->baseTopic.c_str(), clientId.c_str());
 
         esp_mqtt_client_config_t mqtt_cfg = {};
-        mqtt_cfg.uri = mqttUri.c_str();
+        mqtt_cfg.uri = brokers.Uri(0);
         mqtt_cfg.event_handle = StaticEventHandler;
         mqtt_cfg.user_context = this;
         mqtt_cfg.client_id = clientId.c_str();
+        mqtt_cfg.task_prio = taskConfig.client.priority;
+        mqtt_cfg.task_stack = taskConfig.client.stackSize;
         mqttClient = esp_mqtt_client_init(&mqtt_cfg);
         
         esp_mqtt_client_start(mqttClient);
+
+        if (brokers.Count() > 1 && brokerHealthCheckIntervalMs > 0 &&
+            !startTask(&BrokerHealthTask, "MqttBrokerHealth", taskConfig.brokerHealth, this, &brokerHealthTask))
+            ESP_LOGE("MQTT", "Could not create broker health task, failing over on failed connects only");
+    }
+
+    return *this;
+}
+
+EspIdfMqttClient& EspIdfMqttClient::EnableOutbox(const MqttOutbox::Config& config)
+{
+    if (outbox.IsActive()) {
+        ESP_LOGW("MQTT", "Outbox already enabled");
+        return *this;
+    }
+
+    // The offline store may have started the task already
+    if (outbox.Begin(config) && !outboxTask)
+        StartOutboxTask();
+
+    return *this;
+}
+
+EspIdfMqttClient& EspIdfMqttClient::EnableOfflineStore(const MqttOfflineStore::Config& config)
+{
+    if (!SPIFFS.begin(true)) {
+        ESP_LOGE("MQTT", "Could not access SPIFFS, offline store disabled");
+        return *this;
     }
 
+    // Replaying is done by the outbox task, so start it even without outbox
+    if (offlineStore.Begin(config) && !outboxTask)
+        StartOutboxTask();
+
     return *this;
 }
 
+void EspIdfMqttClient::StartOutboxTask()
+{
+    if (!startTask(&OutboxTask, "MqttOutbox", taskConfig.outbox, this, &outboxTask))
+        ESP_LOGE("MQTT", "Could not create outbox task, staying in synchronous mode");
+}
+
+void EspIdfMqttClient::OutboxTask(void* clientPointer)
+{
+    auto client = reinterpret_cast<EspIdfMqttClient*>(clientPointer);
+    while (true) {
+        // Woken up by new messages and by (re)connects
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        client->DrainOutbox();
+    }
+}
+
+void EspIdfMqttClient::DrainOutbox()
+{
+    BASECAMP_TRACE_SCOPE("mqtt.drainOutbox");
+    DrainRamOutbox();
+
+    while (IsConnected() && !offlineStore.IsEmpty()) {
+        bool failed = false;
+        bool remaining = offlineStore.ReplayBatch(kOfflineReplayBatchSize, [this, &failed](const char* topic, const char* payload, size_t length, bool retain, int qos) {
+            failed = PublishNow(topic, payload, length, retain, qos, nullptr, false) < 0;
+            return !failed;
+        });
+        // Fresh messages take precedence over replayed ones
+        DrainRamOutbox();
+        // A failed message is kept, retrying right away would only fail again. The next
+        // publish or connect wakes the task up.
+        if (!remaining || failed)
+            break;
+    }
+}
+
+void EspIdfMqttClient::DrainRamOutbox()
+{
+    MqttOutbox::Message message;
+    while (IsConnected() && outbox.Peek(message)) {
+        int publishResult = PublishNow(message.topic, message.payload, message.length, message.retain,
+                                       message.qos, message.callback, false);
+        if (publishResult < 0 && !IsConnected()) {
+            // Lost the connection in the mean time, keep the message for the next connect
+            break;
+        }
+        if (publishResult < 0 && message.callback)
+            message.callback(publishResult, false, 0);
+        outbox.Commit(publishResult >= 0);
+    }
+}
+
 EspIdfMqttClient& EspIdfMqttClient::OnConnect(OnConnectUserCallback callback) {
   // TBD: fire immediately if alreay connected?
   _onConnectUserCallbacks.push_back(callback);
@@ -48,35 +156,321 @@ esp_err_t EspIdfMqttClient::StaticEventHandler(esp_mqtt_event_handle_t event)
 
 esp_err_t EspIdfMqttClient::EventHandler(esp_mqtt_event_handle_t event)
 {
+    BASECAMP_TRACE_SCOPE("mqtt.event");
+    if (!clientTaskRegistered) {
+        clientTaskRegistered = true;
+        clientTask = xTaskGetCurrentTaskHandle();
+        basecampTaskStacks.add("mqtt_task", clientTask, taskConfig.client.stackSize);
+    }
     if (event->event_id == MQTT_EVENT_CONNECTED)
     {
         ESP_LOGI("MQTT", "Connected");
+        brokers.Connected();
+        connected = true;
+        deliveryTracker.Reconnected();
         for (auto callback : _onConnectUserCallbacks)
             callback();
+        // Sessions are not persistent, so all subscriptions have to be renewed
+        if (subscriptionMutex) {
+            xSemaphoreTakeRecursive(subscriptionMutex, portMAX_DELAY);
+            for (const auto& subscription : subscriptions)
+                esp_mqtt_client_subscribe(mqttClient, subscription.topicFilter.c_str(), subscription.qos);
+            xSemaphoreGiveRecursive(subscriptionMutex);
+        }
+        if (!haDiscoveryEntities.empty() && !haDiscoveryTopicPrefix.isEmpty())
+            PublishChangedHaDiscovery();
+        if (outboxTask)
+            xTaskNotifyGive(outboxTask);
+    }
+    else if (event->event_id == MQTT_EVENT_DISCONNECTED)
+    {
+        ESP_LOGI("MQTT", "Disconnected");
+        // Also reported for failed connects
+        const bool wasConnected = connected.exchange(false);
+        if (brokers.Disconnected(wasConnected, linkUp)) {
+            static MetricCounter *failovers = basecampMetrics.counter("basecamp_mqtt_failovers_total", "Switches to another MQTT broker");
+            failovers->increment();
+            const size_t active = brokers.Active();
+            ESP_LOGW("MQTT", "Failing over to %s:%u", brokers.Host(active), brokers.Port(active));
+            // Used for the next reconnect
+            esp_mqtt_client_set_uri(mqttClient, brokers.Uri(active));
+            // The new broker does not have the retained discovery configs
+            ForceHaDiscoveryRepublish();
+        }
+    }
+    else if (event->event_id == MQTT_EVENT_PUBLISHED)
+    {
+        deliveryTracker.Acknowledge(event->msg_id);
+    }
+    else if (event->event_id == MQTT_EVENT_DATA)
+    {
+        HandleData(event);
     }
 
     return ESP_OK;
 }
 
+void EspIdfMqttClient::BrokerHealthTask(void* clientPointer)
+{
+    auto client = reinterpret_cast<EspIdfMqttClient*>(clientPointer);
+    while (true) {
+        vTaskDelay(pdMS_TO_TICKS(client->brokerHealthCheckIntervalMs));
+        if (!client->linkUp)
+            continue;
+        for (size_t i = 0; i < client->brokers.Count(); i++)
+            client->brokers.Probe(i, kBrokerProbeTimeoutMs);
+
+        // A failing connection is handled by the failover in EventHandler()
+        const size_t preferred = client->brokers.Preferred();
+        if (client->IsConnected() && preferred != client->brokers.Active())
+            client->SwitchBroker(preferred);
+    }
+}
+
+void EspIdfMqttClient::SwitchBroker(size_t index)
+{
+    static MetricCounter *failovers = basecampMetrics.counter("basecamp_mqtt_failovers_total", "Switches to another MQTT broker");
+    failovers->increment();
+    ESP_LOGW("MQTT", "Returning to %s:%u", brokers.Host(index), brokers.Port(index));
+
+    // Queued messages wait for the new connection
+    const bool wasConnected = connected.exchange(false);
+    // Its stack is read one last time, so before stopping deletes the MQTT task
+    if (clientTask)
+        basecampTaskStacks.finished(clientTask);
+    // Ends the MQTT task without a disconnect event
+    esp_mqtt_client_stop(mqttClient);
+    clientTask = nullptr;
+    clientTaskRegistered = false;
+    if (wasConnected)
+        brokers.Disconnected(true);
+
+    brokers.Select(index);
+    esp_mqtt_client_set_uri(mqttClient, brokers.Uri(index));
+    ForceHaDiscoveryRepublish();
+    esp_mqtt_client_start(mqttClient);
+}
+
+void EspIdfMqttClient::SetLinkUp(bool up)
+{
+    linkUp = up;
+    // Catch up on everything queued while the link was down
+    if (up && connected && outboxTask)
+        xTaskNotifyGive(outboxTask);
+}
+
+bool EspIdfMqttClient::Subscribe(const String& topicFilter, MqttMessageCallback callback, int qos /* = 0 */)
+{
+    if (!subscriptionMutex) {
+        ESP_LOGE("MQTT", "Begin() has not been called");
+        return false;
+    }
+
+    xSemaphoreTakeRecursive(subscriptionMutex, portMAX_DELAY);
+    if (!inboundBuffer)
+        inboundBuffer = static_cast<char*>(heapAllocate(HeapSubsystem::mqtt, inboundBufferSize + 1));
+    bool result = (inboundBuffer != nullptr) && subscriptionTrie.Insert(topicFilter.c_str(), std::move(callback));
+    if (result) {
+        bool known = false;
+        for (const auto& subscription : subscriptions)
+            known |= (subscription.topicFilter == topicFilter);
+        if (!known) {
+            subscriptions.push_back({topicFilter, qos});
+            if (connected)
+                esp_mqtt_client_subscribe(mqttClient, topicFilter.c_str(), qos);
+        }
+    }
+    xSemaphoreGiveRecursive(subscriptionMutex);
+
+    ESP_LOGD("MQTT", "Subscribe to %s (qos %i): %u", topicFilter.c_str(), qos, result);
+    return result;
+}
+
+EspIdfMqttClient& EspIdfMqttClient::SetInboundBufferSize(size_t size)
+{
+    if (inboundBuffer)
+        ESP_LOGW("MQTT", "Inbound buffer already allocated, size stays at %u bytes", inboundBufferSize);
+    else
+        inboundBufferSize = size;
+    return *this;
+}
+
+void EspIdfMqttClient::HandleData(esp_mqtt_event_handle_t event)
+{
+    if (!inboundBuffer)
+        return;
+
+    // The topic is only part of the first fragment
+    if (event->current_data_offset == 0) {
+        inboundDiscarding = false;
+        if ((size_t)event->topic_len > MqttTopic::kMaxLength || (size_t)event->total_data_len > inboundBufferSize) {
+            ESP_LOGW("MQTT", "Dropping inbound message (topic %i, payload %i bytes)", event->topic_len, event->total_data_len);
+            inboundDiscarding = true;
+            return;
+        }
+        memcpy(inboundTopic, event->topic, event->topic_len);
+        inboundTopic[event->topic_len] = '\0';
+        inboundTopicLength = event->topic_len;
+    }
+    if (inboundDiscarding || (size_t)(event->current_data_offset + event->data_len) > inboundBufferSize)
+        return;
+
+    memcpy(inboundBuffer + event->current_data_offset, event->data, event->data_len);
+    if (event->current_data_offset + event->data_len < event->total_data_len)
+        return;
+
+    inboundBuffer[event->total_data_len] = '\0';
+    xSemaphoreTakeRecursive(subscriptionMutex, portMAX_DELAY);
+    size_t matched = subscriptionTrie.Dispatch(inboundTopic, inboundTopicLength, inboundBuffer, event->total_data_len);
+    xSemaphoreGiveRecursive(subscriptionMutex);
+    ESP_LOGD("MQTT", "Received %i bytes on %s, %u callbacks", event->total_data_len, inboundTopic, matched);
+}
+
+bool EspIdfMqttClient::BuildTopic(char* buffer, size_t bufferSize, const char* prefix, const char* suffix)
+{
+    int length = (suffix && *suffix) ? snprintf(buffer, bufferSize, "%s/%s", prefix, suffix)
+                                     : snprintf(buffer, bufferSize, "%s", prefix);
+    if (length < 0 || (size_t)length >= bufferSize) {
+        ESP_LOGE("MQTT", "Topic too long: %s/%s", prefix, suffix ? suffix : "");
+        return false;
+    }
+    return true;
+}
+
+MqttTopic EspIdfMqttClient::MakeTopic(const char* topicSuffix, const char* topic /* = nullptr */) const
+{
+    MqttTopic result;
+    if (BuildTopic(result.topic, sizeof(result.topic), (topic && *topic) ? topic : baseTopic.c_str(), topicSuffix))
+        result.topicLength = strlen(result.topic);
+    else
+        result.topic[0] = '\0';
+    return result;
+}
+
 void EspIdfMqttClient::Publish(const String& message, bool retain /* = false */, const String& topicSuffix /* = {} */, const String& topic /* = {} */)
 {
-    String topicInt = !topic.isEmpty() ? topic : baseTopic;
-    if (!topicSuffix.isEmpty())
-        topicInt += "/" + topicSuffix;
+    char topicInt[MqttTopic::kMaxLength + 1];
+    if (!BuildTopic(topicInt, sizeof(topicInt), !topic.isEmpty() ? topic.c_str() : baseTopic.c_str(), topicSuffix.c_str()))
+        return;
 
-    ESP_LOGI("MQTT", "topic: %s, retain: %u, message: %s", topicInt.c_str(), retain, message.c_str());
+    ESP_LOGD("MQTT", "topic: %s, retain: %u, length: %u", topicInt, retain, message.length());
 
-    int publishResult = -1;
-    if (mqttClient)
-        publishResult = esp_mqtt_client_publish(mqttClient, topicInt.c_str(),  message.c_str(), 0, 0, retain);
+    PublishInternal(topicInt, message.c_str(), message.length(), retain);
+}
 
-    ESP_LOGI("MQTT", "publish result: %i", publishResult);
+void EspIdfMqttClient::Publish(const MqttTopic& topic, const char* payload, size_t length, bool retain /* = false */,
+                               int qos /* = 0 */, MqttPublishCallback callback /* = nullptr */)
+{
+    if (!topic.IsValid())
+        return;
+
+    ESP_LOGD("MQTT", "topic: %s, retain: %u, qos: %i, length: %u", topic.c_str(), retain, qos, length);
+
+    PublishInternal(topic.c_str(), payload, length, retain, qos, std::move(callback));
+}
+
+void EspIdfMqttClient::Publish(const MqttTopic& topic, const JsonDocument& message, char* buffer, size_t bufferSize, bool retain /* = false */,
+                               int qos /* = 0 */, MqttPublishCallback callback /* = nullptr */)
+{
+    size_t length = serializeJson(message, buffer, bufferSize);
+    if (length + 1 >= bufferSize) {
+        // serializeJson() silently truncates, so a completely filled buffer has to be treated as overflow
+        ESP_LOGE("MQTT", "JSON message for %s does not fit into %u bytes", topic.c_str(), bufferSize);
+        return;
+    }
+
+    Publish(topic, buffer, length, retain, qos, std::move(callback));
+}
+
+void EspIdfMqttClient::Publish(const MqttTopic& topic, const JsonDocument& message, bool retain /* = false */,
+                               int qos /* = 0 */, MqttPublishCallback callback /* = nullptr */)
+{
+    if (!AcquireJsonBuffer())
+        return;
+    Publish(topic, message, jsonBuffer, jsonBufferSize, retain, qos, std::move(callback));
+    xSemaphoreGive(jsonBufferMutex);
+}
+
+bool EspIdfMqttClient::AcquireJsonBuffer()
+{
+    if (!jsonBufferMutex) {
+        ESP_LOGE("MQTT", "Begin() has not been called");
+        return false;
+    }
+
+    xSemaphoreTake(jsonBufferMutex, portMAX_DELAY);
+    if (!jsonBuffer) {
+        // One-time allocation, kept for the lifetime of the client
+        jsonBuffer = static_cast<char*>(heapAllocate(HeapSubsystem::mqtt, jsonBufferSize));
+        if (!jsonBuffer) {
+            ESP_LOGE("MQTT", "Could not allocate JSON buffer of %u bytes", jsonBufferSize);
+            xSemaphoreGive(jsonBufferMutex);
+            return false;
+        }
+    }
+    return true;
+}
+
+EspIdfMqttClient& EspIdfMqttClient::SetJsonBufferSize(size_t size)
+{
+    if (jsonBuffer)
+        ESP_LOGW("MQTT", "JSON buffer already allocated, size stays at %u bytes", jsonBufferSize);
+    else
+        jsonBufferSize = size;
+    return *this;
 }
 
-void EspIdfMqttClient::Publish(JsonDocument message, bool retain /* = false */, const String& topicSuffix /* = {} */, const String& topic /* = {} */)
+bool EspIdfMqttClient::PublishInternal(const char* topic, const char* message, size_t length, bool retain,
+                                       int qos /* = 0 */, MqttPublishCallback callback /* = nullptr */)
 {
-    ESP_LOGD("MQTT", "Entered function");
+    if (!IsConnected() && offlineStore.IsActive())
+    {
+        // Completion callbacks can not be persisted, they are not called for stored messages
+        return offlineStore.Store(topic, message, length, retain, qos);
+    }
+
+    // The task also runs for the offline store alone, without an outbox. Payloads too large
+    // for a slot are sent directly instead of being dropped.
+    if (outboxTask && outbox.IsActive() && length <= outbox.GetConfig().maxPayloadLength)
+    {
+        if (!outbox.Enqueue(topic, message, length, retain, qos, std::move(callback)))
+            return false;
+        xTaskNotifyGive(outboxTask);
+        return true;
+    }
 
+    int publishResult = PublishNow(topic, message, length, retain, qos, std::move(callback));
+    if (publishResult < 0)
+        ESP_LOGD("MQTT", "Publishing to %s failed", topic);
+    return publishResult >= 0;
+}
+
+int EspIdfMqttClient::PublishNow(const char* topic, const char* message, size_t length, bool retain,
+                                 int qos /* = 0 */, MqttPublishCallback callback /* = nullptr */, bool reportFailure /* = true */)
+{
+    BASECAMP_TRACE_SCOPE("mqtt.publish");
+    // Taken before publishing, the acknowledge may be processed before esp_mqtt_client_publish() returns
+    const int64_t startUs = esp_timer_get_time();
+    // esp-mqtt takes strlen(message) for a length of 0
+    int msgId = mqttClient ? esp_mqtt_client_publish(mqttClient, topic, length > 0 ? message : "", length, qos, retain) : -1;
+
+    static MetricCounter *published = basecampMetrics.counter("basecamp_mqtt_publish_total", "MQTT messages handed to the client", "result=\"ok\"");
+    static MetricCounter *failed = basecampMetrics.counter("basecamp_mqtt_publish_total", "MQTT messages handed to the client", "result=\"failed\"");
+    (msgId < 0 ? failed : published)->increment();
+
+    if (msgId < 0) {
+        if (reportFailure && callback)
+            callback(msgId, false, 0);
+    } else if (qos > 0) {
+        deliveryTracker.Track(msgId, topic, startUs, std::move(callback));
+    } else if (callback) {
+        callback(msgId, true, esp_timer_get_time() - startUs);
+    }
+    return msgId;
+}
+
+void EspIdfMqttClient::Publish(const JsonDocument& message, bool retain /* = false */, const String& topicSuffix /* = {} */, const String& topic /* = {} */)
+{
     String stringMessage;
     serializeJson(message, stringMessage);
 #if DEBUG
@@ -93,65 +487,215 @@ void EspIdfMqttClient::PublishHaDiscoveryInformation(bool isBinary, const String
 {
     if (!haDiscoveryTopicPrefix.isEmpty())
     {
+        HaDiscoveryEntity entity;
+        entity.isBinary = isBinary;
+        entity.unitOfMeasurement = unitOfMeasurement;
+        entity.deviceClass = deviceClass;
+        entity.expireAfter = expireAfter;
+        entity.valueTemplate = valueTemplate;
+        entity.forceUpdate = forceUpdate;
+        entity.setJsonAttributesTopic = setJsonAttributesTopic;
+        entity.entitySuffix = entitySuffix;
+        entity.stateTopicSuffix = stateTopicSuffix;
+
+        if (!AcquireJsonBuffer())
+            return;
+        char topic[MqttTopic::kMaxLength + 1];
+        char uniqueEntityId[96];
+        size_t length = SerializeHaDiscovery(entity, topic, sizeof(topic), uniqueEntityId, sizeof(uniqueEntityId));
+        if (length > 0)
+            PublishInternal(topic, jsonBuffer, length, true);
+        xSemaphoreGive(jsonBufferMutex);
+    }
+}
 
-        ESP_LOGI("MQTT", "stateTopicSuffix: %s, entityIdSuffix: %s", stateTopicSuffix.c_str(), entitySuffix.c_str());
+// Renders topic and config payload of one entity into jsonBuffer, the caller has to hold jsonBufferMutex.
+// Returns the payload length or 0 on failure.
+size_t EspIdfMqttClient::SerializeHaDiscovery(const HaDiscoveryEntity& entity, char* topic, size_t topicSize, char* uniqueEntityId, size_t uniqueEntityIdSize)
+{
+    ESP_LOGD("MQTT", "stateTopicSuffix: %s, entityIdSuffix: %s", entity.stateTopicSuffix.c_str(), entity.entitySuffix.c_str());
 
-        String entityIdSuffixInt;
-        if (!stateTopicSuffix.isEmpty())
-            entityIdSuffixInt += "_" + stateTopicSuffix;
-        if (!entitySuffix.isEmpty())
-            entityIdSuffixInt += "_" + entitySuffix;
-        
-        // TBD slash vs. underscore
-        String uniqueDeviceId = "esp32_" + macAddress;
-        String uniqueEntityId = uniqueDeviceId + entityIdSuffixInt;
-        String entityName = deviceName + entityIdSuffixInt;
-        String entityStateTopic = baseTopic;
-        if (!stateTopicSuffix.isEmpty())
-            entityStateTopic += "/" + stateTopicSuffix;
-        String haEntityType = isBinary ? "binary_sensor" : "sensor";
-
-        ESP_LOGD("MQTT", "haDiscoveryTopicPrefix: %s, uniqueDeviceId: %s, deviceName: %s, uniqueEntityId: %s, entityName: %s, entityStateTopic: %s",
-                 haDiscoveryTopicPrefix.c_str(), uniqueDeviceId.c_str(), deviceName.c_str(), uniqueEntityId.c_str(), entityName.c_str(), entityStateTopic.c_str());
-
-        DynamicJsonDocument haDiscovery(2048);
-        haDiscovery["unique_id"] = uniqueEntityId;
-        haDiscovery["name"] = entityName;
-        haDiscovery["state_topic"] = entityStateTopic;
-        if (unitOfMeasurement && !unitOfMeasurement.isEmpty())
-            haDiscovery["unit_of_measurement"] = unitOfMeasurement;
-        if (deviceClass && !deviceClass.isEmpty())
-            haDiscovery["device_class"] = deviceClass;
-        if (expireAfter)
-            haDiscovery["expire_after"] = expireAfter;
-        if (valueTemplate && !valueTemplate.isEmpty())
+    char entityIdSuffixInt[64] = "";
+    if (!entity.stateTopicSuffix.isEmpty())
+        snprintf(entityIdSuffixInt, sizeof(entityIdSuffixInt), "_%s", entity.stateTopicSuffix.c_str());
+    if (!entity.entitySuffix.isEmpty()) {
+        size_t used = strlen(entityIdSuffixInt);
+        snprintf(entityIdSuffixInt + used, sizeof(entityIdSuffixInt) - used, "_%s", entity.entitySuffix.c_str());
+    }
+
+    // TBD slash vs. underscore
+    char uniqueDeviceId[24];
+    snprintf(uniqueDeviceId, sizeof(uniqueDeviceId), "esp32_%s", macAddress.c_str());
+    snprintf(uniqueEntityId, uniqueEntityIdSize, "%s%s", uniqueDeviceId, entityIdSuffixInt);
+    char entityName[96];
+    snprintf(entityName, sizeof(entityName), "%s%s", deviceName.c_str(), entityIdSuffixInt);
+    char entityStateTopic[MqttTopic::kMaxLength + 1];
+    if (!BuildTopic(entityStateTopic, sizeof(entityStateTopic), baseTopic.c_str(), entity.stateTopicSuffix.c_str()))
+        return 0;
+    const char* haEntityType = entity.isBinary ? "binary_sensor" : "sensor";
+
+    int topicLength = snprintf(topic, topicSize, "%s/%s/%s/config", haDiscoveryTopicPrefix.c_str(), haEntityType, uniqueEntityId);
+    if (topicLength < 0 || (size_t)topicLength >= topicSize) {
+        ESP_LOGE("MQTT", "Discovery topic too long for %s", uniqueEntityId);
+        return 0;
+    }
+
+    ESP_LOGD("MQTT", "haDiscoveryTopicPrefix: %s, uniqueDeviceId: %s, deviceName: %s, uniqueEntityId: %s, entityName: %s, entityStateTopic: %s",
+             haDiscoveryTopicPrefix.c_str(), uniqueDeviceId, deviceName.c_str(), uniqueEntityId, entityName, entityStateTopic);
+
+    if (!haDiscoveryDocument)
+        haDiscoveryDocument = new HeapJsonDocument<HeapSubsystem::mqtt>(1024);
+    JsonDocument& haDiscovery = *haDiscoveryDocument;
+    haDiscovery.clear();
+
+    // All strings stay valid until serialization below, so they do not need to be copied into the document
+    haDiscovery["unique_id"] = (const char*)uniqueEntityId;
+    haDiscovery["name"] = (const char*)entityName;
+    haDiscovery["state_topic"] = (const char*)entityStateTopic;
+    if (!entity.unitOfMeasurement.isEmpty())
+        haDiscovery["unit_of_measurement"] = entity.unitOfMeasurement.c_str();
+    if (!entity.deviceClass.isEmpty())
+        haDiscovery["device_class"] = entity.deviceClass.c_str();
+    if (entity.expireAfter)
+        haDiscovery["expire_after"] = entity.expireAfter;
+    if (!entity.valueTemplate.isEmpty())
+    {
+        haDiscovery["value_template"] = entity.valueTemplate.c_str();
+        if (entity.isBinary)
         {
-            haDiscovery["value_template"] = valueTemplate;
-            if (isBinary)
-            {
-                // DynamicJsonDocument will render true/false as true/false
-                haDiscovery["payload_on"] = true;
-                haDiscovery["payload_off"] = false;
-            }
+            // JsonDocument will render true/false as true/false
+            haDiscovery["payload_on"] = true;
+            haDiscovery["payload_off"] = false;
         }
-        else
+    }
+    else
+    {
+        if (entity.isBinary)
         {
-            if (isBinary)
-            {
-                // String(boolean) will render true/false as 1/0
-                haDiscovery["payload_on"] = 1;
-                haDiscovery["payload_off"] = 0;
-            }
+            // String(boolean) will render true/false as 1/0
+            haDiscovery["payload_on"] = 1;
+            haDiscovery["payload_off"] = 0;
+        }
+    }
+    if (entity.forceUpdate)
+        haDiscovery["force_update"] = "true";
+    if (entity.setJsonAttributesTopic)
+        haDiscovery["json_attributes_topic"] = (const char*)entityStateTopic;
+
+    JsonObject deviceObject = haDiscovery.createNestedObject("device");
+    deviceObject.createNestedArray("identifiers").add((const char*)uniqueDeviceId);
+    deviceObject["name"] = deviceName.c_str();
+
+    if (haDiscovery.overflowed()) {
+        ESP_LOGE("MQTT", "Discovery document overflowed for %s", uniqueEntityId);
+        return 0;
+    }
+
+    size_t length = serializeJson(haDiscovery, jsonBuffer, jsonBufferSize);
+    if (length + 1 >= jsonBufferSize) {
+        ESP_LOGE("MQTT", "Discovery config for %s does not fit into %u bytes", uniqueEntityId, jsonBufferSize);
+        return 0;
+    }
+    return length;
+}
+
+EspIdfMqttClient& EspIdfMqttClient::AddHaDiscoveryEntity(const HaDiscoveryEntity& entity)
+{
+    haDiscoveryEntities.push_back(entity);
+    return *this;
+}
+
+EspIdfMqttClient& EspIdfMqttClient::SetHaDiscoveryInterval(uint32_t intervalMs)
+{
+    haDiscoveryIntervalMs = intervalMs;
+    return *this;
+}
+
+void EspIdfMqttClient::ForceHaDiscoveryRepublish()
+{
+    Preferences preferences;
+    preferences.begin(kHaDiscoveryPreferences, false);
+    preferences.clear();
+    preferences.end();
+}
+
+void EspIdfMqttClient::PublishChangedHaDiscovery()
+{
+    // Called from the MQTT task, so hand over to a short-lived task that may take its time
+    portENTER_CRITICAL(&haDiscoveryMux);
+    bool running = (haDiscoveryTask != nullptr);
+    // A running task restarts from the first entity after the current one is done
+    haDiscoveryRestart = running;
+    portEXIT_CRITICAL(&haDiscoveryMux);
+    if (running)
+        return;
+
+    if (!startTask(&HaDiscoveryTask, "HaDiscovery", taskConfig.haDiscovery, this, &haDiscoveryTask))
+        ESP_LOGE("MQTT", "Could not create discovery task");
+}
+
+void EspIdfMqttClient::HaDiscoveryTask(void* clientPointer)
+{
+    auto client = reinterpret_cast<EspIdfMqttClient*>(clientPointer);
+    Preferences preferences;
+    preferences.begin(kHaDiscoveryPreferences, false);
+
+    size_t published = 0;
+    size_t index = 0;
+    while (true) {
+        portENTER_CRITICAL(&client->haDiscoveryMux);
+        if (client->haDiscoveryRestart) {
+            client->haDiscoveryRestart = false;
+            index = 0;
         }
-        if (forceUpdate)
-            haDiscovery["force_update"] = "true";
-        if (setJsonAttributesTopic)
-            haDiscovery["json_attributes_topic"] = entityStateTopic;
+        // Stop when done or disconnected, the next connect will start a new run
+        bool done = (index >= client->haDiscoveryEntities.size() || !client->IsConnected());
+        if (done)
+            client->haDiscoveryTask = nullptr;
+        portEXIT_CRITICAL(&client->haDiscoveryMux);
+        if (done)
+            break;
+
+        const HaDiscoveryEntity& entity = client->haDiscoveryEntities[index++];
+        if (!client->AcquireJsonBuffer())
+            continue;
 
-        JsonObject deviceObject = haDiscovery.createNestedObject("device");
-        deviceObject.createNestedArray("identifiers").add(uniqueDeviceId);
-        deviceObject["name"] = deviceName;
+        char topic[MqttTopic::kMaxLength + 1];
+        char uniqueEntityId[96];
+        size_t length = client->SerializeHaDiscovery(entity, topic, sizeof(topic), uniqueEntityId, sizeof(uniqueEntityId));
+        bool sent = false;
+        if (length > 0) {
+            // NVS keys are limited to 15 characters, so the entity is identified by a hash of its id
+            char key[10];
+            snprintf(key, sizeof(key), "h%08x", basecampHash::fnv1a(uniqueEntityId, strlen(uniqueEntityId)));
+            uint32_t hash = basecampHash::fnv1a(client->jsonBuffer, length, basecampHash::fnv1a(topic, strlen(topic)));
 
-        Publish(haDiscovery, true, "", haDiscoveryTopicPrefix + "/" + haEntityType + "/" + uniqueEntityId + "/config");
+            if (preferences.getUInt(key, 0) != hash) {
+                ESP_LOGI("MQTT", "Publishing discovery config for %s", uniqueEntityId);
+                // Only remember the hash once the broker acknowledged the config
+                sent = client->PublishInternal(topic, client->jsonBuffer, length, true, 1, [key, hash](int, bool delivered, uint32_t) {
+                    if (delivered) {
+                        Preferences acknowledged;
+                        acknowledged.begin(kHaDiscoveryPreferences, false);
+                        acknowledged.putUInt(key, hash);
+                        acknowledged.end();
+                    }
+                });
+            } else {
+                ESP_LOGD("MQTT", "Discovery config for %s unchanged", uniqueEntityId);
+            }
+        }
+        xSemaphoreGive(client->jsonBufferMutex);
+
+        if (sent) {
+            published++;
+            // Rate limit, so reconnect storms do not flood the broker
+            vTaskDelay(pdMS_TO_TICKS(client->haDiscoveryIntervalMs));
+        }
     }
+
+    preferences.end();
+    ESP_LOGI("MQTT", "Discovery done, %u configs published", published);
+    basecampTaskStacks.finished(xTaskGetCurrentTaskHandle());
+    vTaskDelete(NULL);
 }
@@ -4,24 +4,197 @@
 #include <ArduinoJson.h>
 #include <functional>
 #include <mqtt_client.h>
+#include <atomic>
+#include <vector>
+
+#include "MqttBrokerList.hpp"
+#include "MqttOutbox.hpp"
+#include "MqttOfflineStore.hpp"
+#include "HeapMonitor.hpp"
+#include "MqttTopicTrie.hpp"
+#include "TaskPlacement.hpp"
+#include "Scheduler.hpp"
 
 typedef std::function<void()> OnConnectUserCallback;
 
+// Fully built topic in a fixed buffer. Create it once via EspIdfMqttClient::MakeTopic()
+// and reuse it for every publish, so the hot path does not need to build Strings.
+class MqttTopic {
+    public:
+        static constexpr size_t kMaxLength = 128;
+
+        MqttTopic() { topic[0] = '\0'; }
+        const char* c_str() const { return topic; }
+        size_t length() const { return topicLength; }
+        bool IsValid() const { return topicLength > 0; }
+
+    private:
+        friend class EspIdfMqttClient;
+        char topic[kMaxLength + 1];
+        size_t topicLength = 0;
+};
+
+// Home Assistant MQTT Discovery entity, see EspIdfMqttClient::AddHaDiscoveryEntity()
+struct HaDiscoveryEntity {
+    bool isBinary = false;
+    String unitOfMeasurement;
+    String deviceClass;
+    int expireAfter = 0;
+    String valueTemplate;
+    bool forceUpdate = false;
+    bool setJsonAttributesTopic = false;
+    String entitySuffix;
+    String stateTopicSuffix;
+};
+
 class EspIdfMqttClient {
 	public:
+        // Placement of the client's tasks
+        struct TaskConfig {
+            // The ESP-IDF MQTT task. Its core is chosen in menuconfig (MQTT_TASK_CORE_SELECTION), core is ignored.
+            TaskPlacement client = {6144, 5, tskNO_AFFINITY};
+            // Sends queued messages, see EnableOutbox()
+            TaskPlacement outbox = {3072, 1, tskNO_AFFINITY};
+            // Short-lived, publishes the Home Assistant discovery configs after connecting
+            TaskPlacement haDiscovery = {4096, 1, tskNO_AFFINITY};
+            // Checks the brokers' health, only started with more than one broker
+            TaskPlacement brokerHealth = {3072, 1, tskNO_AFFINITY};
+        };
+
+        // Must be called before Begin() and EnableOutbox()
+        EspIdfMqttClient& SetTaskConfig(const TaskConfig& config) { taskConfig = config; return *this; }
+        // mqttUri may list several brokers separated by commas, the first one is the primary.
+        // See MqttBrokerList for how the client fails over between them.
         EspIdfMqttClient& Begin(const String& mqttUri, const String& deviceName = {}, const String& haDiscoveryTopicPrefix = {}, const String& baseTopic = {});
+        // Must be called before Begin(). 0 disables health checks, so the client only fails over
+        // after failed connects and does not return to the primary.
+        EspIdfMqttClient& SetBrokerHealthCheckInterval(uint32_t intervalMs) { brokerHealthCheckIntervalMs = intervalMs; return *this; }
+        // Returns the number of entries written to stats
+        size_t GetBrokerStats(MqttBrokerList::Stats* stats, size_t maxEntries) const { return brokers.GetStats(stats, maxEntries); }
         EspIdfMqttClient& OnConnect(OnConnectUserCallback callback);
+        // Switches Publish() to asynchronous mode: messages are queued into a preallocated outbox
+        // and sent by a dedicated task, so the caller never waits for the network. Payloads larger
+        // than config.maxPayloadLength are still published directly by the caller.
+        EspIdfMqttClient& EnableOutbox(const MqttOutbox::Config& config = {});
+        MqttOutbox::Stats GetOutboxStats() const { return outbox.GetStats(); }
+        // Messages published while offline are stored on SPIFFS and replayed in batches after reconnecting
+        EspIdfMqttClient& EnableOfflineStore(const MqttOfflineStore::Config& config = {});
+        MqttOfflineStore::Stats GetOfflineStoreStats() { return offlineStore.GetStats(); }
+        // Writes messages still buffered in RAM to flash, e.g. before going to deep sleep
+        bool FlushOfflineStore() { return offlineStore.Flush(); }
+        bool IsConnected() const { return connected && linkUp; }
+        // Report the network link state (e.g. from NetworkControl::onLinkChange()). While the link is down
+        // messages go to the outbox and offline store right away instead of waiting for the broker timeout.
+        void SetLinkUp(bool up);
         void Publish(const String& message, bool retain = false, const String& topicSuffix = {}, const String& topic = {});
-        void Publish(JsonDocument message, bool retain = false, const String& topicSuffix = {}, const String& topic = {});
+        void Publish(const JsonDocument& message, bool retain = false, const String& topicSuffix = {}, const String& topic = {});
+
+        // Allocation-free publishing. MakeTopic() must be called after Begin() as it uses the base topic.
+        MqttTopic MakeTopic(const char* topicSuffix, const char* topic = nullptr) const;
+        // The optional callback reports delivery (QoS 1/2: acknowledged by the broker) and round-trip latency.
+        void Publish(const MqttTopic& topic, const char* payload, size_t length, bool retain = false,
+                     int qos = 0, MqttPublishCallback callback = nullptr);
+        // Serializes into the given buffer, which needs one spare byte beyond the serialized size
+        void Publish(const MqttTopic& topic, const JsonDocument& message, char* buffer, size_t bufferSize, bool retain = false,
+                     int qos = 0, MqttPublishCallback callback = nullptr);
+        // Serializes into the client's pooled buffer (allocated once, see SetJsonBufferSize())
+        void Publish(const MqttTopic& topic, const JsonDocument& message, bool retain = false,
+                     int qos = 0, MqttPublishCallback callback = nullptr);
+        // Must be called before the first JSON publish via the pooled buffer
+        EspIdfMqttClient& SetJsonBufferSize(size_t size);
         void PublishHaDiscoveryInformation(bool isBinary, const String &unitOfMeasurement, const String &deviceClass, int expireAfter, const String &valueTemplate,
                                            bool forceUpdate, bool setJsonAttributesTopic, const String &entityIdSuffix, const String &stateTopicSuffix);
+
+        // Declares an entity once (before Begin()). Its discovery config is published on every connect,
+        // but only if it differs from the last acknowledged one (content hash is kept in Preferences).
+        // Publishes are spaced out by the discovery interval instead of being sent as one burst.
+        EspIdfMqttClient& AddHaDiscoveryEntity(const HaDiscoveryEntity& entity);
+        EspIdfMqttClient& SetHaDiscoveryInterval(uint32_t intervalMs);
+        // Forgets all stored hashes, e.g. after the broker lost its retained messages. Done
+        // automatically when switching to another broker.
+        void ForceHaDiscoveryRepublish();
+
+        // Subscribes to topicFilter (may contain '+' and '#') and calls callback for every matching message.
+        // Subscriptions are renewed automatically on every connect.
+        bool Subscribe(const String& topicFilter, MqttMessageCallback callback, int qos = 0);
+        // Delivery statistics of QoS 1/2 publishes
+        MqttDeliveryTracker::Stats GetDeliveryStats() { return deliveryTracker.GetStats(); }
+        // Per-topic round-trip latencies, returns the number of entries written
+        size_t GetLatencyStats(MqttDeliveryTracker::LatencyStats* stats, size_t maxEntries) { return deliveryTracker.GetLatencyStats(stats, maxEntries); }
+        // Time after which an unacknowledged publish counts as timed out
+        EspIdfMqttClient& SetDeliveryTimeout(uint32_t timeoutMs) { deliveryTracker.SetTimeout(timeoutMs); return *this; }
+
+        // Fragmented messages are reassembled in a buffer of this size, larger messages are dropped.
+        // Must be called before the first Subscribe().
+        EspIdfMqttClient& SetInboundBufferSize(size_t size);
     private:
+#ifdef BASECAMP_BENCHMARK
+        friend class BasecampBenchmark;
+#endif
         String macAddress;
         String deviceName;
         String baseTopic;
         String haDiscoveryTopicPrefix;
-        esp_mqtt_client_handle_t mqttClient;
+        esp_mqtt_client_handle_t mqttClient = nullptr;
+        std::atomic<bool> connected{false};
+        std::atomic<bool> linkUp{true};
+        TaskConfig taskConfig;
+        // The MQTT task is created by ESP-IDF, it is registered for stack reports on its first event
+        bool clientTaskRegistered = false;
+        TaskHandle_t clientTask = nullptr;
         static esp_err_t StaticEventHandler(esp_mqtt_event_handle_t event);
         esp_err_t EventHandler(esp_mqtt_event_handle_t event);
+        int PublishNow(const char* topic, const char* message, size_t length, bool retain,
+                       int qos = 0, MqttPublishCallback callback = nullptr, bool reportFailure = true);
+        bool PublishInternal(const char* topic, const char* message, size_t length, bool retain,
+                             int qos = 0, MqttPublishCallback callback = nullptr);
+        MqttDeliveryTracker deliveryTracker;
+        Scheduler::TimerId deliveryExpiryTimer = Scheduler::kNoTimer;
+        static bool BuildTopic(char* buffer, size_t bufferSize, const char* prefix, const char* suffix);
+
+        // Pooled JSON buffer and discovery document, both guarded by jsonBufferMutex
+        char* jsonBuffer = nullptr;
+        size_t jsonBufferSize = 1024;
+        HeapJsonDocument<HeapSubsystem::mqtt>* haDiscoveryDocument = nullptr;
+        SemaphoreHandle_t jsonBufferMutex = nullptr;
+        bool AcquireJsonBuffer();
+
+        size_t SerializeHaDiscovery(const HaDiscoveryEntity& entity, char* topic, size_t topicSize, char* uniqueEntityId, size_t uniqueEntityIdSize);
+        std::vector<HaDiscoveryEntity> haDiscoveryEntities;
+        uint32_t haDiscoveryIntervalMs = 250;
+        TaskHandle_t haDiscoveryTask = nullptr;
+        bool haDiscoveryRestart = false;
+        portMUX_TYPE haDiscoveryMux = portMUX_INITIALIZER_UNLOCKED;
+        static void HaDiscoveryTask(void* clientPointer);
+        void PublishChangedHaDiscovery();
+
+        struct Subscription {
+            String topicFilter;
+            int qos;
+        };
+        std::vector<Subscription> subscriptions;
+        MqttTopicTrie subscriptionTrie;
+        SemaphoreHandle_t subscriptionMutex = nullptr;
+        // Reassembly of (possibly fragmented) inbound messages, only used from the MQTT task
+        char inboundTopic[MqttTopic::kMaxLength + 1];
+        size_t inboundTopicLength = 0;
+        char* inboundBuffer = nullptr;
+        size_t inboundBufferSize = 1024;
+        bool inboundDiscarding = false;
+        void HandleData(esp_mqtt_event_handle_t event);
+
+        MqttBrokerList brokers;
+        uint32_t brokerHealthCheckIntervalMs = 60000;
+        TaskHandle_t brokerHealthTask = nullptr;
+        static void BrokerHealthTask(void* clientPointer);
+        void SwitchBroker(size_t index);
+
+        MqttOutbox outbox;
+        TaskHandle_t outboxTask = nullptr;
+        MqttOfflineStore offlineStore;
+        void StartOutboxTask();
+        static void OutboxTask(void* clientPointer);
+        void DrainOutbox();
+        void DrainRamOutbox();
         std::vector<OnConnectUserCallback> _onConnectUserCallbacks;
 };
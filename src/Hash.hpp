@@ -0,0 +1,30 @@
+/*
+   Basecamp - ESP32 library to simplify the basics of IoT projects
+   Written by Merlin Schumacher (mls@ct.de) for c't magazin für computer technik (https://www.ct.de)
+   Licensed under GPLv3. See LICENSE for details.
+   */
+
+#ifndef Hash_h
+#define Hash_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace basecampHash {
+	const constexpr uint32_t kFnv1aSeed = 2166136261u;
+
+	// 32 bit FNV-1a. Not collision resistant, only for cache keys, checksums and short names.
+	// Passing a previous result as seed hashes several pieces as if they were one.
+	inline uint32_t fnv1a(const void* data, size_t length, uint32_t seed = kFnv1aSeed)
+	{
+		const uint8_t* bytes = static_cast<const uint8_t*>(data);
+		uint32_t hash = seed;
+		while (length--) {
+			hash ^= *bytes++;
+			hash *= 16777619u;
+		}
+		return hash;
+	}
+}
+
+#endif
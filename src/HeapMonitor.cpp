@@ -0,0 +1,262 @@
+/*
+   Basecamp - ESP32 library to simplify the basics of IoT projects
+   Written by Merlin Schumacher (mls@ct.de) for c't magazin für computer technik (https://www.ct.de)
+   Licensed under GPLv3. See LICENSE for details.
+   */
+#include "HeapMonitor.hpp"
+#include "Metrics.hpp"
+
+#include <atomic>
+#include <Esp32Logging.hpp>
+#include <esp_heap_caps.h>
+
+namespace {
+	const constexpr char* kLoggingTag = "BasecampHeap";
+	const constexpr uint32_t kHeapCaps = MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT;
+	const constexpr uint32_t kExternalCaps = MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT;
+
+	const char* const kSubsystemNames[kHeapSubsystemCount] = {"config", "web", "mqtt", "logs", "ota", "other"};
+	const char* const kSubsystemLabels[kHeapSubsystemCount] = {
+		"subsystem=\"config\"",
+		"subsystem=\"web\"",
+		"subsystem=\"mqtt\"",
+		"subsystem=\"logs\"",
+		"subsystem=\"ota\"",
+		"subsystem=\"other\"",
+	};
+
+	// Precedes every block from heapAllocate(), 8 bytes keep the alignment of malloc()
+	struct BlockHeader {
+		uint32_t size;
+		uint8_t subsystem;
+		bool external;
+		uint8_t reserved[2];
+	};
+
+	// Zero-initialized before any constructor runs, so allocations from static constructors are counted
+	struct SubsystemCounters {
+		std::atomic<uint32_t> bytes;
+		std::atomic<uint32_t> externalBytes;
+		std::atomic<uint32_t> peakBytes;
+		std::atomic<uint32_t> allocations;
+		std::atomic<uint32_t> failures;
+	};
+	SubsystemCounters counters[kHeapSubsystemCount];
+
+	// Constant-initialized, in the order of HeapSubsystem
+	volatile HeapPlacement placements[kHeapSubsystemCount] = {
+		HeapPlacement::preferExternal,
+		HeapPlacement::preferExternal,
+		HeapPlacement::preferExternal,
+		HeapPlacement::internal,
+		HeapPlacement::preferExternal,
+		HeapPlacement::internal,
+	};
+
+	void addBytes(SubsystemCounters &counter, const BlockHeader *header)
+	{
+		const uint32_t bytes = counter.bytes.fetch_add(header->size, std::memory_order_relaxed) + header->size;
+		if (header->external) {
+			counter.externalBytes.fetch_add(header->size, std::memory_order_relaxed);
+		}
+		uint32_t peak = counter.peakBytes.load(std::memory_order_relaxed);
+		while (bytes > peak && !counter.peakBytes.compare_exchange_weak(peak, bytes, std::memory_order_relaxed)) {
+		}
+	}
+
+	void removeBytes(SubsystemCounters &counter, const BlockHeader *header)
+	{
+		counter.bytes.fetch_sub(header->size, std::memory_order_relaxed);
+		if (header->external) {
+			counter.externalBytes.fetch_sub(header->size, std::memory_order_relaxed);
+		}
+	}
+}
+
+HeapMonitor basecampHeap;
+
+void* heapAllocate(HeapSubsystem subsystem, size_t size)
+{
+	SubsystemCounters &counter = counters[static_cast<size_t>(subsystem)];
+	BlockHeader *header = nullptr;
+	bool external = false;
+	if (size >= kHeapExternalMinimumSize && placements[static_cast<size_t>(subsystem)] == HeapPlacement::preferExternal) {
+		header = static_cast<BlockHeader*>(heap_caps_malloc(sizeof(BlockHeader) + size, kExternalCaps));
+		external = (header != nullptr);
+	}
+	if (!header) {
+		// Not malloc(): with SPIRAM_USE_MALLOC it may place large blocks in PSRAM as well
+		header = static_cast<BlockHeader*>(heap_caps_malloc(sizeof(BlockHeader) + size, kHeapCaps));
+	}
+	if (!header) {
+		counter.failures.fetch_add(1, std::memory_order_relaxed);
+		return nullptr;
+	}
+	header->size = size;
+	header->subsystem = static_cast<uint8_t>(subsystem);
+	header->external = external;
+
+	counter.allocations.fetch_add(1, std::memory_order_relaxed);
+	addBytes(counter, header);
+	return header + 1;
+}
+
+void* heapReallocate(void *pointer, size_t size)
+{
+	if (!pointer) {
+		return nullptr;
+	}
+	BlockHeader *header = static_cast<BlockHeader*>(pointer) - 1;
+	SubsystemCounters &counter = counters[header->subsystem];
+	const BlockHeader previous = *header;
+	// Stays where it is, free() would release both kinds
+	BlockHeader *resized = static_cast<BlockHeader*>(heap_caps_realloc(header, sizeof(BlockHeader) + size,
+		previous.external ? kExternalCaps : kHeapCaps));
+	if (!resized) {
+		counter.failures.fetch_add(1, std::memory_order_relaxed);
+		return nullptr;
+	}
+	removeBytes(counter, &previous);
+	resized->size = size;
+	addBytes(counter, resized);
+	return resized + 1;
+}
+
+void heapFree(void *pointer)
+{
+	if (!pointer) {
+		return;
+	}
+	BlockHeader *header = static_cast<BlockHeader*>(pointer) - 1;
+	removeBytes(counters[header->subsystem], header);
+	free(header);
+}
+
+void setHeapPlacement(HeapSubsystem subsystem, HeapPlacement placement)
+{
+	placements[static_cast<size_t>(subsystem)] = placement;
+}
+
+HeapPlacement getHeapPlacement(HeapSubsystem subsystem)
+{
+	return placements[static_cast<size_t>(subsystem)];
+}
+
+HeapMonitor::HeapMonitor()
+	: callbackMutex_(xSemaphoreCreateMutex())
+{
+}
+
+void HeapMonitor::begin(uint32_t intervalMs)
+{
+	if (timer_ != Scheduler::kNoTimer) {
+		basecampScheduler.cancel(timer_);
+	}
+	timer_ = basecampScheduler.every(intervalMs, [this]() { check(); });
+	// Metrics are available right away
+	basecampScheduler.post([this]() { check(); });
+}
+
+void HeapMonitor::onLowHeap(LowHeapCallback callback)
+{
+	xSemaphoreTake(callbackMutex_, portMAX_DELAY);
+	callbacks_.push_back(std::move(callback));
+	xSemaphoreGive(callbackMutex_);
+}
+
+HeapStats HeapMonitor::sample()
+{
+	HeapStats stats;
+	stats.freeBytes = heap_caps_get_free_size(kHeapCaps);
+	stats.largestFreeBlock = heap_caps_get_largest_free_block(kHeapCaps);
+	stats.minimumFreeBytes = heap_caps_get_minimum_free_size(kHeapCaps);
+	stats.fragmentationPercent = (stats.freeBytes > 0 && stats.largestFreeBlock <= stats.freeBytes)
+		? 100 - static_cast<uint64_t>(stats.largestFreeBlock) * 100 / stats.freeBytes : 0;
+	return stats;
+}
+
+HeapSubsystemStats HeapMonitor::getSubsystemStats(HeapSubsystem subsystem)
+{
+	const SubsystemCounters &counter = counters[static_cast<size_t>(subsystem)];
+	return {
+		counter.bytes.load(std::memory_order_relaxed),
+		counter.externalBytes.load(std::memory_order_relaxed),
+		counter.peakBytes.load(std::memory_order_relaxed),
+		counter.allocations.load(std::memory_order_relaxed),
+		counter.failures.load(std::memory_order_relaxed),
+	};
+}
+
+const char* HeapMonitor::getSubsystemName(HeapSubsystem subsystem)
+{
+	return kSubsystemNames[static_cast<size_t>(subsystem)];
+}
+
+String HeapMonitor::describe() const
+{
+	const HeapStats stats = sample();
+	char line[224];
+	int length = snprintf(line, sizeof(line), "Heap: %u B free, largest block %u B, minimum %u B, %u%% fragmented;",
+		stats.freeBytes, stats.largestFreeBlock, stats.minimumFreeBytes, stats.fragmentationPercent);
+	const uint32_t externalFree = heap_caps_get_free_size(kExternalCaps);
+	if (externalFree > 0 && length > 0 && static_cast<size_t>(length) < sizeof(line)) {
+		length += snprintf(line + length, sizeof(line) - length, " PSRAM %u B free;", externalFree);
+	}
+	for (size_t i = 0; i < kHeapSubsystemCount && length > 0 && static_cast<size_t>(length) < sizeof(line); i++) {
+		length += snprintf(line + length, sizeof(line) - length, " %s %u B", kSubsystemNames[i],
+			counters[i].bytes.load(std::memory_order_relaxed));
+	}
+	return String(line);
+}
+
+void HeapMonitor::check()
+{
+	static MetricGauge *freeBytes = basecampMetrics.gauge("basecamp_heap_free_bytes", "Free internal heap");
+	static MetricGauge *largestBlock = basecampMetrics.gauge("basecamp_heap_largest_free_block_bytes", "Largest free block of the internal heap");
+	static MetricGauge *minimumFree = basecampMetrics.gauge("basecamp_heap_minimum_free_bytes", "Lowest free internal heap since boot");
+	static MetricGauge *fragmentation = basecampMetrics.gauge("basecamp_heap_fragmentation_percent", "Free internal heap outside of the largest block");
+	static MetricGauge *externalFree = basecampMetrics.gauge("basecamp_heap_psram_free_bytes", "Free PSRAM, 0 without PSRAM");
+	static MetricCounter *lowHeap = basecampMetrics.counter("basecamp_heap_low_total", "Times the largest free block dropped below the threshold");
+	static MetricGauge *subsystemBytes[kHeapSubsystemCount];
+	if (!subsystemBytes[0]) {
+		for (size_t i = 0; i < kHeapSubsystemCount; i++) {
+			subsystemBytes[i] = basecampMetrics.gauge("basecamp_heap_subsystem_bytes", "Heap in use by Basecamp's buffers", kSubsystemLabels[i]);
+		}
+	}
+
+	const HeapStats stats = sample();
+	freeBytes->set(stats.freeBytes);
+	largestBlock->set(stats.largestFreeBlock);
+	minimumFree->set(stats.minimumFreeBytes);
+	fragmentation->set(stats.fragmentationPercent);
+	externalFree->set(heap_caps_get_free_size(kExternalCaps));
+	for (size_t i = 0; i < kHeapSubsystemCount; i++) {
+		subsystemBytes[i]->set(counters[i].bytes.load(std::memory_order_relaxed));
+	}
+
+	const uint32_t threshold = threshold_;
+	if (threshold == 0) {
+		low_ = false;
+		return;
+	}
+	if (low_) {
+		// Hysteresis, so a block size close to the threshold does not raise one alert after the other
+		low_ = stats.largestFreeBlock < threshold + threshold / 8;
+		return;
+	}
+	if (stats.largestFreeBlock >= threshold) {
+		return;
+	}
+
+	low_ = true;
+	lowHeap->increment();
+	ESP_LOGW(kLoggingTag, "Largest free block down to %u B (%u B free, %u%% fragmented)", stats.largestFreeBlock,
+		stats.freeBytes, stats.fragmentationPercent);
+	// Copied, so callbacks can register further callbacks
+	xSemaphoreTake(callbackMutex_, portMAX_DELAY);
+	const std::vector<LowHeapCallback> callbacks = callbacks_;
+	xSemaphoreGive(callbackMutex_);
+	for (const auto &callback : callbacks) {
+		callback(stats);
+	}
+}
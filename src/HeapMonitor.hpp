@@ -0,0 +1,126 @@
+/*
+   Basecamp - ESP32 library to simplify the basics of IoT projects
+   Written by Merlin Schumacher (mls@ct.de) for c't magazin für computer technik (https://www.ct.de)
+   Licensed under GPLv3. See LICENSE for details.
+   */
+
+#ifndef HeapMonitor_h
+#define HeapMonitor_h
+
+#include <functional>
+#include <vector>
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include "Scheduler.hpp"
+
+// Owners of the buffers allocated via heapAllocate()
+enum class HeapSubsystem : uint8_t {
+	config,
+	web,
+	mqtt,
+	logs,
+	ota,
+	other,
+};
+
+static constexpr size_t kHeapSubsystemCount = static_cast<size_t>(HeapSubsystem::other) + 1;
+
+enum class HeapPlacement : uint8_t {
+	internal,
+	// Blocks of at least kHeapExternalMinimumSize go to PSRAM if there is any, otherwise
+	// or when it is full to internal RAM. Not for buffers used by DMA or while the flash
+	// cache is disabled.
+	preferExternal,
+};
+
+// PSRAM is slower and small blocks would only fragment it
+static constexpr size_t kHeapExternalMinimumSize = 512;
+
+// Like malloc(), realloc() and free(), but the memory is accounted to subsystem and placed
+// as set for it. Blocks from heapAllocate() must only be released with heapFree() and vice
+// versa. All can be used from static constructors.
+void* heapAllocate(HeapSubsystem subsystem, size_t size);
+void* heapReallocate(void *pointer, size_t size);
+void heapFree(void *pointer);
+
+// Applies to later allocations. By default config, web, MQTT and OTA prefer PSRAM, the log
+// ring stays internal as it is written from any task.
+void setHeapPlacement(HeapSubsystem subsystem, HeapPlacement placement);
+HeapPlacement getHeapPlacement(HeapSubsystem subsystem);
+
+// ArduinoJson allocator for BasicJsonDocument
+template<HeapSubsystem SUBSYSTEM>
+struct HeapJsonAllocator {
+	void* allocate(size_t size) { return heapAllocate(SUBSYSTEM, size); }
+	void* reallocate(void *pointer, size_t size) { return heapReallocate(pointer, size); }
+	void deallocate(void *pointer) { heapFree(pointer); }
+};
+
+template<HeapSubsystem SUBSYSTEM>
+using HeapJsonDocument = BasicJsonDocument<HeapJsonAllocator<SUBSYSTEM>>;
+
+// Internal RAM, which is where fragmentation hurts
+struct HeapStats {
+	uint32_t freeBytes;
+	uint32_t largestFreeBlock;
+	uint32_t minimumFreeBytes;
+	// How much of the free memory is not part of the largest block
+	uint8_t fragmentationPercent;
+};
+
+struct HeapSubsystemStats {
+	uint32_t bytes;
+	// Part of bytes placed in PSRAM
+	uint32_t externalBytes;
+	uint32_t peakBytes;
+	uint32_t allocations;
+	uint32_t failures;
+};
+
+// Samples the heap on basecampScheduler, exports it as metrics and warns when the largest
+// free block gets small. Large allocations (TLS, JSON documents, OTA) fail on a block that
+// is too small long before the free memory runs out.
+class HeapMonitor {
+	public:
+		typedef std::function<void(const HeapStats &stats)> LowHeapCallback;
+
+		// A TLS handshake needs about 16 KiB in one piece
+		static constexpr uint32_t kDefaultLowHeapThreshold = 16384;
+
+		HeapMonitor();
+		HeapMonitor(const HeapMonitor&) = delete;
+		HeapMonitor& operator=(const HeapMonitor&) = delete;
+
+		// Calling it again changes the interval
+		void begin(uint32_t intervalMs = 10000);
+
+		// The callbacks are called on the scheduler task once the largest free block drops below
+		// largestBlockBytes, and again only after it recovered by an eighth. 0 disables the check.
+		void setLowHeapThreshold(uint32_t largestBlockBytes) { threshold_ = largestBlockBytes; }
+		void onLowHeap(LowHeapCallback callback);
+
+		static HeapStats sample();
+		static HeapSubsystemStats getSubsystemStats(HeapSubsystem subsystem);
+		static const char* getSubsystemName(HeapSubsystem subsystem);
+
+		// One line for showSystemInfo()
+		String describe() const;
+
+	private:
+		void check();
+
+		Scheduler::TimerId timer_ = Scheduler::kNoTimer;
+		volatile uint32_t threshold_ = kDefaultLowHeapThreshold;
+		// Only used on the scheduler task
+		bool low_ = false;
+
+		SemaphoreHandle_t callbackMutex_;
+		std::vector<LowHeapCallback> callbacks_;
+};
+
+// Shared by all Basecamp subsystems
+extern HeapMonitor basecampHeap;
+
+#endif
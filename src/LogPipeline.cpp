@@ -0,0 +1,524 @@
+/*
+   Basecamp - ESP32 library to simplify the basics of IoT projects
+   Written by Merlin Schumacher (mls@ct.de) for c't magazin für computer technik (https://www.ct.de)
+   Licensed under GPLv3. See LICENSE for details.
+   */
+#include "LogPipeline.hpp"
+#include "Hash.hpp"
+#include "HeapMonitor.hpp"
+#include "TimeSync.hpp"
+
+#include <Esp32Logging.hpp>
+#include <esp_timer.h>
+#include <lwip/netdb.h>
+
+namespace {
+	const constexpr char* kLoggingTag = "BasecampLogs";
+	// Lines arriving meanwhile share the datagram
+	const constexpr uint32_t kBatchDelayMs = 50;
+	const constexpr int64_t kResolveRetryUs = 10 * 1000000LL;
+	// Facility "user" as per RFC 5424
+	const constexpr unsigned kSyslogFacility = 1;
+
+	uint32_t hashTag(const char* tag, size_t length)
+	{
+		// 0 marks unused rate limits
+		const uint32_t hash = basecampHash::fnv1a(tag, length);
+		return hash != 0 ? hash : 1;
+	}
+
+	unsigned syslogSeverity(basecampLog::Severity severity)
+	{
+		switch (severity) {
+			case basecampLog::Severity::fatal: return 2;
+			case basecampLog::Severity::error: return 3;
+			case basecampLog::Severity::warning: return 4;
+			case basecampLog::Severity::info: return 6;
+			default: return 7;
+		}
+	}
+
+	// Prints an already formatted line through a vprintf-like function
+	int printLine(vprintf_like_t function, const char* format, ...)
+	{
+		va_list arguments;
+		va_start(arguments, format);
+		const int result = function(format, arguments);
+		va_end(arguments);
+		return result;
+	}
+}
+
+LogPipeline basecampLogs;
+
+LogPipeline::LogPipeline()
+	: started_(false)
+	, dropped_(0)
+	, mutex_(xSemaphoreCreateMutex())
+{
+	for (auto &limit : limits_) {
+		limit.tagHash = 0;
+	}
+	otherLimit_ = {0, defaultLinesPerSecond_, defaultBurst_, false, defaultBurst_ * 1000u, 0};
+}
+
+bool LogPipeline::addSink(basecampLog::LogCallback sink)
+{
+	if (!start()) {
+		return false;
+	}
+	xSemaphoreTake(mutex_, portMAX_DELAY);
+	sinks_.push_back(std::move(sink));
+	sinksChanged_ = true;
+	xSemaphoreGive(mutex_);
+	return true;
+}
+
+bool LogPipeline::setSyslogServer(const String &host, const String &hostname)
+{
+	if (!start()) {
+		return false;
+	}
+
+	String name = host;
+	uint16_t port = kSyslogPort;
+	const int colon = host.lastIndexOf(':');
+	if (colon > 0) {
+		name = host.substring(0, colon);
+		port = host.substring(colon + 1).toInt();
+	}
+
+	xSemaphoreTake(mutex_, portMAX_DELAY);
+	syslogHost_ = name;
+	syslogPort_ = (port > 0) ? port : kSyslogPort;
+	hostname_ = hostname.length() > 0 ? hostname : String("-");
+	syslogChanged_ = true;
+	xSemaphoreGive(mutex_);
+	ESP_LOGI(kLoggingTag, "Sending logs to %s:%u", name.c_str(), syslogPort_);
+	return true;
+}
+
+void LogPipeline::setRateLimit(const char* tag, uint16_t linesPerSecond, uint16_t burst)
+{
+	const uint32_t hash = hashTag(tag, strlen(tag));
+	portENTER_CRITICAL(&mux_);
+	RateLimit *limit = nullptr;
+	for (auto &candidate : limits_) {
+		if (candidate.tagHash == hash) {
+			limit = &candidate;
+			break;
+		}
+		if (!limit && candidate.tagHash == 0) {
+			limit = &candidate;
+		}
+	}
+	if (limit) {
+		*limit = {hash, linesPerSecond, burst, true, burst * 1000u, 0};
+	}
+	portEXIT_CRITICAL(&mux_);
+
+	if (!limit) {
+		ESP_LOGW(kLoggingTag, "Too many rate limits, not limiting %s", tag);
+	}
+}
+
+void LogPipeline::setDefaultRateLimit(uint16_t linesPerSecond, uint16_t burst)
+{
+	portENTER_CRITICAL(&mux_);
+	defaultLinesPerSecond_ = linesPerSecond;
+	defaultBurst_ = burst;
+	for (auto &limit : limits_) {
+		if (limit.tagHash != 0 && !limit.configured) {
+			limit.linesPerSecond = linesPerSecond;
+			limit.burst = burst;
+		}
+	}
+	otherLimit_.linesPerSecond = linesPerSecond;
+	otherLimit_.burst = burst;
+	portEXIT_CRITICAL(&mux_);
+}
+
+bool LogPipeline::flush(uint32_t timeoutMs)
+{
+	if (!started_) {
+		return true;
+	}
+	if (xTaskGetCurrentTaskHandle() == task_) {
+		return false;
+	}
+
+	xTaskNotifyGive(task_);
+	const int64_t startUs = esp_timer_get_time();
+	for (;;) {
+		portENTER_CRITICAL(&mux_);
+		const bool busy = ringUsed_ > 0 || draining_;
+		portEXIT_CRITICAL(&mux_);
+		if (!busy) {
+			return true;
+		}
+		if (esp_timer_get_time() - startUs >= static_cast<int64_t>(timeoutMs) * 1000) {
+			return false;
+		}
+		vTaskDelay(1);
+	}
+}
+
+bool LogPipeline::start()
+{
+	if (started_) {
+		return true;
+	}
+
+	xSemaphoreTake(mutex_, portMAX_DELAY);
+	if (!started_) {
+		droppedFull_ = basecampMetrics.counter("basecamp_log_dropped_total", "Log lines not shipped", "reason=\"full\"");
+		droppedRate_ = basecampMetrics.counter("basecamp_log_dropped_total", "Log lines not shipped", "reason=\"rate\"");
+		ring_ = static_cast<uint8_t*>(heapAllocate(HeapSubsystem::logs, kRingSize));
+		if (ring_ && startTask(&Task, "BasecampLogs", placement_, this, &task_)) {
+			previousVprintf_ = esp_log_set_vprintf(&vprintfHook);
+			started_ = true;
+		} else {
+			heapFree(ring_);
+			ring_ = nullptr;
+		}
+	}
+	xSemaphoreGive(mutex_);
+
+	if (!started_) {
+		ESP_LOGE(kLoggingTag, "Could not start the log pipeline");
+	}
+	return started_;
+}
+
+int LogPipeline::vprintfHook(const char* format, va_list arguments)
+{
+	char line[kMaxLineLength];
+	va_list copy;
+	va_copy(copy, arguments);
+	const int length = vsnprintf(line, sizeof(line), format, copy);
+	va_end(copy);
+
+	// Set right after the hook, a line racing with that goes to vprintf()
+	const vprintf_like_t console = basecampLogs.previousVprintf_ ? basecampLogs.previousVprintf_ : &vprintf;
+	int result;
+	if (length >= 0 && static_cast<size_t>(length) < sizeof(line)) {
+		// No need to format the line again
+		result = printLine(console, "%s", line);
+	} else {
+		result = console(format, arguments);
+	}
+
+	if (length > 0) {
+		basecampLogs.enqueue(line, static_cast<size_t>(length) < sizeof(line) ? length : sizeof(line) - 1);
+	}
+	return result;
+}
+
+void LogPipeline::enqueue(const char* line, size_t length)
+{
+	// Lines look like "<color>I (1234) tag: message<reset>\n", anything else is kept as it is
+	const char* message = line;
+	const char* end = line + length;
+	if (message < end && *message == '\033') {
+		while (message < end && *message != 'm') {
+			message++;
+		}
+		if (message < end) {
+			message++;
+		}
+	}
+
+	basecampLog::Severity severity = basecampLog::Severity::info;
+	const char* tag = message;
+	size_t tagLength = 0;
+	if (end - message > 3 && message[1] == ' ' && message[2] == '(') {
+		bool known = true;
+		switch (message[0]) {
+			case 'E': severity = basecampLog::Severity::error; break;
+			case 'W': severity = basecampLog::Severity::warning; break;
+			case 'I': severity = basecampLog::Severity::info; break;
+			case 'D': severity = basecampLog::Severity::debug; break;
+			case 'V': severity = basecampLog::Severity::trace; break;
+			default: known = false; break;
+		}
+		const char* close = known ? static_cast<const char*>(memchr(message, ')', end - message)) : nullptr;
+		if (close && end - close > 2 && close[1] == ' ') {
+			const char* start = close + 2;
+			for (const char* p = start; p + 1 < end; p++) {
+				if (p[0] == ':' && p[1] == ' ') {
+					tag = start;
+					tagLength = p - start;
+					message = p + 2;
+					break;
+				}
+			}
+		}
+	}
+
+	while (end > message && (end[-1] == '\n' || end[-1] == '\r')) {
+		end--;
+	}
+	if (end - message >= 4 && memcmp(end - 4, "\033[0m", 4) == 0) {
+		end -= 4;
+	}
+	if (end == message) {
+		return;
+	}
+
+	const int64_t nowUs = esp_timer_get_time();
+	if (severity != basecampLog::Severity::error && !allow(tag, tagLength, nowUs)) {
+		dropped_.fetch_add(1, std::memory_order_relaxed);
+		droppedRate_->increment();
+		return;
+	}
+
+	const RecordHeader header = {nowUs, static_cast<uint16_t>(tagLength), static_cast<uint16_t>(end - message), severity};
+	const size_t size = sizeof(header) + header.tagLength + header.messageLength;
+	portENTER_CRITICAL(&mux_);
+	const bool fits = kRingSize - ringUsed_ >= size;
+	if (fits) {
+		writeRing(&header, sizeof(header));
+		writeRing(tag, header.tagLength);
+		writeRing(message, header.messageLength);
+	}
+	portEXIT_CRITICAL(&mux_);
+
+	if (!fits) {
+		dropped_.fetch_add(1, std::memory_order_relaxed);
+		droppedFull_->increment();
+		return;
+	}
+	xTaskNotifyGive(task_);
+}
+
+bool LogPipeline::allow(const char* tag, size_t tagLength, int64_t nowUs)
+{
+	const uint32_t hash = hashTag(tag, tagLength);
+	portENTER_CRITICAL(&mux_);
+	RateLimit *limit = nullptr;
+	RateLimit *unused = nullptr;
+	for (auto &candidate : limits_) {
+		if (candidate.tagHash == hash) {
+			limit = &candidate;
+			break;
+		}
+		if (!unused && candidate.tagHash == 0) {
+			unused = &candidate;
+		}
+	}
+	if (!limit && unused) {
+		limit = unused;
+		*limit = {hash, defaultLinesPerSecond_, defaultBurst_, false, defaultBurst_ * 1000u, nowUs};
+	}
+	const bool allowed = refill(limit ? *limit : otherLimit_, nowUs);
+	portEXIT_CRITICAL(&mux_);
+	return allowed;
+}
+
+bool LogPipeline::refill(RateLimit &limit, int64_t nowUs)
+{
+	if (limit.linesPerSecond == 0) {
+		return true;
+	}
+
+	// Limited, so the multiplication cannot overflow. A full bucket takes at most 65535 s.
+	int64_t elapsedUs = nowUs - limit.refilledUs;
+	if (elapsedUs > 100000000000LL) {
+		elapsedUs = 100000000000LL;
+	}
+	limit.refilledUs = nowUs;
+	const uint32_t capacity = limit.burst * 1000u;
+	const int64_t tokens = limit.tokens + elapsedUs * limit.linesPerSecond / 1000;
+	limit.tokens = tokens > capacity ? capacity : static_cast<uint32_t>(tokens);
+
+	if (limit.tokens < 1000) {
+		return false;
+	}
+	limit.tokens -= 1000;
+	return true;
+}
+
+void LogPipeline::writeRing(const void *data, size_t length)
+{
+	const uint8_t *bytes = static_cast<const uint8_t*>(data);
+	const size_t tail = (ringHead_ + ringUsed_) % kRingSize;
+	const size_t first = (length < kRingSize - tail) ? length : kRingSize - tail;
+	memcpy(ring_ + tail, bytes, first);
+	memcpy(ring_, bytes + first, length - first);
+	ringUsed_ += length;
+}
+
+void LogPipeline::readRing(void *data, size_t length)
+{
+	uint8_t *bytes = static_cast<uint8_t*>(data);
+	const size_t first = (length < kRingSize - ringHead_) ? length : kRingSize - ringHead_;
+	memcpy(bytes, ring_ + ringHead_, first);
+	memcpy(bytes + first, ring_, length - first);
+	ringHead_ = (ringHead_ + length) % kRingSize;
+	ringUsed_ -= length;
+}
+
+void LogPipeline::Task(void *logPipeline)
+{
+	static_cast<LogPipeline*>(logPipeline)->run();
+}
+
+void LogPipeline::run()
+{
+	for (;;) {
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		vTaskDelay(pdMS_TO_TICKS(kBatchDelayMs));
+		drain();
+	}
+}
+
+void LogPipeline::drain()
+{
+	xSemaphoreTake(mutex_, portMAX_DELAY);
+	if (sinksChanged_) {
+		taskSinks_ = sinks_;
+		sinksChanged_ = false;
+	}
+	if (syslogChanged_) {
+		taskSyslogHost_ = syslogHost_;
+		taskSyslogPort_ = syslogPort_;
+		taskHostname_ = hostname_;
+		syslogChanged_ = false;
+		syslogResolved_ = false;
+		lastResolveUs_ = 0;
+	}
+	xSemaphoreGive(mutex_);
+
+	char text[kMaxLineLength];
+	for (;;) {
+		RecordHeader record;
+		portENTER_CRITICAL(&mux_);
+		const bool available = ringUsed_ > 0;
+		if (available) {
+			readRing(&record, sizeof(record));
+			readRing(text, record.tagLength + record.messageLength);
+			draining_ = true;
+		}
+		portEXIT_CRITICAL(&mux_);
+		if (!available) {
+			break;
+		}
+		deliver(record, text, text + record.tagLength);
+	}
+
+	// Reported once per batch instead of once per line
+	const uint32_t dropped = getDropped();
+	if (dropped != reportedDropped_) {
+		const int length = snprintf(text, sizeof(text), "%u log lines dropped", dropped - reportedDropped_);
+		reportedDropped_ = dropped;
+		const RecordHeader record = {esp_timer_get_time(), static_cast<uint16_t>(strlen(kLoggingTag)),
+			static_cast<uint16_t>(length), basecampLog::Severity::warning};
+		deliver(record, kLoggingTag, text);
+	}
+
+	sendDatagram();
+	portENTER_CRITICAL(&mux_);
+	draining_ = false;
+	portEXIT_CRITICAL(&mux_);
+}
+
+void LogPipeline::deliver(const RecordHeader &record, const char* tag, const char* message)
+{
+	if (!taskSinks_.empty()) {
+		std::string line;
+		line.reserve(record.tagLength + 2 + record.messageLength);
+		if (record.tagLength > 0) {
+			line.append(tag, record.tagLength);
+			line.append(": ");
+		}
+		line.append(message, record.messageLength);
+		for (const auto &sink : taskSinks_) {
+			sink(record.severity, line);
+		}
+	}
+	if (taskSyslogHost_.length() > 0) {
+		appendSyslog(record, tag, message);
+	}
+}
+
+void LogPipeline::appendSyslog(const RecordHeader &record, const char* tag, const char* message)
+{
+	// The timestamp is the time of logging, not of sending
+	char timestamp[32] = "-";
+	if (basecampTime.isValid()) {
+		const int64_t wallUs = basecampTime.toWallClockUs(record.timeUs);
+		const time_t seconds = wallUs / 1000000;
+		struct tm utc;
+		gmtime_r(&seconds, &utc);
+		const size_t length = strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", &utc);
+		snprintf(timestamp + length, sizeof(timestamp) - length, ".%06uZ", static_cast<unsigned>(wallUs % 1000000));
+	}
+
+	char entry[kMaxLineLength + 128];
+	int length = snprintf(entry, sizeof(entry), "<%u>1 %s %s %.*s - - - %.*s\n",
+		kSyslogFacility * 8 + syslogSeverity(record.severity), timestamp, taskHostname_.c_str(),
+		record.tagLength > 0 ? static_cast<int>(record.tagLength) : 1, record.tagLength > 0 ? tag : "-",
+		static_cast<int>(record.messageLength), message);
+	if (length <= 0) {
+		return;
+	}
+	if (static_cast<size_t>(length) >= sizeof(entry)) {
+		length = sizeof(entry) - 1;
+		entry[length - 1] = '\n';
+	}
+
+	if (datagramLength_ + length > kMaxDatagramSize) {
+		sendDatagram();
+	}
+	memcpy(datagram_ + datagramLength_, entry, length);
+	datagramLength_ += length;
+}
+
+void LogPipeline::sendDatagram()
+{
+	if (datagramLength_ == 0) {
+		return;
+	}
+	// Lines are not kept while the server is unknown or unreachable
+	if (resolveSyslogServer()) {
+		// Without the last newline
+		sendto(socket_, datagram_, datagramLength_ - 1, MSG_DONTWAIT,
+			reinterpret_cast<const struct sockaddr*>(&syslogAddress_), sizeof(syslogAddress_));
+	}
+	datagramLength_ = 0;
+}
+
+bool LogPipeline::resolveSyslogServer()
+{
+	if (syslogResolved_) {
+		return true;
+	}
+	const int64_t nowUs = esp_timer_get_time();
+	if (lastResolveUs_ != 0 && nowUs - lastResolveUs_ < kResolveRetryUs) {
+		return false;
+	}
+	lastResolveUs_ = nowUs;
+
+	if (socket_ < 0) {
+		socket_ = socket(AF_INET, SOCK_DGRAM, 0);
+		if (socket_ < 0) {
+			return false;
+		}
+	}
+
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	struct addrinfo *result = nullptr;
+	if (getaddrinfo(taskSyslogHost_.c_str(), nullptr, &hints, &result) != 0 || !result) {
+		// Would end up in the ring again, the retry interval limits the noise
+		ESP_LOGW(kLoggingTag, "Could not resolve %s", taskSyslogHost_.c_str());
+		return false;
+	}
+	memcpy(&syslogAddress_, result->ai_addr, sizeof(syslogAddress_));
+	syslogAddress_.sin_port = htons(taskSyslogPort_);
+	freeaddrinfo(result);
+	syslogResolved_ = true;
+	return true;
+}
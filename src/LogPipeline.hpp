@@ -0,0 +1,149 @@
+/*
+   Basecamp - ESP32 library to simplify the basics of IoT projects
+   Written by Merlin Schumacher (mls@ct.de) for c't magazin für computer technik (https://www.ct.de)
+   Licensed under GPLv3. See LICENSE for details.
+   */
+
+#ifndef LogPipeline_h
+#define LogPipeline_h
+
+#include <atomic>
+#include <stdarg.h>
+#include <vector>
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <esp_log.h>
+#include <lwip/sockets.h>
+#include "Metrics.hpp"
+#include "TaskPlacement.hpp"
+#include "log.hpp"
+
+// Ships ESP log output to sinks and a syslog server without blocking the logging task.
+//
+// Lines written via esp_log_write() (ESP_LOGx) are still printed to the console right away.
+// Besides that they are copied into a fixed ring buffer. A background task passes them on
+// to the sinks and sends them to syslog, several lines per datagram. Lines are dropped and
+// counted if the ring is full or their tag exceeds its rate limit. Errors are never rate limited.
+//
+// The hook and the task are started by the first addSink() or setSyslogServer().
+class LogPipeline {
+	public:
+		static constexpr size_t kRingSize = 4096;
+		// Longer lines are truncated. Taken from the stack of the logging task.
+		static constexpr size_t kMaxLineLength = 256;
+		static constexpr size_t kMaxDatagramSize = 1024;
+		static constexpr size_t kMaxRateLimits = 16;
+		static constexpr uint16_t kSyslogPort = 514;
+
+		LogPipeline();
+		LogPipeline(const LogPipeline&) = delete;
+		LogPipeline& operator=(const LogPipeline&) = delete;
+
+		// Sinks run on the pipeline task and get "tag: message". They may block,
+		// but everything behind them waits.
+		bool addSink(basecampLog::LogCallback sink);
+		// host may end in ":port". Messages are sent as RFC 5424 with the hostname as HOSTNAME
+		// and the log tag as APP-NAME, one message per line.
+		bool setSyslogServer(const String &host, const String &hostname);
+
+		// Lines per second and burst allowed for a tag, 0 lines per second for no limit.
+		// Tags without a limit of their own get the default, 20 lines per second with a burst of 40.
+		void setRateLimit(const char* tag, uint16_t linesPerSecond, uint16_t burst);
+		void setDefaultRateLimit(uint16_t linesPerSecond, uint16_t burst);
+
+		uint32_t getDropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+		// Waits until everything queued so far was handed to the sinks and sent, e.g. before
+		// a deep sleep. Returns false on timeout or if called from a sink.
+		bool flush(uint32_t timeoutMs);
+
+		// Takes effect when the task is started
+		void setTaskPlacement(const TaskPlacement &placement) { placement_ = placement; }
+
+	private:
+		struct RecordHeader {
+			int64_t timeUs;
+			uint16_t tagLength;
+			uint16_t messageLength;
+			basecampLog::Severity severity;
+		};
+
+		struct RateLimit {
+			// 0 if unused
+			uint32_t tagHash;
+			uint16_t linesPerSecond;
+			uint16_t burst;
+			bool configured;
+			// In thousandths of a line
+			uint32_t tokens;
+			int64_t refilledUs;
+		};
+
+		bool start();
+		static int vprintfHook(const char* format, va_list arguments);
+		void enqueue(const char* line, size_t length);
+		bool allow(const char* tag, size_t tagLength, int64_t nowUs);
+		static bool refill(RateLimit &limit, int64_t nowUs);
+		void writeRing(const void *data, size_t length);
+		void readRing(void *data, size_t length);
+
+		static void Task(void *);
+		void run();
+		void drain();
+		void deliver(const RecordHeader &record, const char* tag, const char* message);
+		void appendSyslog(const RecordHeader &record, const char* tag, const char* message);
+		void sendDatagram();
+		bool resolveSyslogServer();
+
+		std::atomic<bool> started_;
+		vprintf_like_t previousVprintf_ = nullptr;
+		TaskHandle_t task_ = nullptr;
+		TaskPlacement placement_ = {4096, 1, tskNO_AFFINITY};
+
+		// Ring of RecordHeader followed by tag and message, guarded by mux_
+		uint8_t *ring_ = nullptr;
+		size_t ringHead_ = 0;
+		size_t ringUsed_ = 0;
+		RateLimit limits_[kMaxRateLimits];
+		// For tags that do not fit into limits_ anymore
+		RateLimit otherLimit_;
+		uint16_t defaultLinesPerSecond_ = 20;
+		uint16_t defaultBurst_ = 40;
+		mutable portMUX_TYPE mux_ = portMUX_INITIALIZER_UNLOCKED;
+
+		// Set while lines taken from the ring are still being delivered
+		bool draining_ = false;
+
+		std::atomic<uint32_t> dropped_;
+		MetricCounter *droppedFull_ = nullptr;
+		MetricCounter *droppedRate_ = nullptr;
+
+		// Guards sinks_ and the syslog settings
+		SemaphoreHandle_t mutex_;
+		std::vector<basecampLog::LogCallback> sinks_;
+		String syslogHost_;
+		uint16_t syslogPort_ = kSyslogPort;
+		String hostname_;
+		bool sinksChanged_ = false;
+		bool syslogChanged_ = false;
+
+		// Only used on the pipeline task, copied from the above when they changed
+		std::vector<basecampLog::LogCallback> taskSinks_;
+		String taskSyslogHost_;
+		uint16_t taskSyslogPort_ = kSyslogPort;
+		String taskHostname_;
+		int socket_ = -1;
+		struct sockaddr_in syslogAddress_;
+		bool syslogResolved_ = false;
+		int64_t lastResolveUs_ = 0;
+		uint32_t reportedDropped_ = 0;
+		char datagram_[kMaxDatagramSize];
+		size_t datagramLength_ = 0;
+};
+
+// Shared by all Basecamp subsystems
+extern LogPipeline basecampLogs;
+
+#endif
@@ -0,0 +1,203 @@
+/*
+   Basecamp - ESP32 library to simplify the basics of IoT projects
+   Written by Merlin Schumacher (mls@ct.de) for c't magazin für computer technik (https://www.ct.de)
+   Licensed under GPLv3. See LICENSE for details.
+   */
+#include "Metrics.hpp"
+
+#include <Esp32Logging.hpp>
+
+namespace {
+	const constexpr char* kLoggingTag = "BasecampMetrics";
+
+	bool sameLabels(const char* a, const char* b)
+	{
+		if (!a || !b) {
+			return a == b;
+		}
+		return strcmp(a, b) == 0;
+	}
+}
+
+MetricsRegistry basecampMetrics;
+
+void MetricHistogram::observe(uint32_t value)
+{
+	size_t bucket = 0;
+	while (bucket < boundCount_ && value > bounds_[bucket]) {
+		bucket++;
+	}
+	buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+	count_.fetch_add(1, std::memory_order_relaxed);
+	sum_.fetch_add(value, std::memory_order_relaxed);
+}
+
+const MetricsRegistry::Entry* MetricsRegistry::find(const char* name, const char* labels) const
+{
+	for (size_t i = 0; i < entryCount_; i++) {
+		if (strcmp(entries_[i].name, name) == 0 && sameLabels(entries_[i].labels, labels)) {
+			return &entries_[i];
+		}
+	}
+	return nullptr;
+}
+
+bool MetricsRegistry::add(const char* name, const char* help, const char* labels, Type type, uint8_t index)
+{
+	if (entryCount_ == kMaxMetrics) {
+		return false;
+	}
+	entries_[entryCount_++] = {name, help, labels, type, index};
+	return true;
+}
+
+MetricCounter* MetricsRegistry::counter(const char* name, const char* help, const char* labels)
+{
+	MetricCounter *result = &overflowCounter_;
+	portENTER_CRITICAL(&mux_);
+	const Entry *existing = find(name, labels);
+	if (existing && existing->type == Type::counter) {
+		result = &counters_[existing->index];
+	} else if (!existing && counterCount_ < kMaxMetrics && add(name, help, labels, Type::counter, counterCount_)) {
+		result = &counters_[counterCount_++];
+	}
+	portEXIT_CRITICAL(&mux_);
+
+	if (result == &overflowCounter_) {
+		ESP_LOGW(kLoggingTag, "Could not register counter %s", name);
+	}
+	return result;
+}
+
+MetricGauge* MetricsRegistry::gauge(const char* name, const char* help, const char* labels)
+{
+	MetricGauge *result = &overflowGauge_;
+	portENTER_CRITICAL(&mux_);
+	const Entry *existing = find(name, labels);
+	if (existing && existing->type == Type::gauge) {
+		result = &gauges_[existing->index];
+	} else if (!existing && gaugeCount_ < kMaxMetrics && add(name, help, labels, Type::gauge, gaugeCount_)) {
+		result = &gauges_[gaugeCount_++];
+	}
+	portEXIT_CRITICAL(&mux_);
+
+	if (result == &overflowGauge_) {
+		ESP_LOGW(kLoggingTag, "Could not register gauge %s", name);
+	}
+	return result;
+}
+
+MetricHistogram* MetricsRegistry::histogram(const char* name, const char* help, const uint32_t* bounds, size_t boundCount)
+{
+	MetricHistogram *result = &overflowHistogram_;
+	if (boundCount > MetricHistogram::kMaxBuckets) {
+		boundCount = MetricHistogram::kMaxBuckets;
+	}
+
+	portENTER_CRITICAL(&mux_);
+	const Entry *existing = find(name, nullptr);
+	if (existing && existing->type == Type::histogram) {
+		result = &histograms_[existing->index];
+	} else if (!existing && histogramCount_ < kMaxHistograms && add(name, help, nullptr, Type::histogram, histogramCount_)) {
+		result = &histograms_[histogramCount_++];
+		result->bounds_ = bounds;
+		result->boundCount_ = boundCount;
+	}
+	portEXIT_CRITICAL(&mux_);
+
+	if (result == &overflowHistogram_) {
+		ESP_LOGW(kLoggingTag, "Could not register histogram %s", name);
+		// Keeps observe() working
+		result->bounds_ = bounds;
+		result->boundCount_ = 0;
+	}
+	return result;
+}
+
+void MetricsRegistry::renderValue(Print &out, const Entry &entry) const
+{
+	switch (entry.type) {
+		case Type::counter:
+		case Type::gauge:
+			out.print(entry.name);
+			if (entry.labels) {
+				out.print('{');
+				out.print(entry.labels);
+				out.print('}');
+			}
+			out.print(' ');
+			if (entry.type == Type::counter) {
+				out.print(counters_[entry.index].get());
+				out.print('\n');
+			} else {
+				out.print(gauges_[entry.index].get());
+				out.print('\n');
+			}
+			break;
+		case Type::histogram: {
+			const MetricHistogram &histogram = histograms_[entry.index];
+			uint32_t cumulated = 0;
+			for (size_t i = 0; i <= histogram.boundCount_; i++) {
+				cumulated += histogram.buckets_[i].load(std::memory_order_relaxed);
+				out.print(entry.name);
+				out.print("_bucket{le=\"");
+				if (i < histogram.boundCount_) {
+					out.print(histogram.bounds_[i]);
+				} else {
+					out.print("+Inf");
+				}
+				out.print("\"} ");
+				out.print(cumulated);
+				out.print('\n');
+			}
+			out.print(entry.name);
+			out.print("_sum ");
+			out.print(histogram.sum_.load(std::memory_order_relaxed));
+			out.print('\n');
+			out.print(entry.name);
+			out.print("_count ");
+			out.print(histogram.count_.load(std::memory_order_relaxed));
+			out.print('\n');
+			break;
+		}
+	}
+}
+
+void MetricsRegistry::render(Print &out) const
+{
+	static const char* const kTypeNames[] = {"counter", "gauge", "histogram"};
+
+	// Entries are only ever added, so everything below the count taken here is stable
+	portENTER_CRITICAL(&mux_);
+	const size_t entryCount = entryCount_;
+	portEXIT_CRITICAL(&mux_);
+
+	for (size_t i = 0; i < entryCount; i++) {
+		const Entry &entry = entries_[i];
+		// Metrics sharing a name (with different labels) are rendered as one group
+		bool rendered = false;
+		for (size_t j = 0; j < i && !rendered; j++) {
+			rendered = (strcmp(entries_[j].name, entry.name) == 0);
+		}
+		if (rendered) {
+			continue;
+		}
+
+		// Lines end in '\n' only, Prometheus would read the '\r' of println() as part of the value
+		out.print("# HELP ");
+		out.print(entry.name);
+		out.print(' ');
+		out.print(entry.help);
+		out.print('\n');
+		out.print("# TYPE ");
+		out.print(entry.name);
+		out.print(' ');
+		out.print(kTypeNames[static_cast<size_t>(entry.type)]);
+		out.print('\n');
+		for (size_t j = i; j < entryCount; j++) {
+			if (strcmp(entries_[j].name, entry.name) == 0) {
+				renderValue(out, entries_[j]);
+			}
+		}
+	}
+}
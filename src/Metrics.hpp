@@ -0,0 +1,146 @@
+/*
+   Basecamp - ESP32 library to simplify the basics of IoT projects
+   Written by Merlin Schumacher (mls@ct.de) for c't magazin für computer technik (https://www.ct.de)
+   Licensed under GPLv3. See LICENSE for details.
+   */
+
+#ifndef Metrics_h
+#define Metrics_h
+
+#include <atomic>
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+
+// Monotonically increasing value
+class MetricCounter {
+	public:
+		void increment(uint32_t by = 1) { value_.fetch_add(by, std::memory_order_relaxed); }
+		uint32_t get() const { return value_.load(std::memory_order_relaxed); }
+
+	private:
+		std::atomic<uint32_t> value_;
+};
+
+// Value that goes up and down
+class MetricGauge {
+	public:
+		void set(int32_t value) { value_.store(value, std::memory_order_relaxed); }
+		void add(int32_t by) { value_.fetch_add(by, std::memory_order_relaxed); }
+		int32_t get() const { return value_.load(std::memory_order_relaxed); }
+
+	private:
+		std::atomic<int32_t> value_;
+};
+
+// Distribution of values over fixed buckets, defined by their upper bounds
+class MetricHistogram {
+	public:
+		static constexpr size_t kMaxBuckets = 8;
+
+		void observe(uint32_t value);
+
+	private:
+		friend class MetricsRegistry;
+
+		const uint32_t* bounds_;
+		size_t boundCount_;
+		// One more than bounds for +Inf
+		std::atomic<uint32_t> buckets_[kMaxBuckets + 1];
+		std::atomic<uint32_t> count_;
+		std::atomic<uint32_t> sum_;
+};
+
+// Fixed-size registry of counters, gauges and histograms, rendered in the Prometheus text format.
+// Everything lives in static arrays, updating a metric is a single atomic operation.
+// Name, help, labels and bounds are not copied and have to be literals (or live as long).
+// Registering the same name and labels again returns the existing metric.
+class MetricsRegistry {
+	public:
+		static constexpr size_t kMaxMetrics = 40;
+		static constexpr size_t kMaxHistograms = 4;
+
+		// labels are rendered verbatim, e.g. "route=\"/data.json\"". Never returns nullptr:
+		// once the registry is full, further metrics are counted but not rendered.
+		MetricCounter* counter(const char* name, const char* help, const char* labels = nullptr);
+		MetricGauge* gauge(const char* name, const char* help, const char* labels = nullptr);
+		// bounds have to be sorted, at most MetricHistogram::kMaxBuckets
+		MetricHistogram* histogram(const char* name, const char* help, const uint32_t* bounds, size_t boundCount);
+
+		// Writes all metrics in the Prometheus text exposition format
+		void render(Print &out) const;
+
+	private:
+		enum class Type : uint8_t {
+			counter,
+			gauge,
+			histogram,
+		};
+
+		struct Entry {
+			const char* name;
+			const char* help;
+			const char* labels;
+			Type type;
+			// Index into counters_, gauges_ or histograms_
+			uint8_t index;
+		};
+
+		const Entry* find(const char* name, const char* labels) const;
+		bool add(const char* name, const char* help, const char* labels, Type type, uint8_t index);
+		void renderValue(Print &out, const Entry &entry) const;
+
+		Entry entries_[kMaxMetrics];
+		size_t entryCount_ = 0;
+		MetricCounter counters_[kMaxMetrics];
+		size_t counterCount_ = 0;
+		MetricGauge gauges_[kMaxMetrics];
+		size_t gaugeCount_ = 0;
+		MetricHistogram histograms_[kMaxHistograms];
+		size_t histogramCount_ = 0;
+
+		// Handed out when the registry is full
+		MetricCounter overflowCounter_;
+		MetricGauge overflowGauge_;
+		MetricHistogram overflowHistogram_;
+
+		mutable portMUX_TYPE mux_ = portMUX_INITIALIZER_UNLOCKED;
+};
+
+// Shared by all Basecamp subsystems. Constant-initialized, so it can be used from static constructors.
+extern MetricsRegistry basecampMetrics;
+
+// Print into a fixed buffer, output beyond its size is dropped but still counted
+class MetricsBufferPrint : public Print {
+	public:
+		MetricsBufferPrint(char *buffer, size_t size)
+			: buffer_(buffer)
+			, size_(size)
+		{
+			buffer_[0] = '\0';
+		}
+
+		size_t write(uint8_t c) override {
+			required_++;
+			if (length_ + 1 >= size_) {
+				truncated_ = true;
+				return 0;
+			}
+			buffer_[length_++] = c;
+			buffer_[length_] = '\0';
+			return 1;
+		}
+
+		size_t length() const { return length_; }
+		bool isTruncated() const { return truncated_; }
+		// Buffer size the complete output needs, including the terminator
+		size_t requiredSize() const { return required_ + 1; }
+
+	private:
+		char *buffer_;
+		size_t size_;
+		size_t length_ = 0;
+		size_t required_ = 0;
+		bool truncated_ = false;
+};
+
+#endif
@@ -0,0 +1,209 @@
+#include "MqttBrokerList.hpp"
+
+#include <Esp32Logging.hpp>
+#include <esp_timer.h>
+#include <lwip/netdb.h>
+#include <lwip/sockets.h>
+#include <unistd.h>
+
+namespace {
+    uint16_t DefaultPort(const String& scheme)
+    {
+        if (scheme == "mqtts")
+            return 8883;
+        if (scheme == "ws")
+            return 80;
+        if (scheme == "wss")
+            return 443;
+        return 1883;
+    }
+}
+
+size_t MqttBrokerList::Parse(const String& uris)
+{
+    count = 0;
+    active = 0;
+    int start = 0;
+    while (start < (int)uris.length()) {
+        int end = uris.indexOf(',', start);
+        if (end < 0)
+            end = uris.length();
+        String uri = uris.substring(start, end);
+        uri.trim();
+        start = end + 1;
+        if (uri.isEmpty())
+            continue;
+        if (count == kMaxBrokers) {
+            ESP_LOGW("MQTT", "Only %u brokers supported, ignoring the rest", kMaxBrokers);
+            break;
+        }
+
+        // scheme://[user[:password]@]host[:port][/path]
+        Broker& broker = brokers[count++];
+        const int schemeEnd = uri.indexOf("://");
+        const int hostStart = (schemeEnd >= 0) ? schemeEnd + 3 : 0;
+        int hostEnd = uri.indexOf('/', hostStart);
+        if (hostEnd < 0)
+            hostEnd = uri.length();
+        String authority = uri.substring(hostStart, hostEnd);
+        const int at = authority.lastIndexOf('@');
+        if (at >= 0)
+            authority = authority.substring(at + 1);
+        const int colon = authority.lastIndexOf(':');
+        broker.uri = uri;
+        broker.host = (colon >= 0) ? authority.substring(0, colon) : authority;
+        broker.port = (colon >= 0) ? authority.substring(colon + 1).toInt()
+                                   : DefaultPort(schemeEnd >= 0 ? uri.substring(0, schemeEnd) : String("mqtt"));
+        broker.healthy = true;
+        broker.connects = 0;
+        broker.failedConnects = 0;
+        broker.consecutiveFailures = 0;
+        broker.probeLatencyMs = 0;
+        broker.uptimeUs = 0;
+    }
+    return count;
+}
+
+size_t MqttBrokerList::Active() const
+{
+    portENTER_CRITICAL(&mux);
+    const size_t result = active;
+    portEXIT_CRITICAL(&mux);
+    return result;
+}
+
+void MqttBrokerList::Connected()
+{
+    portENTER_CRITICAL(&mux);
+    Broker& broker = brokers[active];
+    broker.healthy = true;
+    broker.connects++;
+    broker.consecutiveFailures = 0;
+    connectedSinceUs = esp_timer_get_time();
+    portEXIT_CRITICAL(&mux);
+}
+
+bool MqttBrokerList::Disconnected(bool wasConnected, bool linkUp)
+{
+    if (count == 0 || (!wasConnected && !linkUp))
+        return false;
+
+    portENTER_CRITICAL(&mux);
+    Broker& broker = brokers[active];
+    bool changed = false;
+    if (wasConnected) {
+        // A lost connection is retried on the same broker first
+        if (connectedSinceUs != 0)
+            broker.uptimeUs += esp_timer_get_time() - connectedSinceUs;
+        connectedSinceUs = 0;
+    } else {
+        broker.failedConnects++;
+        if (++broker.consecutiveFailures >= kFailoverAttempts && count > 1) {
+            broker.healthy = false;
+            const size_t next = ChooseLocked(active);
+            changed = (next != active);
+            active = next;
+            brokers[active].consecutiveFailures = 0;
+        }
+    }
+    portEXIT_CRITICAL(&mux);
+    return changed;
+}
+
+size_t MqttBrokerList::ChooseLocked(size_t exclude) const
+{
+    size_t best = count;
+    for (size_t i = 0; i < count; i++) {
+        if (i == exclude || !brokers[i].healthy)
+            continue;
+        if (i == 0)
+            return 0;
+        // Not yet checked ones come last
+        const uint32_t latency = brokers[i].probeLatencyMs ? brokers[i].probeLatencyMs : UINT32_MAX;
+        if (best == count || latency < (brokers[best].probeLatencyMs ? brokers[best].probeLatencyMs : UINT32_MAX))
+            best = i;
+    }
+    // All down, keep going round
+    return (best < count) ? best : (exclude + 1) % count;
+}
+
+bool MqttBrokerList::Probe(size_t index, uint32_t timeoutMs)
+{
+    const Broker& broker = brokers[index];
+    char port[6];
+    snprintf(port, sizeof(port), "%u", broker.port);
+    addrinfo hints = {};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* address = nullptr;
+
+    const int64_t startUs = esp_timer_get_time();
+    bool reachable = false;
+    if (getaddrinfo(broker.host.c_str(), port, &hints, &address) == 0 && address) {
+        const int fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (fd >= 0) {
+            fcntl(fd, F_SETFL, O_NONBLOCK);
+            if (connect(fd, address->ai_addr, address->ai_addrlen) == 0) {
+                reachable = true;
+            } else if (errno == EINPROGRESS) {
+                fd_set writable;
+                FD_ZERO(&writable);
+                FD_SET(fd, &writable);
+                timeval timeout = {(time_t)(timeoutMs / 1000), (suseconds_t)(timeoutMs % 1000) * 1000};
+                int error = 0;
+                socklen_t errorLength = sizeof(error);
+                reachable = select(fd + 1, nullptr, &writable, nullptr, &timeout) > 0 &&
+                            getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &errorLength) == 0 && error == 0;
+            }
+            close(fd);
+        }
+        freeaddrinfo(address);
+    }
+    const uint32_t latencyMs = (esp_timer_get_time() - startUs) / 1000;
+
+    portENTER_CRITICAL(&mux);
+    Broker& probed = brokers[index];
+    probed.healthy = reachable;
+    if (reachable) {
+        // At least 1, 0 stands for unknown
+        const uint32_t sample = latencyMs > 0 ? latencyMs : 1;
+        probed.probeLatencyMs = probed.probeLatencyMs ? (3 * probed.probeLatencyMs + sample) / 4 : sample;
+    }
+    portEXIT_CRITICAL(&mux);
+
+    ESP_LOGD("MQTT", "Health check of %s:%u: %s in %u ms", broker.host.c_str(), broker.port, reachable ? "ok" : "failed", latencyMs);
+    return reachable;
+}
+
+size_t MqttBrokerList::Preferred() const
+{
+    portENTER_CRITICAL(&mux);
+    const size_t result = (active != 0 && count > 0 && brokers[0].healthy) ? 0 : active;
+    portEXIT_CRITICAL(&mux);
+    return result;
+}
+
+void MqttBrokerList::Select(size_t index)
+{
+    portENTER_CRITICAL(&mux);
+    active = index;
+    brokers[active].consecutiveFailures = 0;
+    portEXIT_CRITICAL(&mux);
+}
+
+size_t MqttBrokerList::GetStats(Stats* stats, size_t maxEntries) const
+{
+    const int64_t nowUs = esp_timer_get_time();
+    portENTER_CRITICAL(&mux);
+    size_t written = 0;
+    for (; written < count && written < maxEntries; written++) {
+        const Broker& broker = brokers[written];
+        int64_t uptimeUs = broker.uptimeUs;
+        if (written == active && connectedSinceUs != 0)
+            uptimeUs += nowUs - connectedSinceUs;
+        stats[written] = {broker.uri.c_str(), written == active, broker.healthy, broker.connects,
+                          broker.failedConnects, broker.probeLatencyMs, (uint32_t)(uptimeUs / 1000000)};
+    }
+    portEXIT_CRITICAL(&mux);
+    return written;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+
+// Brokers of one client in the order of preference, the first one is the primary. Keeps their
+// health and picks the broker to connect to:
+// - a broker is given up after kFailoverAttempts failed connects in a row, the next one is the
+//   primary if it is healthy, else the healthy broker that answered the health checks fastest
+// - a working connection stays where it is, except that it returns to the primary once that
+//   is healthy again
+// Health checks are plain TCP connects, see Probe(). All storage is fixed-size.
+class MqttBrokerList {
+    public:
+        static constexpr size_t kMaxBrokers = 4;
+        static constexpr uint32_t kFailoverAttempts = 2;
+
+        struct Stats {
+            const char* uri;
+            bool active;
+            // Result of the last health check or connect
+            bool healthy;
+            uint32_t connects;
+            uint32_t failedConnects;
+            // Smoothed time of the health checks' TCP connect including DNS, 0 if not checked yet
+            uint32_t probeLatencyMs;
+            // Total time connected
+            uint32_t uptimeS;
+        };
+
+        // Comma-separated URIs, returns the number of brokers. Must not be called while in use.
+        size_t Parse(const String& uris);
+        size_t Count() const { return count; }
+        size_t Active() const;
+        const char* Uri(size_t index) const { return brokers[index].uri.c_str(); }
+        // For logging, the URI may contain credentials
+        const char* Host(size_t index) const { return brokers[index].host.c_str(); }
+        uint16_t Port(size_t index) const { return brokers[index].port; }
+
+        // Connection events of the active broker
+        void Connected();
+        // Returns true if the active broker changed and the client has to switch to it. Failed
+        // connects while the network link is down say nothing about the broker and are not counted.
+        bool Disconnected(bool wasConnected, bool linkUp = true);
+
+        // Blocks for up to timeoutMs, only to be called from a single task
+        bool Probe(size_t index, uint32_t timeoutMs);
+        // Broker a working connection should move to, Active() to stay
+        size_t Preferred() const;
+        void Select(size_t index);
+
+        // Returns the number of entries written to stats
+        size_t GetStats(Stats* stats, size_t maxEntries) const;
+
+    private:
+        struct Broker {
+            String uri;
+            String host;
+            uint16_t port;
+            bool healthy;
+            uint32_t connects;
+            uint32_t failedConnects;
+            uint32_t consecutiveFailures;
+            uint32_t probeLatencyMs;
+            int64_t uptimeUs;
+        };
+
+        size_t ChooseLocked(size_t exclude) const;
+
+        Broker brokers[kMaxBrokers];
+        size_t count = 0;
+        size_t active = 0;
+        // 0 while not connected
+        int64_t connectedSinceUs = 0;
+        mutable portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+};
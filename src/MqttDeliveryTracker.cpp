@@ -0,0 +1,187 @@
+#include "MqttDeliveryTracker.hpp"
+#include "Hash.hpp"
+#include <esp_timer.h>
+#include <algorithm>
+
+MqttDeliveryTracker::MqttDeliveryTracker()
+    : mutex(xSemaphoreCreateMutex())
+{
+    memset(earlyAcks, 0, sizeof(earlyAcks));
+}
+
+MqttDeliveryTracker::~MqttDeliveryTracker()
+{
+    vSemaphoreDelete(mutex);
+}
+
+uint8_t MqttDeliveryTracker::TopicIndexLocked(const char* topic)
+{
+    const uint32_t hash = basecampHash::fnv1a(topic, strlen(topic));
+    for (size_t i = 0; i < topicCount; i++) {
+        if (topics[i].topicHash == hash)
+            return i;
+    }
+
+    if (topicCount == kMaxTopics)
+        return kMaxTopics - 1;
+
+    TopicHistogram& histogram = topics[topicCount];
+    memset(&histogram, 0, sizeof(histogram));
+    histogram.topicHash = hash;
+    // Keep the last entry as catch-all for all further topics
+    strlcpy(histogram.topic, (topicCount == kMaxTopics - 1) ? "*" : topic, sizeof(histogram.topic));
+    return topicCount++;
+}
+
+void MqttDeliveryTracker::RecordLocked(uint8_t topicIndex, uint32_t latencyUs)
+{
+    TopicHistogram& histogram = topics[topicIndex];
+    const uint32_t latencyMs = latencyUs / 1000;
+    size_t bucket = 0;
+    while (bucket < kLatencyBuckets - 1 && (latencyMs >> (bucket + 1)) > 0)
+        bucket++;
+    histogram.buckets[bucket]++;
+    histogram.count++;
+    if (latencyMs > histogram.maxMs)
+        histogram.maxMs = latencyMs;
+}
+
+void MqttDeliveryTracker::Track(int msgId, const char* topic, int64_t startUs, MqttPublishCallback callback)
+{
+    Expire();
+
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    stats.tracked++;
+    const uint8_t topicIndex = TopicIndexLocked(topic);
+
+    for (auto& earlyAck : earlyAcks) {
+        if (earlyAck.msgId == msgId) {
+            const uint32_t latencyUs = earlyAck.ackUs - startUs;
+            earlyAck.msgId = 0;
+            stats.acknowledged++;
+            RecordLocked(topicIndex, latencyUs);
+            xSemaphoreGive(mutex);
+            if (callback)
+                callback(msgId, true, latencyUs);
+            return;
+        }
+    }
+
+    if (inFlightCount == kMaxInFlight) {
+        stats.untracked++;
+        xSemaphoreGive(mutex);
+        ESP_LOGW("MQTT", "Delivery tracking table full, not tracking msg_id %i", msgId);
+        if (callback)
+            callback(msgId, false, 0);
+        return;
+    }
+
+    InFlight& entry = inFlight[inFlightCount++];
+    entry.msgId = msgId;
+    entry.topicIndex = topicIndex;
+    entry.startUs = startUs;
+    entry.callback = std::move(callback);
+    xSemaphoreGive(mutex);
+}
+
+void MqttDeliveryTracker::Acknowledge(int msgId)
+{
+    const int64_t nowUs = esp_timer_get_time();
+
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    for (size_t i = 0; i < inFlightCount; i++) {
+        if (inFlight[i].msgId == msgId) {
+            const uint32_t latencyUs = nowUs - inFlight[i].startUs;
+            MqttPublishCallback callback = std::move(inFlight[i].callback);
+            RecordLocked(inFlight[i].topicIndex, latencyUs);
+            stats.acknowledged++;
+            inFlight[i] = std::move(inFlight[--inFlightCount]);
+            xSemaphoreGive(mutex);
+
+            ESP_LOGD("MQTT", "msg_id %i acknowledged after %u us", msgId, latencyUs);
+            if (callback)
+                callback(msgId, true, latencyUs);
+            Expire();
+            return;
+        }
+    }
+
+    // Track() has not been called yet (or the message was not tracked at all)
+    earlyAcks[earlyAckNext] = {msgId, nowUs};
+    earlyAckNext = (earlyAckNext + 1) % (sizeof(earlyAcks) / sizeof(earlyAcks[0]));
+    xSemaphoreGive(mutex);
+}
+
+void MqttDeliveryTracker::Reconnected()
+{
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    stats.retransmits += inFlightCount;
+    xSemaphoreGive(mutex);
+}
+
+void MqttDeliveryTracker::Expire()
+{
+    const int64_t nowUs = esp_timer_get_time();
+
+    while (true) {
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        size_t i = 0;
+        while (i < inFlightCount && (nowUs - inFlight[i].startUs) < (int64_t)timeoutMs * 1000)
+            i++;
+        if (i == inFlightCount) {
+            xSemaphoreGive(mutex);
+            return;
+        }
+
+        const int msgId = inFlight[i].msgId;
+        const uint32_t ageUs = nowUs - inFlight[i].startUs;
+        MqttPublishCallback callback = std::move(inFlight[i].callback);
+        stats.timeouts++;
+        inFlight[i] = std::move(inFlight[--inFlightCount]);
+        xSemaphoreGive(mutex);
+
+        ESP_LOGW("MQTT", "msg_id %i not acknowledged within %u ms", msgId, timeoutMs);
+        if (callback)
+            callback(msgId, false, ageUs);
+    }
+}
+
+MqttDeliveryTracker::Stats MqttDeliveryTracker::GetStats()
+{
+    Expire();
+
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    Stats result = stats;
+    result.inFlight = inFlightCount;
+    xSemaphoreGive(mutex);
+    return result;
+}
+
+uint32_t MqttDeliveryTracker::Percentile(const TopicHistogram& histogram, uint32_t permille)
+{
+    const uint64_t threshold = ((uint64_t)histogram.count * permille + 999) / 1000;
+    uint64_t cumulated = 0;
+    for (size_t bucket = 0; bucket < kLatencyBuckets; bucket++) {
+        cumulated += histogram.buckets[bucket];
+        if (cumulated >= threshold)
+            return std::min<uint32_t>(1u << (bucket + 1), histogram.maxMs);
+    }
+    return histogram.maxMs;
+}
+
+size_t MqttDeliveryTracker::GetLatencyStats(LatencyStats* result, size_t maxEntries)
+{
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    size_t entries = std::min(maxEntries, topicCount);
+    for (size_t i = 0; i < entries; i++) {
+        const TopicHistogram& histogram = topics[i];
+        strlcpy(result[i].topic, histogram.topic, sizeof(result[i].topic));
+        result[i].count = histogram.count;
+        result[i].p50Ms = Percentile(histogram, 500);
+        result[i].p95Ms = Percentile(histogram, 950);
+        result[i].p99Ms = Percentile(histogram, 990);
+        result[i].maxMs = histogram.maxMs;
+    }
+    xSemaphoreGive(mutex);
+    return entries;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <Esp32Logging.hpp>
+#include <functional>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+// Called once per publish: for QoS 0 as soon as the message has been handed to the socket,
+// for QoS 1/2 when the broker acknowledged it (delivered = true) or the timeout expired.
+// Untracked messages (all in-flight slots in use) are reported right away as not delivered
+// with a latency of 0, though the broker may still receive them.
+typedef std::function<void(int msgId, bool delivered, uint32_t latencyUs)> MqttPublishCallback;
+
+// Matches in-flight QoS 1/2 message ids against MQTT_EVENT_PUBLISHED and keeps per-topic
+// round-trip latency histograms. All storage is fixed-size.
+class MqttDeliveryTracker {
+    public:
+        static constexpr size_t kMaxInFlight = 16;
+        static constexpr size_t kMaxTopics = 8;
+        // Bucket 0 covers [0, 2) ms, bucket i covers [2^i, 2^(i+1)) ms
+        static constexpr size_t kLatencyBuckets = 16;
+        static constexpr size_t kTopicDisplayLength = 63;
+
+        struct Stats {
+            uint32_t tracked = 0;
+            uint32_t acknowledged = 0;
+            uint32_t timeouts = 0;
+            // In-flight messages that were pending while reconnecting and thus got resent
+            uint32_t retransmits = 0;
+            // Not tracked because all in-flight slots were in use
+            uint32_t untracked = 0;
+            size_t inFlight = 0;
+        };
+
+        struct LatencyStats {
+            // Truncated for display. The last table entry collects all topics that did not fit ("*").
+            char topic[kTopicDisplayLength + 1];
+            uint32_t count;
+            // Upper bounds of the histogram buckets the percentiles fall into
+            uint32_t p50Ms;
+            uint32_t p95Ms;
+            uint32_t p99Ms;
+            uint32_t maxMs;
+        };
+
+        MqttDeliveryTracker();
+        ~MqttDeliveryTracker();
+
+        void SetTimeout(uint32_t timeoutMs) { this->timeoutMs = timeoutMs; }
+
+        // startUs has to be taken before the message has been handed to the client,
+        // as the acknowledge may arrive before Track() gets called.
+        void Track(int msgId, const char* topic, int64_t startUs, MqttPublishCallback callback);
+        // To be called for MQTT_EVENT_PUBLISHED
+        void Acknowledge(int msgId);
+        // To be called for MQTT_EVENT_CONNECTED, the client resends all pending messages
+        void Reconnected();
+        // Fails all entries older than the timeout, also done implicitly by Track() and Acknowledge().
+        // Has to be called periodically as well, otherwise timeouts only fire with further traffic.
+        void Expire();
+
+        Stats GetStats();
+        // Returns the number of entries written to stats
+        size_t GetLatencyStats(LatencyStats* stats, size_t maxEntries);
+
+    private:
+        struct InFlight {
+            int msgId;
+            uint8_t topicIndex;
+            int64_t startUs;
+            MqttPublishCallback callback;
+        };
+
+        struct TopicHistogram {
+            uint32_t topicHash;
+            char topic[kTopicDisplayLength + 1];
+            uint32_t buckets[kLatencyBuckets];
+            uint32_t count;
+            uint32_t maxMs;
+        };
+
+        struct EarlyAck {
+            int msgId;
+            int64_t ackUs;
+        };
+
+        uint8_t TopicIndexLocked(const char* topic);
+        void RecordLocked(uint8_t topicIndex, uint32_t latencyUs);
+        static uint32_t Percentile(const TopicHistogram& histogram, uint32_t permille);
+
+        InFlight inFlight[kMaxInFlight];
+        size_t inFlightCount = 0;
+        TopicHistogram topics[kMaxTopics];
+        size_t topicCount = 0;
+        // Acknowledges that arrived before their Track() call
+        EarlyAck earlyAcks[4];
+        size_t earlyAckNext = 0;
+        uint32_t timeoutMs = 30000;
+        Stats stats;
+        SemaphoreHandle_t mutex;
+};
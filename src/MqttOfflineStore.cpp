@@ -0,0 +1,267 @@
+#include "MqttOfflineStore.hpp"
+#include "HeapMonitor.hpp"
+#include <SPIFFS.h>
+#include <time.h>
+
+namespace {
+    // Timestamps before 2020 mean that the system time has not been set yet
+    const constexpr time_t kMinValidTime = 1577836800;
+}
+
+MqttOfflineStore::~MqttOfflineStore()
+{
+    heapFree(pageBuffer);
+    heapFree(recordBuffer);
+    if (mutex)
+        vSemaphoreDelete(mutex);
+}
+
+void MqttOfflineStore::SegmentPath(uint32_t segment, char* path, size_t pathSize) const
+{
+    snprintf(path, pathSize, "%s/%08u", config.directory, segment);
+}
+
+bool MqttOfflineStore::Begin(const Config& config)
+{
+    if (pageBuffer) {
+        ESP_LOGW("MQTT", "Offline store already initialized");
+        return true;
+    }
+
+    this->config = config;
+    const size_t maxRecordSize = sizeof(RecordHeader) + config.maxTopicLength + config.maxPayloadLength;
+    if (config.maxTopicLength > UINT8_MAX || config.maxPayloadLength > UINT16_MAX || config.maxSegments == 0) {
+        ESP_LOGE("MQTT", "Invalid offline store configuration");
+        return false;
+    }
+    // A page has to hold at least one record of maximum size
+    if (this->config.pageSize < maxRecordSize)
+        this->config.pageSize = maxRecordSize;
+    if (this->config.segmentSize < this->config.pageSize)
+        this->config.segmentSize = this->config.pageSize;
+
+    pageBuffer = static_cast<char*>(heapAllocate(HeapSubsystem::mqtt, this->config.pageSize));
+    recordBuffer = static_cast<char*>(heapAllocate(HeapSubsystem::mqtt, maxRecordSize + 2));
+    mutex = xSemaphoreCreateMutex();
+    if (!pageBuffer || !recordBuffer || !mutex) {
+        ESP_LOGE("MQTT", "Could not allocate offline store buffers");
+        heapFree(pageBuffer);
+        heapFree(recordBuffer);
+        pageBuffer = nullptr;
+        recordBuffer = nullptr;
+        return false;
+    }
+
+    // Pick up segments left over from before the last reboot
+    const size_t prefixLength = strlen(config.directory);
+    bool found = false;
+    uint32_t lastSegment = 0;
+    File root = SPIFFS.open("/");
+    for (File file = root.openNextFile(); file; file = root.openNextFile()) {
+        const char* name = file.name();
+        if (strncmp(name, config.directory, prefixLength) != 0 || name[prefixLength] != '/')
+            continue;
+        uint32_t segment = strtoul(name + prefixLength + 1, nullptr, 10);
+        if (!found || segment < firstSegment)
+            firstSegment = segment;
+        if (!found || segment >= lastSegment) {
+            lastSegment = segment;
+            writeSegmentSize = file.size();
+        }
+        found = true;
+    }
+    nextSegment = found ? lastSegment + 1 : 0;
+    if (!found)
+        firstSegment = 0;
+
+    ESP_LOGI("MQTT", "Offline store: %u segments pending", nextSegment - firstSegment);
+    return true;
+}
+
+bool MqttOfflineStore::IsEmpty()
+{
+    if (!pageBuffer)
+        return true;
+
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    bool empty = (firstSegment == nextSegment && pageLength == 0);
+    xSemaphoreGive(mutex);
+    return empty;
+}
+
+void MqttOfflineStore::RemoveSegmentLocked(uint32_t segment)
+{
+    char path[32];
+    SegmentPath(segment, path, sizeof(path));
+    SPIFFS.remove(path);
+    if (segment == firstSegment) {
+        firstSegment++;
+        readOffset = 0;
+    }
+    if (firstSegment == nextSegment)
+        writeSegmentSize = 0;
+}
+
+bool MqttOfflineStore::FlushLocked()
+{
+    if (pageLength == 0)
+        return true;
+
+    if (firstSegment == nextSegment || writeSegmentSize + pageLength > config.segmentSize) {
+        // Start a new segment, making room by discarding the oldest one if needed
+        nextSegment++;
+        writeSegmentSize = 0;
+        while (nextSegment - firstSegment > config.maxSegments) {
+            ESP_LOGW("MQTT", "Offline store full, discarding oldest segment");
+            RemoveSegmentLocked(firstSegment);
+            stats.droppedSegments++;
+        }
+    }
+
+    char path[32];
+    SegmentPath(nextSegment - 1, path, sizeof(path));
+    File file = SPIFFS.open(path, FILE_APPEND);
+    if (!file) {
+        ESP_LOGE("MQTT", "Could not open %s", path);
+        return false;
+    }
+    size_t written = file.write(reinterpret_cast<const uint8_t*>(pageBuffer), pageLength);
+    file.close();
+    if (written != pageLength) {
+        ESP_LOGE("MQTT", "Short write to %s (%u of %u bytes)", path, written, pageLength);
+        return false;
+    }
+
+    writeSegmentSize += written;
+    pageLength = 0;
+    stats.pageWrites++;
+    return true;
+}
+
+bool MqttOfflineStore::Store(const char* topic, const char* payload, size_t length, bool retain, int qos)
+{
+    if (!pageBuffer)
+        return false;
+
+    const size_t topicLength = strlen(topic);
+    if (topicLength > config.maxTopicLength || length > config.maxPayloadLength) {
+        ESP_LOGW("MQTT", "Message for %s too large for offline store (%u bytes)", topic, length);
+        return false;
+    }
+
+    RecordHeader header;
+    header.magic = kRecordMagic;
+    header.flags = (retain ? 1 : 0) | ((qos & 0x03) << 1);
+    header.topicLength = topicLength;
+    header.payloadLength = length;
+    time_t now = time(nullptr);
+    header.timestamp = (now >= kMinValidTime) ? now : 0;
+    const size_t recordSize = sizeof(header) + topicLength + length;
+
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    bool result = true;
+    if (pageLength + recordSize > config.pageSize)
+        result = FlushLocked();
+    if (result) {
+        if (pageLength == 0)
+            pageStartMs = millis();
+        memcpy(pageBuffer + pageLength, &header, sizeof(header));
+        memcpy(pageBuffer + pageLength + sizeof(header), topic, topicLength);
+        memcpy(pageBuffer + pageLength + sizeof(header) + topicLength, payload, length);
+        pageLength += recordSize;
+        stats.stored++;
+
+        if (config.flushIntervalMs && millis() - pageStartMs >= config.flushIntervalMs)
+            FlushLocked();
+    }
+    xSemaphoreGive(mutex);
+    return result;
+}
+
+bool MqttOfflineStore::Flush()
+{
+    if (!pageBuffer)
+        return false;
+
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    bool result = FlushLocked();
+    xSemaphoreGive(mutex);
+    return result;
+}
+
+bool MqttOfflineStore::ReplayBatch(size_t maxMessages, const ReplayCallback& callback)
+{
+    if (!pageBuffer)
+        return false;
+
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    // Everything goes through flash, so the order of messages is kept
+    FlushLocked();
+
+    const time_t now = time(nullptr);
+    size_t offered = 0;
+    bool stopped = false;
+    while (offered < maxMessages && !stopped && firstSegment != nextSegment) {
+        char path[32];
+        SegmentPath(firstSegment, path, sizeof(path));
+        File file = SPIFFS.open(path, FILE_READ);
+        if (file)
+            file.seek(readOffset);
+
+        while (offered < maxMessages && file) {
+            RecordHeader header;
+            if (file.read(reinterpret_cast<uint8_t*>(&header), sizeof(header)) != sizeof(header))
+                break;
+            const size_t bodySize = header.topicLength + header.payloadLength;
+            if (header.magic != kRecordMagic || header.topicLength > config.maxTopicLength ||
+                header.payloadLength > config.maxPayloadLength ||
+                file.read(reinterpret_cast<uint8_t*>(recordBuffer), bodySize) != bodySize) {
+                ESP_LOGE("MQTT", "Corrupted record in %s at %u, skipping rest of segment", path, readOffset);
+                break;
+            }
+
+            // Topic and payload are NUL-terminated for the callback
+            char* payload = recordBuffer + header.topicLength + 1;
+            memmove(payload, recordBuffer + header.topicLength, header.payloadLength);
+            recordBuffer[header.topicLength] = '\0';
+            payload[header.payloadLength] = '\0';
+
+            if (config.ttlSeconds && header.timestamp && now >= kMinValidTime && now - header.timestamp > config.ttlSeconds) {
+                stats.expired++;
+            } else {
+                offered++;
+                if (!callback(recordBuffer, payload, header.payloadLength, header.flags & 1, header.flags >> 1)) {
+                    stopped = true;
+                    break;
+                }
+                stats.replayed++;
+            }
+            readOffset += sizeof(header) + bodySize;
+        }
+
+        if (file)
+            file.close();
+        if (!stopped && offered < maxMessages) {
+            // Segment completely replayed (or unreadable)
+            RemoveSegmentLocked(firstSegment);
+        }
+    }
+
+    bool remaining = (firstSegment != nextSegment);
+    xSemaphoreGive(mutex);
+    return remaining;
+}
+
+MqttOfflineStore::Stats MqttOfflineStore::GetStats()
+{
+    Stats result;
+    if (!pageBuffer)
+        return result;
+
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    result = stats;
+    result.segments = nextSegment - firstSegment;
+    result.buffered = pageLength;
+    xSemaphoreGive(mutex);
+    return result;
+}
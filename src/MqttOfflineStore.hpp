@@ -0,0 +1,88 @@
+#pragma once
+
+#include <Esp32Logging.hpp>
+#include <functional>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+// Persistent store-and-forward buffer for MQTT messages published while offline.
+// Messages are collected in a RAM page and appended to log segment files on SPIFFS
+// once the page is full, so flash is written in page-sized chunks instead of per message.
+// Segments are append-only and rotated: when the maximum number of segments is reached,
+// the oldest one is discarded. After a reboot, partially replayed segments are replayed
+// again from their start (at-least-once delivery).
+class MqttOfflineStore {
+    public:
+        struct Config {
+            const char* directory = "/mqttq";
+            size_t pageSize = 1024;
+            size_t segmentSize = 16 * 1024;
+            size_t maxSegments = 4;
+            // Messages older than this are skipped on replay, 0 disables. Requires valid system time.
+            uint32_t ttlSeconds = 24 * 60 * 60;
+            // Buffered messages are flushed to flash at latest after this time, 0 disables
+            uint32_t flushIntervalMs = 30000;
+            size_t maxTopicLength = 128;
+            size_t maxPayloadLength = 512;
+        };
+
+        struct Stats {
+            uint32_t stored = 0;
+            uint32_t replayed = 0;
+            uint32_t expired = 0;
+            uint32_t droppedSegments = 0;
+            uint32_t pageWrites = 0;
+            size_t segments = 0;
+            size_t buffered = 0;
+        };
+
+        // Returns false to stop the replay, the message will be offered again next time
+        typedef std::function<bool(const char* topic, const char* payload, size_t length, bool retain, int qos)> ReplayCallback;
+
+        MqttOfflineStore() = default;
+        ~MqttOfflineStore();
+        MqttOfflineStore(const MqttOfflineStore&) = delete;
+        MqttOfflineStore& operator=(const MqttOfflineStore&) = delete;
+
+        // SPIFFS has to be mounted already
+        bool Begin(const Config& config);
+        bool IsActive() const { return pageBuffer != nullptr; }
+        bool IsEmpty();
+
+        bool Store(const char* topic, const char* payload, size_t length, bool retain, int qos);
+        // Writes buffered messages to flash, e.g. before going to deep sleep
+        bool Flush();
+        // Offers up to maxMessages of the oldest messages to callback. Returns true if messages are left.
+        bool ReplayBatch(size_t maxMessages, const ReplayCallback& callback);
+
+        Stats GetStats();
+
+    private:
+        struct RecordHeader {
+            uint16_t magic;
+            uint8_t flags;
+            uint8_t topicLength;
+            uint16_t payloadLength;
+            uint32_t timestamp;
+        } __attribute__((packed));
+
+        static constexpr uint16_t kRecordMagic = 0xBC01;
+
+        void SegmentPath(uint32_t segment, char* path, size_t pathSize) const;
+        bool FlushLocked();
+        void RemoveSegmentLocked(uint32_t segment);
+
+        Config config;
+        char* pageBuffer = nullptr;
+        size_t pageLength = 0;
+        uint32_t pageStartMs = 0;
+        // Holds one record while replaying
+        char* recordBuffer = nullptr;
+        // Segment files are numbered, [firstSegment, nextSegment) exist on flash
+        uint32_t firstSegment = 0;
+        uint32_t nextSegment = 0;
+        size_t writeSegmentSize = 0;
+        size_t readOffset = 0;
+        Stats stats;
+        SemaphoreHandle_t mutex = nullptr;
+};
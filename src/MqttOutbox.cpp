@@ -0,0 +1,207 @@
+#include "MqttOutbox.hpp"
+#include "HeapMonitor.hpp"
+
+#include <new>
+
+MqttOutbox::~MqttOutbox()
+{
+    heapFree(storage);
+    delete[] slots;
+    if (mutex)
+        vSemaphoreDelete(mutex);
+}
+
+bool MqttOutbox::Begin(const Config& config)
+{
+    if (storage) {
+        ESP_LOGW("MQTT", "Outbox already initialized");
+        return true;
+    }
+    if (config.capacity == 0 || config.maxTopicLength == 0) {
+        ESP_LOGE("MQTT", "Invalid outbox configuration");
+        return false;
+    }
+
+    this->config = config;
+    const size_t slotSize = SlotSize();
+    storage = static_cast<char*>(heapAllocate(HeapSubsystem::mqtt, (config.capacity + 1) * slotSize));
+    slots = new (std::nothrow) Slot[config.capacity + 1]();
+    mutex = xSemaphoreCreateMutex();
+    if (!storage || !slots || !mutex) {
+        ESP_LOGE("MQTT", "Could not allocate outbox with %u slots", config.capacity);
+        heapFree(storage);
+        delete[] slots;
+        storage = nullptr;
+        slots = nullptr;
+        return false;
+    }
+
+    ESP_LOGD("MQTT", "Outbox: %u slots of %u bytes, policy %i", config.capacity, slotSize, (int)config.dropPolicy);
+    return true;
+}
+
+char* MqttOutbox::TopicBuffer(size_t index) const
+{
+    return storage + index * SlotSize();
+}
+
+char* MqttOutbox::PayloadBuffer(size_t index) const
+{
+    return TopicBuffer(index) + config.maxTopicLength + 1;
+}
+
+void MqttOutbox::Store(size_t index, const char* topic, size_t topicLength, const char* payload, size_t length, bool retain,
+                       int qos, MqttPublishCallback callback)
+{
+    memcpy(TopicBuffer(index), topic, topicLength);
+    TopicBuffer(index)[topicLength] = '\0';
+    memcpy(PayloadBuffer(index), payload, length);
+    PayloadBuffer(index)[length] = '\0';
+    slots[index].topicLength = topicLength;
+    slots[index].payloadLength = length;
+    slots[index].retain = retain;
+    slots[index].qos = qos;
+    slots[index].callback = std::move(callback);
+    slots[index].sequence = ++nextSequence;
+}
+
+MqttPublishCallback MqttOutbox::TakeCallbackLocked(size_t index)
+{
+    MqttPublishCallback callback = std::move(slots[index].callback);
+    slots[index].callback = nullptr;
+    if (peekValid && index == head && slots[index].sequence == peekedSequence)
+        return nullptr;
+    return callback;
+}
+
+MqttPublishCallback MqttOutbox::DropOldestLocked()
+{
+    MqttPublishCallback callback = TakeCallbackLocked(head);
+    head = (head + 1) % config.capacity;
+    count--;
+    stats.dropped++;
+    return callback;
+}
+
+bool MqttOutbox::Enqueue(const char* topic, const char* payload, size_t length, bool retain,
+                         int qos /* = 0 */, MqttPublishCallback callback /* = nullptr */)
+{
+    if (!storage)
+        return false;
+
+    const size_t topicLength = strlen(topic);
+    if (topicLength > config.maxTopicLength || length > config.maxPayloadLength) {
+        ESP_LOGW("MQTT", "Message for %s too large for outbox (%u bytes)", topic, length);
+        xSemaphoreTake(mutex, portMAX_DELAY);
+        stats.dropped++;
+        xSemaphoreGive(mutex);
+        if (callback)
+            callback(-1, false, 0);
+        return false;
+    }
+
+    bool accepted = true;
+    // Called after releasing the lock, as it may enqueue again
+    MqttPublishCallback dropped;
+    xSemaphoreTake(mutex, portMAX_DELAY);
+
+    if (config.dropPolicy == DropPolicy::coalesceByTopic) {
+        for (size_t i = 0; i < count; i++) {
+            const size_t index = (head + i) % config.capacity;
+            if (slots[index].topicLength == topicLength && memcmp(TopicBuffer(index), topic, topicLength) == 0) {
+                // Keep the position in the queue, only the most recent value is of interest
+                dropped = TakeCallbackLocked(index);
+                Store(index, topic, topicLength, payload, length, retain, qos, std::move(callback));
+                stats.enqueued++;
+                stats.dropped++;
+                xSemaphoreGive(mutex);
+                if (dropped)
+                    dropped(-1, false, 0);
+                return true;
+            }
+        }
+    }
+
+    if (count == config.capacity) {
+        if (config.dropPolicy == DropPolicy::dropNewest) {
+            stats.dropped++;
+            accepted = false;
+            dropped = std::move(callback);
+        } else {
+            dropped = DropOldestLocked();
+        }
+    }
+
+    if (accepted) {
+        Store((head + count) % config.capacity, topic, topicLength, payload, length, retain, qos, std::move(callback));
+        count++;
+        stats.enqueued++;
+        if (count > stats.highWaterMark)
+            stats.highWaterMark = count;
+    }
+
+    xSemaphoreGive(mutex);
+    if (dropped)
+        dropped(-1, false, 0);
+    return accepted;
+}
+
+bool MqttOutbox::Peek(Message& message)
+{
+    if (!storage)
+        return false;
+
+    const size_t scratch = config.capacity;
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    if (count == 0) {
+        peekValid = false;
+        xSemaphoreGive(mutex);
+        return false;
+    }
+    // Copy out so that publishing can happen without holding the lock
+    const Slot& slot = slots[head];
+    Store(scratch, TopicBuffer(head), slot.topicLength, PayloadBuffer(head), slot.payloadLength, slot.retain, slot.qos, slot.callback);
+    peekedSequence = slot.sequence;
+    peekValid = true;
+    xSemaphoreGive(mutex);
+
+    message.topic = TopicBuffer(scratch);
+    message.payload = PayloadBuffer(scratch);
+    message.length = slots[scratch].payloadLength;
+    message.retain = slots[scratch].retain;
+    message.qos = slots[scratch].qos;
+    message.callback = slots[scratch].callback;
+    return true;
+}
+
+void MqttOutbox::Commit(bool sent)
+{
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    if (peekValid) {
+        if (sent)
+            stats.sent++;
+        else
+            stats.failed++;
+        // The message may have been dropped or coalesced while it was being published
+        if (count > 0 && slots[head].sequence == peekedSequence) {
+            slots[head].callback = nullptr;
+            head = (head + 1) % config.capacity;
+            count--;
+        }
+        peekValid = false;
+    }
+    xSemaphoreGive(mutex);
+}
+
+MqttOutbox::Stats MqttOutbox::GetStats() const
+{
+    Stats result;
+    if (!storage)
+        return result;
+
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    result = stats;
+    result.depth = count;
+    xSemaphoreGive(mutex);
+    return result;
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <Esp32Logging.hpp>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include "MqttDeliveryTracker.hpp"
+
+// Fixed-capacity ring buffer of MQTT messages. All slots are allocated once in Begin(),
+// so enqueueing takes a bounded amount of time. Only callbacks that do not fit into
+// std::function's inline storage allocate when they are stored.
+// Callbacks of dropped messages are called with delivered = false and a msgId of -1.
+class MqttOutbox {
+    public:
+        enum class DropPolicy {
+            dropOldest,         ///< Discard the oldest queued message to make room
+            dropNewest,         ///< Reject the message that is being enqueued
+            coalesceByTopic,    ///< Replace a queued message with the same topic, else drop the oldest
+        };
+
+        struct Config {
+            size_t capacity = 16;
+            size_t maxTopicLength = 128;
+            size_t maxPayloadLength = 512;
+            DropPolicy dropPolicy = DropPolicy::dropOldest;
+        };
+
+        struct Stats {
+            uint32_t enqueued = 0;
+            uint32_t sent = 0;
+            uint32_t dropped = 0;
+            uint32_t failed = 0;
+            size_t depth = 0;
+            size_t highWaterMark = 0;
+        };
+
+        // Copy of the oldest message, valid until the next call to Peek()
+        struct Message {
+            const char* topic;
+            const char* payload;
+            size_t length;
+            bool retain;
+            int qos;
+            MqttPublishCallback callback;
+        };
+
+        MqttOutbox() = default;
+        ~MqttOutbox();
+        MqttOutbox(const MqttOutbox&) = delete;
+        MqttOutbox& operator=(const MqttOutbox&) = delete;
+
+        bool Begin(const Config& config);
+        bool IsActive() const { return storage != nullptr; }
+        const Config& GetConfig() const { return config; }
+
+        // Returns false if the message was rejected (too large or dropped by the policy)
+        bool Enqueue(const char* topic, const char* payload, size_t length, bool retain,
+                     int qos = 0, MqttPublishCallback callback = nullptr);
+
+        // Copies the oldest message without removing it. Only to be called from the single drainer task.
+        bool Peek(Message& message);
+        // Removes the message returned by the last Peek() (unless it has been replaced in the mean time)
+        void Commit(bool sent);
+
+        Stats GetStats() const;
+
+    private:
+        struct Slot {
+            uint32_t sequence;
+            size_t topicLength;
+            size_t payloadLength;
+            bool retain;
+            int qos;
+            MqttPublishCallback callback;
+        };
+
+        // Topic and payload are both NUL-terminated
+        size_t SlotSize() const { return config.maxTopicLength + 1 + config.maxPayloadLength + 1; }
+        char* TopicBuffer(size_t index) const;
+        char* PayloadBuffer(size_t index) const;
+        void Store(size_t index, const char* topic, size_t topicLength, const char* payload, size_t length, bool retain,
+                   int qos, MqttPublishCallback callback);
+        MqttPublishCallback DropOldestLocked();
+        // Takes the callback out of the slot, unless the drainer is publishing that message and calls it itself
+        MqttPublishCallback TakeCallbackLocked(size_t index);
+
+        Config config;
+        // (capacity + 1) topic/payload buffers, the last one is the drainer's scratch copy
+        char* storage = nullptr;
+        Slot* slots = nullptr;
+        size_t head = 0;
+        size_t count = 0;
+        uint32_t nextSequence = 0;
+        uint32_t peekedSequence = 0;
+        bool peekValid = false;
+        Stats stats;
+        mutable SemaphoreHandle_t mutex = nullptr;
+};
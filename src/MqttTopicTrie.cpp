@@ -0,0 +1,127 @@
+#include "MqttTopicTrie.hpp"
+#include "HeapMonitor.hpp"
+
+MqttTopicTrie::Node::~Node()
+{
+    for (auto child : children)
+        delete child;
+    delete singleLevel;
+    delete multiLevel;
+    heapFree(level);
+}
+
+MqttTopicTrie::~MqttTopicTrie() = default;
+
+bool MqttTopicTrie::IsValidFilter(const char* topicFilter)
+{
+    if (!topicFilter || !*topicFilter)
+        return false;
+
+    for (const char* c = topicFilter; *c; c++) {
+        bool levelStart = (c == topicFilter || c[-1] == '/');
+        bool levelEnd = (c[1] == '\0' || c[1] == '/');
+        // Wildcards have to occupy a whole level, '#' additionally has to be the last one
+        if (*c == '+' && !(levelStart && levelEnd))
+            return false;
+        if (*c == '#' && !(levelStart && c[1] == '\0'))
+            return false;
+    }
+    return true;
+}
+
+MqttTopicTrie::Node* MqttTopicTrie::FindOrAddChild(Node* node, const char* level, size_t levelLength)
+{
+    for (auto child : node->children) {
+        if (child->levelLength == levelLength && memcmp(child->level, level, levelLength) == 0)
+            return child;
+    }
+
+    Node* child = new Node();
+    child->level = static_cast<char*>(heapAllocate(HeapSubsystem::mqtt, levelLength + 1));
+    memcpy(child->level, level, levelLength);
+    child->level[levelLength] = '\0';
+    child->levelLength = levelLength;
+    node->children.push_back(child);
+    return child;
+}
+
+bool MqttTopicTrie::Insert(const char* topicFilter, MqttMessageCallback callback)
+{
+    if (!IsValidFilter(topicFilter)) {
+        ESP_LOGE("MQTT", "Invalid topic filter: %s", topicFilter ? topicFilter : "(null)");
+        return false;
+    }
+
+    Node* node = &root;
+    const char* level = topicFilter;
+    while (true) {
+        const char* levelEnd = strchr(level, '/');
+        size_t levelLength = levelEnd ? (size_t)(levelEnd - level) : strlen(level);
+
+        if (levelLength == 1 && *level == '+') {
+            if (!node->singleLevel)
+                node->singleLevel = new Node();
+            node = node->singleLevel;
+        } else if (levelLength == 1 && *level == '#') {
+            if (!node->multiLevel)
+                node->multiLevel = new Node();
+            node = node->multiLevel;
+        } else {
+            node = FindOrAddChild(node, level, levelLength);
+        }
+
+        if (!levelEnd)
+            break;
+        level = levelEnd + 1;
+    }
+
+    node->callbacks.push_back(std::move(callback));
+    return true;
+}
+
+size_t MqttTopicTrie::Dispatch(const char* topic, size_t topicLength, const char* payload, size_t length) const
+{
+    if (topicLength == 0)
+        return 0;
+    return Match(&root, topic, topic + topicLength, true, topic, payload, length);
+}
+
+// level points to the start of the current topic level or is nullptr if all levels have been consumed
+size_t MqttTopicTrie::Match(const Node* node, const char* level, const char* topicEnd, bool isFirstLevel,
+                            const char* topic, const char* payload, size_t length) const
+{
+    size_t matched = 0;
+    // Wildcards on the first level must not match topics starting with '$' (e.g. $SYS)
+    bool wildcardsAllowed = !(isFirstLevel && level && level < topicEnd && *level == '$');
+
+    // '#' also matches the parent level itself ("a/#" matches "a")
+    if (node->multiLevel && wildcardsAllowed) {
+        for (const auto& callback : node->multiLevel->callbacks)
+            callback(topic, payload, length);
+        matched += node->multiLevel->callbacks.size();
+    }
+
+    if (!level) {
+        for (const auto& callback : node->callbacks)
+            callback(topic, payload, length);
+        return matched + node->callbacks.size();
+    }
+
+    const char* levelEnd = static_cast<const char*>(memchr(level, '/', topicEnd - level));
+    if (!levelEnd)
+        levelEnd = topicEnd;
+    const size_t levelLength = levelEnd - level;
+    const char* nextLevel = (levelEnd < topicEnd) ? levelEnd + 1 : nullptr;
+
+    for (auto child : node->children) {
+        if (child->levelLength == levelLength && memcmp(child->level, level, levelLength) == 0) {
+            matched += Match(child, nextLevel, topicEnd, false, topic, payload, length);
+            break;
+        }
+    }
+
+    if (node->singleLevel && wildcardsAllowed)
+        matched += Match(node->singleLevel, nextLevel, topicEnd, false, topic, payload, length);
+
+    return matched;
+}
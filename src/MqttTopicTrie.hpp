@@ -0,0 +1,44 @@
+#pragma once
+
+#include <Esp32Logging.hpp>
+#include <functional>
+#include <vector>
+
+// Called for every inbound message whose topic matches the subscribed filter.
+// The payload is NUL-terminated for convenience, but may contain binary data (see length).
+typedef std::function<void(const char* topic, const char* payload, size_t length)> MqttMessageCallback;
+
+// Prefix tree of MQTT topic filters, one node per topic level. Dispatch cost depends on the
+// number of levels of the incoming topic (and wildcards along the way), not on the number of
+// subscriptions. Supports the '+' (single level) and '#' (multi level) wildcards.
+class MqttTopicTrie {
+    public:
+        MqttTopicTrie() = default;
+        ~MqttTopicTrie();
+        MqttTopicTrie(const MqttTopicTrie&) = delete;
+        MqttTopicTrie& operator=(const MqttTopicTrie&) = delete;
+
+        // Returns false if topicFilter is not a valid MQTT topic filter
+        bool Insert(const char* topicFilter, MqttMessageCallback callback);
+        // Calls all callbacks matching topic, returns the number of callbacks called
+        size_t Dispatch(const char* topic, size_t topicLength, const char* payload, size_t length) const;
+
+        static bool IsValidFilter(const char* topicFilter);
+
+    private:
+        struct Node {
+            ~Node();
+            char* level = nullptr;
+            size_t levelLength = 0;
+            std::vector<Node*> children;
+            Node* singleLevel = nullptr;    // '+'
+            Node* multiLevel = nullptr;     // '#'
+            std::vector<MqttMessageCallback> callbacks;
+        };
+
+        static Node* FindOrAddChild(Node* node, const char* level, size_t levelLength);
+        size_t Match(const Node* node, const char* level, const char* topicEnd, bool isFirstLevel,
+                     const char* topic, const char* payload, size_t length) const;
+
+        Node root;
+};
@@ -5,17 +5,49 @@
    */
 
 #include "NetworkControl.hpp"
+#include "Hash.hpp"
+#include "Metrics.hpp"
 #ifdef BASECAMP_NETWORK_ETHERNET
 #include <ETH.h>
 #endif
+#include <esp_attr.h>
+#include <esp_timer.h>
+#include <esp_wifi.h>
 
 namespace {
 	const constexpr char* kLoggingTag = "BasecampNetwork";
 
 	// Minumum access point secret length to be generated (8 is min for ESP32)
 	const constexpr unsigned minApSecretLength = 8;
+	// Reconnects stay locked to the cached access point, give up on it after this many failures
+	const constexpr uint32_t kFastConnectReconnectAttempts = 3;
 #ifdef BASECAMP_NETWORK_ETHERNET
 	static bool eth_connected = false;
+#else
+	// The last successful connection. RTC memory survives restarts and deep sleep, not power loss.
+	struct FastConnectCache {
+		static constexpr uint32_t kMagic = 0x42434643;
+
+		uint32_t magic;
+		// Of SSID and password, the cache is only used for the same network
+		uint32_t credentialsHash;
+		uint8_t bssid[6];
+		uint8_t channel;
+		bool hasLease;
+		uint32_t ip;
+		uint32_t gateway;
+		uint32_t netmask;
+		uint32_t dns;
+	};
+	RTC_DATA_ATTR FastConnectCache fastConnectCache;
+
+	uint32_t credentialsHash(const String &essid, const String &password)
+	{
+		// The separator keeps "ab"/"c" apart from "a"/"bc"
+		uint32_t hash = basecampHash::fnv1a(essid.c_str(), essid.length());
+		hash = basecampHash::fnv1a("\n", 1, hash);
+		return basecampHash::fnv1a(password.c_str(), password.length(), hash);
+	}
 #endif
 }
 
@@ -25,14 +57,16 @@ void NetworkControl::begin(String essid, String password, String configured,
 #ifdef BASECAMP_NETWORK_ETHERNET
 	ESP_LOGI(kLoggingTag, "Connecting to Ethernet");
 	operationMode_ = Mode::client;
-	WiFi.onEvent(WiFiEvent);
+	WiFi.onEvent([this](WiFiEvent_t event, system_event_info_t) { WiFiEvent(event); });
 	ETH.begin() ;
 	ETH.setHostname(hostname.c_str());
 	ESP_LOGD(kLoggingTag, "Ethernet initialized") ;
-	ESP_LOGI(kLoggingTag, "Waiting for connection") ;
-	while (!eth_connected) {
-		Serial.print(".") ;
-		delay(100) ;
+	if (waitForConnection_) {
+		ESP_LOGI(kLoggingTag, "Waiting for connection") ;
+		while (!eth_connected) {
+			Serial.print(".") ;
+			delay(100) ;
+		}
 	}
 #else
 	ESP_LOGI(kLoggingTag, "Connecting to Wifi");
@@ -43,12 +77,12 @@ void NetworkControl::begin(String essid, String password, String configured,
 		_wifiAPName = "ESP32_" + getHardwareMacAddress();
 	}
 
-	WiFi.onEvent(WiFiEvent);
+	WiFi.onEvent([this](WiFiEvent_t event, system_event_info_t) { WiFiEvent(event); });
 	if (_wifiConfigured.equalsIgnoreCase("true")) {
 		operationMode_ = Mode::client;
 		ESP_LOGI(kLoggingTag, "Wifi is configured, connecting to '%s'", _wifiEssid.c_str());
 
-		WiFi.begin(_wifiEssid.c_str(), _wifiPassword.c_str());
+		connectWifi();
 		// TBD klären
 		// https://github.com/me-no-dev/ESPAsyncWebServer/issues/437
 		// https://github.com/espressif/arduino-esp32/issues/3157
@@ -74,6 +108,137 @@ void NetworkControl::begin(String essid, String password, String configured,
 
 }
 
+void NetworkControl::setReconnectBackoff(uint32_t minimumMs, uint32_t maximumMs)
+{
+	reconnectMinimumMs_ = minimumMs > 0 ? minimumMs : 1;
+	reconnectMaximumMs_ = maximumMs > reconnectMinimumMs_ ? maximumMs : reconnectMinimumMs_;
+}
+
+void NetworkControl::setStaticIp(IPAddress ip, IPAddress gateway, IPAddress netmask, IPAddress dns)
+{
+	staticIp_ = ip;
+	staticGateway_ = gateway;
+	staticNetmask_ = netmask;
+	// Usually the gateway also resolves names
+	staticDns_ = (static_cast<uint32_t>(dns) != 0) ? dns : gateway;
+	usesStaticIp_ = (static_cast<uint32_t>(ip) != 0);
+}
+
+#ifndef BASECAMP_NETWORK_ETHERNET
+void NetworkControl::connectWifi()
+{
+	const bool cached = (fastConnectCache.magic == FastConnectCache::kMagic &&
+		fastConnectCache.credentialsHash == credentialsHash(_wifiEssid, _wifiPassword));
+
+	connectTimings_ = {};
+	if (usesStaticIp_) {
+		WiFi.config(staticIp_, staticGateway_, staticNetmask_, staticDns_);
+	} else if (cached && reuseDhcpLease_ && fastConnectCache.hasLease) {
+		ESP_LOGD(kLoggingTag, "Reusing the previous DHCP lease");
+		WiFi.config(IPAddress(fastConnectCache.ip), IPAddress(fastConnectCache.gateway),
+			IPAddress(fastConnectCache.netmask), IPAddress(fastConnectCache.dns));
+		connectTimings_.reusedLease = true;
+	}
+
+	connecting_ = true;
+	connectStartUs_ = esp_timer_get_time();
+	if (cached) {
+		ESP_LOGD(kLoggingTag, "Connecting to the previous access point on channel %u", fastConnectCache.channel);
+		connectTimings_.fastConnect = true;
+		WiFi.begin(_wifiEssid.c_str(), _wifiPassword.c_str(), fastConnectCache.channel, fastConnectCache.bssid);
+	} else {
+		WiFi.begin(_wifiEssid.c_str(), _wifiPassword.c_str());
+	}
+}
+
+void NetworkControl::rememberConnection()
+{
+	const uint8_t *bssid = WiFi.BSSID();
+	if (!bssid) {
+		return;
+	}
+
+	FastConnectCache cache = {};
+	cache.magic = FastConnectCache::kMagic;
+	cache.credentialsHash = credentialsHash(_wifiEssid, _wifiPassword);
+	memcpy(cache.bssid, bssid, sizeof(cache.bssid));
+	cache.channel = WiFi.channel();
+	if (!usesStaticIp_) {
+		cache.hasLease = true;
+		cache.ip = WiFi.localIP();
+		cache.gateway = WiFi.gatewayIP();
+		cache.netmask = WiFi.subnetMask();
+		cache.dns = WiFi.dnsIP();
+	}
+	fastConnectCache = cache;
+}
+
+void NetworkControl::scheduleReconnect()
+{
+	if (reconnectPending_.exchange(true)) {
+		// Another attempt already failed while waiting
+		return;
+	}
+	if (!reconnectTimer_) {
+		esp_timer_create_args_t timerArgs = {};
+		timerArgs.callback = &reconnectTimerCallback;
+		timerArgs.arg = this;
+		timerArgs.name = "wifiReconnect";
+		if (esp_timer_create(&timerArgs, &reconnectTimer_) != ESP_OK) {
+			reconnectTimer_ = nullptr;
+			reconnectPending_ = false;
+			WiFi.reconnect();
+			return;
+		}
+	}
+
+	// Half of the backoff is fixed, the other half random ("equal jitter")
+	const uint32_t shift = reconnectAttempt_ < 16 ? reconnectAttempt_ : 16;
+	uint64_t backoffMs = static_cast<uint64_t>(reconnectMinimumMs_) << shift;
+	if (backoffMs > reconnectMaximumMs_) {
+		backoffMs = reconnectMaximumMs_;
+	}
+	const uint32_t delayMs = backoffMs / 2 + esp_random() % (backoffMs / 2 + 1);
+	reconnectAttempt_++;
+
+	ESP_LOGI(kLoggingTag, "WIFI reconnect attempt %u in %u ms", reconnectAttempt_, delayMs);
+	esp_timer_start_once(reconnectTimer_, static_cast<uint64_t>(delayMs) * 1000);
+}
+
+void NetworkControl::reconnectTimerCallback(void *networkControl)
+{
+	NetworkControl *self = static_cast<NetworkControl*>(networkControl);
+	self->reconnectPending_ = false;
+	// Not WiFi.reconnect(), disconnecting first would report another disconnect
+	esp_wifi_connect();
+}
+#endif
+
+void NetworkControl::setLinkUp(bool up)
+{
+	if (linkUp_.exchange(up) == up) {
+		return;
+	}
+	ESP_LOGI(kLoggingTag, "Link %s", up ? "up" : "down");
+	for (const auto &callback : linkChangeCallbacks_) {
+		callback(up);
+	}
+}
+
+void NetworkControl::clearBootCounter()
+{
+	if (bootCounterCleared_) {
+		return;
+	}
+	// Only once per boot, the events used to open the NVS namespace every time
+	Preferences preferences;
+	preferences.begin("basecamp", false);
+	if (preferences.getUInt("bootcounter", 0) != 0) {
+		preferences.putUInt("bootcounter", 0);
+	}
+	preferences.end();
+	bootCounterCleared_ = true;
+}
 
 bool NetworkControl::isConnected()
 {
@@ -114,11 +279,7 @@ String NetworkControl::getAPName() {
 
 void NetworkControl::WiFiEvent(WiFiEvent_t event)
 {
-	Preferences preferences;
-	preferences.begin("basecamp", false);
-	unsigned int __attribute__((unused)) bootCounter = preferences.getUInt("bootcounter", 0);
-	// In case somebody wants to know this..
-	ESP_LOGD(kLoggingTag, "WiFiEvent %d, Bootcounter is %d", event, bootCounter);
+	ESP_LOGD(kLoggingTag, "WiFiEvent %d", event);
 #ifdef BASECAMP_NETWORK_ETHERNET
 	switch (event) {
     case SYSTEM_EVENT_ETH_START:
@@ -130,14 +291,18 @@ void NetworkControl::WiFiEvent(WiFiEvent_t event)
     case SYSTEM_EVENT_ETH_GOT_IP:
 	  ESP_LOGI(kLoggingTag, "ETH Got IPv4 %s (%d Mbps, full duplex: %d, MAC %s)", ETH.localIP().toString().c_str(), ETH.linkSpeed(), ETH.fullDuplex(), ETH.macAddress().c_str());
       eth_connected = true;
+      clearBootCounter();
+      setLinkUp(true);
       break;
     case SYSTEM_EVENT_ETH_DISCONNECTED:
       ESP_LOGI(kLoggingTag, "ETH Disconnected");
       eth_connected = false;
+      setLinkUp(false);
       break;
     case SYSTEM_EVENT_ETH_STOP:
       ESP_LOGI(kLoggingTag, "ETH Stopped");
       eth_connected = false;
+      setLinkUp(false);
       break;
     default:
       break;
@@ -145,14 +310,54 @@ void NetworkControl::WiFiEvent(WiFiEvent_t event)
 #else
 	IPAddress ip __attribute__((unused));
 	switch(event) {
+		case SYSTEM_EVENT_STA_CONNECTED:
+			if (connecting_) {
+				connectTimings_.associatedUs = esp_timer_get_time() - connectStartUs_;
+			}
+			break;
 		case SYSTEM_EVENT_STA_GOT_IP:
 			ip = WiFi.localIP();
 			ESP_LOGI(kLoggingTag, "WIFI Got IPv4 address %u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
-			preferences.putUInt("bootcounter", 0);
+			clearBootCounter();
+			reconnectAttempt_ = 0;
+			{
+				static MetricCounter *gotIp = basecampMetrics.counter("basecamp_wifi_connects_total", "WiFi connections with an IP address");
+				gotIp->increment();
+			}
+			if (connecting_) {
+				connecting_ = false;
+				connectTimings_.gotIpUs = esp_timer_get_time() - connectStartUs_;
+				ESP_LOGI(kLoggingTag, "WIFI connected within %u us (associated after %u us, fast connect: %d, reused lease: %d)",
+					connectTimings_.gotIpUs, connectTimings_.associatedUs, connectTimings_.fastConnect, connectTimings_.reusedLease);
+				static MetricGauge *connectTime = basecampMetrics.gauge("basecamp_wifi_connect_duration_us", "Time from starting to connect until an IP address was available");
+				connectTime->set(connectTimings_.gotIpUs);
+			}
+			rememberConnection();
+			setLinkUp(true);
 			break;
 		case SYSTEM_EVENT_STA_DISCONNECTED:
 			ESP_LOGI(kLoggingTag, "WIFI Lost connection");
-			WiFi.reconnect();
+			{
+				static MetricCounter *disconnects = basecampMetrics.counter("basecamp_wifi_disconnects_total", "Lost WiFi connections");
+				disconnects->increment();
+			}
+			setLinkUp(false);
+			if (operationMode_ != Mode::client) {
+				break;
+			}
+			if ((connectTimings_.fastConnect || connectTimings_.reusedLease) &&
+				(connecting_ || reconnectAttempt_ >= kFastConnectReconnectAttempts)) {
+				// The access point moved, changed its channel or the lease is gone: forget it and scan
+				ESP_LOGW(kLoggingTag, "WIFI fast connect failed, falling back to a full scan");
+				fastConnectCache.magic = 0;
+				if (connectTimings_.reusedLease) {
+					// Zero addresses switch back to DHCP
+					WiFi.config(IPAddress(), IPAddress(), IPAddress());
+				}
+				connectWifi();
+				break;
+			}
+			scheduleReconnect();
 			break;
 		default:
 			// INFO: Default = do nothing
@@ -9,11 +9,15 @@
 
 #include <Esp32Logging.hpp>
 
+#include <atomic>
+#include <functional>
 #include <iomanip>
 #include <sstream>
+#include <vector>
 #include <WiFi.h>
 #include <WiFiClient.h>
 #include <Preferences.h>
+#include <esp_timer.h>
 
 class NetworkControl {
 	public:
@@ -23,21 +27,51 @@ class NetworkControl {
 			client,
 		};
 
+		// Called from the WiFi event task whenever the link goes up (with an IP address) or down
+		typedef std::function<void(bool up)> LinkChangeCallback;
+
 		NetworkControl(){};
 		bool connect();
 		bool disconnect();
 		static bool isConnected() ;
+		// Same as isConnected(), but only reads the state tracked from the link events
+		bool isLinkUp() const { return linkUp_; }
+		// Has to be called before begin()
+		void onLinkChange(LinkChangeCallback callback) { linkChangeCallbacks_.push_back(std::move(callback)); }
+		// After losing the connection, reconnect attempts are delayed exponentially from minimumMs
+		// up to maximumMs, with random jitter so devices sharing an access point do not retry in lockstep.
+		void setReconnectBackoff(uint32_t minimumMs, uint32_t maximumMs);
 
 		Mode getOperationMode() const;
 
+		// Time from starting to connect until the link was up, in microseconds
+		struct ConnectTimings {
+			uint32_t associatedUs = 0;
+			uint32_t gotIpUs = 0;
+			// Connected directly to the cached access point and channel, without scanning
+			bool fastConnect = false;
+			// The cached DHCP lease was used instead of asking the DHCP server
+			bool reusedLease = false;
+		};
+		const ConnectTimings& getConnectTimings() const { return connectTimings_; }
+
+		// Uses a fixed address instead of DHCP. Has to be called before begin().
+		void setStaticIp(IPAddress ip, IPAddress gateway, IPAddress netmask, IPAddress dns = IPAddress());
+		// Reuses the DHCP lease of the previous connection (kept in RTC memory across restarts
+		// and deep sleep) to skip DHCP. Only safe if the DHCP server keeps the lease reserved.
+		void setReuseDhcpLease(bool reuse) { reuseDhcpLease_ = reuse; }
+
 		void begin(String essid, String password = "", String configured = "False",
 							 String hostname = "BasecampDevice", String apSecret="");
+		// Whether the first connection resets the boot counter in NVS (default). Has to be called before begin().
+		void setClearBootCounter(bool clear) { bootCounterCleared_ = !clear; }
+		// Ethernet only: whether begin() blocks until the link is up (default)
+		void setWaitForConnection(bool wait) { waitForConnection_ = wait; }
 		IPAddress getIP();
 		IPAddress getSoftAPIP();
 		void setAPName(const String &name);
 		String getAPName();
 		int status();
-		static void WiFiEvent(WiFiEvent_t event);
 
 		unsigned getMinimumSecretLength() const;
 		String generateRandomSecret(unsigned length) const;
@@ -51,12 +85,47 @@ class NetworkControl {
 		String getSoftwareMacAddress(const String& delimiter = {});
 		String getBaseMacAddress(const String& delimiter = {});
 	private:
+		void WiFiEvent(WiFiEvent_t event);
+		void setLinkUp(bool up);
+		// Resets the boot counter once the first connection of this boot is up
+		void clearBootCounter();
+#ifndef BASECAMP_NETWORK_ETHERNET
+		// Connects directly if the last successful connection for these credentials is known
+		void connectWifi();
+		void rememberConnection();
+		void scheduleReconnect();
+		static void reconnectTimerCallback(void *networkControl);
+#endif
+
 		String _wifiEssid;
 		String _wifiPassword;
 		String _ap;
 		String _wifiAPName;
 
 		Mode operationMode_ = Mode::unconfigured;
+		bool waitForConnection_ = true;
+
+		IPAddress staticIp_;
+		IPAddress staticGateway_;
+		IPAddress staticNetmask_;
+		IPAddress staticDns_;
+		bool reuseDhcpLease_ = false;
+		bool usesStaticIp_ = false;
+
+		ConnectTimings connectTimings_;
+		int64_t connectStartUs_ = 0;
+		bool connecting_ = false;
+
+		std::atomic<bool> linkUp_{false};
+		std::vector<LinkChangeCallback> linkChangeCallbacks_;
+		bool bootCounterCleared_ = false;
+
+		uint32_t reconnectMinimumMs_ = 1000;
+		uint32_t reconnectMaximumMs_ = 60000;
+		uint32_t reconnectAttempt_ = 0;
+		esp_timer_handle_t reconnectTimer_ = nullptr;
+		// Set from the WiFi event task, cleared from the esp_timer task
+		std::atomic<bool> reconnectPending_{false};
 };
 
 #endif
@@ -0,0 +1,582 @@
+/*
+   Basecamp - ESP32 library to simplify the basics of IoT projects
+   Written by Merlin Schumacher (mls@ct.de) for c't magazin für computer technik (https://www.ct.de)
+   Licensed under GPLv3. See LICENSE for details.
+   */
+#include "OtaPipeline.hpp"
+#include "HeapMonitor.hpp"
+#include "Metrics.hpp"
+
+#include <algorithm>
+#include <Esp32Logging.hpp>
+#include <HTTPClient.h>
+#include <esp_timer.h>
+
+namespace {
+	const constexpr char* kLoggingTag = "BasecampOta";
+
+	const constexpr uint8_t kGzipMagic[] = {0x1f, 0x8b};
+	const constexpr uint8_t kGzipDeflate = 8;
+	const constexpr uint8_t kDeltaMagic[] = {'B', 'C', 'D', 'F'};
+	const constexpr uint8_t kDeltaVersion = 1;
+
+	// Delta operations
+	const constexpr uint8_t kOpEnd = 0x00;
+	const constexpr uint8_t kOpCopy = 0x01;
+	const constexpr uint8_t kOpInsert = 0x02;
+
+	// gzip header flags and the parts of the header they announce (RFC 1952)
+	const constexpr uint8_t kGzipHeaderCrc = 0x02;
+	const constexpr uint8_t kGzipExtra = 0x04;
+	const constexpr uint8_t kGzipName = 0x08;
+	const constexpr uint8_t kGzipComment = 0x10;
+	enum GzipStep : uint8_t {
+		gzipFixed,
+		gzipExtraLength,
+		gzipExtraData,
+		gzipName,
+		gzipComment,
+		gzipHeaderCrc,
+		gzipDone,
+	};
+	// Fixed part: ID1 ID2 CM FLG MTIME(4) XFL OS
+	const constexpr uint16_t kGzipFixedHeaderSize = 10;
+
+	uint32_t readLe32(const uint8_t *data)
+	{
+		return data[0] | (data[1] << 8) | (data[2] << 16) | (static_cast<uint32_t>(data[3]) << 24);
+	}
+
+	int hexValue(char c)
+	{
+		if (c >= '0' && c <= '9') {
+			return c - '0';
+		}
+		if (c >= 'a' && c <= 'f') {
+			return c - 'a' + 10;
+		}
+		if (c >= 'A' && c <= 'F') {
+			return c - 'A' + 10;
+		}
+		return -1;
+	}
+
+	// Lets HTTPClient::writeToStream() feed the pipeline. It handles chunked transfers as well.
+	class PipelineStream : public Stream {
+		public:
+			explicit PipelineStream(OtaPipeline &pipeline)
+				: pipeline_(pipeline)
+			{
+			}
+
+			size_t write(const uint8_t *buffer, size_t size) override {
+				// Anything less than size makes writeToStream() stop the download
+				return pipeline_.write(buffer, size) ? size : 0;
+			}
+			size_t write(uint8_t c) override { return write(&c, 1); }
+			int available() override { return 0; }
+			int read() override { return -1; }
+			int peek() override { return -1; }
+			void flush() override {}
+
+		private:
+			OtaPipeline &pipeline_;
+	};
+}
+
+bool OtaProgressLimiter::shouldReport(size_t done, size_t total)
+{
+	const int64_t now = esp_timer_get_time();
+	if ((total > 0 && done >= total) || now - lastReportUs_ >= intervalUs_) {
+		lastReportUs_ = now;
+		return true;
+	}
+	return false;
+}
+
+OtaPipeline::~OtaPipeline()
+{
+	abort();
+}
+
+bool OtaPipeline::parseSha256(const char* hex, uint8_t (&sha256)[32])
+{
+	if (!hex || strlen(hex) != 2 * sizeof(sha256)) {
+		return false;
+	}
+	for (size_t i = 0; i < sizeof(sha256); i++) {
+		const int high = hexValue(hex[2 * i]);
+		const int low = hexValue(hex[2 * i + 1]);
+		if (high < 0 || low < 0) {
+			return false;
+		}
+		sha256[i] = (high << 4) | low;
+	}
+	return true;
+}
+
+void OtaPipeline::onProgress(ProgressCallback callback, uint32_t intervalMs)
+{
+	progressCallback_ = std::move(callback);
+	progressLimiter_ = OtaProgressLimiter(intervalMs);
+}
+
+bool OtaPipeline::fail(const char* error)
+{
+	static MetricCounter *otaErrors = basecampMetrics.counter("basecamp_ota_errors_total", "Failed OTA updates");
+	otaErrors->increment();
+
+	ESP_LOGE(kLoggingTag, "Update failed: %s", error);
+	error_ = error;
+	abort();
+	return false;
+}
+
+bool OtaPipeline::begin(size_t imageSize, const uint8_t *expectedSha256)
+{
+	if (active_) {
+		ESP_LOGE(kLoggingTag, "An update is already running");
+		return false;
+	}
+
+	error_ = "";
+	source_ = esp_ota_get_running_partition();
+	target_ = esp_ota_get_next_update_partition(nullptr);
+	if (!target_) {
+		return fail("No OTA partition");
+	}
+	if (imageSize > target_->size) {
+		return fail("Image larger than the partition");
+	}
+
+	checkSha256_ = (expectedSha256 != nullptr);
+	if (checkSha256_) {
+		memcpy(expectedSha256_, expectedSha256, sizeof(expectedSha256_));
+	}
+	mbedtls_sha256_init(&sha_);
+	mbedtls_sha256_starts_ret(&sha_, 0);
+
+	// esp_ota_begin() is deferred to the first write, once a delta has announced the size
+	handle_ = 0;
+	imageSize_ = imageSize;
+	written_ = 0;
+	inputState_ = InputState::detect;
+	decodedState_ = DecodedState::detect;
+	magicLength_ = 0;
+	active_ = true;
+
+	ESP_LOGW(kLoggingTag, "Updating partition %s", target_->label);
+	return true;
+}
+
+void OtaPipeline::abort()
+{
+	if (!active_) {
+		return;
+	}
+	if (handle_) {
+		// Releases the handle, the boot partition stays as it is
+		esp_ota_end(handle_);
+		handle_ = 0;
+	}
+	mbedtls_sha256_free(&sha_);
+	releaseBuffers();
+	active_ = false;
+}
+
+void OtaPipeline::releaseBuffers()
+{
+	heapFree(inflator_);
+	inflator_ = nullptr;
+	heapFree(window_);
+	window_ = nullptr;
+	heapFree(copyBuffer_);
+	copyBuffer_ = nullptr;
+}
+
+bool OtaPipeline::write(const uint8_t *data, size_t length)
+{
+	if (!active_) {
+		return false;
+	}
+	return feedInput(data, length);
+}
+
+bool OtaPipeline::feedInput(const uint8_t *data, size_t length)
+{
+	while (length > 0) {
+		switch (inputState_) {
+			case InputState::detect:
+				magic_[magicLength_++] = *data++;
+				length--;
+				if (magicLength_ < sizeof(magic_)) {
+					break;
+				}
+				if (memcmp(magic_, kGzipMagic, sizeof(kGzipMagic)) == 0) {
+					inflator_ = static_cast<tinfl_decompressor*>(heapAllocate(HeapSubsystem::ota, sizeof(tinfl_decompressor)));
+					window_ = static_cast<uint8_t*>(heapAllocate(HeapSubsystem::ota, TINFL_LZ_DICT_SIZE));
+					if (!inflator_ || !window_) {
+						return fail("Not enough memory to inflate");
+					}
+					tinfl_init(inflator_);
+					windowOffset_ = 0;
+					gzipStep_ = gzipFixed;
+					gzipRead_ = sizeof(kGzipMagic);
+					inputState_ = InputState::gzipHeader;
+				} else {
+					inputState_ = InputState::raw;
+					if (!feedDecoded(magic_, magicLength_)) {
+						return false;
+					}
+				}
+				break;
+			case InputState::gzipHeader:
+				if (!parseGzipHeader(data, length)) {
+					return false;
+				}
+				break;
+			case InputState::inflate:
+				if (!inflate(data, length)) {
+					return false;
+				}
+				break;
+			case InputState::trailer:
+				// CRC-32 and size of the content, the SHA-256 covers that
+				return true;
+			case InputState::raw:
+				return feedDecoded(data, length);
+		}
+	}
+	return true;
+}
+
+bool OtaPipeline::parseGzipHeader(const uint8_t *&data, size_t &length)
+{
+	while (true) {
+		// Skip the optional parts not announced by the flags
+		if ((gzipStep_ == gzipExtraLength && !(gzipFlags_ & kGzipExtra)) ||
+			(gzipStep_ == gzipName && !(gzipFlags_ & kGzipName)) ||
+			(gzipStep_ == gzipComment && !(gzipFlags_ & kGzipComment)) ||
+			(gzipStep_ == gzipHeaderCrc && !(gzipFlags_ & kGzipHeaderCrc))) {
+			gzipStep_ = (gzipStep_ == gzipExtraLength) ? gzipName : gzipStep_ + 1;
+			gzipRead_ = 0;
+			continue;
+		}
+		if (gzipStep_ == gzipDone) {
+			inputState_ = InputState::inflate;
+			return true;
+		}
+		if (length == 0) {
+			return true;
+		}
+
+		const uint8_t c = *data++;
+		length--;
+		switch (gzipStep_) {
+			case gzipFixed:
+				if (gzipRead_ == 2 && c != kGzipDeflate) {
+					return fail("Unsupported gzip compression method");
+				}
+				if (gzipRead_ == 3) {
+					gzipFlags_ = c;
+				}
+				if (++gzipRead_ == kGzipFixedHeaderSize) {
+					gzipStep_ = gzipExtraLength;
+					gzipRead_ = 0;
+				}
+				break;
+			case gzipExtraLength:
+				gzipSkip_ = (gzipRead_ == 0) ? c : gzipSkip_ | (c << 8);
+				if (++gzipRead_ == 2) {
+					gzipStep_ = (gzipSkip_ > 0) ? gzipExtraData : gzipName;
+					gzipRead_ = 0;
+				}
+				break;
+			case gzipExtraData:
+				if (--gzipSkip_ == 0) {
+					gzipStep_ = gzipName;
+				}
+				break;
+			case gzipName:
+			case gzipComment:
+				// Zero terminated
+				if (c == 0) {
+					gzipStep_++;
+				}
+				break;
+			case gzipHeaderCrc:
+				if (++gzipRead_ == 2) {
+					gzipStep_ = gzipDone;
+				}
+				break;
+		}
+	}
+}
+
+bool OtaPipeline::inflate(const uint8_t *&data, size_t &length)
+{
+	while (true) {
+		size_t inBytes = length;
+		size_t outBytes = TINFL_LZ_DICT_SIZE - windowOffset_;
+		// The window doubles as the output buffer, it wraps around
+		const tinfl_status status = tinfl_decompress(inflator_, data, &inBytes, window_, window_ + windowOffset_, &outBytes,
+			TINFL_FLAG_HAS_MORE_INPUT);
+		data += inBytes;
+		length -= inBytes;
+
+		if (outBytes > 0) {
+			if (!feedDecoded(window_ + windowOffset_, outBytes)) {
+				return false;
+			}
+			windowOffset_ = (windowOffset_ + outBytes) & (TINFL_LZ_DICT_SIZE - 1);
+		}
+		if (status < TINFL_STATUS_DONE) {
+			return fail("Corrupt gzip data");
+		}
+		if (status == TINFL_STATUS_DONE) {
+			heapFree(inflator_);
+			inflator_ = nullptr;
+			heapFree(window_);
+			window_ = nullptr;
+			inputState_ = InputState::trailer;
+			return true;
+		}
+		if (status == TINFL_STATUS_NEEDS_MORE_INPUT) {
+			return true;
+		}
+		// TINFL_STATUS_HAS_MORE_OUTPUT: continue after the window has been passed on
+	}
+}
+
+bool OtaPipeline::feedDecoded(const uint8_t *data, size_t length)
+{
+	while (length > 0) {
+		switch (decodedState_) {
+			case DecodedState::detect:
+				// Application images start with 0xE9, so the first byte is enough
+				if (*data == kDeltaMagic[0]) {
+					decodedState_ = DecodedState::deltaHeader;
+					decodedHeaderLength_ = 0;
+					decodedHeaderNeeded_ = kDeltaHeaderSize;
+				} else {
+					decodedState_ = DecodedState::raw;
+				}
+				break;
+			case DecodedState::deltaHeader:
+			case DecodedState::deltaArguments: {
+				const size_t chunk = std::min(decodedHeaderNeeded_ - decodedHeaderLength_, length);
+				memcpy(decodedHeader_ + decodedHeaderLength_, data, chunk);
+				decodedHeaderLength_ += chunk;
+				data += chunk;
+				length -= chunk;
+				if (decodedHeaderLength_ < decodedHeaderNeeded_) {
+					break;
+				}
+				const bool success = (decodedState_ == DecodedState::deltaHeader) ? startDelta() : runDeltaOp();
+				if (!success) {
+					return false;
+				}
+				break;
+			}
+			case DecodedState::deltaOp:
+				deltaOp_ = *data++;
+				length--;
+				decodedHeaderLength_ = 0;
+				if (deltaOp_ == kOpEnd) {
+					decodedState_ = DecodedState::deltaEnd;
+				} else if (deltaOp_ == kOpCopy) {
+					decodedState_ = DecodedState::deltaArguments;
+					decodedHeaderNeeded_ = 8;
+				} else if (deltaOp_ == kOpInsert) {
+					decodedState_ = DecodedState::deltaArguments;
+					decodedHeaderNeeded_ = 4;
+				} else {
+					return fail("Corrupt delta");
+				}
+				break;
+			case DecodedState::deltaInsert: {
+				const size_t chunk = std::min<size_t>(insertRemaining_, length);
+				if (!writeImage(data, chunk)) {
+					return false;
+				}
+				insertRemaining_ -= chunk;
+				data += chunk;
+				length -= chunk;
+				if (insertRemaining_ == 0) {
+					decodedState_ = DecodedState::deltaOp;
+				}
+				break;
+			}
+			case DecodedState::deltaEnd:
+				return fail("Data after the end of the delta");
+			case DecodedState::raw:
+				return writeImage(data, length);
+		}
+	}
+	return true;
+}
+
+bool OtaPipeline::startDelta()
+{
+	if (memcmp(decodedHeader_, kDeltaMagic, sizeof(kDeltaMagic)) != 0 || decodedHeader_[4] != kDeltaVersion) {
+		return fail("Unsupported delta format");
+	}
+
+	const uint32_t targetSize = readLe32(decodedHeader_ + 8);
+	if (targetSize > target_->size || (imageSize_ > 0 && imageSize_ != targetSize)) {
+		return fail("Invalid delta image size");
+	}
+	imageSize_ = targetSize;
+
+	// With an appended digest IDF returns that digest, i.e. the hash of the image without its last
+	// 32 bytes, otherwise the hash of the whole image. otadelta.py writes the same.
+	uint8_t runningSha256[32];
+	if (!source_ || esp_partition_get_sha256(source_, runningSha256) != ESP_OK ||
+		memcmp(runningSha256, decodedHeader_ + 12, sizeof(runningSha256)) != 0) {
+		return fail("Delta was not created against the running firmware");
+	}
+
+	copyBuffer_ = static_cast<uint8_t*>(heapAllocate(HeapSubsystem::ota, kCopyBufferSize));
+	if (!copyBuffer_) {
+		return fail("Not enough memory to apply the delta");
+	}
+	decodedState_ = DecodedState::deltaOp;
+	return true;
+}
+
+bool OtaPipeline::runDeltaOp()
+{
+	if (deltaOp_ == kOpInsert) {
+		insertRemaining_ = readLe32(decodedHeader_);
+		decodedState_ = (insertRemaining_ > 0) ? DecodedState::deltaInsert : DecodedState::deltaOp;
+		return true;
+	}
+
+	uint32_t offset = readLe32(decodedHeader_);
+	uint32_t remaining = readLe32(decodedHeader_ + 4);
+	if (remaining > source_->size || offset > source_->size - remaining) {
+		return fail("Delta copies beyond the running firmware");
+	}
+	while (remaining > 0) {
+		const size_t chunk = (remaining < kCopyBufferSize) ? remaining : kCopyBufferSize;
+		if (esp_partition_read(source_, offset, copyBuffer_, chunk) != ESP_OK) {
+			return fail("Reading the running firmware failed");
+		}
+		if (!writeImage(copyBuffer_, chunk)) {
+			return false;
+		}
+		offset += chunk;
+		remaining -= chunk;
+	}
+	decodedState_ = DecodedState::deltaOp;
+	return true;
+}
+
+bool OtaPipeline::writeImage(const uint8_t *data, size_t length)
+{
+	if (length == 0) {
+		return true;
+	}
+	if ((imageSize_ > 0 && written_ + length > imageSize_) || written_ + length > target_->size) {
+		return fail("Image larger than announced");
+	}
+	if (!handle_) {
+		// Only the announced size is erased, the whole partition if it is unknown
+		if (esp_ota_begin(target_, imageSize_ > 0 ? imageSize_ : OTA_SIZE_UNKNOWN, &handle_) != ESP_OK) {
+			handle_ = 0;
+			return fail("esp_ota_begin failed");
+		}
+	}
+	if (esp_ota_write(handle_, data, length) != ESP_OK) {
+		return fail("Writing the partition failed");
+	}
+	mbedtls_sha256_update_ret(&sha_, data, length);
+	written_ += length;
+
+	if (progressLimiter_.shouldReport(written_, imageSize_)) {
+		static MetricGauge *otaProgress = basecampMetrics.gauge("basecamp_ota_progress_percent", "Progress of the running OTA update");
+		otaProgress->set(OtaProgressLimiter::percent(written_, imageSize_));
+		if (imageSize_ > 0) {
+			ESP_LOGI(kLoggingTag, "Progress: %u of %u bytes (%u%%)", written_, imageSize_, OtaProgressLimiter::percent(written_, imageSize_));
+		} else {
+			ESP_LOGI(kLoggingTag, "Progress: %u bytes", written_);
+		}
+		if (progressCallback_) {
+			progressCallback_(written_, imageSize_);
+		}
+	}
+	return true;
+}
+
+bool OtaPipeline::end()
+{
+	if (!active_) {
+		return false;
+	}
+
+	// Images shorter than the magic
+	if (inputState_ == InputState::detect && magicLength_ > 0) {
+		inputState_ = InputState::raw;
+		if (!feedDecoded(magic_, magicLength_)) {
+			return false;
+		}
+	}
+	if (inputState_ == InputState::gzipHeader || inputState_ == InputState::inflate) {
+		return fail("Truncated gzip data");
+	}
+	if (decodedState_ != DecodedState::raw && decodedState_ != DecodedState::deltaEnd) {
+		return fail(written_ == 0 ? "No data" : "Truncated delta");
+	}
+	if (!handle_ || (imageSize_ > 0 && written_ != imageSize_)) {
+		return fail("Image smaller than announced");
+	}
+
+	uint8_t sha256[32];
+	mbedtls_sha256_finish_ret(&sha_, sha256);
+	if (checkSha256_ && memcmp(sha256, expectedSha256_, sizeof(sha256)) != 0) {
+		return fail("SHA-256 mismatch");
+	}
+
+	// Checks the image itself
+	const esp_err_t result = esp_ota_end(handle_);
+	handle_ = 0;
+	if (result != ESP_OK) {
+		return fail("Invalid image");
+	}
+	if (esp_ota_set_boot_partition(target_) != ESP_OK) {
+		return fail("Activating the partition failed");
+	}
+
+	mbedtls_sha256_free(&sha_);
+	releaseBuffers();
+	active_ = false;
+	ESP_LOGW(kLoggingTag, "Update of %u bytes written to %s, it is used after a restart", written_, target_->label);
+	return true;
+}
+
+bool OtaPipeline::pull(const char* url, const uint8_t (&expectedSha256)[32])
+{
+	HTTPClient http;
+	if (!http.begin(url)) {
+		return fail("Invalid URL");
+	}
+	const int status = http.GET();
+	if (status != HTTP_CODE_OK) {
+		ESP_LOGE(kLoggingTag, "Download of %s failed with %d", url, status);
+		http.end();
+		return fail("Download failed");
+	}
+	if (!begin(0, expectedSha256)) {
+		http.end();
+		return false;
+	}
+
+	PipelineStream stream(*this);
+	const int result = http.writeToStream(&stream);
+	http.end();
+	if (result < 0) {
+		// The pipeline may have failed already and reported why
+		return active_ ? fail("Download interrupted") : false;
+	}
+	return end();
+}
@@ -0,0 +1,148 @@
+/*
+   Basecamp - ESP32 library to simplify the basics of IoT projects
+   Written by Merlin Schumacher (mls@ct.de) for c't magazin für computer technik (https://www.ct.de)
+   Licensed under GPLv3. See LICENSE for details.
+   */
+
+#ifndef OtaPipeline_h
+#define OtaPipeline_h
+
+#include <functional>
+#include <Arduino.h>
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#include <mbedtls/sha256.h>
+#include <rom/miniz.h>
+
+// Limits progress reports to one per interval, plus the final one
+class OtaProgressLimiter {
+	public:
+		explicit OtaProgressLimiter(uint32_t intervalMs = 1000)
+			: intervalUs_(static_cast<int64_t>(intervalMs) * 1000)
+		{
+		}
+
+		bool shouldReport(size_t done, size_t total);
+		// 0 if total is unknown
+		static unsigned percent(size_t done, size_t total) {
+			return total > 0 ? static_cast<uint64_t>(done) * 100 / total : 0;
+		}
+
+	private:
+		int64_t intervalUs_;
+		int64_t lastReportUs_ = 0;
+};
+
+// Streams an update into the next OTA partition. The format is detected from the data:
+// - a plain application image,
+// - gzip (e.g. "gzip -9 firmware.bin"), inflated with the ROM inflater and a 32 KiB window,
+// - a delta against the running image, as written by otadelta.py, optionally gzipped as well.
+// The SHA-256 of the resulting image is computed while writing and checked before the
+// partition is activated.
+//
+// Delta format, all numbers little endian:
+//   header: "BCDF", u8 version (1), 3 reserved bytes, u32 size of the resulting image,
+//           SHA-256 of the image the delta was created against (32 bytes)
+//   ops:    0x01 COPY   u32 offset, u32 length  - copy from the running image
+//           0x02 INSERT u32 length, data         - take the following bytes
+//           0x00 END
+class OtaPipeline {
+	public:
+		// written and total are bytes of the resulting image, total is 0 while unknown
+		typedef std::function<void(size_t written, size_t total)> ProgressCallback;
+
+		OtaPipeline() = default;
+		~OtaPipeline();
+		OtaPipeline(const OtaPipeline&) = delete;
+		OtaPipeline& operator=(const OtaPipeline&) = delete;
+
+		// imageSize (for progress reports) may be 0 if unknown. Without expectedSha256 only
+		// the checks of esp_ota_end() are done.
+		bool begin(size_t imageSize = 0, const uint8_t *expectedSha256 = nullptr);
+		bool write(const uint8_t *data, size_t length);
+		// Verifies the image and makes it the boot partition, restart afterwards
+		bool end();
+		void abort();
+		bool isActive() const { return active_; }
+
+		// Downloads the update via HTTP(S) and applies it. The checksum is required as the
+		// server certificate is not verified.
+		bool pull(const char* url, const uint8_t (&expectedSha256)[32]);
+
+		// Rate-limited, called from the task calling write()
+		void onProgress(ProgressCallback callback, uint32_t intervalMs = 1000);
+
+		// Description of the last failure
+		const char* getError() const { return error_; }
+
+		// Parses 64 hex digits
+		static bool parseSha256(const char* hex, uint8_t (&sha256)[32]);
+
+	private:
+		enum class InputState : uint8_t {
+			detect,
+			gzipHeader,
+			inflate,
+			trailer,
+			raw,
+		};
+		enum class DecodedState : uint8_t {
+			detect,
+			deltaHeader,
+			deltaOp,
+			deltaArguments,
+			deltaInsert,
+			deltaEnd,
+			raw,
+		};
+
+		static constexpr size_t kDeltaHeaderSize = 44;
+		static constexpr size_t kCopyBufferSize = 1024;
+
+		bool fail(const char* error);
+		bool feedInput(const uint8_t *data, size_t length);
+		bool parseGzipHeader(const uint8_t *&data, size_t &length);
+		bool inflate(const uint8_t *&data, size_t &length);
+		bool feedDecoded(const uint8_t *data, size_t length);
+		bool startDelta();
+		bool runDeltaOp();
+		bool writeImage(const uint8_t *data, size_t length);
+		void releaseBuffers();
+
+		bool active_ = false;
+		const char* error_ = "";
+		esp_ota_handle_t handle_ = 0;
+		const esp_partition_t *target_ = nullptr;
+		const esp_partition_t *source_ = nullptr;
+		mbedtls_sha256_context sha_;
+		uint8_t expectedSha256_[32];
+		bool checkSha256_ = false;
+		size_t imageSize_ = 0;
+		size_t written_ = 0;
+
+		InputState inputState_ = InputState::detect;
+		DecodedState decodedState_ = DecodedState::detect;
+		// The first two bytes tell gzip from everything else
+		uint8_t magic_[2];
+		size_t magicLength_ = 0;
+		uint8_t gzipStep_ = 0;
+		uint8_t gzipFlags_ = 0;
+		uint16_t gzipRead_ = 0;
+		uint16_t gzipSkip_ = 0;
+		// Delta header or op arguments being collected
+		uint8_t decodedHeader_[kDeltaHeaderSize];
+		size_t decodedHeaderLength_ = 0;
+		size_t decodedHeaderNeeded_ = 0;
+		uint8_t deltaOp_ = 0;
+		uint32_t insertRemaining_ = 0;
+
+		tinfl_decompressor *inflator_ = nullptr;
+		uint8_t *window_ = nullptr;
+		size_t windowOffset_ = 0;
+		uint8_t *copyBuffer_ = nullptr;
+
+		ProgressCallback progressCallback_;
+		OtaProgressLimiter progressLimiter_;
+};
+
+#endif
@@ -0,0 +1,240 @@
+/*
+   Basecamp - ESP32 library to simplify the basics of IoT projects
+   Written by Merlin Schumacher (mls@ct.de) for c't magazin für computer technik (https://www.ct.de)
+   Licensed under GPLv3. See LICENSE for details.
+   */
+#include "Scheduler.hpp"
+
+#include <Esp32Logging.hpp>
+#include <esp_timer.h>
+
+namespace {
+	const constexpr char* kLoggingTag = "BasecampScheduler";
+}
+
+Scheduler basecampScheduler;
+
+Scheduler::Scheduler()
+	: mutex_(xSemaphoreCreateMutex())
+{
+	for (auto &timer : timers_) {
+		timer.id = kNoTimer;
+	}
+}
+
+Scheduler::TimerId Scheduler::every(uint32_t intervalMs, Callback callback)
+{
+	return addTimer(intervalMs, intervalMs > 0 ? intervalMs : 1, std::move(callback));
+}
+
+Scheduler::TimerId Scheduler::after(uint32_t delayMs, Callback callback)
+{
+	return addTimer(delayMs, 0, std::move(callback));
+}
+
+Scheduler::TimerId Scheduler::addTimer(uint32_t delayMs, uint32_t intervalMs, Callback callback)
+{
+	if (!start()) {
+		return kNoTimer;
+	}
+
+	xSemaphoreTake(mutex_, portMAX_DELAY);
+	Timer *timer = find(kNoTimer);
+	if (!timer) {
+		xSemaphoreGive(mutex_);
+		ESP_LOGE(kLoggingTag, "All %u timers in use", kMaxTimers);
+		return kNoTimer;
+	}
+
+	const TimerId id = nextId_;
+	// Ids wrap around, skipping kNoTimer
+	nextId_ = (nextId_ == UINT16_MAX) ? 1 : nextId_ + 1;
+	timer->id = id;
+	timer->intervalMs = intervalMs;
+	timer->dueUs = esp_timer_get_time() + static_cast<int64_t>(delayMs) * 1000;
+	timer->callback = std::move(callback);
+	xSemaphoreGive(mutex_);
+
+	wake();
+	return id;
+}
+
+Scheduler::Timer* Scheduler::find(TimerId timer)
+{
+	for (auto &candidate : timers_) {
+		if (candidate.id == timer) {
+			return &candidate;
+		}
+	}
+	return nullptr;
+}
+
+bool Scheduler::reschedule(TimerId timer, uint32_t delayMs)
+{
+	if (timer == kNoTimer) {
+		return false;
+	}
+
+	xSemaphoreTake(mutex_, portMAX_DELAY);
+	Timer *found = find(timer);
+	if (found) {
+		found->dueUs = esp_timer_get_time() + static_cast<int64_t>(delayMs) * 1000;
+		if (found->intervalMs > 0) {
+			found->intervalMs = delayMs > 0 ? delayMs : 1;
+		}
+	}
+	xSemaphoreGive(mutex_);
+
+	if (found) {
+		wake();
+	}
+	return found != nullptr;
+}
+
+void Scheduler::cancel(TimerId timer)
+{
+	if (timer == kNoTimer) {
+		return;
+	}
+
+	Callback callback;
+	xSemaphoreTake(mutex_, portMAX_DELAY);
+	Timer *found = find(timer);
+	if (found) {
+		found->id = kNoTimer;
+		callback = std::move(found->callback);
+		found->callback = nullptr;
+	}
+	xSemaphoreGive(mutex_);
+	// The callback and everything it captured is destroyed here, outside the lock
+}
+
+bool Scheduler::post(Callback callback)
+{
+	if (!start()) {
+		return false;
+	}
+
+	xSemaphoreTake(mutex_, portMAX_DELAY);
+	if (postedCount_ == kMaxPosted) {
+		xSemaphoreGive(mutex_);
+		ESP_LOGW(kLoggingTag, "Too much posted work, dropping");
+		return false;
+	}
+	posted_[(postedFirst_ + postedCount_) % kMaxPosted] = std::move(callback);
+	postedCount_++;
+	xSemaphoreGive(mutex_);
+
+	wake();
+	return true;
+}
+
+bool Scheduler::start()
+{
+	if (task_) {
+		return true;
+	}
+
+	xSemaphoreTake(mutex_, portMAX_DELAY);
+	if (!task_) {
+		startTask(&Task, "Scheduler", placement_, this, &task_);
+	}
+	xSemaphoreGive(mutex_);
+	return task_ != nullptr;
+}
+
+void Scheduler::setTaskPlacement(const TaskPlacement &placement)
+{
+	xSemaphoreTake(mutex_, portMAX_DELAY);
+	placement_ = placement;
+	if (task_) {
+		vTaskPrioritySet(task_, placement.priority);
+		ESP_LOGW(kLoggingTag, "Already running, only the priority was changed");
+	}
+	xSemaphoreGive(mutex_);
+}
+
+void Scheduler::wake()
+{
+	xTaskNotifyGive(task_);
+}
+
+void Scheduler::Task(void *schedulerPointer)
+{
+	static_cast<Scheduler*>(schedulerPointer)->run();
+}
+
+void Scheduler::run()
+{
+	while (true) {
+		const TickType_t sleep = runNext();
+		if (sleep > 0) {
+			// Every wake() ends the sleep early to pick up new timers and posted work
+			ulTaskNotifyTake(pdTRUE, sleep);
+		}
+	}
+}
+
+TickType_t Scheduler::runNext()
+{
+	Callback callback;
+	xSemaphoreTake(mutex_, portMAX_DELAY);
+
+	// Posted work first, it is usually a reaction to an event
+	if (postedCount_ > 0) {
+		callback = std::move(posted_[postedFirst_]);
+		posted_[postedFirst_] = nullptr;
+		postedFirst_ = (postedFirst_ + 1) % kMaxPosted;
+		postedCount_--;
+		xSemaphoreGive(mutex_);
+		callback();
+		return 0;
+	}
+
+	Timer *next = nullptr;
+	for (auto &timer : timers_) {
+		if (timer.id != kNoTimer && timer.callback && (!next || timer.dueUs < next->dueUs)) {
+			next = &timer;
+		}
+	}
+	if (!next) {
+		xSemaphoreGive(mutex_);
+		return portMAX_DELAY;
+	}
+
+	const int64_t now = esp_timer_get_time();
+	if (next->dueUs > now) {
+		const TickType_t sleep = pdMS_TO_TICKS((next->dueUs - now + 999) / 1000);
+		xSemaphoreGive(mutex_);
+		return sleep > 0 ? sleep : 1;
+	}
+
+	// The callback is moved out while it runs, so it may cancel or reschedule its own timer
+	const TimerId id = next->id;
+	const bool repeating = next->intervalMs > 0;
+	callback = std::move(next->callback);
+	next->callback = nullptr;
+	if (repeating) {
+		next->dueUs += static_cast<int64_t>(next->intervalMs) * 1000;
+		if (next->dueUs <= now) {
+			// Fell behind, skip the missed runs instead of catching up in a burst
+			next->dueUs = now + static_cast<int64_t>(next->intervalMs) * 1000;
+		}
+	} else {
+		next->id = kNoTimer;
+	}
+	xSemaphoreGive(mutex_);
+
+	callback();
+
+	if (repeating) {
+		xSemaphoreTake(mutex_, portMAX_DELAY);
+		// Unless it was cancelled meanwhile
+		Timer *timer = find(id);
+		if (timer && !timer->callback) {
+			timer->callback = std::move(callback);
+		}
+		xSemaphoreGive(mutex_);
+	}
+	return 0;
+}
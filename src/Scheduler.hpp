@@ -0,0 +1,87 @@
+/*
+   Basecamp - ESP32 library to simplify the basics of IoT projects
+   Written by Merlin Schumacher (mls@ct.de) for c't magazin für computer technik (https://www.ct.de)
+   Licensed under GPLv3. See LICENSE for details.
+   */
+
+#ifndef Scheduler_h
+#define Scheduler_h
+
+#include <functional>
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include "TaskPlacement.hpp"
+
+// Runs timers and posted work for Basecamp's services on one task instead of a task per
+// service. The task sleeps until the next timer is due or work is posted, so posting from
+// an event handler wakes it right away. The task is created on first use.
+//
+// Callbacks run one after another and must not block for long: everything else hosted
+// here waits for them.
+class Scheduler {
+	public:
+		typedef std::function<void()> Callback;
+		typedef uint16_t TimerId;
+
+		static constexpr TimerId kNoTimer = 0;
+		static constexpr size_t kMaxTimers = 12;
+		static constexpr size_t kMaxPosted = 8;
+
+		Scheduler();
+		Scheduler(const Scheduler&) = delete;
+		Scheduler& operator=(const Scheduler&) = delete;
+
+		// Calls callback every intervalMs, the first time after intervalMs.
+		// Returns kNoTimer if all timers are in use.
+		TimerId every(uint32_t intervalMs, Callback callback);
+		// Calls callback once after delayMs
+		TimerId after(uint32_t delayMs, Callback callback);
+		// Restarts the timer: it is due delayMs from now, repeating timers continue with that interval.
+		// Returns false if the timer does not exist (anymore).
+		bool reschedule(TimerId timer, uint32_t delayMs);
+		// Safe for timers that already fired, also from their own callback
+		void cancel(TimerId timer);
+
+		// Runs callback on the scheduler task as soon as possible. Callable from any task, not from ISRs.
+		bool post(Callback callback);
+
+		// Takes effect when the task is started. Afterwards only the priority can be changed.
+		void setTaskPlacement(const TaskPlacement &placement);
+
+		bool isSchedulerTask() const { return task_ != nullptr && xTaskGetCurrentTaskHandle() == task_; }
+
+	private:
+		struct Timer {
+			TimerId id;
+			uint32_t intervalMs;
+			int64_t dueUs;
+			Callback callback;
+		};
+
+		TimerId addTimer(uint32_t delayMs, uint32_t intervalMs, Callback callback);
+		Timer* find(TimerId timer);
+		bool start();
+		void wake();
+		static void Task(void *);
+		void run();
+		// Runs one due timer or posted callback, returns the ticks to sleep if there was none
+		TickType_t runNext();
+
+		Timer timers_[kMaxTimers];
+		TimerId nextId_ = 1;
+		Callback posted_[kMaxPosted];
+		size_t postedFirst_ = 0;
+		size_t postedCount_ = 0;
+
+		SemaphoreHandle_t mutex_;
+		TaskHandle_t task_ = nullptr;
+		// Above the Arduino loop task by default, so wakeups are not delayed by a busy loop()
+		TaskPlacement placement_ = {6144, 2, tskNO_AFFINITY};
+};
+
+// Shared by all Basecamp subsystems. Do not use it from static constructors.
+extern Scheduler basecampScheduler;
+
+#endif
@@ -0,0 +1,105 @@
+/*
+   Basecamp - ESP32 library to simplify the basics of IoT projects
+   Written by Merlin Schumacher (mls@ct.de) for c't magazin für computer technik (https://www.ct.de)
+   Licensed under GPLv3. See LICENSE for details.
+   */
+#include "StartupSequence.hpp"
+#include "Trace.hpp"
+
+#include <Esp32Logging.hpp>
+#include <esp_timer.h>
+
+namespace {
+	const constexpr char* kLoggingTag = "BasecampStartup";
+}
+
+StartupSequence::StageId StartupSequence::addStage(const char* name, Action action, Condition condition, uint32_t dependencies)
+{
+	if (stageCount_ == kMaxStages) {
+		// Programming error. Dependencies on the returned id refer to the last stage instead.
+		ESP_LOGE(kLoggingTag, "Too many startup stages, dropping %s", name);
+		return kMaxStages - 1;
+	}
+
+	const StageId id = stageCount_++;
+	stages_[id] = {name, std::move(action), std::move(condition), dependencies, 0, 0, false};
+	allMask_ |= after(id);
+	return id;
+}
+
+StartupSequence::StageId StartupSequence::add(const char* name, Action action, uint32_t dependencies)
+{
+	return addStage(name, std::move(action), nullptr, dependencies);
+}
+
+StartupSequence::StageId StartupSequence::addCondition(const char* name, Condition condition, uint32_t dependencies)
+{
+	return addStage(name, nullptr, std::move(condition), dependencies);
+}
+
+bool StartupSequence::step(size_t index)
+{
+	Stage &stage = stages_[index];
+	const int64_t now = esp_timer_get_time();
+	if (!stage.started) {
+		stage.started = true;
+		stage.startedUs = now - startUs_;
+	}
+
+	if (stage.action) {
+		BASECAMP_TRACE_SCOPE(stage.name);
+		stage.action();
+		// Not needed anymore, release everything it captured
+		stage.action = nullptr;
+	} else if (!stage.condition()) {
+		return false;
+	} else {
+		stage.condition = nullptr;
+	}
+
+	stage.durationUs = esp_timer_get_time() - startUs_ - stage.startedUs;
+	doneMask_ |= after(index);
+	ESP_LOGD(kLoggingTag, "Stage %s done after %u us", stage.name, stage.durationUs);
+	return true;
+}
+
+bool StartupSequence::run()
+{
+	if (isDone()) {
+		return true;
+	}
+	if (startUs_ == 0) {
+		startUs_ = esp_timer_get_time();
+	}
+
+	// Finishing a stage may make earlier added ones ready, so repeat until nothing changes
+	bool progressed = true;
+	while (progressed) {
+		progressed = false;
+		for (size_t i = 0; i < stageCount_; i++) {
+			const Stage &stage = stages_[i];
+			if ((doneMask_ & after(i)) || (stage.dependencies & ~doneMask_)) {
+				continue;
+			}
+			progressed |= step(i);
+		}
+	}
+
+	if (isDone()) {
+		logTimings();
+		return true;
+	}
+	return false;
+}
+
+void StartupSequence::logTimings() const
+{
+	forEachStage([](const char* name, uint32_t startedUs, uint32_t durationUs, bool done)
+	{
+		if (done) {
+			ESP_LOGI(kLoggingTag, "%-14s started at %6u us, took %6u us", name, startedUs, durationUs);
+		} else {
+			ESP_LOGI(kLoggingTag, "%-14s pending", name);
+		}
+	});
+}
@@ -0,0 +1,70 @@
+/*
+   Basecamp - ESP32 library to simplify the basics of IoT projects
+   Written by Merlin Schumacher (mls@ct.de) for c't magazin für computer technik (https://www.ct.de)
+   Licensed under GPLv3. See LICENSE for details.
+   */
+
+#ifndef StartupSequence_h
+#define StartupSequence_h
+
+#include <functional>
+#include <Arduino.h>
+
+// Startup work split into stages that depend on each other. Stages run in the order they
+// were added as soon as all their dependencies are done. Condition stages wait for something
+// outside (e.g. the network link) and are polled by run(), so stages not depending on them
+// continue without blocking.
+class StartupSequence {
+	public:
+		typedef uint8_t StageId;
+		typedef std::function<void()> Action;
+		typedef std::function<bool()> Condition;
+
+		static constexpr size_t kMaxStages = 16;
+
+		// Dependency mask for add(), combine them with |
+		static uint32_t after(StageId stage) { return 1u << stage; }
+
+		// name has to be a string literal
+		StageId add(const char* name, Action action, uint32_t dependencies = 0);
+		// Done once condition returns true
+		StageId addCondition(const char* name, Condition condition, uint32_t dependencies = 0);
+
+		// Runs everything that is ready. Returns true once all stages are done.
+		bool run();
+		bool isDone() const { return doneMask_ == allMask_; }
+
+		// Calls function(name, startedUs, durationUs, done), times are relative to the first run().
+		// For condition stages the duration is the time spent waiting.
+		template<typename FUNCTION>
+		void forEachStage(FUNCTION function) const {
+			for (size_t i = 0; i < stageCount_; i++) {
+				const Stage &stage = stages_[i];
+				function(stage.name, stage.startedUs, stage.durationUs, (doneMask_ & after(i)) != 0);
+			}
+		}
+
+		void logTimings() const;
+
+	private:
+		struct Stage {
+			const char* name;
+			Action action;
+			Condition condition;
+			uint32_t dependencies;
+			uint32_t startedUs;
+			uint32_t durationUs;
+			bool started;
+		};
+
+		StageId addStage(const char* name, Action action, Condition condition, uint32_t dependencies);
+		bool step(size_t index);
+
+		Stage stages_[kMaxStages];
+		size_t stageCount_ = 0;
+		uint32_t allMask_ = 0;
+		uint32_t doneMask_ = 0;
+		int64_t startUs_ = 0;
+};
+
+#endif
@@ -0,0 +1,157 @@
+/*
+   Basecamp - ESP32 library to simplify the basics of IoT projects
+   Written by Merlin Schumacher (mls@ct.de) for c't magazin für computer technik (https://www.ct.de)
+   Licensed under GPLv3. See LICENSE for details.
+   */
+#include "TaskPlacement.hpp"
+
+#include <Esp32Logging.hpp>
+
+#include <new>
+
+namespace {
+	const constexpr char* kLoggingTag = "BasecampTasks";
+
+	struct TaskStart {
+		TaskFunction_t function;
+		void *parameter;
+		const char* name;
+		uint32_t stackSize;
+	};
+
+	// Registers the task from within, it may finish before xTaskCreatePinnedToCore() returns
+	void runTask(void *startPointer)
+	{
+		const TaskStart start = *static_cast<TaskStart*>(startPointer);
+		delete static_cast<TaskStart*>(startPointer);
+		basecampTaskStacks.add(start.name, xTaskGetCurrentTaskHandle(), start.stackSize);
+		start.function(start.parameter);
+	}
+}
+
+TaskStackMonitor basecampTaskStacks;
+
+bool startTask(TaskFunction_t function, const char* name, const TaskPlacement &placement, void *parameter,
+	TaskHandle_t *handle)
+{
+	TaskStart *start = new (std::nothrow) TaskStart{function, parameter, name, placement.stackSize};
+	TaskHandle_t task = nullptr;
+	// FreeRTOS sets the handle before the task is ready to run
+	if (!start || xTaskCreatePinnedToCore(&runTask, name, placement.stackSize, start, placement.priority,
+		handle ? handle : &task, placement.core) != pdPASS) {
+		ESP_LOGE(kLoggingTag, "Could not start task %s", name);
+		delete start;
+		if (handle) {
+			*handle = nullptr;
+		}
+		return false;
+	}
+	return true;
+}
+
+SemaphoreHandle_t TaskStackMonitor::walkMutex()
+{
+	portENTER_CRITICAL(&mux_);
+	SemaphoreHandle_t mutex = walkMutex_;
+	portEXIT_CRITICAL(&mux_);
+	if (mutex) {
+		return mutex;
+	}
+
+	SemaphoreHandle_t created = xSemaphoreCreateMutex();
+	portENTER_CRITICAL(&mux_);
+	if (!walkMutex_) {
+		walkMutex_ = created;
+	}
+	mutex = walkMutex_;
+	portEXIT_CRITICAL(&mux_);
+	if (mutex != created) {
+		vSemaphoreDelete(created);
+	}
+	return mutex;
+}
+
+void TaskStackMonitor::add(const char* name, TaskHandle_t task, uint32_t stackSize)
+{
+	portENTER_CRITICAL(&mux_);
+	Entry *entry = nullptr;
+	for (size_t i = 0; i < taskCount_ && !entry; i++) {
+		if (strcmp(tasks_[i].name, name) == 0) {
+			entry = &tasks_[i];
+		}
+	}
+	if (!entry && taskCount_ < kMaxTasks) {
+		entry = &tasks_[taskCount_++];
+		*entry = {name, nullptr, stackSize, stackSize};
+	}
+	if (entry) {
+		entry->task = task;
+		entry->stackSize = stackSize;
+	}
+	portEXIT_CRITICAL(&mux_);
+
+	if (!entry) {
+		ESP_LOGW(kLoggingTag, "Too many tasks, not monitoring %s", name);
+	}
+}
+
+void TaskStackMonitor::finished(TaskHandle_t task)
+{
+	SemaphoreHandle_t mutex = walkMutex();
+	xSemaphoreTake(mutex, portMAX_DELAY);
+	// ESP-IDF counts stacks in bytes, not words
+	const uint32_t free = uxTaskGetStackHighWaterMark(task);
+	portENTER_CRITICAL(&mux_);
+	for (size_t i = 0; i < taskCount_; i++) {
+		if (tasks_[i].task == task) {
+			if (free < tasks_[i].minFree) {
+				tasks_[i].minFree = free;
+			}
+			tasks_[i].task = nullptr;
+		}
+	}
+	portEXIT_CRITICAL(&mux_);
+	xSemaphoreGive(mutex);
+}
+
+size_t TaskStackMonitor::snapshot(Entry (&tasks)[kMaxTasks])
+{
+	SemaphoreHandle_t mutex = walkMutex();
+	xSemaphoreTake(mutex, portMAX_DELAY);
+	portENTER_CRITICAL(&mux_);
+	const size_t count = taskCount_;
+	for (size_t i = 0; i < count; i++) {
+		tasks[i] = tasks_[i];
+	}
+	portEXIT_CRITICAL(&mux_);
+
+	// Reading a stack takes a while, so not in the critical section
+	for (size_t i = 0; i < count; i++) {
+		if (tasks[i].task) {
+			const uint32_t free = uxTaskGetStackHighWaterMark(tasks[i].task);
+			if (free < tasks[i].minFree) {
+				tasks[i].minFree = free;
+			}
+		}
+	}
+
+	portENTER_CRITICAL(&mux_);
+	for (size_t i = 0; i < count; i++) {
+		// Skips entries whose task was restarted meanwhile
+		if (tasks_[i].task == tasks[i].task && tasks[i].minFree < tasks_[i].minFree) {
+			tasks_[i].minFree = tasks[i].minFree;
+		}
+	}
+	portEXIT_CRITICAL(&mux_);
+	xSemaphoreGive(mutex);
+	return count;
+}
+
+void TaskStackMonitor::log()
+{
+	forEach([](const char* name, uint32_t stackSize, uint32_t minFree, bool running)
+	{
+		ESP_LOGI(kLoggingTag, "%-14s stack %5u bytes, %5u used at most%s", name, stackSize, stackSize - minFree,
+			running ? "" : " (finished)");
+	});
+}
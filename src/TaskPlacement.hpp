@@ -0,0 +1,75 @@
+/*
+   Basecamp - ESP32 library to simplify the basics of IoT projects
+   Written by Merlin Schumacher (mls@ct.de) for c't magazin für computer technik (https://www.ct.de)
+   Licensed under GPLv3. See LICENSE for details.
+   */
+
+#ifndef TaskPlacement_h
+#define TaskPlacement_h
+
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+
+// Where and how a background task runs
+struct TaskPlacement {
+	uint32_t stackSize;
+	UBaseType_t priority;
+	// tskNO_AFFINITY, 0 (PRO_CPU) or 1 (APP_CPU)
+	BaseType_t core;
+};
+
+// Creates the task as placed. It registers itself with basecampTaskStacks before function
+// runs, and *handle is set before it can run.
+bool startTask(TaskFunction_t function, const char* name, const TaskPlacement &placement, void *parameter,
+	TaskHandle_t *handle = nullptr);
+
+// Keeps track of the stack usage of Basecamp's tasks, so stacks can be sized tightly.
+// Names are not copied and have to be string literals.
+class TaskStackMonitor {
+	public:
+		static constexpr size_t kMaxTasks = 12;
+
+		// Starting a task with the same name again reuses its entry
+		void add(const char* name, TaskHandle_t task, uint32_t stackSize);
+		// Tasks that delete themselves call this right before, with their own handle.
+		// The last high-water mark is kept.
+		void finished(TaskHandle_t task);
+
+		// Calls function(name, stackSize, minFreeBytes, running) for every task seen so far.
+		// minFreeBytes is the lowest amount of unused stack since the task was started.
+		template<typename FUNCTION>
+		void forEach(FUNCTION function) {
+			Entry tasks[kMaxTasks];
+			const size_t count = snapshot(tasks);
+			for (size_t i = 0; i < count; i++) {
+				function(tasks[i].name, tasks[i].stackSize, tasks[i].minFree, tasks[i].task != nullptr);
+			}
+		}
+
+		void log();
+
+	private:
+		struct Entry {
+			const char* name;
+			TaskHandle_t task;
+			uint32_t stackSize;
+			uint32_t minFree;
+		};
+
+		// Updates and copies all entries, a task cannot finish meanwhile
+		size_t snapshot(Entry (&tasks)[kMaxTasks]);
+		// Held while reading stacks, so their tasks cannot finish meanwhile. Created on first use.
+		SemaphoreHandle_t walkMutex();
+
+		Entry tasks_[kMaxTasks];
+		size_t taskCount_ = 0;
+		portMUX_TYPE mux_ = portMUX_INITIALIZER_UNLOCKED;
+		SemaphoreHandle_t walkMutex_ = nullptr;
+};
+
+// Shared by all Basecamp subsystems. Constant-initialized, so it can be used from static constructors.
+extern TaskStackMonitor basecampTaskStacks;
+
+#endif
@@ -0,0 +1,179 @@
+/*
+   Basecamp - ESP32 library to simplify the basics of IoT projects
+   Written by Merlin Schumacher (mls@ct.de) for c't magazin für computer technik (https://www.ct.de)
+   Licensed under GPLv3. See LICENSE for details.
+   */
+#include "TimeSync.hpp"
+#include "Metrics.hpp"
+#include "Scheduler.hpp"
+#include "lwip/apps/sntp.h"
+
+#include <Esp32Logging.hpp>
+#include <sys/time.h>
+
+namespace {
+	const constexpr char* kLoggingTag = "BasecampTime";
+	const constexpr uint32_t kPollIntervalMs = 1000;
+	// Both esp_timer readings around gettimeofday() have to be this close, otherwise the task
+	// was preempted in between and the sample is repeated
+	const constexpr int64_t kMaxSampleSpreadUs = 200;
+	const constexpr int kSampleAttempts = 4;
+	// Added to the reading uncertainty of both samples: a larger step of the offset between
+	// two polls is a sync, even if the reachability register did not show it
+	const constexpr int64_t kStepMarginUs = 20;
+
+	int32_t clampToInt32(int64_t value)
+	{
+		return value > INT32_MAX ? INT32_MAX : (value < INT32_MIN ? INT32_MIN : static_cast<int32_t>(value));
+	}
+}
+
+TimeSync basecampTime;
+
+TimeSync::TimeSync()
+	: callbackMutex_(xSemaphoreCreateMutex())
+{
+}
+
+void TimeSync::begin(const char* server, const char* timezone, bool startSntp)
+{
+	if (started_) {
+		ESP_LOGW(kLoggingTag, "Already started");
+		return;
+	}
+	started_ = true;
+
+	setenv("TZ", timezone, 1);
+	tzset();
+	if (startSntp) {
+		server_ = server;
+		sntp_setoperatingmode(SNTP_OPMODE_POLL);
+		sntp_setservername(0, const_cast<char*>(server_.c_str()));
+		sntp_init();
+		ESP_LOGD(kLoggingTag, "Using NTP server %s", server_.c_str());
+	}
+
+	// Valid right away if the RTC kept the time
+	int64_t monotonicUs;
+	const int64_t offsetUs = sampleOffset(monotonicUs, sampleSpreadUs_);
+	portENTER_CRITICAL(&mux_);
+	offsetUs_ = offsetUs;
+	portEXIT_CRITICAL(&mux_);
+	reachability_ = sntp_enabled() ? sntp_getreachability(0) : 0;
+
+	basecampScheduler.every(kPollIntervalMs, [this]() { poll(); });
+}
+
+int64_t TimeSync::toWallClockUs(int64_t monotonicUs) const
+{
+	portENTER_CRITICAL(&mux_);
+	const int64_t offsetUs = offsetUs_;
+	portEXIT_CRITICAL(&mux_);
+	return monotonicUs + offsetUs;
+}
+
+void TimeSync::onSync(SyncCallback callback)
+{
+	xSemaphoreTake(callbackMutex_, portMAX_DELAY);
+	callbacks_.push_back(std::move(callback));
+	xSemaphoreGive(callbackMutex_);
+}
+
+TimeSyncStats TimeSync::getStats() const
+{
+	portENTER_CRITICAL(&mux_);
+	const TimeSyncStats stats = stats_;
+	portEXIT_CRITICAL(&mux_);
+	return stats;
+}
+
+int64_t TimeSync::sampleOffset(int64_t &monotonicUs, int64_t &spreadUs)
+{
+	struct timeval now;
+	int64_t beforeUs = 0;
+	int64_t afterUs = 0;
+	for (int attempt = 0; attempt < kSampleAttempts; attempt++) {
+		beforeUs = esp_timer_get_time();
+		gettimeofday(&now, nullptr);
+		afterUs = esp_timer_get_time();
+		if (afterUs - beforeUs <= kMaxSampleSpreadUs) {
+			break;
+		}
+	}
+	monotonicUs = beforeUs + (afterUs - beforeUs) / 2;
+	spreadUs = afterUs - beforeUs;
+	return static_cast<int64_t>(now.tv_sec) * 1000000 + now.tv_usec - monotonicUs;
+}
+
+void TimeSync::poll()
+{
+	int64_t monotonicUs;
+	int64_t spreadUs;
+	const int64_t offsetUs = sampleOffset(monotonicUs, spreadUs);
+	// Only written on this task, no need to lock for reading
+	const int64_t previousOffsetUs = offsetUs_;
+	const int64_t correctionUs = offsetUs - previousOffsetUs;
+	const bool wasValid = monotonicUs + previousOffsetUs >= static_cast<int64_t>(kMinimumValidTime) * 1000000;
+
+	// Shifted left on every request, the lowest bit is set on an answer. Once eight requests in
+	// a row were answered it stays at 0xff, and as the answer usually arrives within the same
+	// poll interval as the request, most syncs after that only show as a step of the offset.
+	const uint8_t reachability = sntp_enabled() ? sntp_getreachability(0) : 0;
+	const bool answered = reachability != reachability_ && (reachability & 1);
+	reachability_ = reachability;
+	// Without a sync both clocks run in lockstep, so any step beyond what the readings
+	// themselves could be off by was made by SNTP
+	const int64_t stepThresholdUs = (spreadUs + sampleSpreadUs_) / 2 + kStepMarginUs;
+	sampleSpreadUs_ = spreadUs;
+	const bool stepped = correctionUs > stepThresholdUs || correctionUs < -stepThresholdUs;
+
+	// Between syncs the offset is left alone: the sampling jitter would make timestamps go backwards
+	if (answered || stepped) {
+		portENTER_CRITICAL(&mux_);
+		offsetUs_ = offsetUs;
+		portEXIT_CRITICAL(&mux_);
+		synced(correctionUs, monotonicUs, wasValid);
+	}
+}
+
+void TimeSync::synced(int64_t correctionUs, int64_t monotonicUs, bool wasValid)
+{
+	static MetricCounter *syncs = basecampMetrics.counter("basecamp_time_syncs_total", "Clock syncs by SNTP");
+	static MetricGauge *correction = basecampMetrics.gauge("basecamp_time_correction_us", "Clock step applied by the last sync");
+
+	const int32_t clampedUs = clampToInt32(correctionUs);
+	const bool hasDrift = wasValid && lastSyncMonotonicUs_ != 0 && monotonicUs > lastSyncMonotonicUs_;
+	const float driftPpm = hasDrift ? static_cast<float>(correctionUs) * 1e6f / static_cast<float>(monotonicUs - lastSyncMonotonicUs_) : 0;
+	portENTER_CRITICAL(&mux_);
+	stats_.syncCount++;
+	stats_.lastSync = time(nullptr);
+	// Setting the clock for the first time is no correction
+	if (wasValid) {
+		stats_.lastCorrectionUs = clampedUs;
+		const int32_t magnitudeUs = clampedUs < 0 ? -clampedUs : clampedUs;
+		if (magnitudeUs > stats_.maxCorrectionUs) {
+			stats_.maxCorrectionUs = magnitudeUs;
+		}
+		if (hasDrift) {
+			stats_.driftPpm = driftPpm;
+		}
+	}
+	portEXIT_CRITICAL(&mux_);
+	lastSyncMonotonicUs_ = monotonicUs;
+
+	syncs->increment();
+	if (wasValid) {
+		correction->set(clampedUs);
+		ESP_LOGD(kLoggingTag, "Synced, corrected by %d us", clampedUs);
+	} else {
+		ESP_LOGI(kLoggingTag, "Clock set by SNTP");
+	}
+
+	// Copied, so callbacks can register further callbacks
+	xSemaphoreTake(callbackMutex_, portMAX_DELAY);
+	const std::vector<SyncCallback> callbacks = callbacks_;
+	xSemaphoreGive(callbackMutex_);
+	for (const auto &callback : callbacks) {
+		callback();
+	}
+}
@@ -0,0 +1,95 @@
+/*
+   Basecamp - ESP32 library to simplify the basics of IoT projects
+   Written by Merlin Schumacher (mls@ct.de) for c't magazin für computer technik (https://www.ct.de)
+   Licensed under GPLv3. See LICENSE for details.
+   */
+
+#ifndef TimeSync_h
+#define TimeSync_h
+
+#include <functional>
+#include <vector>
+#include <time.h>
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <esp_timer.h>
+
+struct TimeSyncStats {
+	// Syncs since boot
+	uint32_t syncCount;
+	// Wall clock of the last sync, 0 if there was none since boot
+	time_t lastSync;
+	// Clock step applied by the last and the largest sync, not counting the sync setting
+	// the clock for the first time
+	int32_t lastCorrectionUs;
+	int32_t maxCorrectionUs;
+	// Drift of the local clock measured between the last two syncs, positive if it runs slow
+	float driftPpm;
+};
+
+// Keeps track of SNTP and maps esp_timer_get_time() to the wall clock.
+//
+// The offset between both clocks is sampled once a second on basecampScheduler, so
+// taking a timestamp is an addition instead of a gettimeofday() call. A sync is detected
+// by the SNTP reachability register or a step of the offset, IDF 3.x has no callback. A
+// sync correcting the clock by less than the sampling jitter (some 100 us) goes unnoticed.
+class TimeSync {
+	public:
+		typedef std::function<void()> SyncCallback;
+
+		// Anything earlier means the clock was never set
+		static constexpr time_t kMinimumValidTime = 1609459200;
+
+		TimeSync();
+		TimeSync(const TimeSync&) = delete;
+		TimeSync& operator=(const TimeSync&) = delete;
+
+		// Sets the TZ and starts polling. Without startSntp the clock is expected to be valid
+		// already, e.g. kept by the RTC during deep sleep.
+		void begin(const char* server, const char* timezone, bool startSntp = true);
+
+		// True once the wall clock is set, by SNTP or before a deep sleep
+		bool isValid() const { return nowUs() >= static_cast<int64_t>(kMinimumValidTime) * 1000000; }
+		bool isSynced() const { return getStats().lastSync != 0; }
+
+		// Wall clock in microseconds since the epoch
+		int64_t nowUs() const { return toWallClockUs(esp_timer_get_time()); }
+		// Maps an earlier esp_timer_get_time() value to the wall clock. Uses the current offset,
+		// a sync between taking the timestamp and mapping it shifts the result by the correction.
+		int64_t toWallClockUs(int64_t monotonicUs) const;
+
+		// Called on the scheduler task after every sync. Callable from any task.
+		void onSync(SyncCallback callback);
+
+		TimeSyncStats getStats() const;
+
+	private:
+		void poll();
+		// Offset between wall clock and esp_timer in microseconds, from close enough readings of both.
+		// spreadUs is the time between both esp_timer readings.
+		static int64_t sampleOffset(int64_t &monotonicUs, int64_t &spreadUs);
+		void synced(int64_t correctionUs, int64_t monotonicUs, bool wasValid);
+
+		bool started_ = false;
+		// lwip only keeps the pointer
+		String server_;
+		int64_t offsetUs_ = 0;
+		mutable portMUX_TYPE mux_ = portMUX_INITIALIZER_UNLOCKED;
+
+		// Only used on the scheduler task
+		uint8_t reachability_ = 0;
+		int64_t sampleSpreadUs_ = 0;
+		int64_t lastSyncMonotonicUs_ = 0;
+
+		SemaphoreHandle_t callbackMutex_;
+		std::vector<SyncCallback> callbacks_;
+
+		// Written on the scheduler task, read under mux_
+		TimeSyncStats stats_ = {};
+};
+
+// Shared by all Basecamp subsystems
+extern TimeSync basecampTime;
+
+#endif
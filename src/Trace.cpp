@@ -0,0 +1,105 @@
+/*
+   Basecamp - ESP32 library to simplify the basics of IoT projects
+   Written by Merlin Schumacher (mls@ct.de) for c't magazin für computer technik (https://www.ct.de)
+   Licensed under GPLv3. See LICENSE for details.
+   */
+#include "Trace.hpp"
+
+#ifdef BASECAMP_TRACE
+
+#include <Esp32Logging.hpp>
+
+namespace {
+	const constexpr char* kLoggingTag = "BasecampTrace";
+
+	struct Ring {
+		basecampTrace::Event events[basecampTrace::kEventsPerCore];
+		// Number of events ever recorded, the slot is taken modulo the size
+		std::atomic<uint32_t> next;
+	};
+
+	Ring rings[portNUM_PROCESSORS];
+
+	// Calls function(core, event) for every recorded event, oldest first per core.
+	// Events overwritten while dumping may show up inconsistent, tracing is best effort.
+	template<typename FUNCTION>
+	void forEachEvent(FUNCTION function)
+	{
+		for (size_t core = 0; core < portNUM_PROCESSORS; core++) {
+			const uint32_t next = rings[core].next.load(std::memory_order_acquire);
+			const uint32_t count = next < basecampTrace::kEventsPerCore ? next : basecampTrace::kEventsPerCore;
+			for (uint32_t i = next - count; i != next; i++) {
+				const basecampTrace::Event &event = rings[core].events[i % basecampTrace::kEventsPerCore];
+				if (event.name) {
+					function(core, event);
+				}
+			}
+		}
+	}
+
+	void writeJsonString(Print &out, const char* text)
+	{
+		out.print('"');
+		for (; *text; text++) {
+			if (*text == '"' || *text == '\\') {
+				out.print('\\');
+			}
+			out.print(*text);
+		}
+		out.print('"');
+	}
+}
+
+void basecampTrace::record(const char* name, int64_t startUs, uint32_t durationUs)
+{
+	// The core may change after reading it, the atomic slot keeps that safe, it is only less local
+	Ring &ring = rings[xPortGetCoreID()];
+	const uint32_t slot = ring.next.fetch_add(1, std::memory_order_relaxed) % kEventsPerCore;
+	Event &event = ring.events[slot];
+	event.startUs = startUs;
+	event.durationUs = durationUs;
+	// The name publishes the event, so it is stored last
+	std::atomic_thread_fence(std::memory_order_release);
+	event.name = name;
+}
+
+void basecampTrace::dump(Print &out)
+{
+	bool first = true;
+	out.print("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	forEachEvent([&](size_t core, const Event &event)
+	{
+		if (!first) {
+			out.print(',');
+		}
+		first = false;
+
+		char numbers[96];
+		snprintf(numbers, sizeof(numbers), ",\"ph\":\"X\",\"pid\":0,\"tid\":%u,\"ts\":%lld,\"dur\":%u}",
+			core, event.startUs, event.durationUs);
+		out.print("{\"name\":");
+		writeJsonString(out, event.name);
+		out.print(numbers);
+	});
+	out.print("]}");
+}
+
+void basecampTrace::dumpToLog()
+{
+	forEachEvent([&](size_t core, const Event &event)
+	{
+		ESP_LOGI(kLoggingTag, "core %u at %lld us: %s took %u us", core, event.startUs, event.name, event.durationUs);
+	});
+}
+
+void basecampTrace::clear()
+{
+	for (auto &ring : rings) {
+		for (auto &event : ring.events) {
+			event.name = nullptr;
+		}
+		ring.next.store(0, std::memory_order_release);
+	}
+}
+
+#endif
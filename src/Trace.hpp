@@ -0,0 +1,82 @@
+/*
+   Basecamp - ESP32 library to simplify the basics of IoT projects
+   Written by Merlin Schumacher (mls@ct.de) for c't magazin für computer technik (https://www.ct.de)
+   Licensed under GPLv3. See LICENSE for details.
+   */
+
+#ifndef Trace_h
+#define Trace_h
+
+// Scoped tracing for the hot paths. Build with BASECAMP_TRACE defined to record, otherwise
+// all macros compile to nothing:
+//
+//   void doWork() {
+//     BASECAMP_TRACE_SCOPE("doWork");
+//     ...
+//   }
+//
+// Names are not copied and have to be string literals.
+
+#ifdef BASECAMP_TRACE
+
+#include <atomic>
+#include <Arduino.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+
+namespace basecampTrace {
+	// Per core, the oldest events are overwritten
+	static constexpr size_t kEventsPerCore = 128;
+
+	struct Event {
+		const char* name;
+		int64_t startUs;
+		uint32_t durationUs;
+	};
+
+	// Lock-free: every writer claims its own slot in the ring of the core it runs on
+	void record(const char* name, int64_t startUs, uint32_t durationUs);
+
+	// Writes all recorded events as Chrome trace-event JSON (load it in chrome://tracing or Perfetto)
+	void dump(Print &out);
+	// Writes one line per event to the ESP log, which reaches syslog if it is forwarded there
+	void dumpToLog();
+	void clear();
+
+	class Scope {
+		public:
+			explicit Scope(const char* name)
+				: name_(name)
+				, startUs_(esp_timer_get_time())
+			{
+			}
+
+			// Not the cycle counter: it is per core, and unpinned tasks may move between cores
+			~Scope() {
+				record(name_, startUs_, esp_timer_get_time() - startUs_);
+			}
+
+			Scope(const Scope&) = delete;
+			Scope& operator=(const Scope&) = delete;
+
+		private:
+			const char* name_;
+			int64_t startUs_;
+	};
+}
+
+#define BASECAMP_TRACE_CONCAT_(a, b) a##b
+#define BASECAMP_TRACE_CONCAT(a, b) BASECAMP_TRACE_CONCAT_(a, b)
+#define BASECAMP_TRACE_SCOPE(name) basecampTrace::Scope BASECAMP_TRACE_CONCAT(basecampTraceScope, __LINE__)(name)
+#define BASECAMP_TRACE_DUMP(print) basecampTrace::dump(print)
+#define BASECAMP_TRACE_DUMP_TO_LOG() basecampTrace::dumpToLog()
+
+#else
+
+#define BASECAMP_TRACE_SCOPE(name) do {} while (0)
+#define BASECAMP_TRACE_DUMP(print) do {} while (0)
+#define BASECAMP_TRACE_DUMP_TO_LOG() do {} while (0)
+
+#endif
+
+#endif
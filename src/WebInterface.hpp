@@ -6,47 +6,136 @@
 
 #ifndef WebInterface_h
 #define WebInterface_h
-#include <map>
+#include <utility>
+#include <vector>
+#include <Arduino.h>
+#include <soc/soc.h>
+#include "HeapMonitor.hpp"
+
+// Immutable string of the web interface. String literals live in flash (DROM) and are
+// only referenced, everything else is copied once into an exactly sized heap buffer.
+class InterfaceString {
+	public:
+		InterfaceString() = default;
+
+		InterfaceString(const char* text) {
+			if (!text) {
+				return;
+			}
+			if (isInFlash(text)) {
+				data_ = text;
+			} else {
+				copy(text, strlen(text));
+			}
+		}
+
+		InterfaceString(const String &text) {
+			copy(text.c_str(), text.length());
+		}
+
+		InterfaceString(const InterfaceString &other) {
+			if (other.owned_) {
+				copy(other.data_, strlen(other.data_));
+			} else {
+				data_ = other.data_;
+			}
+		}
+
+		InterfaceString(InterfaceString &&other) noexcept
+			: data_(other.data_)
+			, owned_(other.owned_)
+		{
+			other.data_ = "";
+			other.owned_ = false;
+		}
+
+		InterfaceString& operator=(InterfaceString other) noexcept {
+			std::swap(data_, other.data_);
+			std::swap(owned_, other.owned_);
+			return *this;
+		}
+
+		~InterfaceString() {
+			if (owned_) {
+				heapFree(const_cast<char*>(data_));
+			}
+		}
+
+		const char* c_str() const { return data_; }
+		size_t length() const { return strlen(data_); }
+		bool isEmpty() const { return *data_ == '\0'; }
+		bool operator==(const char* other) const { return strcmp(data_, other) == 0; }
+		bool operator!=(const char* other) const { return !(*this == other); }
+
+	private:
+		static bool isInFlash(const char* text) {
+			const uintptr_t address = reinterpret_cast<uintptr_t>(text);
+			return address >= SOC_DROM_LOW && address < SOC_DROM_HIGH;
+		}
+
+		void copy(const char* text, size_t length) {
+			char* buffer = static_cast<char*>(heapAllocate(HeapSubsystem::web, length + 1));
+			if (!buffer) {
+				return;
+			}
+			memcpy(buffer, text, length);
+			buffer[length] = '\0';
+			data_ = buffer;
+			owned_ = true;
+		}
+
+		const char* data_ = "";
+		bool owned_ = false;
+};
 
 // TODO: Discuss if this could not be modified to a struct as there is no
 // real programatically-wise logic inside this clas.
 class InterfaceElement {
 	public:
-		InterfaceElement(String p_id, String p_element, String p_content, String p_parent) {
+		struct Attribute {
+			InterfaceString key;
+			InterfaceString value;
+		};
+
+		InterfaceElement(InterfaceString p_id, InterfaceString p_element, InterfaceString p_content, InterfaceString p_parent) {
 			element = std::move(p_element);
 			id = std::move(p_id);
 			content = std::move(p_content);
 			parent = std::move(p_parent);
 		};
 
-		struct cmp_str
+		const char* getId() const
 		{
-			bool operator()(const String &a, const String &b) const
-			{
-				return strcmp(a.c_str(), b.c_str()) < 0;
-			}
-		};
-
-		const String& getId() const
-		{
-			return id;
+			return id.c_str();
 		}
 
-		String element;
-		String id;
-		String content;
-		String parent;
-		std::map<String, String, cmp_str> attributes;
+		InterfaceString element;
+		InterfaceString id;
+		InterfaceString content;
+		InterfaceString parent;
 
-		void setAttribute(String key, String value) {
-			attributes[key] = value;
+		void setAttribute(InterfaceString key, InterfaceString value) {
+			Attribute* existing = findAttributeEntry(key.c_str());
+			if (existing) {
+				existing->value = std::move(value);
+			} else if (inlineAttributeCount_ < kInlineAttributes) {
+				inlineAttributes_[inlineAttributeCount_++] = {std::move(key), std::move(value)};
+			} else {
+				moreAttributes_.push_back({std::move(key), std::move(value)});
+			}
 		};
 
+		// Return value for `key` or nullptr if `key` is not found.
+		const char* findAttribute(const char* key) const {
+			const Attribute* found = const_cast<InterfaceElement*>(this)->findAttributeEntry(key);
+			return found ? found->value.c_str() : nullptr;
+		}
+
 		// Return value for `key` or "" if `key` is not found.
 		String getAttribute(const String &key) const {
-			auto found = attributes.find(key);
-			if (found != attributes.end()) {
-				return found->second;
+			const char* found = findAttribute(key.c_str());
+			if (found) {
+				return found;
 			}
 
 			// TODO: What shall we really return if not found?
@@ -54,5 +143,38 @@ class InterfaceElement {
 			// to something like `getOr(const String &key, String default = "")`?
 			return {""};
 		}
+
+		// Calls function(const Attribute&) for every attribute in the order they were set
+		template<typename FUNCTION>
+		void forEachAttribute(FUNCTION function) const {
+			for (size_t i = 0; i < inlineAttributeCount_; i++) {
+				function(inlineAttributes_[i]);
+			}
+			for (const auto &attribute : moreAttributes_) {
+				function(attribute);
+			}
+		}
+
+	private:
+		// Most elements have at most a few attributes, those are stored without further allocations
+		static constexpr size_t kInlineAttributes = 4;
+
+		Attribute* findAttributeEntry(const char* key) {
+			for (size_t i = 0; i < inlineAttributeCount_; i++) {
+				if (inlineAttributes_[i].key == key) {
+					return &inlineAttributes_[i];
+				}
+			}
+			for (auto &attribute : moreAttributes_) {
+				if (attribute.key == key) {
+					return &attribute;
+				}
+			}
+			return nullptr;
+		}
+
+		Attribute inlineAttributes_[kInlineAttributes];
+		size_t inlineAttributeCount_ = 0;
+		std::vector<Attribute> moreAttributes_;
 };
 #endif
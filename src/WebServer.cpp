@@ -5,10 +5,283 @@
    */
 
 #include "WebServer.hpp"
+#include "Hash.hpp"
+#include "Metrics.hpp"
+#include "Trace.hpp"
+
+#include <algorithm>
 
 namespace {
 	const constexpr char* kLoggingTag = "BasecampWeb";
 
+	// Like server.on(), but keeps the If-None-Match header which ESPAsyncWebServer drops otherwise
+	class ConditionalGetHandler : public AsyncWebHandler {
+		public:
+			ConditionalGetHandler(const char* url, ArRequestHandlerFunction handler)
+				: url_(url)
+				, handler_(std::move(handler))
+			{
+			}
+
+			bool canHandle(AsyncWebServerRequest *request) override {
+				if (request->method() != HTTP_GET || request->url() != url_) {
+					return false;
+				}
+				request->addInterestingHeader("If-None-Match");
+				return true;
+			}
+
+			void handleRequest(AsyncWebServerRequest *request) override {
+				handler_(request);
+			}
+
+		private:
+			const char* url_;
+			ArRequestHandlerFunction handler_;
+	};
+
+	// The configuration form is small, anything larger is rejected without buffering it
+	const constexpr size_t kMaxSubmitLength = 4096;
+
+	// Incremental parser for the flat JSON object sent by collectConfiguration(),
+	// e.g. {"WifiEssid":"name","WifiPassword":"secret"}. Only string values are accepted.
+	// Lives in request->_tempObject, which is released with free(), so it has to stay trivial.
+	// It is allocated with room for stagedSize bytes behind it, where complete pairs are kept
+	// until the whole body turned out to be valid. Decoded they never take more than the body.
+	struct SubmitConfigParser
+	{
+		enum class State : uint8_t {
+			objectStart,	// must be 0, the parser is zero-initialized
+			keyOrEnd,
+			key,
+			colon,
+			valueStart,
+			value,
+			commaOrEnd,
+			done,
+			error,
+		};
+
+		State state;
+		bool escape;
+		// Hex digits still expected for a unicode escape
+		uint8_t unicodeDigits;
+		uint16_t unicode;
+		uint16_t pairs;
+		size_t keyLength;
+		size_t valueLength;
+		char key[32];
+		// Room for several MQTT broker URIs with credentials
+		char value[1024];
+		size_t stagedSize;
+		size_t stagedLength;
+
+		// Pairs as "key\0value\0", one after another
+		char* staged() { return reinterpret_cast<char*>(this + 1); }
+
+		void stage(const char* key, const char* value)
+		{
+			const size_t keySize = strlen(key) + 1;
+			const size_t valueSize = strlen(value) + 1;
+			if (stagedLength + keySize + valueSize > stagedSize) {
+				state = State::error;
+				return;
+			}
+			memcpy(staged() + stagedLength, key, keySize);
+			memcpy(staged() + stagedLength + keySize, value, valueSize);
+			stagedLength += keySize + valueSize;
+		}
+
+		// Called for every staged pair, value may be modified in place
+		template<typename ITEM>
+		void forEachStaged(ITEM item)
+		{
+			size_t offset = 0;
+			while (offset < stagedLength) {
+				const char* key = staged() + offset;
+				offset += strlen(key) + 1;
+				char* value = staged() + offset;
+				const size_t valueLength = strlen(value);
+				offset += valueLength + 1;
+				item(key, value, valueLength);
+			}
+		}
+
+		// Called for every key/value pair, value may be modified in place
+		template<typename ITEM>
+		void feed(const uint8_t *data, size_t length, ITEM item)
+		{
+			for (size_t i = 0; i < length && state != State::error; i++) {
+				const char c = static_cast<char>(data[i]);
+				switch (state) {
+					case State::objectStart:
+						expect(c, '{', State::keyOrEnd);
+						break;
+					case State::keyOrEnd:
+					case State::valueStart:
+						if (c == '"') {
+							state = (state == State::keyOrEnd) ? State::key : State::value;
+						} else if (c == '}' && state == State::keyOrEnd && pairs == 0) {
+							state = State::done;
+						} else if (!isspace(static_cast<unsigned char>(c))) {
+							state = State::error;
+						}
+						break;
+					case State::key:
+						if (appendStringChar(c, key, keyLength, sizeof(key))) {
+							state = State::colon;
+						}
+						break;
+					case State::colon:
+						expect(c, ':', State::valueStart);
+						break;
+					case State::value:
+						if (appendStringChar(c, value, valueLength, sizeof(value))) {
+							// Before item(), which may fail the parser
+							state = State::commaOrEnd;
+							item(key, value, valueLength);
+							pairs++;
+							keyLength = 0;
+							valueLength = 0;
+						}
+						break;
+					case State::commaOrEnd:
+						if (c == ',') {
+							state = State::keyOrEnd;
+						} else if (c == '}') {
+							state = State::done;
+						} else if (!isspace(static_cast<unsigned char>(c))) {
+							state = State::error;
+						}
+						break;
+					case State::done:
+						if (!isspace(static_cast<unsigned char>(c))) {
+							state = State::error;
+						}
+						break;
+					case State::error:
+						break;
+				}
+			}
+		}
+
+		void expect(char c, char expected, State next)
+		{
+			if (c == expected) {
+				state = next;
+			} else if (!isspace(static_cast<unsigned char>(c))) {
+				state = State::error;
+			}
+		}
+
+		void append(int c, char *buffer, size_t &bufferLength, size_t size)
+		{
+			// Keep room for the terminating NUL
+			if (bufferLength + 1 >= size) {
+				state = State::error;
+				return;
+			}
+			buffer[bufferLength++] = static_cast<char>(c);
+			buffer[bufferLength] = '\0';
+		}
+
+		// Returns true if c terminated the string
+		bool appendStringChar(char c, char *buffer, size_t &bufferLength, size_t size)
+		{
+			if (unicodeDigits > 0) {
+				if (!isxdigit(static_cast<unsigned char>(c))) {
+					state = State::error;
+					return false;
+				}
+				unicode = (unicode << 4) | (isdigit(static_cast<unsigned char>(c)) ? c - '0' : (tolower(c) - 'a' + 10));
+				if (--unicodeDigits == 0) {
+					// Encode as UTF-8, surrogate pairs are not combined
+					if (unicode < 0x80) {
+						append(unicode, buffer, bufferLength, size);
+					} else if (unicode < 0x800) {
+						append(0xC0 | (unicode >> 6), buffer, bufferLength, size);
+						append(0x80 | (unicode & 0x3F), buffer, bufferLength, size);
+					} else {
+						append(0xE0 | (unicode >> 12), buffer, bufferLength, size);
+						append(0x80 | ((unicode >> 6) & 0x3F), buffer, bufferLength, size);
+						append(0x80 | (unicode & 0x3F), buffer, bufferLength, size);
+					}
+				}
+				return false;
+			}
+			if (escape) {
+				escape = false;
+				switch (c) {
+					case 'b': c = '\b'; break;
+					case 'f': c = '\f'; break;
+					case 'n': c = '\n'; break;
+					case 'r': c = '\r'; break;
+					case 't': c = '\t'; break;
+					case 'u':
+						unicodeDigits = 4;
+						unicode = 0;
+						return false;
+					default:
+						// '"', '\\' and '/' stand for themselves
+						break;
+				}
+				append(c, buffer, bufferLength, size);
+				return false;
+			}
+			if (c == '\\') {
+				escape = true;
+				return false;
+			}
+			if (c == '"') {
+				return true;
+			}
+			append(c, buffer, bufferLength, size);
+			return false;
+		}
+	};
+
+	const constexpr char* kHttpRequestsName = "basecamp_http_requests_total";
+	const constexpr char* kHttpRequestsHelp = "HTTP requests by route";
+
+	// Events queued per client before further events are dropped
+	const constexpr size_t kMaxQueuedEvents = 4;
+
+	// Serves the gzipped assets generated by data2header.sh
+	class StaticAssetHandler : public AsyncWebHandler {
+		public:
+			bool canHandle(AsyncWebServerRequest *request) override {
+				if (request->method() != HTTP_GET || !findBasecampAsset(request->url().c_str())) {
+					return false;
+				}
+				request->addInterestingHeader("If-None-Match");
+				return true;
+			}
+
+			void handleRequest(AsyncWebServerRequest *request) override {
+				static MetricCounter *requests = basecampMetrics.counter(kHttpRequestsName, kHttpRequestsHelp, "route=\"static\"");
+				requests->increment();
+
+				const BasecampAsset *asset = findBasecampAsset(request->url().c_str());
+				AsyncWebServerResponse *response;
+				AsyncWebHeader *ifNoneMatch = request->getHeader("If-None-Match");
+				if (ifNoneMatch && ifNoneMatch->value() == asset->etag) {
+					response = request->beginResponse(304);
+				} else {
+					response = request->beginResponse_P(200, asset->mimeType, asset->data, asset->length);
+					response->addHeader("Content-Encoding", "gzip");
+				}
+				response->addHeader("ETag", asset->etag);
+				if (asset->maxAgeSeconds > 0) {
+					char cacheControl[32];
+					snprintf(cacheControl, sizeof(cacheControl), "public, max-age=%u", asset->maxAgeSeconds);
+					response->addHeader("Cache-Control", cacheControl);
+				} else {
+					response->addHeader("Cache-Control", "no-cache");
+				}
+				request->send(response);
+			}
+	};
+
 	template<typename NAMEVALUETYPE>
 	void debugPrint(std::ostream &stream, NAMEVALUETYPE &nameAndValue)
 	{
@@ -19,6 +292,7 @@ namespace {
 WebServer::WebServer()
 	: server(80)
 	, events("/events")
+	, interfaceMutex_(xSemaphoreCreateMutex())
 {
 	server.addHandler(&events);
 #ifdef BASECAMP_USEDNS
@@ -30,105 +304,107 @@ WebServer::WebServer()
 
 void WebServer::begin(Configuration &configuration, std::function<void()> submitFunc) {
 	SPIFFS.begin();
+	configuration_ = &configuration;
 	
-	server.on("/" , HTTP_GET, [](AsyncWebServerRequest * request)
-	{
-			AsyncWebServerResponse *response = request->beginResponse_P(200, "text/html", index_htm_gz, index_htm_gz_len);
-			response->addHeader("Content-Encoding", "gzip");
-			request->send(response);
-	});
+	server.addHandler(new StaticAssetHandler());
 
-	server.on("/basecamp.css" , HTTP_GET, [](AsyncWebServerRequest * request)
+	server.addHandler(new ConditionalGetHandler("/data.json", [this](AsyncWebServerRequest * request)
 	{
-			AsyncWebServerResponse *response = request->beginResponse_P(200, "text/css", basecamp_css_gz, basecamp_css_gz_len);
-			response->addHeader("Content-Encoding", "gzip");
-			request->send(response);
-	});
+			static MetricCounter *requests = basecampMetrics.counter(kHttpRequestsName, kHttpRequestsHelp, "route=\"/data.json\"");
+			requests->increment();
+			sendInterfaceData(request);
+	}));
 
-	server.on("/basecamp.js" , HTTP_GET, [](AsyncWebServerRequest * request)
+	server.on("/metrics", HTTP_GET, [](AsyncWebServerRequest *request)
 	{
-			AsyncWebServerResponse *response = request->beginResponse_P(200, "text/js", basecamp_js_gz, basecamp_js_gz_len);
-			response->addHeader("Content-Encoding", "gzip");
+			static MetricCounter *requests = basecampMetrics.counter(kHttpRequestsName, kHttpRequestsHelp, "route=\"/metrics\"");
+			requests->increment();
+			AsyncResponseStream *response = request->beginResponseStream("text/plain; version=0.0.4");
+			basecampMetrics.render(*response);
 			request->send(response);
 	});
-	server.on("/logo.svg" , HTTP_GET, [](AsyncWebServerRequest * request)
+
+#ifdef BASECAMP_TRACE
+	// Chrome trace-event JSON, open it in chrome://tracing or ui.perfetto.dev
+	server.on("/trace", HTTP_GET, [](AsyncWebServerRequest *request)
 	{
-			AsyncWebServerResponse *response = request->beginResponse_P(200, "image/svg+xml", logo_svg_gz, logo_svg_gz_len);
-			response->addHeader("Content-Encoding", "gzip");
+			AsyncResponseStream *response = request->beginResponseStream("application/json");
+			BASECAMP_TRACE_DUMP(*response);
 			request->send(response);
 	});
+#endif
 
-	server.on("/data.json" , HTTP_GET, [&configuration, this](AsyncWebServerRequest * request)
+	submitFunc_ = std::move(submitFunc);
+	server.on("/submitconfig", HTTP_POST, [this](AsyncWebServerRequest *request)
 	{
-			AsyncJsonResponse *response = new AsyncJsonResponse(false, 8192);
-			
-			JsonObject _jsonData = response->getRoot();
-			JsonArray elements = _jsonData.createNestedArray("elements");
-
-			for (const auto &interfaceElement : interfaceElements)
-			{
-				JsonObject element = elements.createNestedObject();
-				JsonObject attributes = element.createNestedObject("attributes");
-				element["element"] = interfaceElement.element;
-				element["id"] = interfaceElement.id;
-				element["content"] = interfaceElement.content;
-				element["parent"] = interfaceElement.parent;
-
-				for (const auto &attribute : interfaceElement.attributes)
-				{
-					attributes[attribute.first] = String{attribute.second};
-				}
-
-				if (interfaceElement.getAttribute("data-config").length() != 0)
-				{
-					if (interfaceElement.getAttribute("type")=="password")
-					{
-						attributes["placeholder"] = "Password unchanged";
-						attributes["value"] = "";
-					} else {
-						attributes["value"] = String{configuration.get(interfaceElement.getAttribute("data-config"))};
+			static MetricCounter *requests = basecampMetrics.counter(kHttpRequestsName, kHttpRequestsHelp, "route=\"/submitconfig\"");
+			requests->increment();
+			debugPrintRequest(request);
+			if (request->contentLength() > kMaxSubmitLength) {
+				request->send(413);
+				return;
+			}
+			auto *parser = static_cast<SubmitConfigParser*>(request->_tempObject);
+			if (!parser && request->params() > 0) {
+				// Form data sent by an older basecamp.js still cached by the browser,
+				// ESPAsyncWebServer has already parsed it.
+				for (int i = 0; i < request->params(); i++) {
+					AsyncWebParameter *webParameter = request->getParam(i);
+					if (webParameter->isPost()) {
+						String value = webParameter->value();
+						applySubmittedValue(webParameter->name().c_str(), &value[0], value.length());
 					}
 				}
+				request->send(201);
+				startSubmitTask();
+				return;
 			}
-#ifdef DEBUG
-			serializeJsonPretty(_jsonData, Serial);
-#endif
-			response->setLength();
-			// NOTE: AsyncServer.send(ptr* foo) deletes `response` after async send.
-			// As this is not documented in the header there: thanks for nothing.
-			request->send(response);
-	});
-
-	server.on("/submitconfig", HTTP_POST, [&configuration, submitFunc, this](AsyncWebServerRequest *request)
-	{
-			if (request->params() == 0) {
+			if (!parser || parser->state != SubmitConfigParser::State::done) {
+				ESP_LOGW(kLoggingTag, "Malformed configuration submission.");
+				request->send(400);
+				return;
+			}
+			if (parser->pairs == 0) {
 				ESP_LOGD(kLoggingTag, "Refusing to take over an empty configuration submission.");
 				request->send(500);
 				return;
 			}
-			debugPrintRequest(request);
 
-			for (int i = 0; i < request->params(); i++)
+			// Only now the body is known to be valid, a malformed one must not leave some of its values behind
+			parser->forEachStaged([this](const char* key, char* value, size_t valueLength)
 			{
-				AsyncWebParameter *webParameter = request->getParam(i);
-				if (webParameter->isPost() && webParameter->value().length() != 0)
-				{
-						// allow to clear value by entering spaces
-						String valueTrimmed = String(webParameter->value());
-						valueTrimmed.trim();
-						configuration.set(webParameter->name().c_str(), valueTrimmed.c_str());
+				applySubmittedValue(key, value, valueLength);
+			});
+			request->send(201);
+			// Writing to flash and submitFunc (which usually restarts) must not block the TCP stack
+			startSubmitTask();
+	}, nullptr, [this](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
+	{
+			if (index == 0) {
+				if (total > kMaxSubmitLength) {
+					ESP_LOGW(kLoggingTag, "Configuration submission too large (%u bytes)", total);
+					return;
+				}
+				// Released by AsyncWebServerRequest with free()
+				auto *parser = static_cast<SubmitConfigParser*>(calloc(1, sizeof(SubmitConfigParser) + total));
+				if (parser) {
+					parser->stagedSize = total;
 				}
+				request->_tempObject = parser;
+			}
+			auto *parser = static_cast<SubmitConfigParser*>(request->_tempObject);
+			if (parser) {
+				parser->feed(data, len, [parser](const char* key, char* value, size_t)
+				{
+					parser->stage(key, value);
+				});
 			}
-
-			configuration.save();
-			request->send(201);
-
-			// Only call submitFunc when it has been set to something useful
-			if( submitFunc ) submitFunc();
 	});
 
 	server.onNotFound([this](AsyncWebServerRequest *request)
 	{
+			static MetricCounter *requests = basecampMetrics.counter(kHttpRequestsName, kHttpRequestsHelp, "route=\"notfound\"");
+			requests->increment();
 #ifdef DEBUG
 	  	DEBUG_PRINTLN("WebServer request not found: ");
 			debugPrintRequest(request);
@@ -139,6 +415,81 @@ void WebServer::begin(Configuration &configuration, std::function<void()> submit
 	server.begin();
 }
 
+bool WebServer::isConfigurable(const char* key)
+{
+	bool found = false;
+	xSemaphoreTake(interfaceMutex_, portMAX_DELAY);
+	for (const auto &element : interfaceElements) {
+		const char* configKey = element.findAttribute("data-config");
+		if (configKey && strcmp(configKey, key) == 0) {
+			found = true;
+			break;
+		}
+	}
+	xSemaphoreGive(interfaceMutex_);
+	return found;
+}
+
+void WebServer::applySubmittedValue(const char* key, char* value, size_t length)
+{
+	if (length == 0) {
+		return;
+	}
+	if (!isConfigurable(key)) {
+		ESP_LOGW(kLoggingTag, "Ignoring unknown configuration key %s", key);
+		return;
+	}
+
+	// allow to clear value by entering spaces
+	while (length > 0 && isspace(static_cast<unsigned char>(value[length - 1]))) {
+		value[--length] = '\0';
+	}
+	while (isspace(static_cast<unsigned char>(*value))) {
+		value++;
+	}
+
+	ConfigurationKey configKey;
+	if (Configuration::findKey(key, configKey)) {
+		configuration_->set(configKey, value);
+	} else {
+		configuration_->set(key, value);
+	}
+}
+
+void WebServer::startSubmitTask()
+{
+	if (submitPending_.exchange(true)) {
+		ESP_LOGD(kLoggingTag, "Configuration is already being saved");
+		return;
+	}
+
+	auto submit = [](void *parameter)
+	{
+		auto *self = static_cast<WebServer*>(parameter);
+		self->configuration_->save();
+		// Only call submitFunc when it has been set to something useful
+		if (self->submitFunc_) self->submitFunc_();
+		self->submitPending_ = false;
+		basecampTaskStacks.finished(xTaskGetCurrentTaskHandle());
+		vTaskDelete(nullptr);
+	};
+	if (!startTask(submit, "BasecampSubmit", submitTask_, this)) {
+		ESP_LOGE(kLoggingTag, "Could not start submit task, saving in place");
+		configuration_->save();
+		submitPending_ = false;
+		if (submitFunc_) submitFunc_();
+	}
+}
+
+bool WebServer::sendEvent(const char* event, const char* message)
+{
+	if (events.count() == 0 || events.avgPacketsWaiting() >= kMaxQueuedEvents) {
+		return false;
+	}
+	events.send(message, event, millis());
+	return true;
+}
+
 void WebServer::debugPrintRequest(AsyncWebServerRequest *request)
 {
 #ifdef DEBUG
@@ -195,25 +546,166 @@ void WebServer::debugPrintRequest(AsyncWebServerRequest *request)
 #endif
 }
 
-void WebServer::addInterfaceElement(const String &id, String element, String content, String parent, String configvariable) {
-	interfaceElements.emplace_back(id, std::move(element), std::move(content), std::move(parent));
-	if (configvariable.length() != 0) {
-		setInterfaceElementAttribute(id, "data-config", std::move(configvariable));
+void WebServer::renderInterfaceData()
+{
+	HeapJsonDocument<HeapSubsystem::web> _jsonDoc(8192);
+	JsonObject _jsonData = _jsonDoc.to<JsonObject>();
+	JsonArray elements = _jsonData.createNestedArray("elements");
+
+	for (const auto &interfaceElement : interfaceElements)
+	{
+		JsonObject element = elements.createNestedObject();
+		JsonObject attributes = element.createNestedObject("attributes");
+		// The document is serialized while the elements are locked, so the strings can be referenced
+		element["element"] = interfaceElement.element.c_str();
+		element["id"] = interfaceElement.id.c_str();
+		element["content"] = interfaceElement.content.c_str();
+		element["parent"] = interfaceElement.parent.c_str();
+
+		interfaceElement.forEachAttribute([&attributes](const InterfaceElement::Attribute &attribute)
+		{
+			attributes[attribute.key.c_str()] = attribute.value.c_str();
+		});
+
+		const char* configKey = interfaceElement.findAttribute("data-config");
+		if (configKey && *configKey)
+		{
+			const char* type = interfaceElement.findAttribute("type");
+			if (type && strcmp(type, "password") == 0)
+			{
+				attributes["placeholder"] = "Password unchanged";
+				attributes["value"] = "";
+			} else {
+				attributes["value"] = configuration_->get(configKey);
+			}
+		}
 	}
+#ifdef DEBUG
+	serializeJsonPretty(_jsonData, Serial);
+#endif
+
+	std::shared_ptr<String> data = std::make_shared<String>();
+	serializeJson(_jsonDoc, *data);
+
+	// Derived from the content, so it stays valid across reboots
+	char etag[11];
+	snprintf(etag, sizeof(etag), "\"%08x\"", basecampHash::fnv1a(data->c_str(), data->length()));
+	interfaceDataEtag_ = etag;
+	interfaceData_ = std::move(data);
 }
 
-void WebServer::setInterfaceElementAttribute(const String &id, const String &key, String value)
+std::shared_ptr<const String> WebServer::getInterfaceData(String &etag)
 {
-	for (auto &element : interfaceElements) {
-		if (element.getId() == id) {
-			element.setAttribute(key, std::move(value));
-			return;
+	xSemaphoreTake(interfaceMutex_, portMAX_DELAY);
+	const uint32_t configurationRevision = configuration_->getRevision();
+	if (!interfaceData_ || renderedInterfaceRevision_ != interfaceRevision_ ||
+		renderedConfigurationRevision_ != configurationRevision) {
+		ESP_LOGD(kLoggingTag, "Rendering /data.json");
+		renderedInterfaceRevision_ = interfaceRevision_;
+		renderedConfigurationRevision_ = configurationRevision;
+		renderInterfaceData();
+	}
+	std::shared_ptr<const String> data = interfaceData_;
+	etag = interfaceDataEtag_;
+	xSemaphoreGive(interfaceMutex_);
+	return data;
+}
+
+void WebServer::sendInterfaceData(AsyncWebServerRequest *request)
+{
+	String etag;
+	std::shared_ptr<const String> data = getInterfaceData(etag);
+
+	AsyncWebHeader *ifNoneMatch = request->getHeader("If-None-Match");
+	if (ifNoneMatch && ifNoneMatch->value() == etag) {
+		AsyncWebServerResponse *response = request->beginResponse(304);
+		response->addHeader("ETag", etag);
+		request->send(response);
+		return;
+	}
+
+	// Stream from the cached buffer, the response keeps it alive until it has been sent.
+	// The length is known, so there is no need for chunked encoding.
+	AsyncWebServerResponse *response = request->beginResponse("application/json", data->length(),
+		[data](uint8_t *buffer, size_t maxLen, size_t index) -> size_t
+		{
+			const size_t length = std::min(maxLen, data->length() - index);
+			memcpy(buffer, data->c_str() + index, length);
+			return length;
+		});
+	response->addHeader("ETag", etag);
+	response->addHeader("Cache-Control", "no-cache");
+	// NOTE: AsyncServer.send(ptr* foo) deletes `response` after async send.
+	// As this is not documented in the header there: thanks for nothing.
+	request->send(response);
+}
+
+namespace {
+	// Orders element indices by the id of the element
+	struct CompareElementId
+	{
+		const std::vector<InterfaceElement> &elements;
+
+		bool operator()(uint16_t index, const char* id) const
+		{
+			return strcmp(elements[index].getId(), id) < 0;
 		}
+
+		bool operator()(const char* id, uint16_t index) const
+		{
+			return strcmp(id, elements[index].getId()) < 0;
+		}
+	};
+}
+
+InterfaceElement* WebServer::findInterfaceElement(const char* id)
+{
+	auto found = std::lower_bound(interfaceElementIndex_.begin(), interfaceElementIndex_.end(), id,
+		CompareElementId{interfaceElements});
+	if (found == interfaceElementIndex_.end() || strcmp(interfaceElements[*found].getId(), id) != 0) {
+		return nullptr;
+	}
+	return &interfaceElements[*found];
+}
+
+void WebServer::addInterfaceElement(InterfaceString id, InterfaceString element, InterfaceString content, InterfaceString parent, InterfaceString configvariable) {
+	xSemaphoreTake(interfaceMutex_, portMAX_DELAY);
+	if (interfaceElements.size() > UINT16_MAX) {
+		xSemaphoreGive(interfaceMutex_);
+		ESP_LOGE(kLoggingTag, "Too many interface elements, ignoring %s", id.c_str());
+		return;
+	}
+
+	// Elements with the same id keep their order, so lookups find the first one as before
+	const uint16_t index = interfaceElements.size();
+	auto position = std::upper_bound(interfaceElementIndex_.begin(), interfaceElementIndex_.end(), id.c_str(),
+		CompareElementId{interfaceElements});
+	interfaceElements.emplace_back(std::move(id), std::move(element), std::move(content), std::move(parent));
+	interfaceElementIndex_.insert(position, index);
+	if (!configvariable.isEmpty()) {
+		interfaceElements.back().setAttribute("data-config", std::move(configvariable));
+	}
+	interfaceRevision_++;
+	xSemaphoreGive(interfaceMutex_);
+}
+
+void WebServer::setInterfaceElementAttribute(const char* id, InterfaceString key, InterfaceString value)
+{
+	xSemaphoreTake(interfaceMutex_, portMAX_DELAY);
+	InterfaceElement* element = findInterfaceElement(id);
+	if (element) {
+		element->setAttribute(std::move(key), std::move(value));
+		interfaceRevision_++;
 	}
+	xSemaphoreGive(interfaceMutex_);
 }
 
 void WebServer::reset() {
+	xSemaphoreTake(interfaceMutex_, portMAX_DELAY);
 	interfaceElements.clear();
+	interfaceElementIndex_.clear();
+	interfaceRevision_++;
+	xSemaphoreGive(interfaceMutex_);
 	// We should also reset the server itself, according to documentation, but it will cause a crash.
 	// It works without reset, if you only configure one server after a reboot. Not sure what happens if you want to reconfigure during runtime.
 	//server.reset();
@@ -9,7 +9,9 @@
 
 #include <Esp32Logging.hpp>
 
+#include <atomic>
 #include <map>
+#include <memory>
 #include <vector>
 #include <SPIFFS.h>
 #include <ESPAsyncWebServer.h>
@@ -17,6 +19,7 @@
 
 #include "data.hpp"
 #include "Configuration.hpp"
+#include "TaskPlacement.hpp"
 #include "WebInterface.hpp"
 
 #ifdef BASECAMP_USEDNS
@@ -31,18 +34,30 @@ class WebServer {
 		~WebServer() = default;
 
 		void begin(Configuration &configuration, std::function<void()> submitFunc = 0);
+		// Of the task saving a submitted configuration, takes effect on the next submission
+		void setSubmitTaskPlacement(const TaskPlacement &placement) { submitTask_ = placement; }
 		bool addURL(const char* url, const char* content, const char* mimetype);
 		
 		// Remark: The server should be stopped before any changes to the interface elements are done to avoid inconsistent results if a request comes in at that very moment.
 		// However, ESPAsyncWebServer does not support any kind of end() function or something like that in the moment.
-		void addInterfaceElement(const String &id, String element, String content, String parent = "#configform", String configvariable = "");
+		// String literals are only referenced, there is no need to copy them into Strings.
+		void addInterfaceElement(InterfaceString id, InterfaceString element, InterfaceString content, InterfaceString parent = "#configform", InterfaceString configvariable = "");
 
 		// Sets "key" to "value" in element with id "id" if exists.
-		void setInterfaceElementAttribute(const String &id, const String &key, String value);
+		void setInterfaceElementAttribute(const char* id, InterfaceString key, InterfaceString value);
+		void setInterfaceElementAttribute(const String &id, InterfaceString key, InterfaceString value) {
+			setInterfaceElementAttribute(id.c_str(), std::move(key), std::move(value));
+		}
 		
 		// Removes all interface elements
 		void reset();
 
+		// Number of clients connected to /events
+		size_t eventClientCount() { return events.count(); }
+		// Sends an event to all clients of /events. Returns false (and drops the event)
+		// if the clients are not keeping up.
+		bool sendEvent(const char* event, const char* message);
+
 		struct cmp_str
 		{
 			bool operator()(String a, String b)
@@ -53,6 +68,9 @@ class WebServer {
 
 		AsyncWebServer server;
 	private:
+#ifdef BASECAMP_BENCHMARK
+		friend class BasecampBenchmark;
+#endif
 		static void onWsEvent(AsyncWebSocket * server, AsyncWebSocketClient * client, AwsEventType type, void * arg, uint8_t *data, size_t len);
 		std::map<const char*, const char* > _URLList;
 		bool handleFileRead(char* path);
@@ -61,14 +79,46 @@ class WebServer {
 		// Print "request" to serial console for debugging purposes.
 		void debugPrintRequest(AsyncWebServerRequest *request);
 
+		// Returns /data.json, rendered again only if the interface elements or the configuration changed
+		std::shared_ptr<const String> getInterfaceData(String &etag);
+		void renderInterfaceData();
+		// Answers with 304 if the client already has the current version
+		void sendInterfaceData(AsyncWebServerRequest *request);
+
 		int _interfaceElementCounter = 0;
 		static std::map<String, String, cmp_str> _interfaceMeta;
 		int _typeof(String a){ return 0; };
 		int _typeof(int a){ return 1; };
 		int _typeof(std::map<String, String, cmp_str> a){ return 2; };
 
+		// Returns the first element with id "id" or nullptr
+		InterfaceElement* findInterfaceElement(const char* id);
+
+		// Returns true if an interface element is bound to configuration key "key" (data-config)
+		bool isConfigurable(const char* key);
+		// Applies one submitted key/value pair to the configuration
+		void applySubmittedValue(const char* key, char* value, size_t length);
+		// Saves the configuration and calls submitFunc_ in a worker task
+		void startSubmitTask();
+
+		std::function<void()> submitFunc_;
+		std::atomic<bool> submitPending_{false};
+		TaskPlacement submitTask_ = {4096, 1, tskNO_AFFINITY};
+
 		AsyncEventSource events;
+		// In the order they were added, which is the order they are rendered in
 		std::vector<InterfaceElement> interfaceElements;
+		// Indices into interfaceElements, sorted by id
+		std::vector<uint16_t> interfaceElementIndex_;
+
+		Configuration *configuration_ = nullptr;
+		// Guards interfaceElements and the cached /data.json
+		SemaphoreHandle_t interfaceMutex_;
+		uint32_t interfaceRevision_ = 0;
+		uint32_t renderedInterfaceRevision_ = 0;
+		uint32_t renderedConfigurationRevision_ = 0;
+		std::shared_ptr<const String> interfaceData_;
+		String interfaceDataEtag_;
 };
 
 #endif
@@ -4,6 +4,9 @@
    Licensed under GPLv3. See LICENSE for details.
    */
 
+#ifndef data_h
+#define data_h
+
 #include <pgmspace.h>
 //
 // converted data/* to gzipped flash variables
@@ -66,93 +69,95 @@ const uint8_t basecamp_css_gz[] PROGMEM {
   0x9a, 0xda, 0x61, 0xeb, 0xb1, 0xf9, 0x91, 0x70, 0xee, 0xa0, 0xe9, 0x0f,
   0x1d, 0x82, 0x27, 0x7a, 0x95, 0x05, 0x00, 0x00
 };
-#define basecamp_js_gz_len 1020
+#define basecamp_js_gz_len 1037
 const uint8_t basecamp_js_gz[] PROGMEM {
-  0x1f, 0x8b, 0x08, 0x08, 0xb3, 0x56, 0xa1, 0x5b, 0x00, 0x03, 0x62, 0x61,
-  0x73, 0x65, 0x63, 0x61, 0x6d, 0x70, 0x2e, 0x6a, 0x73, 0x00, 0xa5, 0x56,
-  0xdf, 0x6f, 0xdb, 0x36, 0x10, 0xfe, 0x57, 0x58, 0x16, 0x08, 0xa4, 0x45,
-  0xd1, 0x12, 0x74, 0x4f, 0xd6, 0xd4, 0x21, 0x4d, 0xbb, 0xad, 0x45, 0xb6,
+  0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x03, 0xa5, 0x56,
+  0xdd, 0x6f, 0xdb, 0x36, 0x10, 0xff, 0x57, 0x58, 0x16, 0x08, 0xa4, 0x45,
+  0x51, 0x13, 0x74, 0x4f, 0xd6, 0xd4, 0x21, 0x4d, 0x8b, 0xb5, 0x43, 0xb6,
   0x16, 0x75, 0x80, 0x0d, 0x30, 0xfc, 0x40, 0x91, 0x27, 0x99, 0x09, 0x23,
   0x6a, 0x24, 0x15, 0xcf, 0x30, 0xf4, 0xbf, 0xef, 0x48, 0x49, 0x96, 0x9c,
-  0xc4, 0x4f, 0x7b, 0xb1, 0xac, 0xe3, 0xf1, 0xbb, 0xef, 0x7e, 0xeb, 0xde,
-  0xea, 0xfa, 0x23, 0x73, 0x2c, 0xa7, 0x02, 0x7f, 0xd3, 0x7b, 0x7c, 0xa5,
-  0x59, 0xd9, 0xd6, 0xdc, 0x49, 0x5d, 0x13, 0xa5, 0x99, 0x88, 0xe2, 0x3d,
-  0xd7, 0xb5, 0xd5, 0x0a, 0x52, 0xa5, 0xab, 0x88, 0x7e, 0x60, 0x16, 0x38,
-  0x7b, 0x6c, 0xc2, 0x21, 0x08, 0x1a, 0x67, 0x4f, 0xcc, 0x90, 0x22, 0xaf,
-  0x61, 0x4b, 0xfe, 0xfe, 0xe3, 0xf6, 0x77, 0xe7, 0x9a, 0xef, 0xf0, 0x4f,
-  0x0b, 0xd6, 0x45, 0xf1, 0x84, 0xc4, 0x11, 0xc6, 0xeb, 0x89, 0xfc, 0xcb,
-  0xf2, 0xeb, 0x9f, 0x69, 0xc3, 0x8c, 0x85, 0xc8, 0x6d, 0xa4, 0x4d, 0x0d,
-  0xd8, 0x06, 0xf1, 0xe1, 0x0e, 0xfe, 0x75, 0x71, 0x56, 0xb4, 0x52, 0x89,
-  0xa5, 0x74, 0x10, 0x89, 0x14, 0x14, 0x3c, 0x42, 0xed, 0x6c, 0xdc, 0x1d,
-  0x60, 0x58, 0x24, 0x9e, 0xd1, 0xb9, 0xd5, 0xfa, 0xc1, 0x12, 0x25, 0x1f,
-  0x80, 0xb8, 0x0d, 0x18, 0x20, 0x5b, 0x66, 0x09, 0x23, 0x8d, 0xd1, 0x05,
-  0x5e, 0x4f, 0xc9, 0xd2, 0x31, 0xd7, 0x5a, 0x72, 0xa3, 0x05, 0x2c, 0x08,
-  0x3d, 0x2f, 0x52, 0x1b, 0x04, 0x71, 0xc6, 0x84, 0xf8, 0xd4, 0x1b, 0xb8,
-  0xd3, 0x1f, 0xf5, 0x63, 0x44, 0x37, 0x57, 0x34, 0xa1, 0x60, 0x8c, 0x36,
-  0xf8, 0xbc, 0xd1, 0xad, 0x12, 0xa4, 0xd6, 0x2e, 0xb8, 0x49, 0xd0, 0x64,
-  0x29, 0xab, 0xd6, 0x30, 0xcf, 0x62, 0x8e, 0x93, 0xec, 0xad, 0xdb, 0x29,
-  0x58, 0x50, 0xae, 0x95, 0x36, 0x0b, 0x83, 0x01, 0xe9, 0xe2, 0xcc, 0x80,
-  0x6b, 0x4d, 0xdd, 0x15, 0xa9, 0x37, 0xf2, 0x84, 0x26, 0x6e, 0xa5, 0x75,
-  0x50, 0x83, 0x89, 0xa8, 0x87, 0xa3, 0x09, 0x47, 0x4f, 0x5f, 0x39, 0x1c,
-  0xac, 0x33, 0x7f, 0xaa, 0x1b, 0xa8, 0x23, 0xfa, 0xdb, 0xa7, 0x3b, 0x9a,
-  0xdc, 0x0f, 0x49, 0xf2, 0x62, 0x0b, 0x35, 0xa6, 0x64, 0x8a, 0xc8, 0xc8,
-  0x0c, 0x06, 0x67, 0x22, 0x16, 0xef, 0xed, 0x56, 0x3a, 0xbe, 0x89, 0xd8,
-  0x18, 0x41, 0x0c, 0x19, 0x26, 0x8d, 0xca, 0xba, 0x69, 0x1d, 0x5d, 0xc8,
-  0x12, 0x4f, 0xf0, 0x9a, 0x0b, 0x27, 0x8a, 0x15, 0xa0, 0x3e, 0x8b, 0x9c,
-  0x86, 0x3f, 0x25, 0x9a, 0x3f, 0x67, 0xa9, 0x14, 0x59, 0x78, 0xbd, 0x76,
-  0xce, 0xe4, 0x7b, 0xea, 0xa5, 0x0b, 0x2f, 0xed, 0x5e, 0x46, 0x2d, 0xe8,
-  0xd1, 0x64, 0x80, 0x49, 0x0e, 0xc8, 0xc9, 0x01, 0x00, 0x65, 0x98, 0x6e,
-  0x6f, 0xec, 0xe5, 0xed, 0x9e, 0x52, 0xe2, 0xb1, 0x13, 0xea, 0x9f, 0x0c,
-  0x2f, 0xc8, 0xa2, 0x75, 0x60, 0x13, 0xfa, 0x96, 0x9e, 0x0f, 0xb0, 0x71,
-  0x07, 0xca, 0xc2, 0xfe, 0xf9, 0xf5, 0x83, 0x83, 0x3d, 0xc0, 0x64, 0xfb,
-  0x08, 0xe7, 0x60, 0xbe, 0x2b, 0x0c, 0xb0, 0x87, 0x4c, 0x40, 0xc9, 0x5a,
-  0xe5, 0x16, 0xff, 0x13, 0x2d, 0x0b, 0x68, 0xdd, 0xac, 0x36, 0x9f, 0xe1,
-  0x15, 0x09, 0x4b, 0xa0, 0xaf, 0xfa, 0x32, 0x67, 0xa6, 0x6a, 0x43, 0x31,
-  0xa7, 0x0a, 0xea, 0xca, 0x6d, 0xde, 0xbf, 0x3b, 0x3b, 0x3b, 0xc8, 0x56,
-  0xef, 0xd6, 0x6f, 0xf2, 0xbc, 0xad, 0x91, 0x99, 0xac, 0x41, 0xfc, 0x32,
-  0x3f, 0x58, 0xec, 0xbb, 0xd0, 0x60, 0xd5, 0x04, 0xb1, 0xfa, 0x69, 0x1d,
-  0x44, 0x3c, 0x17, 0x9a, 0x07, 0x51, 0x5a, 0x81, 0x1b, 0x6c, 0x7f, 0xd8,
-  0x7d, 0x16, 0x58, 0x03, 0x19, 0x66, 0xf9, 0x0d, 0xc7, 0xc4, 0x4f, 0x3a,
-  0x1c, 0xf9, 0xba, 0x43, 0x99, 0x14, 0x71, 0x87, 0x2a, 0xc8, 0x8f, 0xa7,
-  0x0e, 0x3b, 0xef, 0xa6, 0xf7, 0x35, 0x07, 0x2f, 0x65, 0x5e, 0x6a, 0xc1,
-  0x5d, 0x8f, 0x6e, 0x63, 0xa2, 0x84, 0x2f, 0xcb, 0x6e, 0x2e, 0xb4, 0x11,
-  0x4f, 0xca, 0xbe, 0xfb, 0xc5, 0x64, 0x05, 0x3b, 0xdf, 0xec, 0x96, 0x18,
-  0x49, 0xee, 0xb4, 0x89, 0xaa, 0x9e, 0x08, 0x36, 0xed, 0x49, 0x15, 0xfa,
-  0x76, 0x6b, 0x58, 0xd3, 0x80, 0xa1, 0x71, 0x27, 0x52, 0xff, 0xaf, 0x16,
-  0x37, 0x1b, 0x9c, 0x02, 0x11, 0x9f, 0x95, 0xf9, 0x73, 0xc3, 0x48, 0x11,
-  0xab, 0x32, 0x0a, 0xa3, 0x87, 0x48, 0x0c, 0x7e, 0xbc, 0xf7, 0xc4, 0x57,
-  0xc5, 0xfa, 0x05, 0x77, 0xcc, 0x83, 0x17, 0x77, 0xb3, 0x54, 0x4d, 0x53,
-  0x86, 0xf7, 0x09, 0x2a, 0xf2, 0x89, 0x46, 0x36, 0x9f, 0x2f, 0xd8, 0xa8,
-  0x5b, 0x24, 0x83, 0x8a, 0x63, 0xe2, 0x2e, 0xc7, 0x41, 0xb6, 0x5a, 0x67,
-  0x23, 0x05, 0x96, 0x5f, 0x66, 0xec, 0xe7, 0x51, 0x25, 0x63, 0xe7, 0xe7,
-  0x81, 0x0e, 0x5f, 0xb1, 0xf5, 0x50, 0x2e, 0x79, 0x5e, 0x60, 0x0c, 0xd2,
-  0xa6, 0xb5, 0x9b, 0x20, 0x8e, 0x33, 0x64, 0xd9, 0x28, 0xc9, 0x21, 0x62,
-  0xc9, 0xd5, 0x54, 0x4c, 0x47, 0x80, 0xe2, 0x08, 0xf0, 0x45, 0xa7, 0x0b,
-  0x8f, 0xe3, 0xf3, 0x35, 0xe7, 0x56, 0xe4, 0x7c, 0x75, 0x39, 0x5a, 0x9d,
-  0xfb, 0x8c, 0x03, 0xca, 0x47, 0xfc, 0x66, 0x3e, 0xc9, 0x70, 0x28, 0x9f,
-  0x2a, 0x21, 0xfa, 0x97, 0x2c, 0xe5, 0xa8, 0xec, 0xc7, 0x7c, 0xfa, 0xc4,
-  0x54, 0x0b, 0x39, 0xbd, 0x33, 0x2d, 0xd0, 0xa1, 0xfe, 0xfc, 0xcc, 0xff,
-  0x55, 0x9b, 0x47, 0x3f, 0x9c, 0x70, 0xda, 0x1f, 0x4d, 0xc9, 0x01, 0xcc,
-  0x4e, 0x79, 0x2f, 0xb4, 0xd8, 0x1d, 0x27, 0xff, 0x5a, 0xa9, 0x88, 0xfe,
-  0xb0, 0xf2, 0xab, 0xe7, 0xa2, 0xbf, 0xbc, 0xc6, 0x7d, 0x32, 0x06, 0x41,
-  0xe4, 0xaf, 0x02, 0x0e, 0xce, 0x5e, 0x5c, 0x65, 0xe2, 0x3d, 0x86, 0x49,
-  0x5c, 0x5c, 0xf4, 0x19, 0xa9, 0x5e, 0x57, 0x5f, 0x89, 0xb5, 0xf7, 0x6d,
-  0x56, 0xcb, 0x33, 0x73, 0xc3, 0xf6, 0x62, 0xa7, 0xaf, 0x06, 0xaf, 0x7d,
-  0x11, 0x9f, 0xd4, 0xd8, 0x30, 0x3b, 0x03, 0x37, 0xb8, 0xfb, 0x64, 0x08,
-  0x18, 0x36, 0x78, 0x9e, 0x53, 0x1a, 0xef, 0x99, 0x02, 0xe3, 0x22, 0xfa,
-  0x4d, 0x01, 0x4e, 0x61, 0x52, 0x4a, 0xa5, 0x88, 0x6e, 0x1d, 0x61, 0xf8,
-  0x1c, 0xb5, 0x49, 0x30, 0x63, 0xe9, 0x61, 0x75, 0x84, 0x21, 0x3d, 0x66,
-  0xf5, 0xec, 0xac, 0x9a, 0x65, 0x98, 0x0f, 0x4d, 0x12, 0x55, 0xbe, 0x23,
-  0x3b, 0xcf, 0x1f, 0x5e, 0xdf, 0xbe, 0x70, 0x72, 0xff, 0x94, 0xaf, 0x1f,
-  0x0e, 0xfb, 0xa7, 0xf0, 0xa7, 0xfd, 0xfe, 0xf9, 0xf6, 0x75, 0x89, 0x0b,
-  0x88, 0xfe, 0x68, 0xdb, 0xe2, 0x11, 0x97, 0xca, 0x18, 0xb4, 0xa3, 0x15,
-  0xbc, 0x44, 0x32, 0xb2, 0xae, 0x8e, 0x97, 0x24, 0xf5, 0x18, 0x61, 0x59,
-  0xf1, 0xd9, 0x67, 0x40, 0x11, 0x1d, 0xc2, 0x71, 0x54, 0x88, 0x78, 0x77,
-  0xdc, 0xb7, 0x05, 0x10, 0xcb, 0x9e, 0x7c, 0x00, 0xa7, 0xda, 0x2d, 0x4f,
-  0x5d, 0x0b, 0x9a, 0xc4, 0xb6, 0x9c, 0x83, 0xb5, 0x65, 0xab, 0xd4, 0x2e,
-  0x25, 0xdf, 0xa1, 0xd0, 0xda, 0x21, 0xa1, 0x14, 0x21, 0xba, 0xad, 0xac,
-  0x85, 0xde, 0xa6, 0xba, 0xf6, 0x8e, 0xe7, 0x23, 0x22, 0xe2, 0xf5, 0xdf,
-  0x36, 0x5d, 0xf6, 0x1f, 0xc6, 0x46, 0x31, 0x2f, 0x02, 0x09, 0x00, 0x00
+  0xc4, 0x4f, 0x7b, 0xb1, 0xac, 0xfb, 0xf8, 0xdd, 0xf7, 0x9d, 0xee, 0xad,
+  0xae, 0x3f, 0x31, 0xc7, 0x72, 0x2a, 0xf0, 0x37, 0xbd, 0xc7, 0x57, 0x9a,
+  0x95, 0x6d, 0xcd, 0x9d, 0xd4, 0x35, 0x51, 0x9a, 0x89, 0x28, 0xde, 0x73,
+  0x5d, 0x5b, 0xad, 0x20, 0x55, 0xba, 0x8a, 0xe8, 0x47, 0x66, 0x81, 0xb3,
+  0xc7, 0x26, 0x30, 0x41, 0xd0, 0x38, 0x7b, 0x62, 0x86, 0x14, 0x79, 0x0d,
+  0x5b, 0xf2, 0xf7, 0x1f, 0xb7, 0x5f, 0x9c, 0x6b, 0x7e, 0xc0, 0x3f, 0x2d,
+  0x58, 0x17, 0xc5, 0x13, 0x12, 0x47, 0x18, 0x2f, 0x27, 0xf2, 0xdf, 0x97,
+  0xdf, 0xfe, 0x4c, 0x1b, 0x66, 0x2c, 0x44, 0x6e, 0x23, 0x6d, 0x6a, 0xc0,
+  0x36, 0x88, 0x0f, 0x77, 0xf0, 0xaf, 0x8b, 0xb3, 0xa2, 0x95, 0x4a, 0x2c,
+  0xa5, 0x83, 0x48, 0xa4, 0xa0, 0xe0, 0x11, 0x6a, 0x67, 0xe3, 0xee, 0x00,
+  0xc3, 0x22, 0xf1, 0xcc, 0x9d, 0x5b, 0xad, 0x1f, 0x2c, 0x51, 0xf2, 0x01,
+  0x88, 0xdb, 0x80, 0x01, 0xb2, 0x65, 0x96, 0x30, 0xd2, 0x18, 0x5d, 0xa0,
+  0x7a, 0x4a, 0x96, 0x8e, 0xb9, 0xd6, 0x92, 0x1b, 0x2d, 0x60, 0x41, 0xe8,
+  0x79, 0x91, 0xda, 0x40, 0x88, 0x33, 0x26, 0xc4, 0xe7, 0xde, 0xc0, 0x9d,
+  0xfe, 0xa4, 0x1f, 0x23, 0xba, 0xb9, 0xa2, 0x09, 0x05, 0x63, 0xb4, 0xc1,
+  0xe7, 0x8d, 0x6e, 0x95, 0x20, 0xb5, 0x76, 0x21, 0x4c, 0x82, 0x26, 0x4b,
+  0x59, 0xb5, 0x86, 0x79, 0x2f, 0xe6, 0x38, 0xc9, 0xde, 0xba, 0x9d, 0x82,
+  0x05, 0xe5, 0x5a, 0x69, 0xb3, 0x30, 0x98, 0x90, 0x2e, 0xce, 0x0c, 0xb8,
+  0xd6, 0xd4, 0x5d, 0x91, 0x7a, 0x23, 0x4f, 0x68, 0xe2, 0x56, 0x5a, 0x07,
+  0x35, 0x98, 0x88, 0x7a, 0x38, 0x9a, 0x70, 0x8c, 0xf4, 0x15, 0xe6, 0x60,
+  0x9d, 0x79, 0xae, 0x6e, 0xa0, 0x8e, 0xe8, 0x6f, 0x9f, 0xef, 0x68, 0x72,
+  0x3f, 0x14, 0xc9, 0x93, 0x2d, 0xd4, 0x58, 0x92, 0x29, 0x23, 0xa3, 0x67,
+  0x30, 0x04, 0x13, 0xb1, 0x78, 0x6f, 0xb7, 0xd2, 0xf1, 0x4d, 0xc4, 0xc6,
+  0x0c, 0x62, 0xca, 0xb0, 0x68, 0x54, 0xd6, 0x4d, 0xeb, 0xe8, 0x42, 0x96,
+  0xc8, 0x41, 0x35, 0x17, 0x38, 0x8a, 0x15, 0xa0, 0xbe, 0x8a, 0x9c, 0x86,
+  0x3f, 0x25, 0x9a, 0x3f, 0x67, 0xa9, 0x14, 0x59, 0x78, 0xbd, 0x76, 0xce,
+  0xe4, 0x7b, 0xea, 0xa9, 0x0b, 0x4f, 0xed, 0x5e, 0x66, 0x2d, 0xc8, 0xd1,
+  0x64, 0x80, 0x49, 0x0e, 0xc8, 0xc9, 0x01, 0x00, 0x69, 0x58, 0x6e, 0x6f,
+  0xec, 0xa5, 0x76, 0xef, 0x52, 0xe2, 0xb1, 0x13, 0xea, 0x9f, 0x0c, 0x15,
+  0x64, 0xd1, 0x3a, 0xb0, 0x09, 0x7d, 0x4b, 0xcf, 0x07, 0xd8, 0xb8, 0x03,
+  0x65, 0x61, 0xff, 0x5c, 0xfd, 0x10, 0x60, 0x0f, 0x30, 0xd9, 0x3e, 0xc2,
+  0x39, 0x98, 0xef, 0x0a, 0x03, 0xec, 0x21, 0x13, 0x50, 0xb2, 0x56, 0xb9,
+  0xc5, 0xff, 0x44, 0xcb, 0x02, 0x5a, 0x37, 0xeb, 0xcd, 0x67, 0x78, 0x45,
+  0xc2, 0x12, 0xe8, 0xbb, 0xbe, 0xcc, 0x99, 0xa9, 0xda, 0xd0, 0xcc, 0xa9,
+  0x82, 0xba, 0x72, 0x9b, 0x0f, 0xef, 0xcf, 0xce, 0x0e, 0xb4, 0xd5, 0xfb,
+  0xf5, 0x9b, 0x3c, 0x6f, 0x6b, 0xf4, 0x4c, 0xd6, 0x20, 0x7e, 0x9d, 0x33,
+  0x16, 0xfb, 0x2e, 0x0c, 0x58, 0x35, 0x41, 0xac, 0x7e, 0x5e, 0x07, 0x12,
+  0xcf, 0x85, 0xe6, 0x81, 0x94, 0x56, 0xe0, 0x06, 0xdb, 0x1f, 0x77, 0x5f,
+  0x05, 0xf6, 0x40, 0x86, 0x55, 0x7e, 0xc3, 0xb1, 0xf0, 0x93, 0x0c, 0x47,
+  0x7f, 0xdd, 0xa1, 0x4d, 0x8a, 0xb8, 0x43, 0x11, 0xf4, 0x8f, 0xa7, 0x0e,
+  0x27, 0xef, 0xa6, 0x8f, 0x35, 0x07, 0x4f, 0x65, 0x9e, 0x6a, 0xc1, 0x5d,
+  0x8f, 0x61, 0x63, 0xa1, 0x84, 0x6f, 0xcb, 0x6e, 0x4e, 0xb4, 0x11, 0x4f,
+  0xca, 0x7e, 0xfa, 0xc5, 0x64, 0x05, 0x27, 0xdf, 0xec, 0x96, 0x98, 0x49,
+  0xee, 0xb4, 0x89, 0xaa, 0xde, 0x11, 0x1c, 0xda, 0x93, 0x22, 0xf4, 0xed,
+  0xd6, 0xb0, 0xa6, 0x01, 0x43, 0xe3, 0x4e, 0xa4, 0xfe, 0x5f, 0x2d, 0x6e,
+  0x36, 0xb8, 0x05, 0x22, 0x3e, 0x6b, 0xf3, 0xe7, 0x86, 0xd1, 0x45, 0xec,
+  0xca, 0x28, 0xac, 0x1e, 0x22, 0x31, 0xf9, 0xf1, 0xde, 0x3b, 0xbe, 0x2a,
+  0xd6, 0x2f, 0x7c, 0xc7, 0x3a, 0x78, 0x72, 0x37, 0x2b, 0xd5, 0xb4, 0x65,
+  0x78, 0x5f, 0xa0, 0x22, 0x9f, 0xdc, 0xc8, 0xe6, 0xfb, 0x05, 0x07, 0x75,
+  0x8b, 0xce, 0xa0, 0xe0, 0x58, 0xb8, 0xcb, 0x71, 0x91, 0xad, 0xd6, 0xd9,
+  0xe8, 0x02, 0xcb, 0x2f, 0x33, 0xf6, 0xcb, 0x28, 0x92, 0xb1, 0xf3, 0xf3,
+  0xe0, 0x0e, 0x5f, 0xb1, 0xf5, 0xd0, 0x2e, 0x79, 0x5e, 0x60, 0x0e, 0xd2,
+  0xa6, 0xb5, 0x9b, 0x40, 0x8e, 0x33, 0xf4, 0xb2, 0x51, 0x92, 0x43, 0xc4,
+  0x92, 0xab, 0xa9, 0x99, 0x8e, 0x00, 0xc5, 0x11, 0xe0, 0x8b, 0x49, 0x17,
+  0x1e, 0xc7, 0xd7, 0x6b, 0xee, 0x5b, 0x91, 0xf3, 0xd5, 0xe5, 0x68, 0x75,
+  0x1e, 0x33, 0x2e, 0x28, 0x9f, 0xf1, 0x9b, 0xf9, 0x26, 0xc3, 0xa5, 0x7c,
+  0xaa, 0x85, 0xe8, 0x5f, 0xb2, 0x94, 0xa3, 0xb0, 0x5f, 0xf3, 0xe9, 0x13,
+  0x53, 0x2d, 0xe4, 0xf4, 0xce, 0xb4, 0x40, 0x87, 0xfe, 0xc3, 0xde, 0x3c,
+  0xda, 0x8c, 0x03, 0x80, 0x9d, 0x6a, 0x5d, 0x68, 0xb1, 0x3b, 0x2e, 0xf8,
+  0xb5, 0x52, 0x11, 0xfd, 0x69, 0xe5, 0xcf, 0xcd, 0x45, 0xaf, 0xbc, 0xc6,
+  0x1b, 0x32, 0x06, 0x2e, 0xf2, 0x57, 0x01, 0x87, 0x00, 0x2f, 0xae, 0x32,
+  0xf1, 0x01, 0x53, 0x23, 0x2e, 0x2e, 0xfa, 0x2a, 0x54, 0xaf, 0x8b, 0xaf,
+  0xc4, 0xda, 0xc7, 0x33, 0xeb, 0xdf, 0x99, 0xb9, 0xe1, 0x62, 0xb1, 0xd3,
+  0xaa, 0x21, 0x52, 0xdf, 0xb8, 0x27, 0x25, 0x36, 0xcc, 0xce, 0xc0, 0x0d,
+  0xde, 0x3b, 0x19, 0x92, 0x84, 0x43, 0x9d, 0xe7, 0x94, 0xc6, 0x7b, 0xa6,
+  0xc0, 0xb8, 0x88, 0x7e, 0x57, 0x80, 0x9b, 0x97, 0x94, 0x52, 0x29, 0xa2,
+  0x5b, 0x47, 0x18, 0x3e, 0x47, 0x69, 0x12, 0xcc, 0x58, 0x7a, 0x38, 0x17,
+  0x61, 0x31, 0x8f, 0x95, 0x3c, 0x3b, 0xab, 0x66, 0x55, 0xe5, 0xab, 0x6a,
+  0x9d, 0xb3, 0xae, 0xf3, 0x8e, 0xc3, 0xeb, 0xa7, 0x16, 0x4e, 0x1e, 0x9b,
+  0xf2, 0x75, 0xe6, 0x70, 0x6c, 0x0a, 0xcf, 0xed, 0x8f, 0xcd, 0xf7, 0x6f,
+  0x4b, 0xbc, 0x36, 0xf4, 0x9d, 0x6d, 0x8b, 0x47, 0xbc, 0x20, 0x63, 0xb6,
+  0xc0, 0xcf, 0xd3, 0x60, 0xe8, 0x0b, 0xe0, 0xd1, 0x47, 0xe5, 0x61, 0x5f,
+  0x5c, 0xdc, 0xed, 0x1a, 0x40, 0x15, 0x9c, 0x1c, 0xec, 0xe5, 0x90, 0xa6,
+  0x77, 0xe1, 0x1b, 0x22, 0x3e, 0x9a, 0x22, 0xba, 0xc4, 0xa1, 0x96, 0x75,
+  0x75, 0x7c, 0x47, 0x07, 0x68, 0xbc, 0x67, 0xe1, 0x9b, 0xc0, 0x62, 0x3e,
+  0xeb, 0x4a, 0x96, 0x3b, 0x1c, 0xba, 0xd9, 0x97, 0x43, 0x11, 0x1d, 0xb2,
+  0x79, 0xd4, 0xbb, 0x88, 0x35, 0x9e, 0xe8, 0x02, 0x88, 0x65, 0x4f, 0x3e,
+  0xff, 0x53, 0xbb, 0x97, 0xa7, 0xd4, 0x82, 0x24, 0xb1, 0x2d, 0xe7, 0x60,
+  0x6d, 0xd9, 0x2a, 0xb5, 0x4b, 0xc9, 0x0f, 0x28, 0xb4, 0x76, 0x68, 0x3d,
+  0x45, 0x88, 0x6e, 0x2b, 0x6b, 0xa1, 0xb7, 0xa9, 0xae, 0x7d, 0xfa, 0xf2,
+  0x11, 0x11, 0xf1, 0xfa, 0xcf, 0xa1, 0x2e, 0xfb, 0x0f, 0x47, 0x81, 0x32,
+  0x1e, 0x35, 0x09, 0x00, 0x00
 };
 #define index_htm_gz_len 273
 const uint8_t index_htm_gz[] PROGMEM {
@@ -242,3 +247,33 @@ const uint8_t logo_svg_gz[] PROGMEM {
   0xb6, 0x6d, 0xfb, 0xe1, 0x71, 0x71, 0x75, 0x66, 0x1b, 0xff, 0x31, 0x6f,
   0x2f, 0xfe, 0x02, 0xdc, 0x6a, 0x94, 0x1e, 0xb2, 0x05, 0x00, 0x00
 };
+
+struct BasecampAsset {
+	const char* path;
+	const char* mimeType;
+	// gzip compressed content
+	const uint8_t* data;
+	size_t length;
+	const char* etag;
+	uint32_t maxAgeSeconds;
+};
+
+constexpr BasecampAsset kBasecampAssets[] = {
+	{"/basecamp.css", "text/css", basecamp_css_gz, basecamp_css_gz_len, "\"3d6da9fce9e68ea0\"", 604800},
+	{"/basecamp.js", "application/javascript", basecamp_js_gz, basecamp_js_gz_len, "\"8df8ec938fb70039\"", 604800},
+	{"/", "text/html", index_htm_gz, index_htm_gz_len, "\"6f9332adc9c18f42\"", 0},
+	{"/logo.svg", "image/svg+xml", logo_svg_gz, logo_svg_gz_len, "\"d44d15b2ff9837af\"", 604800},
+};
+
+// Returns the asset served at path or nullptr
+inline const BasecampAsset* findBasecampAsset(const char* path)
+{
+	for (const auto &asset : kBasecampAssets) {
+		if (strcmp(asset.path, path) == 0) {
+			return &asset;
+		}
+	}
+	return nullptr;
+}
+
+#endif